@@ -60,6 +60,27 @@ void must_set_param(
 
 
 
+/*
+ * Microbenchmark of one kernel over recorded inputs: only run() is timed,
+ * optional prepare() restores inputs changed by the previous run(), run()
+ * returns the count of operations.
+ */
+struct microbench
+{
+    const char * name;
+    void * (*create)(void);
+    void (*prepare)(void * data);
+    uint64_t (*run)(void * data);
+    void (*destroy)(void * data);
+};
+
+/* NULL terminated, compiled with MICROBENCH */
+extern const struct microbench game_microbenches[];
+extern const struct microbench enginelib_microbenches[];
+extern const struct microbench mcts_microbenches[];
+
+
+
 extern struct game_protocol protocol_empty;
 extern struct game_protocol protocol_fastest_free_kick1;
 extern struct game_protocol protocol_fastest_free_kick2;
@@ -69,7 +90,53 @@ extern struct game_protocol protocol_000050;
 extern struct game_protocol protocol_000461;
 extern struct game_protocol protocol_002255;
 
+/* All protocols above, NULL terminated */
+extern const struct game_protocol * const game_protocols[];
+
+struct perft_reference {
+    const struct game_protocol * protocol;
+    int qsteps;
+    int depth;
+    uint64_t count;
+};
+
+extern struct perft_reference perft_references[];
+
+
+
+/* Positions of game_protocols before every step and free kick series generated in them */
+struct recorded_position
+{
+    struct state * state;
+    enum step step;
+};
+
+struct recorded_serie
+{
+    const struct recorded_position * position;
+    struct bsf_serie serie;
+};
+
+struct recording
+{
+    int qgeometries;
+    struct geometry ** geometries;
+    int qpositions;
+    struct recorded_position * positions;
+    int qseries;
+    struct recorded_serie * series;
+};
+
+struct recording * must_create_recording(void);
+void destroy_recording(struct recording * restrict const me);
+
+int recording_geometry_index(
+    const struct recording * const me,
+    const struct geometry * const geometry);
+
+
 
+unsigned long test_qallocs(void);
 
 void test_fail(const char * const fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void info(const char * const fmt, ...) __attribute__ ((format (printf, 1, 2)));
@@ -83,6 +150,11 @@ int test_magic_step3(void);
 int test_step(void);
 int test_step2(void);
 int test_history(void);
+int test_gen_step12(void);
+int test_step_lines(void);
+int test_journal_overflow(void);
+int test_gen_turns(void);
+int test_position_record(void);
 int test_step12_overflow_error(void);
 int test_geometry_straight_dist(void);
 int test_random_ai(void);
@@ -93,7 +165,10 @@ int test_ucb_formula(void);
 int test_simulation(void);
 int test_random_ai_unstep(void);
 int test_mcts_ai_unstep(void);
+int test_mcts_srand(void);
+int test_search_stats(void);
 int test_cycle_detection(void);
+int test_cycle_set_random(void);
 int test_preparation(void);
 int test_gen_complete_free_kicks(void);
 int test_gen_complete_free_kicks_win(void);
@@ -101,6 +176,22 @@ int test_long_free_kick_to_win(void);
 int test_long_free_kick_to_loose(void);
 int test_gen_complete_free_kicks_long(void);
 int test_pack_unpack_serie(void);
+int test_many_answers(void);
+int test_gen_parallel_free_kicks(void);
+int test_gen_free_kicks_transpositions(void);
+int test_gen_free_kicks_many_series(void);
+int test_alloc_free_search(void);
+int test_perft(void);
+int test_ai_pool(void);
+int test_annotate(void);
+int test_selfplay(void);
+int test_sprt(void);
+int test_archive(void);
+int test_replay(void);
+int test_server(void);
+int test_mux(void);
+int test_mux_bsf(void);
+int test_trace(void);
 
 int debug_ai_go(void);
 int debug_simulate(void);
@@ -110,23 +110,11 @@ void debug_trap(void);
 #if ENABLE_LOGS
 #define LOG_FUNC
 #define LOG_BODY ;
-void * get_flog(void);
 #else
 #define LOG_FUNC static inline
 #define LOG_BODY {}
-static inline void * get_flog(void) { return NULL; }
 #endif
 
-LOG_FUNC void log_line(
-    const char * fmt,
-    ...)
-LOG_BODY
-
-LOG_FUNC void log_text(
-    const char * fmt,
-    ...)
-LOG_BODY
-
 
 
 enum step {
@@ -141,11 +129,11 @@ enum step {
     QSTEPS
 };
 
-#define QANSWERS_BITS 8
+#define QANSWERS_BITS 12
 #define MAX_QANSWERS ((1 << QANSWERS_BITS) - 1)
 #define BAD_QANSWERS MAX_QANSWERS
 
-#define QSTEP_BITS 8
+#define QSTEP_BITS 5
 #define INVALID_STEP QSTEPS
 #define BACK(s) ((enum step)(((s)+4) & 0x07))
 
@@ -170,6 +158,16 @@ static inline enum step extract_step(steps_t * mask)
     return result;
 }
 
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
 
 
 #define WARN(me, name, pname1, pvalue1, pname2, pvalue2) \
@@ -205,6 +203,7 @@ struct warns
 };
 
 void warns_init(struct warns * const ws);
+const char * warns_message(const int num);
 void warns_reset(struct warns * const ws);
 const struct warn * warns_get(const struct warns * const ws, int index);
 void warns_add(
@@ -219,6 +218,133 @@ void warns_add(
 
 
 
+/*
+ * Logs of --enable-logs builds are binary traces: MCTS sites add records of
+ * a fixed event id, a node index and up to TRACE_QARGS integers to a ring
+ * buffer of the thread, trace_decode prints them in the text format of MCTS
+ * logs. PAPER_FOOTBALL_TRACE selects the mode: "flight" (default) keeps the
+ * records in memory and dumps the last ones of the thread on a warning,
+ * "full" writes all records and tree snapshots, "off" disables tracing.
+ * Files are written only into the PAPER_FOOTBALL_TRACE_DIR directory.
+ */
+
+#define TRACE_QARGS     4
+#define TRACE_FIXED 10000   /* Fractions are recorded multiplied by TRACE_FIXED */
+
+enum trace_event {
+    TRACE_EOL,
+    TRACE_WARN,
+    TRACE_ALLOC_OVERFLOW,
+    TRACE_ALLOC_NODE,
+    TRACE_SELECT_ENTER,
+    TRACE_SELECT_ONE,
+    TRACE_SELECT_RANDOM,
+    TRACE_SELECT_CHILD_NULL,
+    TRACE_SELECT_UNEXPLORED,
+    TRACE_SELECT_CHILD,
+    TRACE_SELECT_NONE,
+    TRACE_SELECT_RESULT,
+    TRACE_STEP,
+    TRACE_BALL_MOVE,
+    TRACE_BALL_MOVE_COUNT_OOR,
+    TRACE_BALL_MOVE_ALLOC_FAILED,
+    TRACE_BALL_MOVE_PNODE_NULL,
+    TRACE_EXPAND_WIN,
+    TRACE_EXPAND_SERIES,
+    TRACE_EXPAND_ALLOC_FAILED,
+    TRACE_EXPAND_GET_ANSWER,
+    TRACE_ITERATION,
+    TRACE_NO_ANSWERS,
+    TRACE_SELECTED,
+    TRACE_NEXT_CHILD,
+    TRACE_APPLY_ANSWER,
+    TRACE_PUSH_HISTORY,
+    TRACE_WIN_1,
+    TRACE_WIN_2,
+    TRACE_ITERATION_DONE,
+    TRACE_OUT_OF_NODES,
+    TRACE_NEW_CHILD,
+    TRACE_ROLLOUT_START,
+    TRACE_ROLLOUT,
+    TRACE_SNAPSHOT_START,
+    TRACE_SIMULATION_DONE,
+    TRACE_BEST_PREPARATION,
+    TRACE_RETURN_PREPARATION,
+    TRACE_GO_PROGRESS,
+    TRACE_GO_START,
+    TRACE_GO_ANSWER_NULL,
+    TRACE_GO_BEST,
+    TRACE_GO_BEST_NULL,
+    TRACE_GO_BAD_TYPE,
+    TRACE_SIMULATION,
+    TRACE_NODE,
+    TRACE_NODE_TYPE,
+    TRACE_NODE_STEP,
+    TRACE_NODE_QANSWERS,
+    TRACE_NODE_QSTEPS,
+    TRACE_NODE_CHILDREN,
+    TRACE_NODE_PATH,
+    TRACE_CHILD,
+    TRACE_PATH_STEP,
+    TRACE_EXNODE,
+    TRACE_SERIE,
+    TRACE_BALL_MOVES,
+    TRACE_BALL_MOVES_ITEM,
+    TRACE_SNAPSHOT_NODE,
+    TRACE_SNAPSHOT_NO_STEPS,
+    TRACE_SNAPSHOT_STEP,
+    TRACE_SNAPSHOT_NEXT_STEP,
+    TRACE_SNAPSHOT_BALL,
+    TRACE_STATE,
+    TRACE_STATE_STEP1,
+    TRACE_STATE_STEP2,
+    TRACE_STATE_STEP12,
+    QTRACE_EVENTS
+};
+
+/* Titles of node and state dumps */
+enum trace_title {
+    TRACE_TITLE_NODE,
+    TRACE_TITLE_PNODE,
+    TRACE_TITLE_PWIN,
+    TRACE_TITLE_MWIN,
+    TRACE_TITLE_CHILDREN,
+    TRACE_TITLE_BALLMOVE,
+    TRACE_TITLE_RESULT,
+    TRACE_TITLE_CURRENT,
+    TRACE_TITLE_NEXT,
+    TRACE_TITLE_LAST,
+    TRACE_TITLE_ROOT,
+    TRACE_TITLE_CHILD,
+    TRACE_TITLE_BEST,
+    QTRACE_TITLES
+};
+
+LOG_FUNC void trace_add(
+    const enum trace_event event,
+    const int32_t node,
+    const int64_t arg1,
+    const int64_t arg2,
+    const int64_t arg3,
+    const int64_t arg4)
+LOG_BODY
+
+LOG_FUNC void trace_warn(
+    const struct warn * const warn)
+LOG_BODY
+
+#if ENABLE_LOGS
+/* Tree snapshots are recorded only in the full mode */
+int trace_is_full(void);
+#endif
+
+/* Prints trace records as log text, out is FILE * */
+int trace_decode(
+    const char * const filename,
+    void * out);
+
+
+
 enum cycle_result {
     NO_CYCLE = 0,
     CYCLE_FOUND = 1
@@ -253,6 +379,37 @@ static inline void cycle_guard_copy(
 
 enum cycle_result cycle_guard_push(struct cycle_guard * restrict me, int from, int to);
 
+struct cycle_kick {
+    int from, to, override;
+    int anchor;
+    int last_to;
+};
+
+struct cycle_slot {
+    uint64_t key;
+    int value;
+};
+
+/* Same semantics as cycle_guard, O(1) push and pop */
+struct cycle_set {
+    int qkicks;
+    int capacity;
+    int anchor;
+    unsigned int mask;
+    struct cycle_kick * kicks;
+    struct cycle_slot * slots;
+};
+
+unsigned int cycle_set_qslots(int capacity);
+void init_cycle_set(
+    struct cycle_set * restrict const me,
+    int capacity,
+    struct cycle_kick * kicks,
+    struct cycle_slot * slots);
+void cycle_set_reset(struct cycle_set * restrict me);
+enum cycle_result cycle_set_push(struct cycle_set * restrict me, int from, int to);
+void cycle_set_pop(struct cycle_set * restrict me);
+
 
 
 #define MAX_FREE_KICK_SERIE       17
@@ -321,12 +478,18 @@ static inline enum step preparation_pop(
 #define CHANGE_ACTIVE          -7
 #define CHANGE_BALL            -8
 
+/* Upper bound of scalar (CHANGE_*) items recorded by one state_step */
+#define QSCALAR_CHANGES         8
+
 
 
 struct geometry
 {
     uint32_t qpoints;
     uint32_t free_kick_len;
+    uint32_t width;
+    uint32_t height;
+    uint32_t goal_width;
     const int32_t * connections;
     const int32_t * free_kicks;
     const uint8_t * bit_index_table;
@@ -334,8 +497,19 @@ struct geometry
     const enum step * straight_free_kick2;
     const uint32_t * dist_goal1;
     const uint32_t * dist_goal2;
+    const uint8_t * inner_points; /* All points within two steps are on the field */
+    int32_t row_delta;            /* Point offset of a NORTH step for inner points */
+    const uint32_t * step_lines;  /* Lines set by a step, STEP_LINES_STRIDE per (point, step) */
+    const uint8_t * qstep_lines;  /* Number of step_lines items per (point, step) */
 };
 
+/*
+ * A step from point P to N occupies N (lines from all its neighbours)
+ * and crosses the opposite diagonal of a square: up to 8 + 2 lines.
+ * Items are packed as point * QSTEPS + dir.
+ */
+#define STEP_LINES_STRIDE  (QSTEPS + 2)
+
 static inline enum step get_nth_bit(const struct geometry * const geometry, uint8_t mask, int n)
 {
     return geometry->bit_index_table[mask * QSTEPS + n];
@@ -361,6 +535,7 @@ struct state
     struct step_change * step_changes;
     unsigned int qstep_changes;
     unsigned int step_changes_capacity;
+    int own_step_changes;
 };
 
 enum state_status
@@ -378,10 +553,25 @@ static inline int is_free_kick_situation(const struct state * const state)
     return state->step1 == INVALID_STEP && state->step12 == 0;
 }
 
-void init_state(
+/*
+ * The undo journal of a state holds the changes of the last state_step
+ * only, so its size is bounded by the geometry: a free kick sets at most
+ * STEP_LINES_STRIDE lines per point. The journal is never grown: it has
+ * state_journal_capacity items, init_state allocates it or returns ENOMEM.
+ * A state with a shorter journal is not changed by state_step, which
+ * returns NO_WAY and sets errno to ENOBUFS.
+ */
+unsigned int state_journal_capacity(const struct geometry * const geometry);
+
+int init_state(
     struct state * restrict const me,
     const struct geometry * const geometry,
     uint8_t * const lines);
+void init_state_with_journal(
+    struct state * restrict const me,
+    const struct geometry * const geometry,
+    uint8_t * const lines,
+    struct step_change * const journal);
 void free_state(struct state * restrict const me);
 
 struct state * create_state(const struct geometry * const geometry);
@@ -401,6 +591,102 @@ int state_rollback(
 
 
 
+struct step_change
+{
+    int what;
+    uint32_t data;
+};
+
+struct history
+{
+    unsigned int qstep_changes;
+    unsigned int capacity;
+    struct step_change * step_changes;
+    int fixed;
+};
+
+void init_history(struct history * restrict const me);
+void init_fixed_history(
+    struct history * restrict const me,
+    struct step_change * const step_changes,
+    const unsigned int capacity);
+void free_history(struct history * restrict const me);
+int history_push(struct history * restrict const me, const struct state * const state);
+
+
+
+/*
+ * Counts step sequences of exactly depth legal steps (perft), a goal ends
+ * a sequence. Leaf counts are split by the first step into counts[QSTEPS].
+ * The state is restored on return.
+ */
+int state_perft(
+    struct state * restrict const me,
+    const int depth,
+    uint64_t * restrict const counts);
+
+/*
+ * Compact position record: position_record_size() bytes, lines are stored
+ * as a byte of directions per point. A position is set without the history,
+ * the state journal is cleared.
+ */
+
+#define POSITION_FREE_KICK   1
+
+struct position_record
+{
+    uint16_t width;
+    uint16_t height;
+    uint16_t goal_width;
+    uint16_t free_kick_len;
+    int32_t ball;
+    uint8_t active;
+    uint8_t step1;
+    uint8_t step2;
+    uint8_t flags;
+    uint64_t step12;
+    uint8_t lines[];
+};
+
+size_t position_record_size(const struct geometry * const geometry);
+
+void state_save_position(
+    const struct state * const me,
+    struct position_record * restrict const record);
+
+int state_set_position(
+    struct state * restrict const me,
+    const struct position_record * const record);
+
+
+
+/*
+ * Complete turns: the rest of the current turn (up to three steps) until
+ * the move passes or the game ends. Turns leading to the same position
+ * (lines, ball and active player) are reported once.
+ */
+
+#define MAX_TURN_STEPS   3
+#define MAX_TURNS        (QSTEPS * QSTEPS * QSTEPS)
+
+/* Steps are packed by SERIE_STEP_BITS, first step in lowest bits */
+struct turn
+{
+    uint64_t key;
+    uint32_t packed;
+    int16_t ball;
+    int16_t qsteps;
+};
+
+/* Returns the number of turns or -1 with errno: EINVAL in a free kick
+ * situation, ENOBUFS when capacity is too small. The state is restored. */
+int state_gen_turns(
+    struct state * restrict const me,
+    struct turn * restrict const turns,
+    const int capacity);
+
+
+
 struct bsf_node;
 
 enum add_serie_status
@@ -410,31 +696,63 @@ enum add_serie_status
     ADDED_FAILURE
 };
 
+#define BSF_CAPACITY            256
+#define SERIE_STEP_BITS           3
+#define MAX_PACKED_SERIE         21
+
+/* Steps are packed by SERIE_STEP_BITS, first step in lowest bits */
 struct bsf_serie
 {
-    int ball;
-    int qsteps;
-    enum step * steps;
+    uint64_t packed;
+    int32_t ball;
+    int32_t qsteps;
+};
+
+static inline enum step serie_step(const struct bsf_serie * const serie, int index)
+{
+    return (serie->packed >> (SERIE_STEP_BITS * index)) & 7;
+}
+
+struct bsf_node;
+
+struct bsf_visit
+{
+    uint64_t key;
+    struct bsf_node * node;
+    unsigned int serial;
 };
 
 struct bsf_free_kicks
 {
     int qseries;
+    int series_capacity;
     int capacity;
     int max_depth;
     int max_alts;
-    int max_visits;
+    int max_visits;                   /* Expansions per ball, bounds the search by the node pool */
     int stats_sz;
+    steps_t root_steps;
     struct dlist free;
     struct dlist waiting;
     struct dlist used;
     struct bsf_node * root;
+    struct cycle_set guard;
+    const struct bsf_node ** path;
+    int path_len;
     struct bsf_serie * series;
     struct bsf_serie * win;
     struct bsf_serie * loose;
+    struct bsf_serie win_serie;
+    struct bsf_serie loose_serie;
     int * alts;
     int * visits;
     struct state * states;
+    struct bsf_visit * visited;
+    unsigned int visited_mask;
+    unsigned int qvisited;
+    unsigned int serial;
+    unsigned int qstate_steps;
+    unsigned int qtranspositions;
 };
 
 struct bsf_free_kicks * create_bsf_free_kicks(
@@ -449,27 +767,31 @@ void destroy_bsf_free_kicks(struct bsf_free_kicks * restrict const me);
 void bsf_gen(
     struct warns * const warns,
     struct bsf_free_kicks * const me,
-    const struct state * const state,
-    const struct cycle_guard * const guard);
+    const struct state * const state);
 
+struct bsf_parallel;
 
+struct bsf_parallel * create_bsf_parallel(
+    const struct geometry * const geometry,
+    int qthreads,
+    int capacity,
+    int max_depth,
+    int max_alts,
+    int max_visits);
 
-struct step_change
-{
-    int what;
-    uint32_t data;
-};
+void destroy_bsf_parallel(struct bsf_parallel * restrict const me);
 
-struct history
-{
-    unsigned int qstep_changes;
-    unsigned int capacity;
-    struct step_change * step_changes;
-};
+struct bsf_free_kicks * bsf_gen_parallel(
+    struct warns * const warns,
+    struct bsf_parallel * const me,
+    const struct state * const state);
 
-void init_history(struct history * restrict const me);
-void free_history(struct history * restrict const me);
-int history_push(struct history * restrict const me, const struct state * const state);
+/* Threaded state_perft, the position is split by the first two steps */
+int perft_parallel(
+    const struct state * const state,
+    const int depth,
+    int qthreads,
+    uint64_t * restrict const counts);
 
 
 
@@ -490,6 +812,95 @@ struct cache_explanation
     uint32_t bad_alloc;
 };
 
+enum search_phase
+{
+    PHASE_DESCENT,
+    PHASE_EXPANSION,
+    PHASE_ROLLOUT,
+    PHASE_BACKPROP,
+    QPHASES
+};
+
+#define QNODE_TYPES        4
+#define MAX_STATS_DEPTH   32
+
+/* Hot path phases, nested ones are included in CYCLES_CALC_ANSWERS */
+enum cycle_phase
+{
+    CYCLES_SELECT,
+    CYCLES_CALC_ANSWERS,
+    CYCLES_BSF_GEN,
+    CYCLES_ALLOC_ANSWERS,
+    CYCLES_ROLLOUT,
+    CYCLES_UPDATE_HISTORY,
+    QCYCLE_PHASES
+};
+
+struct cycle_counters
+{
+    uint64_t cycles[QCYCLE_PHASES];
+    uint64_t calls[QCYCLE_PHASES];
+};
+
+#if CYCLE_COUNTERS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t read_cycles(void) { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t read_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static inline uint64_t cycles_begin(void)
+{
+    return read_cycles();
+}
+
+static inline void cycles_end(
+    struct cycle_counters * restrict const me,
+    const enum cycle_phase phase,
+    const uint64_t start)
+{
+    me->cycles[phase] += read_cycles() - start;
+    ++me->calls[phase];
+}
+
+#else
+
+static inline uint64_t cycles_begin(void) { return 0; }
+static inline void cycles_end(
+    struct cycle_counters * restrict const me,
+    const enum cycle_phase phase,
+    const uint64_t start) {}
+
+#endif
+
+/* Counters of one search, all zeros for AI without a tree */
+struct search_explanation
+{
+    uint64_t qplayouts;
+    uint64_t qstate_steps;
+    uint64_t qrollouts;
+    uint64_t rollout_steps;
+    uint64_t qcut_rollouts;           /* Stopped by max_depth */
+    uint32_t max_rollout_len;
+    uint32_t max_hist_len;
+    uint64_t qbsf_gen;
+    uint64_t qseries;                 /* Produced by all bsf_gen calls */
+    uint64_t qexpanded[QNODE_TYPES];  /* Nodes with calculated answers by type T, S, B, P */
+    uint64_t qanswers[QNODE_TYPES];
+    uint64_t depths[MAX_STATS_DEPTH]; /* Playouts by tree path length, the last one counts longer paths */
+    uint64_t time_ns;                 /* Wall time of all playouts */
+    uint64_t phase_ns[QPHASES];       /* Zeros without --enable-cycle-counters */
+    struct cycle_counters cycles;     /* Zeros without --enable-cycle-counters */
+};
+
 struct ai_explanation
 {
     size_t qstats;
@@ -497,6 +908,7 @@ struct ai_explanation
     double time;
     double score;
     struct cache_explanation cache;
+    struct search_explanation search;
 };
 
 enum param_type
@@ -554,6 +966,11 @@ struct ai
 
     const struct state * (*get_state)(const struct ai * const ai);
 
+    /* Optional (NULL if not supported), the history is cleared */
+    int (*set_state)(
+        struct ai * restrict const ai,
+        const struct state * const state);
+
     void (*free)(struct ai * restrict const ai);
 
     const struct warn * (*get_warn)(
@@ -584,4 +1001,334 @@ int init_dev_0003_ai(
     struct ai * restrict const ai,
     const struct geometry * const geometry);
 
+
+
+/*
+ * AI pool: independent AI instances with the same parameters, each one
+ * runs jobs in its own thread. A job starts and ends at the initial
+ * position of its AI, so the instances are reused without allocations.
+ */
+
+typedef int (*ai_init)(struct ai * restrict const ai, const struct geometry * const geometry);
+typedef void (*ai_job_run)(struct ai * restrict const ai, void * const job);
+typedef void (*ai_job_done)(void * const job, void * const arg);
+
+struct ai_pool;
+
+/* Both AIs are of the same kind */
+void copy_ai_params(
+    struct ai * restrict const dest,
+    const struct ai * const src);
+
+/* Threads of one search, the bsf_threads parameter or 1 */
+int ai_qthreads(const struct ai * const ai);
+
+/* Root is the initial position of AIs, NULL for the start of a game */
+struct ai_pool * create_ai_pool(
+    const struct ai * const ai,
+    ai_init init_ai,
+    const struct geometry * const geometry,
+    const struct state * const root,
+    const int qworkers);
+
+void destroy_ai_pool(struct ai_pool * restrict const me);
+
+/* Jobs run in parallel, done is called in the job order by the caller */
+int ai_pool_run(
+    struct ai_pool * restrict const me,
+    void * const jobs,
+    const size_t job_sz,
+    const int qjobs,
+    ai_job_run run,
+    ai_job_done done,
+    void * const arg);
+
+/* The position is given by steps from the initial one, played (optional)
+ * is the move made in the game, its score is taken from the same search */
+struct ai_analysis
+{
+    const enum step * steps;
+    unsigned int qsteps;
+    const enum step * played;
+    unsigned int qplayed;
+    double played_score;
+    int status;
+    int qbest;
+    enum step best[MAX_FREE_KICK_SERIE];
+    double score;
+    int32_t qgames;
+    double time;
+};
+
+/* ai_job_run for struct ai_analysis jobs */
+void ai_analyse(
+    struct ai * restrict const ai,
+    void * const job);
+
+/* Splits played steps into turns of one player, a turn ends when the active
+ * player changes or the game is over. offsets[i] is the first step of turn
+ * i and actives[i] its player, both hold qsteps items. Returns the count of
+ * turns or -1 with errno. */
+int split_turns(
+    const struct geometry * const geometry,
+    const enum step * const steps,
+    const unsigned int qsteps,
+    unsigned int * restrict const offsets,
+    int * restrict const actives);
+
+
+
+/*
+ * Self-play: every worker thread hosts an instance of both players and
+ * plays whole games from the start position, the engine adjudicates.
+ */
+
+#define MAX_SELFPLAY_STEPS   4096
+
+struct selfplay_game
+{
+    int swap;            /* The second player moves first */
+    uint64_t seed;       /* Random opening, games with the same seed share it */
+    unsigned int qopening;
+    int status;          /* Error code if an AI failed to follow the game */
+    int winner;          /* 1 or 2 (by colour), 0 if the game is unfinished */
+    int failed;          /* Colour which made an invalid step, 0 if none */
+    unsigned int qsteps;
+    uint8_t steps[MAX_SELFPLAY_STEPS];
+};
+
+typedef void (*selfplay_done)(const struct selfplay_game * const game, void * const arg);
+
+struct selfplay;
+
+/* Players are parameter sources, their instances are created by inits */
+struct selfplay * create_selfplay(
+    const struct ai * const players[2],
+    const ai_init inits[2],
+    const struct geometry * const geometry,
+    const int qworkers);
+
+void destroy_selfplay(struct selfplay * restrict const me);
+
+/* Games run in parallel, done is called in the game order by the caller */
+int selfplay_run(
+    struct selfplay * restrict const me,
+    struct selfplay_game * restrict const games,
+    const int qgames,
+    selfplay_done done,
+    void * const arg);
+
+/*
+ * SPRT for A/B matches of paired games (the same opening, colours are
+ * swapped). A pair scores 0..2 points for the first player, the test uses
+ * the normal approximation of the pentanomial model with logistic Elo.
+ */
+
+enum sprt_decision { SPRT_CONTINUE = 0, SPRT_H0, SPRT_H1 };
+
+struct sprt
+{
+    double elo0;
+    double elo1;
+    double alpha;
+    double beta;
+    uint32_t penta[5];   /* Pairs by the score in half-points */
+};
+
+struct sprt_result
+{
+    uint32_t qpairs;
+    double score;        /* Mean score of the first player, 0..1 */
+    double elo;
+    double elo_error;    /* Half of the 95% confidence interval */
+    double llr;
+    double lower;
+    double upper;
+    enum sprt_decision decision;
+};
+
+void sprt_eval(
+    const struct sprt * const me,
+    struct sprt_result * restrict const result);
+
+
+
+/*
+ * Game archive: an append-only data file of game records and the index
+ * file (name.idx) with record offsets, both are read with mmap. A record
+ * has a fixed header, player names and steps packed in 3 bits each.
+ */
+
+#define ARCHIVE_MAGIC          0x41474650 /* "PFGA" */
+#define ARCHIVE_INDEX_MAGIC    0x49474650 /* "PFGI" */
+#define ARCHIVE_VERSION        1
+
+struct archive_game
+{
+    uint32_t size;         /* Whole record, 8 bytes aligned */
+    uint32_t qsteps;
+    uint16_t width;
+    uint16_t height;
+    uint16_t goal_width;
+    uint16_t free_kick_len;
+    uint64_t seed;
+    int64_t time;          /* Unix time when the game was written */
+    uint8_t result;        /* Winner 1 or 2, 0 for an unfinished game */
+    uint8_t failed;        /* Player who made an invalid step, 0 if none */
+    uint8_t name_lens[2];
+    uint8_t reserved[4];
+    uint8_t data[];        /* Names of both players, then packed steps */
+};
+
+size_t archive_record_size(
+    const unsigned int names_len,
+    const unsigned int qsteps);
+
+void archive_pack_steps(
+    uint8_t * restrict const packed,
+    const uint8_t * const steps,
+    const unsigned int qsteps);
+
+void archive_unpack_steps(
+    const struct archive_game * const game,
+    uint8_t * restrict const steps);
+
+struct archive_writer;
+
+/* Creates files or appends to existing ones */
+struct archive_writer * open_archive_writer(const char * const filename);
+void close_archive_writer(struct archive_writer * restrict const me);
+
+/* Fields size and name_lens of the game are calculated, games longer than
+ * MAX_SELFPLAY_STEPS are rejected with EINVAL */
+int archive_append(
+    struct archive_writer * restrict const me,
+    const struct archive_game * const game,
+    const char * const names[2],
+    const uint8_t * const steps);
+
+struct archive;
+
+struct archive * open_archive(const char * const filename);
+void close_archive(struct archive * restrict const me);
+size_t archive_qgames(const struct archive * const me);
+
+/* NULL if the index is out of range or the record is broken, a returned
+ * game has at most MAX_SELFPLAY_STEPS steps */
+const struct archive_game * archive_get(
+    const struct archive * const me,
+    const size_t index);
+
+
+
+/*
+ * Replay validator: games are replayed with state_step without AI. A game is
+ * bad if it cannot be read, has an invalid geometry or an illegal step, the
+ * declared result differs from the final status or the declared step count
+ * differs from the replayed one. Games lost by an invalid step (failed) must
+ * end in progress.
+ */
+
+enum replay_verdict
+{
+    REPLAY_OK = 0,
+    REPLAY_UNREADABLE,
+    REPLAY_GEOMETRY,
+    REPLAY_ILLEGAL,
+    REPLAY_RESULT,
+    REPLAY_QSTEPS,
+    QREPLAY_VERDICTS
+};
+
+extern const char * replay_verdict_names[QREPLAY_VERDICTS];
+
+struct replay_bad
+{
+    size_t index;          /* Archive record from 0 or stats.txt line from 1 */
+    enum replay_verdict verdict;
+    unsigned int step;     /* Replayed steps before the error */
+};
+
+struct replay_report
+{
+    size_t qgames;
+    uint64_t qsteps;
+    size_t qbad;
+    struct replay_bad * bad; /* Sorted by index, free() it */
+};
+
+int replay_archive(
+    const struct archive * const archive,
+    const int qthreads,
+    struct replay_report * restrict const report);
+
+/* Text games of dirname/games listed in dirname/games/stats.txt */
+int replay_dir(
+    const char * const dirname,
+    const int qthreads,
+    struct replay_report * restrict const report);
+
+
+
+/*
+ * Engine server: a session process is forked for every connection on a Unix
+ * domain socket, it starts with its own new game and default AI. A client passes
+ * its stdin, stdout and stderr with SCM_RIGHTS in the first message, or the
+ * connection itself is used for all three. Sessions share a pool of search
+ * slots and the budget of bytes for node caches, both are reclaimed when a
+ * session ends. Without a server the pool and the budget are unlimited.
+ * Every thread which runs searches, perft or replays holds a slot, a search
+ * with several threads holds ai_qthreads slots for its whole time.
+ */
+
+#define MAX_SERVER_SLOTS      256
+#define DEF_SERVER_SESSIONS    64
+
+struct server_params
+{
+    const char * path;
+    int max_sessions;      /* Next connection waits for a finished session */
+    int qslots;            /* Concurrent searches, 0 for unlimited */
+    uint64_t cache_budget; /* Bytes for all node caches, 0 for unlimited */
+};
+
+/* Session runs with client stdin, stdout and stderr, the result is exit status */
+typedef int (* session_main)(void * arg);
+
+/* Runs until SIGINT or SIGTERM, then sessions are terminated */
+int run_server(
+    const struct server_params * const params,
+    session_main session,
+    void * arg);
+
+/* Count is limited by the number of slots, several slots are taken by one
+ * holder at a time, so holders do not wait for each other with a part taken */
+void search_slots_acquire(const int count);
+void search_slots_release(const int count);
+
+int cache_budget_take(const size_t sz);
+void cache_budget_return(const size_t sz);
+
+
+
+/*
+ * Multiplexed sessions: a line "@id command" of the input is routed to the
+ * session id, a process forked at the first command of the session. The entry
+ * builds the state of the session itself: threads of the engine are not copied
+ * by fork. Every output line of a session is prefixed with
+ * "@id " and written at once, so sessions search concurrently on one pipe.
+ * "@id quit" ends the session, the next command with this id starts anew.
+ */
+
+#define MAX_MUX_ID_LEN   32
+
+/* The line starts with '@', a new session runs entry(arg) on its commands */
+int mux_command(
+    const char * const line,
+    session_main entry,
+    void * arg);
+
+/* Sessions get EOF, then the call waits until they finish their commands */
+void mux_finish(void);
+
 #endif
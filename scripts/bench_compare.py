@@ -0,0 +1,43 @@
+import sys
+import json
+
+def load_results(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                item = json.loads(line)
+                results[item['position']] = item
+    return results
+
+def change(old, new):
+    if old == 0:
+        return "n/a"
+    return f"{100.0 * (new - old) / old:+.1f}%"
+
+def main():
+    if len(sys.argv) != 3:
+        print(f"Usage: {sys.argv[0]} old.json new.json", file=sys.stderr)
+        sys.exit(1)
+
+    old = load_results(sys.argv[1])
+    new = load_results(sys.argv[2])
+
+    print(f"{'position':20} {'playouts/s':>12} {'change':>8} {'nodes/s':>12} {'change':>8}  move")
+    for name, item in new.items():
+        base = old.get(name)
+        if base is None:
+            print(f"{name:20} {item['playouts_per_sec']:12.0f} {'new':>8} {item['nodes_per_sec']:12.0f} {'new':>8}")
+            continue
+
+        mark = "" if item['move'] == base['move'] else f"  differs: {base['move']} -> {item['move']}"
+        print(f"{name:20} {item['playouts_per_sec']:12.0f} {change(base['playouts_per_sec'], item['playouts_per_sec']):>8}"
+              f" {item['nodes_per_sec']:12.0f} {change(base['nodes_per_sec'], item['nodes_per_sec']):>8}{mark}")
+
+    for item in old.values():
+        if item['position'] not in new:
+            print(f"{item['position']:20} missing")
+
+if __name__ == "__main__":
+    main()
@@ -7,6 +7,8 @@ from random import randrange
 from collections import namedtuple
 
 from utils import counter
+from server_client import SessionProcess
+from mux_client import MuxProcess
 
 MAX_LINES = 3000
 BUF_SIZE = 4096
@@ -59,11 +61,16 @@ class Reader:
 
         return None
 
+# Engines are sessions of this server if it is set, see `paper-football --server`
+SERVER_ENV = 'PAPER_FOOTBALL_SERVER'
+
 class Engine:
-    def __init__(self, name, path, dims, **params):
+    def __init__(self, name, path, dims, server=None, mux=None, **params):
         self.name = name
         self.path = path
         self.dims = dims
+        self.server = server or os.environ.get(SERVER_ENV)
+        self.mux = mux # MuxProcess hosting the session
         self.params = params
         self.process = None
         self.stdout_reader = None
@@ -74,12 +81,17 @@ class Engine:
     def _start_process(self):
         ai = self.params.get('ai', 'mcts')
 
-        self.process = subprocess.Popen(
-            [self.path],
-            stdin=subprocess.PIPE,
-            stdout=subprocess.PIPE,
-            stderr=subprocess.PIPE,
-        )
+        if self.mux:
+            self.process = self.mux.session()
+        elif self.server:
+            self.process = SessionProcess(self.server)
+        else:
+            self.process = subprocess.Popen(
+                [self.path],
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
 
         self.stdout_reader = Reader(self.process.stdout)
         self.stderr_reader = Reader(self.process.stderr)
@@ -0,0 +1,118 @@
+import os
+import subprocess
+
+from threading import Lock, Thread
+
+class MuxInput:
+    """Stdin of a session, every written line is sent as `@id line`."""
+
+    def __init__(self, mux, sid):
+        self.mux = mux
+        self.prefix = f"@{sid} ".encode('utf-8')
+        self.buffer = b''
+        self.closed = False
+
+    def write(self, data):
+        if isinstance(data, str):
+            data = data.encode('utf-8')
+        self.buffer += data
+
+    def flush(self):
+        if b'\n' not in self.buffer:
+            return
+        text, self.buffer = self.buffer.rsplit(b'\n', 1)
+        lines = [self.prefix + line + b'\n' for line in text.split(b'\n')]
+        self.mux.send(b''.join(lines))
+
+    def close(self):
+        if not self.closed:
+            self.flush()
+            self.mux.send(self.prefix + b'quit\n')
+            self.closed = True
+
+class MuxSession:
+    """Session of a multiplexing engine, a replacement of subprocess.Popen.
+
+    Tagged replies of the engine are routed to the pipes of the session, so
+    they are read as the output of a spawned engine.
+    """
+
+    def __init__(self, mux, sid):
+        self.mux = mux
+        self.stdin = MuxInput(mux, sid)
+        stdout_r, self.stdout_fd = os.pipe()
+        stderr_r, self.stderr_fd = os.pipe()
+        self.stdout = os.fdopen(stdout_r, 'rb')
+        self.stderr = os.fdopen(stderr_r, 'rb')
+        self.returncode = None
+
+    def _close_pipes(self):
+        for fd in (self.stdout_fd, self.stderr_fd):
+            os.close(fd)
+
+    def poll(self):
+        if self.returncode is None and (self.stdin.closed or self.mux.process.poll() is not None):
+            self.returncode = 0
+        return self.returncode
+
+    def wait(self, timeout=None):
+        """The engine ends the session on quit"""
+        return self.poll()
+
+    def terminate(self):
+        self.stdin.close()
+
+    def kill(self):
+        self.terminate()
+        self.returncode = -9
+
+class MuxProcess:
+    """One engine process hosting many sessions, see `@id` commands in README."""
+
+    def __init__(self, path):
+        self.process = subprocess.Popen(
+            [path],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        self.lock = Lock()
+        self.sessions = {}
+        self.next_id = 1
+        self.threads = [
+            Thread(target=self._route, args=(self.process.stdout, 'stdout_fd'), daemon=True),
+            Thread(target=self._route, args=(self.process.stderr, 'stderr_fd'), daemon=True),
+        ]
+        for thread in self.threads:
+            thread.start()
+
+    def _route(self, stream, attr):
+        for line in stream:
+            if not line.startswith(b'@') or b' ' not in line:
+                continue
+            sid, text = line[1:].split(b' ', 1)
+            with self.lock:
+                session = self.sessions.get(sid.decode('utf-8'))
+            if session is not None:
+                os.write(getattr(session, attr), text)
+
+    def send(self, data):
+        with self.lock:
+            self.process.stdin.write(data)
+            self.process.stdin.flush()
+
+    def session(self):
+        with self.lock:
+            sid = str(self.next_id)
+            self.next_id += 1
+            session = MuxSession(self, sid)
+            self.sessions[sid] = session
+        return session
+
+    def close(self):
+        self.process.stdin.close()
+        self.process.wait()
+        for thread in self.threads:
+            thread.join()
+        for session in self.sessions.values():
+            session._close_pipes()
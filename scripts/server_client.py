@@ -0,0 +1,70 @@
+import os
+import sys
+import socket
+import subprocess
+
+from select import select
+
+class SessionProcess:
+    """Session of `paper-football --server path`, a replacement of subprocess.Popen.
+
+    Pipes are passed to the server with SCM_RIGHTS, so the session reads and
+    writes them as a spawned engine does. The server keeps the connection open
+    while the session is running.
+    """
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(str(path))
+
+        stdin_r, stdin_w = os.pipe()
+        stdout_r, stdout_w = os.pipe()
+        stderr_r, stderr_w = os.pipe()
+        try:
+            socket.send_fds(self.sock, [b'\n'], [stdin_r, stdout_w, stderr_w])
+        finally:
+            for fd in (stdin_r, stdout_w, stderr_w):
+                os.close(fd)
+
+        self.stdin = os.fdopen(stdin_w, 'wb')
+        self.stdout = os.fdopen(stdout_r, 'rb')
+        self.stderr = os.fdopen(stderr_r, 'rb')
+        self.returncode = None
+
+    def poll(self):
+        if self.returncode is None and select([self.sock], [], [], 0)[0]:
+            if not self.sock.recv(1):
+                self.returncode = 0
+        return self.returncode
+
+    def wait(self, timeout=None):
+        if self.returncode is None:
+            if not select([self.sock], [], [], timeout)[0]:
+                raise subprocess.TimeoutExpired('paper-football session', timeout)
+            self.sock.recv(1)
+            self.returncode = 0
+        return self.returncode
+
+    def terminate(self):
+        """The session ends on EOF of its stdin"""
+        if not self.stdin.closed:
+            self.stdin.close()
+
+    def kill(self):
+        self.terminate()
+        self.sock.close()
+        self.returncode = -9
+
+def main():
+    if len(sys.argv) != 2:
+        print(f"Usage: {sys.argv[0]} socket_path", file=sys.stderr)
+        sys.exit(1)
+
+    # Interactive session on our own stdin, stdout and stderr
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(sys.argv[1])
+    socket.send_fds(sock, [b'\n'], [0, 1, 2])
+    sock.recv(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,492 @@
+#include "paper-football.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct archive_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+static const struct archive_file_header data_header = { ARCHIVE_MAGIC, ARCHIVE_VERSION };
+static const struct archive_file_header index_header = { ARCHIVE_INDEX_MAGIC, ARCHIVE_VERSION };
+
+static void index_filename(
+    char * restrict const buf,
+    const size_t buf_sz,
+    const char * const filename)
+{
+    snprintf(buf, buf_sz, "%s.idx", filename);
+}
+
+size_t archive_record_size(
+    const unsigned int names_len,
+    const unsigned int qsteps)
+{
+    const size_t sz = sizeof(struct archive_game) + names_len + (3 * (size_t)qsteps + 7) / 8;
+    return (sz + 7) & ~(size_t)7;
+}
+
+void archive_pack_steps(
+    uint8_t * restrict const packed,
+    const uint8_t * const steps,
+    const unsigned int qsteps)
+{
+    memset(packed, 0, (3 * (size_t)qsteps + 7) / 8);
+    for (unsigned int i = 0; i < qsteps; ++i) {
+        const unsigned int bit = 3 * i;
+        const unsigned int value = (steps[i] & 7) << (bit & 7);
+        packed[bit >> 3] |= value;
+        if ((bit & 7) > 5) {
+            packed[(bit >> 3) + 1] |= value >> 8;
+        }
+    }
+}
+
+void archive_unpack_steps(
+    const struct archive_game * const game,
+    uint8_t * restrict const steps)
+{
+    const uint8_t * const packed = game->data + game->name_lens[0] + game->name_lens[1];
+    for (unsigned int i = 0; i < game->qsteps; ++i) {
+        const unsigned int bit = 3 * i;
+        unsigned int value = packed[bit >> 3] >> (bit & 7);
+        if ((bit & 7) > 5) {
+            value |= packed[(bit >> 3) + 1] << (8 - (bit & 7));
+        }
+        steps[i] = value & 7;
+    }
+}
+
+
+
+struct archive_writer
+{
+    int fd;
+    int index_fd;
+    uint8_t * buf;
+    size_t buf_sz;
+};
+
+static int open_append(
+    const char * const filename,
+    const struct archive_file_header * const header)
+{
+    const int fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+
+    flock(fd, LOCK_EX);
+
+    struct archive_file_header existing;
+    const ssize_t qread = pread(fd, &existing, sizeof(existing), 0);
+    int status = 0;
+    if (qread == 0) {
+        status = write(fd, header, sizeof(*header)) == sizeof(*header) ? 0 : EIO;
+    } else if (qread != sizeof(existing) || existing.magic != header->magic || existing.version != header->version) {
+        status = EINVAL;
+    }
+
+    flock(fd, LOCK_UN);
+
+    if (status != 0) {
+        close(fd);
+        errno = status;
+        return -1;
+    }
+
+    return fd;
+}
+
+struct archive_writer * open_archive_writer(const char * const filename)
+{
+    struct archive_writer * restrict const me = malloc(sizeof(struct archive_writer));
+    if (me == NULL) {
+        return NULL;
+    }
+
+    me->buf = NULL;
+    me->buf_sz = 0;
+
+    me->fd = open_append(filename, &data_header);
+    if (me->fd < 0) {
+        free(me);
+        return NULL;
+    }
+
+    const size_t filename_sz = strlen(filename) + 8;
+    char index_name[filename_sz];
+    index_filename(index_name, filename_sz, filename);
+
+    me->index_fd = open_append(index_name, &index_header);
+    if (me->index_fd < 0) {
+        const int saved = errno;
+        close(me->fd);
+        free(me);
+        errno = saved;
+        return NULL;
+    }
+
+    return me;
+}
+
+void close_archive_writer(struct archive_writer * restrict const me)
+{
+    close(me->index_fd);
+    close(me->fd);
+    free(me->buf);
+    free(me);
+}
+
+int archive_append(
+    struct archive_writer * restrict const me,
+    const struct archive_game * const game,
+    const char * const names[2],
+    const uint8_t * const steps)
+{
+    const size_t len1 = strlen(names[0]);
+    const size_t len2 = strlen(names[1]);
+    if (len1 > UINT8_MAX || len2 > UINT8_MAX || game->qsteps > MAX_SELFPLAY_STEPS) {
+        return EINVAL;
+    }
+
+    const size_t sz = archive_record_size(len1 + len2, game->qsteps);
+    if (sz > me->buf_sz) {
+        uint8_t * const buf = realloc(me->buf, sz);
+        if (buf == NULL) {
+            return ENOMEM;
+        }
+        me->buf = buf;
+        me->buf_sz = sz;
+    }
+
+    memset(me->buf, 0, sz);
+    struct archive_game * restrict const record = (struct archive_game *)me->buf;
+    *record = *game;
+    record->size = sz;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    record->name_lens[0] = len1;
+    record->name_lens[1] = len2;
+    memcpy(record->data, names[0], len1);
+    memcpy(record->data + len1, names[1], len2);
+    archive_pack_steps(record->data + len1 + len2, steps, game->qsteps);
+
+    /* Concurrent writers are serialized by the lock on the data file */
+    flock(me->fd, LOCK_EX);
+
+    int status = 0;
+    const off_t offset = lseek(me->fd, 0, SEEK_END);
+    if (offset < 0) {
+        status = errno;
+    } else if (write(me->fd, record, sz) != (ssize_t)sz) {
+        status = EIO;
+    } else {
+        const uint64_t index_item = offset;
+        if (write(me->index_fd, &index_item, sizeof(index_item)) != sizeof(index_item)) {
+            status = EIO;
+        }
+    }
+
+    flock(me->fd, LOCK_UN);
+    return status;
+}
+
+
+
+struct archive
+{
+    const uint8_t * data;
+    size_t data_sz;
+    const uint8_t * index;
+    size_t index_sz;
+    size_t qgames;
+};
+
+static const void * map_file(
+    const char * const filename,
+    size_t * restrict const sz,
+    const struct archive_file_header * const header)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void * const ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct archive_file_header * const existing = ptr;
+    if (existing->magic != header->magic || existing->version != header->version) {
+        munmap(ptr, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    *sz = st.st_size;
+    return ptr;
+}
+
+struct archive * open_archive(const char * const filename)
+{
+    struct archive * restrict const me = malloc(sizeof(struct archive));
+    if (me == NULL) {
+        return NULL;
+    }
+
+    me->data = map_file(filename, &me->data_sz, &data_header);
+    if (me->data == NULL) {
+        free(me);
+        return NULL;
+    }
+
+    const size_t filename_sz = strlen(filename) + 8;
+    char index_name[filename_sz];
+    index_filename(index_name, filename_sz, filename);
+
+    me->index = map_file(index_name, &me->index_sz, &index_header);
+    if (me->index == NULL) {
+        const int saved = errno;
+        munmap((void *)me->data, me->data_sz);
+        free(me);
+        errno = saved;
+        return NULL;
+    }
+
+    me->qgames = (me->index_sz - sizeof(struct archive_file_header)) / sizeof(uint64_t);
+    return me;
+}
+
+void close_archive(struct archive * restrict const me)
+{
+    munmap((void *)me->index, me->index_sz);
+    munmap((void *)me->data, me->data_sz);
+    free(me);
+}
+
+size_t archive_qgames(const struct archive * const me)
+{
+    return me->qgames;
+}
+
+const struct archive_game * archive_get(
+    const struct archive * const me,
+    const size_t index)
+{
+    if (index >= me->qgames) {
+        return NULL;
+    }
+
+    const uint64_t * const offsets = (const uint64_t *)(me->index + sizeof(struct archive_file_header));
+    const uint64_t offset = offsets[index];
+    const size_t header_sz = sizeof(struct archive_game);
+    if (offset % 8 != 0 || offset < sizeof(struct archive_file_header) || me->data_sz < header_sz || offset > me->data_sz - header_sz) {
+        return NULL;
+    }
+
+    const struct archive_game * const game = (const struct archive_game *)(me->data + offset);
+    if (game->qsteps > MAX_SELFPLAY_STEPS) {
+        return NULL;
+    }
+
+    const size_t sz = archive_record_size(game->name_lens[0] + game->name_lens[1], game->qsteps);
+    if (game->size != sz || sz > me->data_sz - offset) {
+        return NULL;
+    }
+
+    return game;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#define QARCHIVE_GAMES  100
+
+static void fill_game(
+    struct archive_game * restrict const game,
+    uint8_t * restrict const steps,
+    const int index)
+{
+    memset(game, 0, sizeof(*game));
+    game->qsteps = (index * 37) % 301;
+    game->width = 15;
+    game->height = 23;
+    game->goal_width = 4;
+    game->free_kick_len = 5;
+    game->seed = mix64(index);
+    game->time = 1700000000 + index;
+    game->result = index % 3;
+    game->failed = index % 7 == 0;
+
+    for (unsigned int i = 0; i < game->qsteps; ++i) {
+        steps[i] = mix64(index * 1000 + i) % QSTEPS;
+    }
+}
+
+static void must_pwrite(
+    const char * const filename,
+    const void * const data,
+    const size_t sz,
+    const off_t offset)
+{
+    const int fd = open(filename, O_WRONLY);
+    if (fd < 0 || pwrite(fd, data, sz, offset) != (ssize_t)sz) {
+        test_fail("Cannot write %zu bytes to “%s” at %jd, errno = %d.", sz, filename, (intmax_t)offset, errno);
+    }
+    close(fd);
+}
+
+static void must_reject_game(
+    const char * const filename,
+    const size_t index,
+    const char * const what)
+{
+    struct archive * restrict const archive = open_archive(filename);
+    if (archive == NULL) {
+        test_fail("open_archive failed, errno = %d.", errno);
+    }
+
+    if (archive_get(archive, index) != NULL) {
+        test_fail("Game %zu with %s is returned.", index, what);
+    }
+
+    close_archive(archive);
+}
+
+/* Offsets near UINT64_MAX and step counts which wrap record size must not
+ * pass the bounds check, both would read past the data mapping. */
+static void check_corrupt_archive(
+    const char * const filename,
+    const char * const index_name)
+{
+    const uint64_t offset = UINT64_MAX & ~(uint64_t)7;
+    must_pwrite(index_name, &offset, sizeof(offset), sizeof(struct archive_file_header));
+    must_reject_game(filename, 0, "wrapped offset");
+
+    /* 3 * qsteps is 1 in 32 bits, size fits a record of one step */
+    struct archive * restrict const archive = open_archive(filename);
+    if (archive == NULL) {
+        test_fail("open_archive failed, errno = %d.", errno);
+    }
+
+    const struct archive_game * const record = archive_get(archive, 1);
+    if (record == NULL) {
+        test_fail("Game 1 is not found.");
+    }
+
+    const uint32_t header[2] = {
+        archive_record_size(record->name_lens[0] + record->name_lens[1], 1),
+        0xAAAAAAAB
+    };
+    const off_t record_offset = (const uint8_t *)record - archive->data;
+    close_archive(archive);
+
+    must_pwrite(filename, header, sizeof(header), record_offset);
+    must_reject_game(filename, 1, "wrapped step count");
+}
+
+int test_archive(void)
+{
+    char filename[] = "/tmp/pf-archive-XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0) {
+        test_fail("mkstemp failed, errno = %d.", errno);
+    }
+    close(fd);
+    unlink(filename);
+
+    const char * const names[2] = { "first", "second-player" };
+    struct archive_game game;
+    uint8_t steps[512];
+    uint8_t unpacked[512];
+
+    /* Two writers append to the same archive one after another */
+    for (int part = 0; part < 2; ++part) {
+        struct archive_writer * restrict const writer = open_archive_writer(filename);
+        if (writer == NULL) {
+            test_fail("open_archive_writer failed, errno = %d.", errno);
+        }
+
+        for (int i = part * QARCHIVE_GAMES / 2; i < (part + 1) * QARCHIVE_GAMES / 2; ++i) {
+            fill_game(&game, steps, i);
+            const int status = archive_append(writer, &game, names, steps);
+            if (status != 0) {
+                test_fail("archive_append failed with code %d.", status);
+            }
+        }
+
+        close_archive_writer(writer);
+    }
+
+    struct archive * restrict const archive = open_archive(filename);
+    if (archive == NULL) {
+        test_fail("open_archive failed, errno = %d.", errno);
+    }
+
+    if (archive_qgames(archive) != QARCHIVE_GAMES) {
+        test_fail("%zu games in archive, %d expected.", archive_qgames(archive), QARCHIVE_GAMES);
+    }
+
+    for (int i = 0; i < QARCHIVE_GAMES; ++i) {
+        const struct archive_game * const record = archive_get(archive, i);
+        if (record == NULL) {
+            test_fail("Game %d is not found.", i);
+        }
+
+        fill_game(&game, steps, i);
+        const int is_same = 1
+            && record->qsteps == game.qsteps
+            && record->width == game.width
+            && record->free_kick_len == game.free_kick_len
+            && record->seed == game.seed
+            && record->time == game.time
+            && record->result == game.result
+            && record->failed == game.failed
+            && record->name_lens[0] == strlen(names[0])
+            && memcmp(record->data + record->name_lens[0], names[1], strlen(names[1])) == 0
+        ;
+
+        if (!is_same) {
+            test_fail("Game %d header differs.", i);
+        }
+
+        archive_unpack_steps(record, unpacked);
+        if (memcmp(steps, unpacked, game.qsteps) != 0) {
+            test_fail("Game %d steps differ.", i);
+        }
+    }
+
+    if (archive_get(archive, QARCHIVE_GAMES) != NULL) {
+        test_fail("Game out of range is returned.");
+    }
+
+    close_archive(archive);
+
+    const size_t filename_sz = sizeof(filename) + 8;
+    char index_name[filename_sz];
+    index_filename(index_name, filename_sz, filename);
+    check_corrupt_archive(filename, index_name);
+    unlink(index_name);
+    unlink(filename);
+    return 0;
+}
+
+#endif
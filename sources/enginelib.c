@@ -1,6 +1,8 @@
 #include "hashes.h"
 #include "paper-football.h"
 
+#include <pthread.h>
+
 #ifndef MAKE_CHECK
 struct ai_desc ai_list[] = {
     {      "mcts",       MCTS_AI_HASH, &init_mcts_ai },
@@ -50,15 +52,147 @@ enum cycle_result cycle_guard_push(struct cycle_guard * restrict me, int from, i
 }
 
 
+/*
+ * Hashed cycle guard: a kick overrides when its unordered pair of points was
+ * kicked before, then a cycle is found when the target was already a target
+ * since the last not overriding kick (anchor). Slots keep pair keys and point
+ * keys with the last kick index where the point was a target. Pops are LIFO,
+ * so the last inserted key can be removed from the linear probing table.
+ * A kick always moves the ball, so from != to is assumed.
+ */
+
+static inline uint64_t pair_key(int from, int to)
+{
+    const uint32_t lo = from < to ? from : to;
+    const uint32_t hi = from < to ? to : from;
+    return (1ull << 63) | (uint64_t)lo << 32 | hi;
+}
+
+static inline uint64_t point_key(int point)
+{
+    return (uint64_t)(uint32_t)point + 1;
+}
+
+static inline struct cycle_slot * cycle_set_find(
+    const struct cycle_set * const me,
+    const uint64_t key)
+{
+    const unsigned int mask = me->mask;
+    struct cycle_slot * restrict const slots = me->slots;
+    unsigned int i = mix64(key) & mask;
+    while (slots[i].key != 0 && slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return slots + i;
+}
+
+unsigned int cycle_set_qslots(int capacity)
+{
+    unsigned int result = 16;
+    while (result < 4 * (unsigned int)capacity) {
+        result *= 2;
+    }
+    return result;
+}
+
+void init_cycle_set(
+    struct cycle_set * restrict const me,
+    int capacity,
+    struct cycle_kick * kicks,
+    struct cycle_slot * slots)
+{
+    const unsigned int qslots = cycle_set_qslots(capacity);
+    memset(slots, 0, qslots * sizeof(struct cycle_slot));
+    me->qkicks = 0;
+    me->capacity = capacity;
+    me->anchor = -1;
+    me->mask = qslots - 1;
+    me->kicks = kicks;
+    me->slots = slots;
+}
+
+void cycle_set_reset(struct cycle_set * restrict me)
+{
+    while (me->qkicks > 0) {
+        cycle_set_pop(me);
+    }
+}
+
+enum cycle_result cycle_set_push(struct cycle_set * restrict me, int from, int to)
+{
+    const int qkicks = me->qkicks;
+    if (qkicks >= me->capacity) {
+        return CYCLE_FOUND;
+    }
+
+    const uint64_t key = pair_key(from, to);
+    struct cycle_slot * restrict const pair = cycle_set_find(me, key);
+    struct cycle_slot * restrict target = cycle_set_find(me, point_key(to));
+
+    const int override = pair->key != 0;
+    if (override && qkicks >= 2 && target->key != 0 && target->value >= me->anchor) {
+        return CYCLE_FOUND;
+    }
+
+    struct cycle_kick * restrict const kick = me->kicks + qkicks;
+    kick->from = from;
+    kick->to = to;
+    kick->override = override;
+    kick->anchor = me->anchor;
+
+    if (!override) {
+        pair->key = key;
+        me->anchor = qkicks;
+        if (target->key == 0) {
+            target = cycle_set_find(me, point_key(to));
+        }
+    }
+
+    if (target->key != 0) {
+        kick->last_to = target->value;
+    } else {
+        kick->last_to = -1;
+        target->key = point_key(to);
+    }
+
+    target->value = qkicks;
+    me->qkicks = qkicks + 1;
+    return NO_CYCLE;
+}
+
+void cycle_set_pop(struct cycle_set * restrict me)
+{
+    const struct cycle_kick * const kick = me->kicks + --me->qkicks;
+
+    struct cycle_slot * restrict const target = cycle_set_find(me, point_key(kick->to));
+    if (kick->last_to < 0) {
+        target->key = 0;
+    } else {
+        target->value = kick->last_to;
+    }
+
+    if (!kick->override) {
+        cycle_set_find(me, pair_key(kick->from, kick->to))->key = 0;
+    }
+
+    me->anchor = kick->anchor;
+}
+
+
 
 struct bsf_node
 {
     struct dlist link;
     struct bsf_node * parent;
     struct state * state;
-    struct cycle_guard * guard;
     enum step step;
+    int ball;
     int depth;
+    const struct step_change * changes;
+    unsigned int qchanges;
+    unsigned int qlines;
+    unsigned int serial;
+    uint64_t hash;
 };
 
 static struct bsf_node * bsf_node(struct dlist * item)
@@ -75,7 +209,10 @@ static struct bsf_node * bsf_alloc(
 
     struct dlist * first = me->free.next;
     dlist_remove(first);
-    return bsf_node(first);
+
+    struct bsf_node * restrict const result = bsf_node(first);
+    result->serial = ++me->serial;
+    return result;
 }
 
 static void bsf_dealloc(
@@ -85,6 +222,257 @@ static void bsf_dealloc(
     dlist_insert_before(&node->link, &me->free);
 }
 
+/*
+ * Transpositions: position inside a free kick serie is defined by the ball,
+ * the set of lines drawn since the root and the state of the cycle guard.
+ * Hash of the lines is a XOR of mixed step changes, so a child hash is the
+ * parent hash XOR the changes of the last state_step. Visited set is a linear
+ * probing table of hashes with the node which reached the position first, on
+ * a hash hit the full key is compared, so a collision never prunes a node.
+ * Nodes are recycled after visits limit, a stale entry is found by serial.
+ */
+
+static uint64_t changes_hash(
+    const struct step_change * const changes,
+    const unsigned int qchanges)
+{
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < qchanges; ++i) {
+        const int what = changes[i].what;
+        if (what >= 0) {
+            result ^= mix64(1 + 8 * (uint64_t)what + changes[i].data);
+        }
+    }
+    return result;
+}
+
+static unsigned int changes_qlines(
+    const struct step_change * const changes,
+    const unsigned int qchanges)
+{
+    unsigned int result = 0;
+    for (unsigned int i = 0; i < qchanges; ++i) {
+        result += changes[i].what >= 0;
+    }
+    return result;
+}
+
+/* Sorts keys and removes duplicates, returns count of unique keys */
+static int unique_keys(uint64_t * restrict const keys, const int qkeys)
+{
+    for (int i = 1; i < qkeys; ++i) {
+        const uint64_t key = keys[i];
+        int j = i;
+        for (; j > 0 && keys[j-1] > key; --j) {
+            keys[j] = keys[j-1];
+        }
+        keys[j] = key;
+    }
+
+    int result = 0;
+    for (int i = 0; i < qkeys; ++i) {
+        if (result == 0 || keys[result-1] != keys[i]) {
+            keys[result++] = keys[i];
+        }
+    }
+    return result;
+}
+
+static int is_subset(
+    const uint64_t * const keys,
+    const int qkeys,
+    const uint64_t * const set,
+    const int qset)
+{
+    int j = 0;
+    for (int i = 0; i < qkeys; ++i) {
+        while (j < qset && set[j] < keys[i]) {
+            ++j;
+        }
+        if (j == qset || set[j] != keys[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Cycle guard state: kicked pairs and points which were targets since the
+ * last not overriding kick (see cycle_set_push).
+ */
+struct guard_keys
+{
+    int qpairs;
+    int qtargets;
+    uint64_t pairs[MAX_PACKED_SERIE + 1];
+    uint64_t targets[MAX_PACKED_SERIE + 1];
+};
+
+/* Guard after the kicks from the root to the node and the kick to ball (if not NO_WAY) */
+static void get_guard_keys(
+    const struct bsf_node * node,
+    const int ball,
+    struct guard_keys * restrict const me)
+{
+    int balls[MAX_PACKED_SERIE + 2];
+    int qkicks = node->depth;
+    for (int i = qkicks; i >= 0; --i, node = node->parent) {
+        balls[i] = node->ball;
+    }
+
+    if (ball != NO_WAY) {
+        balls[++qkicks] = ball;
+    }
+
+    int anchor = 0;
+    for (int i = 0; i < qkicks; ++i) {
+        const uint64_t key = pair_key(balls[i], balls[i+1]);
+        int override = 0;
+        for (int j = 0; j < i; ++j) {
+            override |= me->pairs[j] == key;
+        }
+        me->pairs[i] = key;
+        anchor = override ? anchor : i;
+    }
+
+    me->qtargets = 0;
+    for (int i = anchor; i < qkicks; ++i) {
+        me->targets[me->qtargets++] = point_key(balls[i+1]);
+    }
+
+    me->qpairs = unique_keys(me->pairs, qkicks);
+    me->qtargets = unique_keys(me->targets, me->qtargets);
+}
+
+/*
+ * Stored node is reached not later by BFS. When it has the same lines and
+ * ball, and its guard has a subset of pairs and a subset of targets, every
+ * kick allowed to the candidate is allowed to the stored node and the subset
+ * relation holds after the kick, so the stored subtree covers the candidate.
+ * Lines of the stored node were added since the root, so they are the same
+ * as the lines of the candidate when all of them are drawn in the candidate
+ * state and their counts are equal.
+ */
+static int bsf_same_position(
+    const struct bsf_node * const stored,
+    const struct bsf_node * const parent,
+    const int ball,
+    const struct state * const state,
+    const unsigned int qlines)
+{
+    if (stored->ball != ball || stored->qlines != qlines || stored->depth > parent->depth + 1) {
+        return 0;
+    }
+
+    for (const struct bsf_node * node = stored; node->parent != NULL; node = node->parent) {
+        const struct step_change * const changes = node->changes;
+        for (unsigned int i = 0; i < node->qchanges; ++i) {
+            const int what = changes[i].what;
+            if (what >= 0 && !(state->lines[what] & (1 << changes[i].data))) {
+                return 0;
+            }
+        }
+    }
+
+    struct guard_keys stored_keys;
+    struct guard_keys keys;
+    get_guard_keys(stored, NO_WAY, &stored_keys);
+    get_guard_keys(parent, ball, &keys);
+    return is_subset(stored_keys.pairs, stored_keys.qpairs, keys.pairs, keys.qpairs)
+        && is_subset(stored_keys.targets, stored_keys.qtargets, keys.targets, keys.qtargets);
+}
+
+#ifdef MAKE_CHECK
+/* Tests force collisions of all positions with the same ball with 0 */
+static uint64_t lines_hash_mask = ~(uint64_t)0;
+#define LINES_HASH(hash) ((hash) & lines_hash_mask)
+#else
+#define LINES_HASH(hash) (hash)
+#endif
+
+/*
+ * Returns 1 for a transposition. Otherwise returns 0 and the slot for the
+ * candidate node in *slot, NULL if the table is full.
+ */
+static int bsf_visited(
+    struct bsf_free_kicks * restrict const me,
+    const uint64_t lines_hash,
+    const struct bsf_node * const parent,
+    const int ball,
+    const struct state * const state,
+    const unsigned int qlines,
+    struct bsf_visit ** restrict const slot)
+{
+    uint64_t key = LINES_HASH(lines_hash) ^ mix64(~(uint64_t)ball);
+    key += key == 0;
+
+    const unsigned int mask = me->visited_mask;
+    struct bsf_visit * restrict const visited = me->visited;
+    unsigned int i = key & mask;
+    for (; visited[i].key != 0; i = (i + 1) & mask) {
+        const struct bsf_visit * const item = visited + i;
+        if (item->key != key || item->node == NULL || item->node->serial != item->serial) {
+            continue;
+        }
+
+        if (bsf_same_position(item->node, parent, ball, state, qlines)) {
+            ++me->qtranspositions;
+            return 1;
+        }
+    }
+
+    *slot = NULL;
+    if (4 * me->qvisited < 3 * (mask + 1)) {
+        visited[i].key = key;
+        visited[i].node = NULL;
+        ++me->qvisited;
+        *slot = visited + i;
+    }
+
+    return 0;
+}
+
+static void bsf_visit(
+    struct bsf_visit * restrict const slot,
+    struct bsf_node * const node)
+{
+    if (slot != NULL) {
+        slot->node = node;
+        slot->serial = node->serial;
+    }
+}
+
+static void bsf_reset_visited(
+    struct bsf_free_kicks * restrict const me,
+    struct bsf_node * const root)
+{
+    memset(me->visited, 0, (me->visited_mask + 1) * sizeof(struct bsf_visit));
+    me->qvisited = 0;
+    me->qstate_steps = 0;
+    me->qtranspositions = 0;
+
+    root->changes = NULL;
+    root->qchanges = 0;
+    root->qlines = 0;
+
+    struct bsf_visit * slot;
+    bsf_visited(me, 0, root, root->ball, root->state, 0, &slot);
+    bsf_visit(slot, root);
+}
+
+static int grow_series(struct bsf_free_kicks * restrict const me)
+{
+    const int series_capacity = 2 * me->series_capacity;
+    struct bsf_serie * series = realloc(me->series, series_capacity * sizeof(struct bsf_serie));
+    if (series == NULL) {
+        return ENOMEM;
+    }
+
+    me->series = series;
+    me->series_capacity = series_capacity;
+    return 0;
+}
+
 static enum add_serie_status add_serie(
     struct warns * const warns,
     struct bsf_free_kicks * restrict const me,
@@ -112,28 +500,32 @@ static enum add_serie_status add_serie(
         if (me->win != NULL) {
             return ADDED_OK;
         }
-        serie = me->series + me->capacity + 1;
+        serie = &me->win_serie;
     }
 
     if (loose) {
         if (me->loose != NULL) {
             return ADDED_OK;
         }
-        serie = me->series + me->capacity;
+        serie = &me->loose_serie;
     }
 
     if (serie == NULL) {
+        if (me->qseries >= me->series_capacity && grow_series(me) != 0) {
+            return ADDED_LAST;
+        }
         serie = me->series + me->qseries;
     }
 
     int depth = node->depth;
+    uint64_t packed = step;
 
     serie->ball = ball;
     serie->qsteps = depth + 1;
-    serie->steps[depth] = step;
 
     while (depth > 0) {
-        serie->steps[--depth] = node->step;
+        --depth;
+        packed = (packed << SERIE_STEP_BITS) | node->step;
         node = node->parent;
 
         if (node == NULL) {
@@ -142,6 +534,8 @@ static enum add_serie_status add_serie(
         }
     };
 
+    serie->packed = packed;
+
     if (node != me->root) {
         WARN(warns, BSF_NODE_NOT_FROM_ROOT, "node", node, "root", me->root);
     }
@@ -157,7 +551,48 @@ static enum add_serie_status add_serie(
     if (ball_alts != NULL) {
         ++ *ball_alts;
     }
-    return me->qseries >= me->capacity ? ADDED_LAST : ADDED_OK;
+    return ADDED_OK;
+}
+
+/*
+ * Move cycle guard from the node of the previous walk to the given node
+ * through their common ancestor.
+ */
+
+static void bsf_walk(
+    struct bsf_free_kicks * restrict const me,
+    const struct bsf_node * const node)
+{
+    struct cycle_set * restrict const guard = &me->guard;
+    const struct bsf_node ** restrict const path = me->path;
+    const int depth = node->depth;
+    const int path_len = me->path_len;
+
+    const struct bsf_node * nodes[depth + 1];
+    const struct bsf_node * ptr = node;
+    for (int i = depth; i --> 0; ptr = ptr->parent) {
+        nodes[i] = ptr;
+    }
+
+    int common = 0;
+    const int qcommon = depth < path_len ? depth : path_len;
+    while (common < qcommon && path[common] == nodes[common]) {
+        ++common;
+    }
+
+    for (int i = path_len; i --> common;) {
+        cycle_set_pop(guard);
+    }
+
+    int ball = common == 0 ? me->root->ball : path[common-1]->ball;
+    for (int i = common; i < depth; ++i) {
+        const struct bsf_node * const next = nodes[i];
+        cycle_set_push(guard, ball, next->ball);
+        ball = next->ball;
+        path[i] = next;
+    }
+
+    me->path_len = depth;
 }
 
 static void bsf_go(
@@ -170,6 +605,7 @@ static void bsf_go(
     struct dlist * restrict const free = &me->free;
     struct dlist * restrict const waiting = &me->waiting;
     struct dlist * restrict const used = &me->used;
+    struct cycle_set * restrict const guard = &me->guard;
 
     while (!is_dlist_empty(waiting)) {
         struct dlist * first = waiting->next;
@@ -187,8 +623,13 @@ static void bsf_go(
         }
 
         dlist_insert_after(first, used);
+        bsf_walk(me, parent);
 
         steps_t steps = state_get_steps(prev);
+        if (depth == 0) {
+            steps &= me->root_steps;
+        }
+
         while (steps) {
             enum step step = extract_step(&steps);
 
@@ -201,6 +642,7 @@ static void bsf_go(
             struct state * restrict const next = child->state;
             state_copy(next, prev);
             int next_ball = state_step(next, step);
+            ++me->qstate_steps;
 
             if (next_ball < 0 || !is_free_kick_situation(next)) {
                 enum add_serie_status status = add_serie(warns, me, parent, prev->active, step, next_ball);
@@ -213,7 +655,7 @@ static void bsf_go(
 
                 switch (status) {
                     case ADDED_LAST:
-                        WARN(warns, BSF_SERIES_OVERFLOW, "qseries", me->qseries, "capacity", me->capacity);
+                        WARN(warns, BSF_SERIES_OVERFLOW, "qseries", me->qseries, "capacity", me->series_capacity);
                         return;
                     case ADDED_OK:
                     case ADDED_FAILURE:
@@ -226,19 +668,30 @@ static void bsf_go(
                 continue;
             }
 
-            struct cycle_guard * restrict const guard = parent->guard;
-            enum cycle_result status = cycle_guard_push(guard, prev_ball, next_ball);
+            enum cycle_result status = cycle_set_push(guard, prev_ball, next_ball);
             if (status == CYCLE_FOUND) {
                 bsf_dealloc(me, child);
                 continue;
             }
+            cycle_set_pop(guard);
 
-            cycle_guard_copy(child->guard, guard);
-            cycle_guard_pop(guard);
+            const uint64_t hash = parent->hash ^ changes_hash(next->step_changes, next->qstep_changes);
+            const unsigned int qlines = parent->qlines + changes_qlines(next->step_changes, next->qstep_changes);
+            struct bsf_visit * slot;
+            if (bsf_visited(me, hash, parent, next_ball, next, qlines, &slot)) {
+                bsf_dealloc(me, child);
+                continue;
+            }
 
             child->step = step;
+            child->ball = next_ball;
+            child->hash = hash;
+            child->changes = next->step_changes;
+            child->qchanges = next->qstep_changes;
+            child->qlines = qlines;
             child->parent = parent;
             child->depth = depth + 1;
+            bsf_visit(slot, child);
             dlist_insert_before(&child->link, waiting);
         }
     }
@@ -256,75 +709,98 @@ struct bsf_free_kicks * create_bsf_free_kicks(
     const uint32_t free_kick_reduce = (free_kick_len - 1) * (free_kick_len - 1);
     const size_t guard_capacity = 4 + qpoints / free_kick_reduce;
 
-    const int max_depth_aligned = (max_depth + 7) & ~7;
+    if (max_depth > MAX_PACKED_SERIE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
     const int stats_sz = qpoints * sizeof(int);
-    const size_t sizes[10] = {
+
+    unsigned int visited_sz = 16;
+    while (visited_sz < 4 * (unsigned int)capacity) {
+        visited_sz *= 2;
+    }
+
+    /* Every node keeps the changes of one state_step in its state journal */
+    const unsigned int state_journal_sz = state_journal_capacity(geometry);
+
+    const size_t sizes[11] = {
         sizeof(struct bsf_free_kicks),
-        capacity * sizeof(struct bsf_serie),
-        capacity * max_depth_aligned * sizeof(enum step),
         capacity * sizeof(struct bsf_node),
         capacity * sizeof(struct state),
         capacity * qpoints,
-        capacity * sizeof(struct cycle_guard),
-        capacity * guard_capacity * sizeof(struct kick),
+        guard_capacity * sizeof(struct cycle_kick),
+        cycle_set_qslots(guard_capacity) * sizeof(struct cycle_slot),
         stats_sz, stats_sz,
+        max_depth * sizeof(struct bsf_node *),
+        visited_sz * sizeof(struct bsf_visit),
+        capacity * state_journal_sz * sizeof(struct step_change),
     };
 
-    void * ptrs[10];
-    void * data = multialloc(10, sizes, ptrs, 64);
+    void * ptrs[11];
+    void * data = multialloc(11, sizes, ptrs, 64);
 
     if (data == NULL) {
         return NULL;
     }
 
+    struct bsf_serie * restrict const series = malloc(capacity * sizeof(struct bsf_serie));
+    if (series == NULL) {
+        free(data);
+        return NULL;
+    }
+
     struct bsf_free_kicks * restrict const me = data;
-    struct bsf_serie * restrict const series = ptrs[1];
-    enum step * restrict const steps_base = ptrs[2];
-    struct bsf_node * restrict const nodes = ptrs[3];
-    struct state * restrict const states = ptrs[4];
-    uint8_t * restrict const lines_base = ptrs[5];
-    struct cycle_guard * restrict const guards = ptrs[6];
-    struct kick * restrict const kicks_base = ptrs[7];
-    int * restrict const alts = ptrs[8];
-    int * restrict const visits = ptrs[9];
+    struct bsf_node * restrict const nodes = ptrs[1];
+    struct state * restrict const states = ptrs[2];
+    uint8_t * restrict const lines_base = ptrs[3];
+    struct cycle_kick * restrict const kicks = ptrs[4];
+    struct cycle_slot * restrict const slots = ptrs[5];
+    int * restrict const alts = ptrs[6];
+    int * restrict const visits = ptrs[7];
+    const struct bsf_node ** restrict const path = ptrs[8];
+    struct bsf_visit * restrict const visited = ptrs[9];
+    struct step_change * restrict const state_journals = ptrs[10];
 
     me->qseries = 0;
-    me->capacity = capacity - 2;
+    me->series_capacity = capacity;
+    me->capacity = capacity;
     me->max_depth = max_depth;
     me->max_alts = max_alts;
     me->max_visits = max_visits;
     me->stats_sz = stats_sz;
+    me->root_steps = ~(steps_t)0;
 
     me->root = NULL;
+    me->path = path;
+    me->path_len = 0;
     me->series = series;
     me->win = NULL;
     me->loose = NULL;
     me->alts = alts;
     me->visits = visits;
     me->states = states;
+    me->visited = visited;
+    me->visited_mask = visited_sz - 1;
+    me->serial = 0;
+    me->qvisited = 0;
+    me->qstate_steps = 0;
+    me->qtranspositions = 0;
 
     dlist_init(&me->free);
     dlist_init(&me->waiting);
     dlist_init(&me->used);
-
-    for (int i = 0; i < capacity; ++i) {
-        series[i].steps = steps_base + i * max_depth_aligned;
-    }
+    init_cycle_set(&me->guard, guard_capacity, kicks, slots);
 
     for (int i = 0; i < capacity; ++i) {
         struct bsf_node * restrict const node = nodes + i;
         struct state * restrict const state = states + i;
         uint8_t * restrict const lines = lines_base + i * qpoints;
-        struct cycle_guard * restrict const guard = guards + i;
-        struct kick * restrict const kicks = kicks_base + i * guard_capacity;
+        struct step_change * restrict const journal = state_journals + i * state_journal_sz;
 
-        init_state(state, geometry, lines);
+        init_state_with_journal(state, geometry, lines, journal);
         node->state = state;
 
-        guard->capacity = guard_capacity;
-        guard->kicks = kicks;
-        node->guard = guard;
-
         dlist_insert_before(&node->link, &me->free);
     }
 
@@ -337,19 +813,19 @@ void destroy_bsf_free_kicks(struct bsf_free_kicks * restrict const me)
         return;
     }
 
-    const int capacity = me->capacity + 2;
+    const int capacity = me->capacity;
     for (int i = 0; i < capacity; ++i) {
         free_state(&me->states[i]);
     }
 
+    free(me->series);
     free(me);
 }
 
 void bsf_gen(
     struct warns * const warns,
     struct bsf_free_kicks * const me,
-    const struct state * const state,
-    const struct cycle_guard * const guard)
+    const struct state * const state)
 {
     struct dlist * restrict const free = &me->free;
     struct dlist * restrict const waiting = &me->waiting;
@@ -369,299 +845,1669 @@ void bsf_gen(
 
     root->parent = NULL;
     root->step = INVALID_STEP;
+    root->ball = state->ball;
     root->depth = 0;
+    root->hash = 0;
     state_copy(root->state, state);
-    cycle_guard_reset(root->guard);
+    cycle_set_reset(&me->guard);
     me->root = root;
     me->win = NULL;
     me->loose = NULL;
+    me->path_len = 0;
 
     memset(me->alts, 0, me->stats_sz);
     memset(me->visits, 0, me->stats_sz);
+    bsf_reset_visited(me, root);
     bsf_go(warns, me);
 }
 
 
 
-#ifdef MAKE_CHECK
+/*
+ * Parallel variant of bsf_gen: branches under different first steps are
+ * independent, so root steps are dealt round robin to workers. Every worker
+ * has its own bsf_free_kicks (state pool, alts and visits). Series are merged
+ * into the result in order of length (as BFS adds them) under max_alts cap.
+ * The calling thread works as worker 0, others wait for the next generation.
+ * Workers take no search slots, the caller holds ai_qthreads slots for them.
+ */
 
-#include "insider.h"
+struct bsf_worker
+{
+    struct bsf_parallel * pool;
+    struct bsf_free_kicks * bsf;
+    struct warns warns;
+    pthread_t thread;
+};
 
-static void run_cycle_test(struct cycle_guard * restrict guard, const int * const path, int count) {
-    cycle_guard_reset(guard);
+struct bsf_parallel
+{
+    int qworkers;
+    int qthreads;
+    int qbusy;
+    int quit;
+    unsigned int generation;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    const struct state * state;
+    struct bsf_free_kicks * result;
+    struct bsf_worker workers[];
+};
 
-    int expected_cycle_at = count - 1;
-    int cycle_found_at = -1;
+static void bsf_worker_run(struct bsf_worker * restrict const worker)
+{
+    const struct bsf_parallel * const pool = worker->pool;
+    warns_reset(&worker->warns);
+    bsf_gen(&worker->warns, worker->bsf, pool->state);
+}
 
-    for (int i = 1; i < count; ++i) {
-        int from = path[i-1];
-        int to = path[i];
-        enum cycle_result result = cycle_guard_push(guard, from, to);
-        if (result == CYCLE_FOUND) {
-            cycle_found_at = i;
-            break;
+static void * bsf_worker_main(void * arg)
+{
+    struct bsf_worker * restrict const worker = arg;
+    struct bsf_parallel * restrict const pool = worker->pool;
+    unsigned int generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->quit && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
         }
-    }
+        const int quit = pool->quit;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
 
-    if (cycle_found_at != expected_cycle_at) {
-        test_fail("Expected cycle at step %d, got %d", expected_cycle_at, cycle_found_at);
+        if (quit) {
+            return NULL;
+        }
+
+        bsf_worker_run(worker);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->qbusy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
     }
 }
 
-int test_cycle_detection(void)
+static void stop_bsf_workers(struct bsf_parallel * restrict const me)
 {
-    const size_t capacity = 100;
-    struct kick * kicks = malloc(capacity * sizeof(struct kick));
-    if (kicks == NULL) {
-        test_fail("Failed to allocate kicks array");
+    pthread_mutex_lock(&me->mutex);
+    me->quit = 1;
+    pthread_cond_broadcast(&me->start);
+    pthread_mutex_unlock(&me->mutex);
+
+    for (int i = 1; i < me->qthreads; ++i) {
+        pthread_join(me->workers[i].thread, NULL);
     }
+    me->qthreads = 1;
+}
 
-    struct cycle_guard guard;
-    guard.capacity = capacity;
-    guard.kicks = kicks;
+struct bsf_parallel * create_bsf_parallel(
+    const struct geometry * const geometry,
+    int qthreads,
+    int capacity,
+    int max_depth,
+    int max_alts,
+    int max_visits)
+{
+    if (qthreads <= 0 || qthreads > QSTEPS) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-    int test1[] = { 1, 2, 1, 2 };
-    int test2[] = { 1, 2, 3, 1, 2, 1 };
-    int test3[] = { 1, 2, 3, 1, 2, 3, 1 };
-    int test4[] = { 1, 2, 1, 3, 1, 2, 1 };
-    int test5[] = { 1, 2, 3, 2, 4, 2, 1, 2 };
-    int test6[] = { 1, 2, 3, 4, 5, 6, 7, 5, 6, 7, 6 };
+    const size_t sz = sizeof(struct bsf_parallel) + qthreads * sizeof(struct bsf_worker);
+    struct bsf_parallel * restrict const me = malloc(sz);
+    if (me == NULL) {
+        return NULL;
+    }
 
-    run_cycle_test(&guard, test1, ARRAY_LEN(test1));
-    run_cycle_test(&guard, test2, ARRAY_LEN(test2));
-    run_cycle_test(&guard, test3, ARRAY_LEN(test3));
-    run_cycle_test(&guard, test4, ARRAY_LEN(test4));
-    run_cycle_test(&guard, test5, ARRAY_LEN(test5));
-    run_cycle_test(&guard, test6, ARRAY_LEN(test6));
+    me->qworkers = qthreads;
+    me->qthreads = 1;
+    me->qbusy = 0;
+    me->quit = 0;
+    me->generation = 0;
+    me->state = NULL;
+    pthread_mutex_init(&me->mutex, NULL);
+    pthread_cond_init(&me->start, NULL);
+    pthread_cond_init(&me->done, NULL);
+
+    for (int i = 0; i < qthreads; ++i) {
+        me->workers[i].bsf = NULL;
+    }
 
-    free(kicks);
-    return 0;
-}
+    me->result = create_bsf_free_kicks(geometry, capacity, max_depth, max_alts, max_visits);
+    if (me->result == NULL) {
+        destroy_bsf_parallel(me);
+        return NULL;
+    }
 
-static void check_prep_step(
-    struct preparation * restrict const prep,
-    const enum step expected)
-{
-    enum step peeked = preparation_peek(prep);
-    if (peeked != expected) {
-        test_fail("peek expected %d, got %d", expected, peeked);
+    for (int i = 0; i < qthreads; ++i) {
+        struct bsf_worker * restrict const worker = me->workers + i;
+        worker->pool = me;
+        warns_init(&worker->warns);
+        worker->bsf = create_bsf_free_kicks(geometry, capacity, max_depth, max_alts, max_visits);
+        if (worker->bsf == NULL) {
+            destroy_bsf_parallel(me);
+            return NULL;
+        }
     }
 
-    enum step popped = preparation_pop(prep);
-    if (popped != expected) {
-        test_fail("pop expected %d, got %d", expected, popped);
+    for (int i = 1; i < qthreads; ++i) {
+        const int status = pthread_create(&me->workers[i].thread, NULL, bsf_worker_main, me->workers + i);
+        if (status != 0) {
+            destroy_bsf_parallel(me);
+            errno = status;
+            return NULL;
+        }
+        me->qthreads = i + 1;
     }
+
+    return me;
 }
 
-int test_preparation(void)
+void destroy_bsf_parallel(struct bsf_parallel * restrict const me)
 {
-    const enum step steps[] = { NORTH_EAST, SOUTH_WEST, SOUTH_EAST, NORTH_WEST, NORTH };
-    const int qsteps = ARRAY_LEN(steps);
+    if (me == NULL) {
+        return;
+    }
 
-    struct preparation prep = {
-        .qpreps = qsteps,
-        .current = 0
-    };
-    memcpy(prep.preps, steps, qsteps * sizeof(enum step));
+    stop_bsf_workers(me);
 
-    for (int i = 0; i < qsteps; ++i) {
-        check_prep_step(&prep, steps[i]);
+    for (int i = 0; i < me->qworkers; ++i) {
+        destroy_bsf_free_kicks(me->workers[i].bsf);
     }
 
-    check_prep_step(&prep, INVALID_STEP);
+    destroy_bsf_free_kicks(me->result);
+    pthread_cond_destroy(&me->done);
+    pthread_cond_destroy(&me->start);
+    pthread_mutex_destroy(&me->mutex);
+    free(me);
+}
 
+static enum add_serie_status merge_serie(
+    struct bsf_free_kicks * restrict const me,
+    const struct bsf_serie * const serie)
+{
+    const int ball = serie->ball;
+    if (ball >= 0) {
+        if (me->alts[ball] >= me->max_alts) {
+            return ADDED_OK;
+        }
+        ++me->alts[ball];
+    }
+
+    if (me->qseries >= me->series_capacity && grow_series(me) != 0) {
+        return ADDED_LAST;
+    }
+
+    me->series[me->qseries++] = *serie;
+    return ADDED_OK;
+}
+
+static void merge_series(
+    struct warns * const warns,
+    struct bsf_parallel * restrict const me)
+{
+    struct bsf_free_kicks * restrict const result = me->result;
+    const int qworkers = me->qworkers;
+
+    result->qseries = 0;
+    result->win = NULL;
+    result->loose = NULL;
+    memset(result->alts, 0, result->stats_sz);
+
+    for (int i = 0; i < qworkers; ++i) {
+        const struct bsf_worker * const worker = me->workers + i;
+        for (int j = 0; j < worker->warns.qwarns; ++j) {
+            const struct warn * const w = worker->warns.warns + j;
+            warns_add(warns, w->num, w->param1, w->value1, w->param2, w->value2, w->file_name, w->line_num);
+        }
+
+        const struct bsf_free_kicks * const bsf = worker->bsf;
+        if (bsf->win != NULL && result->win == NULL) {
+            result->win_serie = *bsf->win;
+            result->win = &result->win_serie;
+        }
+        if (bsf->loose != NULL && result->loose == NULL) {
+            result->loose_serie = *bsf->loose;
+            result->loose = &result->loose_serie;
+        }
+    }
+
+    if (result->win != NULL) {
+        /* Not interested more */
+        return;
+    }
+
+    int cursors[qworkers];
+    memset(cursors, 0, sizeof(cursors));
+
+    for (int qsteps = 1; qsteps <= result->max_depth; ++qsteps)
+    for (int i = 0; i < qworkers; ++i) {
+        const struct bsf_free_kicks * const bsf = me->workers[i].bsf;
+        int * restrict const cursor = cursors + i;
+        for (; *cursor < bsf->qseries; ++*cursor) {
+            const struct bsf_serie * const serie = bsf->series + *cursor;
+            if (serie->qsteps != qsteps) {
+                break;
+            }
+
+            if (merge_serie(result, serie) == ADDED_LAST) {
+                WARN(warns, BSF_SERIES_OVERFLOW, "qseries", result->qseries, "capacity", result->series_capacity);
+                return;
+            }
+        }
+    }
+}
+
+struct bsf_free_kicks * bsf_gen_parallel(
+    struct warns * const warns,
+    struct bsf_parallel * const me,
+    const struct state * const state)
+{
+    const int qworkers = me->qworkers;
+    for (int i = 0; i < qworkers; ++i) {
+        me->workers[i].bsf->root_steps = 0;
+    }
+
+    steps_t steps = state_get_steps(state);
+    for (int i = 0; steps; i = (i + 1) % qworkers) {
+        const enum step step = extract_step(&steps);
+        me->workers[i].bsf->root_steps |= 1 << step;
+    }
+
+    me->state = state;
+
+    pthread_mutex_lock(&me->mutex);
+    me->qbusy = me->qthreads - 1;
+    ++me->generation;
+    pthread_cond_broadcast(&me->start);
+    pthread_mutex_unlock(&me->mutex);
+
+    bsf_worker_run(me->workers);
+
+    pthread_mutex_lock(&me->mutex);
+    while (me->qbusy > 0) {
+        pthread_cond_wait(&me->done, &me->mutex);
+    }
+    pthread_mutex_unlock(&me->mutex);
+
+    merge_series(warns, me);
+    return me->result;
+}
+
+
+
+struct perft_job
+{
+    enum step step1;
+    enum step step2;
+};
+
+struct perft_pool
+{
+    const struct state * root;
+    int depth;
+    int qjobs;
+    int next;
+    int status;
+    uint64_t * counts;
+    struct perft_job jobs[QSTEPS * QSTEPS];
+};
+
+static uint64_t perft_job_run(
+    struct perft_pool * restrict const pool,
+    struct state * restrict const state,
+    const struct perft_job * const job)
+{
+    state_copy(state, pool->root);
+    state_step(state, job->step1);
+    const int ball = state_step(state, job->step2);
+
+    if (pool->depth == 2) {
+        return 1;
+    }
+
+    if (ball < 0) {
+        return 0;
+    }
+
+    uint64_t counts[QSTEPS];
+    const int status = state_perft(state, pool->depth - 2, counts);
+    if (status != 0) {
+        __atomic_store_n(&pool->status, status, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    uint64_t result = 0;
+    for (enum step step = 0; step < QSTEPS; ++step) {
+        result += counts[step];
+    }
+    return result;
+}
+
+static void * perft_worker_main(void * arg)
+{
+    struct perft_pool * restrict const pool = arg;
+    struct state * restrict const state = create_state(pool->root->geometry);
+    if (state == NULL) {
+        __atomic_store_n(&pool->status, ENOMEM, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    search_slots_acquire(1);
+    for (;;) {
+        const int ijob = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (ijob >= pool->qjobs) {
+            break;
+        }
+
+        const struct perft_job * const job = pool->jobs + ijob;
+        const uint64_t count = perft_job_run(pool, state, job);
+        __atomic_add_fetch(pool->counts + job->step1, count, __ATOMIC_RELAXED);
+    }
+    search_slots_release(1);
+
+    destroy_state(state);
+    return NULL;
+}
+
+int perft_parallel(
+    const struct state * const state,
+    const int depth,
+    int qthreads,
+    uint64_t * restrict const counts)
+{
+    if (depth < 1 || qthreads < 1) {
+        return EINVAL;
+    }
+
+    struct state * restrict const root = create_state(state->geometry);
+    if (root == NULL) {
+        return ENOMEM;
+    }
+
+    state_copy(root, state);
+    if (depth == 1 || qthreads == 1 || root->ball < 0) {
+        search_slots_acquire(1);
+        const int status = state_perft(root, depth, counts);
+        search_slots_release(1);
+        destroy_state(root);
+        return status;
+    }
+
+    /* Jobs are the first two steps, so free kicks are balanced between threads */
+    struct perft_pool pool;
+    pool.root = state;
+    pool.depth = depth;
+    pool.qjobs = 0;
+    pool.next = 0;
+    pool.status = 0;
+    pool.counts = counts;
+    memset(counts, 0, QSTEPS * sizeof(uint64_t));
+
+    steps_t steps1 = state_get_steps(root);
+    while (steps1 != 0) {
+        const enum step step1 = extract_step(&steps1);
+        if (state_step(root, step1) == NO_WAY) {
+            continue;
+        }
+
+        steps_t steps2 = root->ball < 0 ? 0 : state_get_steps(root);
+        while (steps2 != 0) {
+            const enum step step2 = extract_step(&steps2);
+            struct perft_job * restrict const job = pool.jobs + pool.qjobs;
+            job->step1 = step1;
+            job->step2 = step2;
+            pool.qjobs += state_step(root, step2) != NO_WAY;
+            state_rollback(root, root->step_changes, root->qstep_changes);
+        }
+
+        state_copy(root, state);
+    }
+
+    destroy_state(root);
+
+    if (qthreads > pool.qjobs) {
+        qthreads = pool.qjobs > 0 ? pool.qjobs : 1;
+    }
+
+    pthread_t threads[qthreads];
+    int qstarted = 1;
+    for (; qstarted < qthreads; ++qstarted) {
+        if (pthread_create(threads + qstarted, NULL, perft_worker_main, &pool) != 0) {
+            break;
+        }
+    }
+
+    perft_worker_main(&pool);
+
+    for (int i = 1; i < qstarted; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return pool.status;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+static void run_cycle_test(
+    struct cycle_guard * restrict guard,
+    struct cycle_set * restrict set,
+    const int * const path,
+    int count)
+{
+    cycle_guard_reset(guard);
+    cycle_set_reset(set);
+
+    int expected_cycle_at = count - 1;
+    int cycle_found_at = -1;
+    int set_cycle_found_at = -1;
+
+    for (int i = 1; i < count; ++i) {
+        int from = path[i-1];
+        int to = path[i];
+        enum cycle_result result = cycle_guard_push(guard, from, to);
+        if (result == CYCLE_FOUND) {
+            cycle_found_at = i;
+            break;
+        }
+    }
+
+    for (int i = 1; i < count; ++i) {
+        enum cycle_result result = cycle_set_push(set, path[i-1], path[i]);
+        if (result == CYCLE_FOUND) {
+            set_cycle_found_at = i;
+            break;
+        }
+    }
+
+    if (cycle_found_at != expected_cycle_at) {
+        test_fail("Expected cycle at step %d, got %d", expected_cycle_at, cycle_found_at);
+    }
+
+    if (set_cycle_found_at != expected_cycle_at) {
+        test_fail("Expected cycle at step %d, cycle_set got %d", expected_cycle_at, set_cycle_found_at);
+    }
+}
+
+int test_cycle_detection(void)
+{
+    const size_t capacity = 100;
+    struct kick * kicks = malloc(capacity * sizeof(struct kick));
+    if (kicks == NULL) {
+        test_fail("Failed to allocate kicks array");
+    }
+
+    struct cycle_guard guard;
+    guard.capacity = capacity;
+    guard.kicks = kicks;
+
+    struct cycle_kick set_kicks[capacity];
+    struct cycle_slot set_slots[cycle_set_qslots(capacity)];
+    struct cycle_set set;
+    init_cycle_set(&set, capacity, set_kicks, set_slots);
+
+    int test1[] = { 1, 2, 1, 2 };
+    int test2[] = { 1, 2, 3, 1, 2, 1 };
+    int test3[] = { 1, 2, 3, 1, 2, 3, 1 };
+    int test4[] = { 1, 2, 1, 3, 1, 2, 1 };
+    int test5[] = { 1, 2, 3, 2, 4, 2, 1, 2 };
+    int test6[] = { 1, 2, 3, 4, 5, 6, 7, 5, 6, 7, 6 };
+
+    run_cycle_test(&guard, &set, test1, ARRAY_LEN(test1));
+    run_cycle_test(&guard, &set, test2, ARRAY_LEN(test2));
+    run_cycle_test(&guard, &set, test3, ARRAY_LEN(test3));
+    run_cycle_test(&guard, &set, test4, ARRAY_LEN(test4));
+    run_cycle_test(&guard, &set, test5, ARRAY_LEN(test5));
+    run_cycle_test(&guard, &set, test6, ARRAY_LEN(test6));
+
+    free(kicks);
+    return 0;
+}
+
+int test_cycle_set_random(void)
+{
+    const int capacity = 24;
+    const int qpoints = 6;
+
+    struct kick kicks[capacity];
+    struct cycle_guard guard;
+    guard.capacity = capacity;
+    guard.kicks = kicks;
+    cycle_guard_reset(&guard);
+
+    struct cycle_kick set_kicks[capacity];
+    struct cycle_slot set_slots[cycle_set_qslots(capacity)];
+    struct cycle_set set;
+    init_cycle_set(&set, capacity, set_kicks, set_slots);
+
+    srand(20251018);
+    int ball = 0;
+    for (int i = 0; i < 200000; ++i) {
+        if (guard.qkicks > 0 && rand() % 3 == 0) {
+            cycle_guard_pop(&guard);
+            cycle_set_pop(&set);
+            ball = guard.qkicks > 0 ? kicks[guard.qkicks - 1].to : rand() % qpoints;
+            continue;
+        }
+
+        const int to = (ball + 1 + rand() % (qpoints - 1)) % qpoints;
+        const enum cycle_result expected = cycle_guard_push(&guard, ball, to);
+        const enum cycle_result result = cycle_set_push(&set, ball, to);
+        if (result != expected) {
+            test_fail("Iteration %d, kick %d -> %d after %d kicks: cycle_set returns %d, cycle_guard %d.",
+                i, ball, to, set.qkicks, result, expected);
+        }
+
+        if (set.qkicks != guard.qkicks) {
+            test_fail("Iteration %d: qkicks mismatch %d != %d.", i, set.qkicks, guard.qkicks);
+        }
+
+        if (result == NO_CYCLE) {
+            ball = to;
+        }
+    }
+
+    cycle_set_reset(&set);
+    for (unsigned int i = 0; i <= set.mask; ++i) {
+        if (set.slots[i].key != 0) {
+            test_fail("Slot %u is not empty after reset.", i);
+        }
+    }
+
+    return 0;
+}
+
+static void check_prep_step(
+    struct preparation * restrict const prep,
+    const enum step expected)
+{
+    enum step peeked = preparation_peek(prep);
+    if (peeked != expected) {
+        test_fail("peek expected %d, got %d", expected, peeked);
+    }
+
+    enum step popped = preparation_pop(prep);
+    if (popped != expected) {
+        test_fail("pop expected %d, got %d", expected, popped);
+    }
+}
+
+int test_preparation(void)
+{
+    const enum step steps[] = { NORTH_EAST, SOUTH_WEST, SOUTH_EAST, NORTH_WEST, NORTH };
+    const int qsteps = ARRAY_LEN(steps);
+
+    struct preparation prep = {
+        .qpreps = qsteps,
+        .current = 0
+    };
+    memcpy(prep.preps, steps, qsteps * sizeof(enum step));
+
+    for (int i = 0; i < qsteps; ++i) {
+        check_prep_step(&prep, steps[i]);
+    }
+
+    check_prep_step(&prep, INVALID_STEP);
+
+    return 0;
+}
+
+static void check_series(
+    const struct bsf_free_kicks * const fks,
+    const struct state * const state)
+{
+    const struct geometry * const geometry = state->geometry;
+
+    struct state * restrict const current = create_state(geometry);
+    if (current == NULL) {
+        test_fail("Failed to create test state for validation");
+    }
+
+    for (int i = 0; i < fks->qseries; ++i) {
+        struct bsf_serie * serie = &fks->series[i];
+        const int qsteps = serie->qsteps;
+
+        if (qsteps <= 0 || qsteps > fks->max_depth) {
+            test_fail("Serie %d has invalid qsteps: %d", i, qsteps);
+        }
+
+        state_copy(current, state);
+
+        // All steps except last should stay in penalty situation
+        for (int j = 0; j < qsteps - 1; ++j) {
+            enum step step = serie_step(serie, j);
+            if (step < 0 || step >= QSTEPS) {
+                test_fail("Serie %d step %d is invalid: %d", i, j, step);
+            }
+
+            int ball = state_step(current, step);
+            if (ball == NO_WAY) {
+                test_fail("Serie %d step %d (%s) is blocked", i, j, step_names[step]);
+            }
+
+            if (!is_free_kick_situation(current)) {
+                test_fail("Serie %d step %d exits penalty before end", i, j);
+            }
+        }
+
+        // Last step should exit penalty
+        enum step last_step = serie_step(serie, qsteps - 1);
+        int ball = state_step(current, last_step);
+        if (ball == NO_WAY) {
+            test_fail("Serie %d last step (%s) is blocked", i, step_names[last_step]);
+        }
+
+        if (ball != serie->ball) {
+            test_fail("Serie %d: final ball %d != expected %d", i, ball, serie->ball);
+        }
+
+        if (ball >= 0 && ball < geometry->qpoints && is_free_kick_situation(current)) {
+            test_fail("Serie %d ends in penalty situation at ball=%d", i, ball);
+        }
+
+        if (is_free_kick_situation(current)) {
+            test_fail("Serie %d still in penalty after all steps", i);
+        }
+    }
+
+    destroy_state(current);
+}
+
+struct bsf_free_kicks * run_bsf(const struct game_protocol * const protocol, int qsteps_back)
+{
+    struct warns warns_storage;
+    struct state state_storage;
+
+    struct warns * restrict const warns = &warns_storage;
+    struct state * restrict const state = &state_storage;
+
+    const struct std_geom * g = &protocol->geom.std;
+    struct geometry * restrict const geometry = create_std_geometry(g->width, g->height, g->goal_width, g->free_kick_len);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d, %d) fails, return value is NULL, errno is %d.", g->width, g->height, g->goal_width, g->free_kick_len, errno);
+    }
+
+    const uint32_t qpoints = geometry->qpoints;
+    uint8_t * restrict const lines = malloc(qpoints);
+
+    warns_init(warns);
+    if (lines == NULL || init_state(state, geometry, lines) != 0) {
+        test_fail("Bad alloc for the state.");
+    }
+
+    const int qsteps = protocol->qsteps - qsteps_back;
+    for (int i=0; i<qsteps; ++i) {
+        const enum step step = protocol->steps[i];
+        const int ball = state_step(state, step);
+        if (ball == NO_WAY) {
+            test_fail("State rejected step %s: move=%d; ball=NO_WAY", step_names[step], i);
+        }
+        if (ball < 0) {
+            test_fail("Game had been finished unexpectedly: step %s: move=%d; ball=%d;", step_names[step], i, ball);
+        }
+    }
+
+    struct bsf_free_kicks * fks = create_bsf_free_kicks(geometry, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+    if (fks == NULL) {
+        test_fail("create_bsf_free_kicks failed");
+    }
+
+    bsf_gen(warns, fks, state);
+
+    // Check for warnings during generation
+    const struct warn * warn = warns_get(warns, 0);
+    if (warn != NULL) {
+        test_fail("Warning after bsf_gen: %s (at %s:%d)",
+            warn->msg, warn->file_name, warn->line_num);
+    }
+
+    check_series(fks, state);
+
+    free_state(state);
+    free(lines);
+    destroy_geometry(geometry);
+    return fks;
+}
+
+int test_gen_complete_free_kicks(void)
+{
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_fastest_free_kick1, 0);
+    if (fks->qseries != 8) {
+        test_fail("bsf_gen returned %d series, expected 8", fks->qseries);
+    }
+
+    destroy_bsf_free_kicks(fks);
+    return 0;
+}
+
+int test_gen_complete_free_kicks_win(void)
+{
+    // Short game ending with penalty and goal
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000461, 0);
+
+    if (fks->win == NULL) {
+        test_fail("Win path not detected in game 000461");
+    }
+
+    if (fks->win->ball != GOAL_1) {
+        test_fail("Win path leads to wrong goal: %d (expected GOAL_1=%d)", fks->win->ball, GOAL_1);
+    }
+
+    if (fks->win->qsteps != 1) {
+        test_fail("Win path has %d steps, expected 1", fks->win->qsteps);
+    }
+
+    destroy_bsf_free_kicks(fks);
+    return 0;
+}
+
+int test_long_free_kick_to_win(void)
+{
+    // Last move sequence: NW N SE (regular move) + W SE SW SW (4-step penalty to GOAL_2)
+    // We run BFS on position before last penalty (cut last 4 steps)
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000050, 4);
+
+    if (fks->win == NULL) {
+        test_fail("Win path not detected in game 000050");
+    }
+
+    if (fks->win->ball != GOAL_2) {
+        test_fail("Win path leads to wrong goal: %d (expected GOAL_2=%d)", fks->win->ball, GOAL_2);
+    }
+
+    if (fks->win->qsteps > 4) {
+        test_fail("Win path has %d steps, expected <= 4", fks->win->qsteps);
+    }
+
+    destroy_bsf_free_kicks(fks);
+    return 0;
+}
+
+int test_long_free_kick_to_loose(void)
+{
+    // Last moves:
+    //   1 NW NW S + NE W E W S N NE
+    //   2 NW N SE + W SE SW SW
+    // 14 steps before we have a free kick with loose
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000050, 14);
+
+    if (fks->loose == NULL) {
+        test_fail("Loose path not detected in game 000050");
+    }
+
+    destroy_bsf_free_kicks(fks);
+    return 0;
+}
+
+int test_gen_complete_free_kicks_long(void)
+{
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_with_hang, 0);
+
+    if (fks->qseries == 0) {
+        test_fail("No series generated for real hung game penalty situation");
+    }
+
+    destroy_bsf_free_kicks(fks);
     return 0;
 }
 
-struct bsf_free_kicks * run_bsf(const struct game_protocol * const protocol, int qsteps_back)
+static void check_same_serie(
+    const char * const name,
+    const int index,
+    const struct bsf_serie * const a,
+    const struct bsf_serie * const b)
+{
+    if (a == NULL && b == NULL) {
+        return;
+    }
+
+    if (a == NULL || b == NULL) {
+        test_fail("%s: serie %d exists only in one generator (%p, %p)", name, index, a, b);
+    }
+
+    if (a->ball != b->ball || a->qsteps != b->qsteps) {
+        test_fail("%s: serie %d mismatch, ball %d/%d, qsteps %d/%d", name, index, a->ball, b->ball, a->qsteps, b->qsteps);
+    }
+
+    if (a->packed != b->packed) {
+        test_fail("%s: serie %d has different steps", name, index);
+    }
+}
+
+static int count_balls(const struct bsf_free_kicks * const fks, int qpoints)
+{
+    int result = 0;
+    for (int i = 0; i < qpoints; ++i) {
+        result += fks->alts[i] > 0;
+    }
+    return result;
+}
+
+static struct bsf_free_kicks * must_gen_with_mask(
+    const struct state * const state,
+    const int capacity,
+    const int max_depth,
+    const int max_visits,
+    const uint64_t hash_mask)
+{
+    struct bsf_free_kicks * restrict const fks = create_bsf_free_kicks(state->geometry, capacity, max_depth, 8, max_visits);
+    if (fks == NULL) {
+        test_fail("create_bsf_free_kicks failed");
+    }
+
+    struct warns warns;
+    warns_init(&warns);
+    lines_hash_mask = hash_mask;
+    bsf_gen(&warns, fks, state);
+    lines_hash_mask = ~(uint64_t)0;
+
+    if (warns.qwarns != 0) {
+        test_fail("Unexpected warning with hash mask %016" PRIx64 ": %s.", hash_mask, warns.warns[0].msg);
+    }
+
+    return fks;
+}
+
+/*
+ * With zero hash mask all positions with the same ball collide, the full key
+ * comparison must keep the same nodes, so series are the same.
+ */
+static void check_forced_collisions(
+    const struct state * const state,
+    const int capacity,
+    const int max_depth,
+    const int max_visits)
+{
+    struct bsf_free_kicks * restrict const expected = must_gen_with_mask(state, capacity, max_depth, max_visits, ~(uint64_t)0);
+    struct bsf_free_kicks * restrict const fks = must_gen_with_mask(state, capacity, max_depth, max_visits, 0);
+
+    if (fks->qtranspositions != expected->qtranspositions || fks->qstate_steps != expected->qstate_steps) {
+        test_fail("Forced collisions: %u transpositions and %u state_step calls, expected %u and %u.",
+            fks->qtranspositions, fks->qstate_steps, expected->qtranspositions, expected->qstate_steps);
+    }
+
+    if (fks->qseries != expected->qseries) {
+        test_fail("Forced collisions: %d series, expected %d.", fks->qseries, expected->qseries);
+    }
+
+    for (int i = 0; i < fks->qseries; ++i) {
+        check_same_serie("forced collisions", i, expected->series + i, fks->series + i);
+    }
+
+    destroy_bsf_free_kicks(fks);
+    destroy_bsf_free_kicks(expected);
+}
+
+/*
+ * Two kicks to the same ball with the same count of lines but different lines
+ * collide with zero hash mask, the second one is not a transposition.
+ */
+static void check_lines_collision(const struct geometry * const geometry)
+{
+    struct bsf_free_kicks * restrict const me = create_bsf_free_kicks(geometry, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+    struct state * restrict const state = create_state(geometry);
+    if (me == NULL || state == NULL) {
+        test_fail("create_bsf_free_kicks or create_state failed");
+    }
+
+    struct step_change changes[2];
+    int qchanges = 0;
+    for (uint32_t point = 0; point < geometry->qpoints && qchanges < 2; ++point) {
+        if ((state->lines[point] & 1) == 0) {
+            changes[qchanges].what = point;
+            changes[qchanges].data = 0;
+            ++qchanges;
+        }
+    }
+
+    if (qchanges != 2) {
+        test_fail("No free lines in the initial state.");
+    }
+
+    lines_hash_mask = 0;
+    struct bsf_node * restrict const root = bsf_alloc(me);
+    root->parent = NULL;
+    root->ball = state->ball;
+    root->depth = 0;
+    bsf_reset_visited(me, root);
+
+    const int ball = (state->ball + 1) % geometry->qpoints;
+    struct bsf_node * restrict const stored = bsf_alloc(me);
+    stored->parent = root;
+    stored->ball = ball;
+    stored->depth = 1;
+    stored->changes = changes;
+    stored->qchanges = 1;
+    stored->qlines = 1;
+
+    struct bsf_visit * slot;
+    state->lines[changes[0].what] ^= 1 << changes[0].data;
+    if (bsf_visited(me, 1, root, ball, state, 1, &slot) || slot == NULL) {
+        test_fail("First kick to ball %d is visited.", ball);
+    }
+    bsf_visit(slot, stored);
+
+    state->lines[changes[0].what] ^= 1 << changes[0].data;
+    state->lines[changes[1].what] ^= 1 << changes[1].data;
+    if (bsf_visited(me, 2, root, ball, state, 1, &slot)) {
+        test_fail("Hash collision with different lines is pruned as a transposition.");
+    }
+
+    state->lines[changes[1].what] ^= 1 << changes[1].data;
+    state->lines[changes[0].what] ^= 1 << changes[0].data;
+    if (!bsf_visited(me, 3, root, ball, state, 1, &slot)) {
+        test_fail("Hash collision with the same lines is not a transposition.");
+    }
+
+    lines_hash_mask = ~(uint64_t)0;
+    destroy_state(state);
+    destroy_bsf_free_kicks(me);
+}
+
+int test_gen_free_kicks_transpositions(void)
+{
+    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_with_hang, 0);
+    if (fks->qtranspositions == 0) {
+        test_fail("No transpositions found in with_hang free kick.");
+    }
+
+    if (fks->qstate_steps == 0) {
+        test_fail("state_step calls are not counted.");
+    }
+
+    struct geometry * restrict const geometry = must_create_protocol_geometry(&protocol_with_hang);
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    for (int i = 0; i < protocol_with_hang.qsteps; ++i) {
+        state_step(state, protocol_with_hang.steps[i]);
+    }
+
+    /* Without visits limit only visited set prunes the search */
+    struct bsf_free_kicks * restrict const unlimited = create_bsf_free_kicks(geometry, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 1 << 30);
+    if (unlimited == NULL) {
+        test_fail("create_bsf_free_kicks failed");
+    }
+
+    struct warns warns;
+    warns_init(&warns);
+    bsf_gen(&warns, unlimited, state);
+
+    check_lines_collision(geometry);
+    check_forced_collisions(state, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8);
+    check_forced_collisions(state, 4 * BSF_CAPACITY, 8, 1 << 30);
+
+    const int qpoints = geometry->qpoints;
+    const int qballs = count_balls(fks, qpoints);
+    const int unlimited_qballs = count_balls(unlimited, qpoints);
+    if (unlimited_qballs < qballs) {
+        test_fail("Unlimited visits reach %d balls, but default search reaches %d.", unlimited_qballs, qballs);
+    }
+
+    destroy_bsf_free_kicks(unlimited);
+    destroy_state(state);
+    destroy_geometry(geometry);
+    destroy_bsf_free_kicks(fks);
+    return 0;
+}
+
+int test_gen_free_kicks_many_series(void)
+{
+    struct geometry * restrict const geometry = must_create_protocol_geometry(&protocol_with_hang);
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    for (int i = 0; i < protocol_with_hang.qsteps; ++i) {
+        state_step(state, protocol_with_hang.steps[i]);
+    }
+
+    /* Small initial capacity, series storage should grow */
+    struct bsf_free_kicks * restrict const fks = create_bsf_free_kicks(geometry, 64, MAX_FREE_KICK_SERIE, 64, 8);
+    if (fks == NULL) {
+        test_fail("create_bsf_free_kicks failed");
+    }
+
+    struct warns warns;
+    warns_init(&warns);
+    bsf_gen(&warns, fks, state);
+
+    for (int i = 0; i < warns.qwarns; ++i) {
+        if (warns.warns[i].num == WARN_BSF_SERIES_OVERFLOW) {
+            test_fail("Series overflow with %d series.", fks->qseries);
+        }
+    }
+
+    if (fks->qseries <= 64) {
+        test_fail("Expected more than 64 series, got %d.", fks->qseries);
+    }
+
+    check_series(fks, state);
+
+    destroy_bsf_free_kicks(fks);
+    destroy_state(state);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+static void check_gen_parallel(
+    const struct game_protocol * const protocol,
+    int qsteps_back,
+    int qthreads)
+{
+    struct warns warns;
+    warns_init(&warns);
+
+    struct bsf_free_kicks * restrict const bsf = run_bsf(protocol, qsteps_back);
+    const char * const name = protocol->name;
+
+    struct geometry * restrict const geometry = must_create_protocol_geometry(protocol);
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    const int qsteps = protocol->qsteps - qsteps_back;
+    for (int i = 0; i < qsteps; ++i) {
+        state_step(state, protocol->steps[i]);
+    }
+
+    struct bsf_parallel * restrict const pool = create_bsf_parallel(geometry, qthreads, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+    if (pool == NULL) {
+        test_fail("create_bsf_parallel(%d threads) failed, errno = %d.", qthreads, errno);
+    }
+
+    for (int pass = 0; pass < 3; ++pass) {
+        const struct bsf_free_kicks * const fks = bsf_gen_parallel(&warns, pool, state);
+
+        const struct warn * warn = warns_get(&warns, 0);
+        if (warn != NULL) {
+            test_fail("%s: warning after bsf_gen_parallel: %s (at %s:%d)", name, warn->msg, warn->file_name, warn->line_num);
+        }
+
+        check_series(fks, state);
+
+        if ((bsf->win == NULL) != (fks->win == NULL)) {
+            test_fail("%s: win is %p for bsf_gen and %p for bsf_gen_parallel", name, bsf->win, fks->win);
+        }
+
+        if (bsf->win != NULL) {
+            /* Series are not complete after win */
+            if (qthreads == 1) {
+                check_same_serie(name, -1, bsf->win, fks->win);
+            }
+            continue;
+        }
+
+        if ((bsf->qseries == 0) != (fks->qseries == 0)) {
+            test_fail("%s: bsf_gen returned %d series, bsf_gen_parallel %d", name, bsf->qseries, fks->qseries);
+        }
+
+        if (qthreads > 1) {
+            continue;
+        }
+
+        if (bsf->qseries != fks->qseries) {
+            test_fail("%s: bsf_gen returned %d series, bsf_gen_parallel %d", name, bsf->qseries, fks->qseries);
+        }
+
+        for (int i = 0; i < bsf->qseries; ++i) {
+            check_same_serie(name, i, bsf->series + i, fks->series + i);
+        }
+
+        check_same_serie(name, -2, bsf->loose, fks->loose);
+    }
+
+    destroy_bsf_parallel(pool);
+    destroy_state(state);
+    destroy_geometry(geometry);
+    destroy_bsf_free_kicks(bsf);
+}
+
+static uint64_t serie_outcome(
+    struct state * restrict const current,
+    const struct state * const state,
+    const struct bsf_serie * const serie)
 {
-    struct warns warns_storage;
-    struct cycle_guard guard_storage;
-    struct state state_storage;
+    state_copy(current, state);
+    for (int i = 0; i < serie->qsteps; ++i) {
+        state_step(current, serie_step(serie, i));
+    }
 
-    struct warns * restrict const warns = &warns_storage;
-    struct cycle_guard * restrict const guard = &guard_storage;
-    struct state * restrict const state = &state_storage;
+    uint64_t result = mix64(~(uint64_t)current->ball);
+    const uint32_t qpoints = state->geometry->qpoints;
+    for (uint32_t point = 0; point < qpoints; ++point) {
+        result ^= mix64(1 + 8 * (uint64_t)point + current->lines[point]);
+    }
+    return result;
+}
 
-    const struct std_geom * g = &protocol->geom.std;
-    struct geometry * restrict const geometry = create_std_geometry(g->width, g->height, g->goal_width, g->free_kick_len);
-    if (geometry == NULL) {
-        test_fail("create_std_geometry(%d, %d, %d, %d) fails, return value is NULL, errno is %d.", g->width, g->height, g->goal_width, g->free_kick_len, errno);
+static int cmp_outcome(const void * a, const void * b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sorted unique outcomes (lines and ball after serie) of all series */
+static int get_outcomes(
+    const struct bsf_free_kicks * const fks,
+    const struct state * const state,
+    uint64_t * restrict const outcomes)
+{
+    struct state * restrict const current = create_state(state->geometry);
+    if (current == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
     }
 
-    const uint32_t qpoints = geometry->qpoints;
-    uint8_t * restrict const lines = malloc(qpoints);
+    for (int i = 0; i < fks->qseries; ++i) {
+        outcomes[i] = serie_outcome(current, state, fks->series + i);
+    }
+    destroy_state(current);
 
-    warns_init(warns);
-    cycle_guard_reset(guard);
-    init_state(state, geometry, lines);
+    qsort(outcomes, fks->qseries, sizeof(uint64_t), cmp_outcome);
+    int qoutcomes = 0;
+    for (int i = 0; i < fks->qseries; ++i) {
+        if (qoutcomes == 0 || outcomes[qoutcomes-1] != outcomes[i]) {
+            outcomes[qoutcomes++] = outcomes[i];
+        }
+    }
+    return qoutcomes;
+}
+
+/*
+ * Workers have own visit counters and transposition tables, so with limits
+ * they cut different series. Without limits (a shallow search fits the pool)
+ * both generators must reach the same set of positions, a transposition may
+ * be found by several workers.
+ */
+static void check_gen_parallel_exhaustive(
+    const struct game_protocol * const protocol,
+    int qsteps_back,
+    int qthreads)
+{
+    const char * const name = protocol->name;
+    const int unlimited = 1 << 30;
+    const int capacity = 4 * BSF_CAPACITY;
+    const int max_depth = 8;
+
+    struct warns warns;
+    warns_init(&warns);
+
+    struct geometry * restrict const geometry = must_create_protocol_geometry(protocol);
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
 
     const int qsteps = protocol->qsteps - qsteps_back;
-    for (int i=0; i<qsteps; ++i) {
-        const enum step step = protocol->steps[i];
-        const int ball = state_step(state, step);
-        if (ball == NO_WAY) {
-            test_fail("State rejected step %s: move=%d; ball=NO_WAY", step_names[step], i);
+    for (int i = 0; i < qsteps; ++i) {
+        state_step(state, protocol->steps[i]);
+    }
+
+    struct bsf_free_kicks * restrict const bsf = create_bsf_free_kicks(geometry, capacity, max_depth, unlimited, unlimited);
+    struct bsf_parallel * restrict const pool = create_bsf_parallel(geometry, qthreads, capacity, max_depth, unlimited, unlimited);
+    if (bsf == NULL || pool == NULL) {
+        test_fail("create free kick generators failed, errno = %d.", errno);
+    }
+
+    bsf_gen(&warns, bsf, state);
+    const struct bsf_free_kicks * const fks = bsf_gen_parallel(&warns, pool, state);
+
+    const struct warn * warn = warns_get(&warns, 0);
+    if (warn != NULL) {
+        test_fail("%s: warning after free kick generation: %s (at %s:%d)", name, warn->msg, warn->file_name, warn->line_num);
+    }
+
+    if ((bsf->win == NULL) != (fks->win == NULL)) {
+        test_fail("%s: win is %p for bsf_gen and %p for bsf_gen_parallel(%d)", name, bsf->win, fks->win, qthreads);
+    }
+
+    if (bsf->win == NULL) {
+        check_series(fks, state);
+
+        uint64_t * restrict const expected = malloc((bsf->qseries + 1) * sizeof(uint64_t));
+        uint64_t * restrict const actual = malloc((fks->qseries + 1) * sizeof(uint64_t));
+        if (expected == NULL || actual == NULL) {
+            test_fail("malloc outcomes failed, errno = %d.", errno);
         }
-        if (ball < 0) {
-            test_fail("Game had been finished unexpectedly: step %s: move=%d; ball=%d;", step_names[step], i, ball);
+
+        const int qexpected = get_outcomes(bsf, state, expected);
+        const int qactual = get_outcomes(fks, state, actual);
+        if (qexpected != qactual) {
+            test_fail("%s: bsf_gen reaches %d positions, bsf_gen_parallel(%d) %d", name, qexpected, qthreads, qactual);
+        }
+
+        for (int i = 0; i < qexpected; ++i) {
+            if (expected[i] != actual[i]) {
+                test_fail("%s: position %d differs for bsf_gen and bsf_gen_parallel(%d)", name, i, qthreads);
+            }
         }
+
+        free(expected);
+        free(actual);
+    }
+
+    destroy_bsf_parallel(pool);
+    destroy_bsf_free_kicks(bsf);
+    destroy_state(state);
+    destroy_geometry(geometry);
+}
+
+int test_gen_parallel_free_kicks(void)
+{
+    const int qthreads[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < ARRAY_LEN(qthreads); ++i) {
+        check_gen_parallel(&protocol_fastest_free_kick1, 0, qthreads[i]);
+        check_gen_parallel(&protocol_fastest_free_kick2, 0, qthreads[i]);
+        check_gen_parallel(&protocol_000461, 0, qthreads[i]);
+        check_gen_parallel(&protocol_000050, 4, qthreads[i]);
+        check_gen_parallel(&protocol_000050, 14, qthreads[i]);
+        check_gen_parallel(&protocol_with_hang, 0, qthreads[i]);
+    }
+
+    for (int i = 1; i < 3; ++i) {
+        check_gen_parallel_exhaustive(&protocol_fastest_free_kick1, 0, qthreads[i]);
+        check_gen_parallel_exhaustive(&protocol_fastest_free_kick2, 0, qthreads[i]);
+        check_gen_parallel_exhaustive(&protocol_000461, 0, qthreads[i]);
+        check_gen_parallel_exhaustive(&protocol_000050, 4, qthreads[i]);
+        check_gen_parallel_exhaustive(&protocol_000050, 14, qthreads[i]);
+        check_gen_parallel_exhaustive(&protocol_with_hang, 0, qthreads[i]);
+    }
+    return 0;
+}
+
+#define QALLOC_FREE_RUNS  8
+#define QALLOC_QTHINK     (32 * 1024)
+
+static void check_no_allocs(const unsigned long before, const char * const what)
+{
+    const unsigned long qallocs = test_qallocs() - before;
+    if (qallocs != 0) {
+        test_fail("%s: %lu allocations on the search hot path.", what, qallocs);
+    }
+}
+
+int test_alloc_free_search(void)
+{
+    const struct game_protocol * const protocol = &protocol_with_hang;
+    struct geometry * restrict const geometry = must_create_protocol_geometry(protocol);
+
+    unsigned long before = test_qallocs();
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    if (test_qallocs() == before) {
+        test_fail("Allocations are not counted.");
+    }
+
+    before = test_qallocs();
+    for (int i = 0; i < protocol->qsteps; ++i) {
+        state_step(state, protocol->steps[i]);
     }
+    check_no_allocs(before, "state_step");
 
-    struct bsf_free_kicks * fks = create_bsf_free_kicks(geometry, 1 << QANSWERS_BITS, MAX_FREE_KICK_SERIE, 8, 8);
+    struct bsf_free_kicks * restrict const fks = create_bsf_free_kicks(geometry, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
     if (fks == NULL) {
-        test_fail("create_bsf_free_kicks failed");
+        test_fail("create_bsf_free_kicks failed, errno = %d.", errno);
     }
 
-    bsf_gen(warns, fks, state, guard);
+    struct warns warns;
+    warns_init(&warns);
 
-    // Check for warnings during generation
-    const struct warn * warn = warns_get(warns, 0);
-    if (warn != NULL) {
-        test_fail("Warning after bsf_gen: %s (at %s:%d)",
-            warn->msg, warn->file_name, warn->line_num);
+    /* Warm up: series storage may grow once to the position needs */
+    bsf_gen(&warns, fks, state);
+
+    before = test_qallocs();
+    for (int i = 0; i < QALLOC_FREE_RUNS; ++i) {
+        bsf_gen(&warns, fks, state);
     }
+    check_no_allocs(before, "bsf_gen");
 
-    // Validate all generated series by replaying them
-    struct state * restrict const current = create_state(geometry);
-    if (current == NULL) {
-        test_fail("Failed to create test state for validation");
+    if (warns.qwarns != 0) {
+        test_fail("Unexpected warning during free kick generation: %s.", warns.warns[0].msg);
     }
 
-    for (int i = 0; i < fks->qseries; ++i) {
-        struct bsf_serie * serie = &fks->series[i];
-        const int qsteps = serie->qsteps;
+    destroy_bsf_free_kicks(fks);
+    destroy_state(state);
+    destroy_geometry(geometry);
 
-        if (qsteps <= 0 || qsteps > fks->max_depth) {
-            test_fail("Serie %d has invalid qsteps: %d", i, qsteps);
+    /* MCTS: node cache and free kick generators are allocated on the first go */
+    must_init_ctx(&protocol_empty);
+    struct ai * restrict const ai = ctx->ai;
+    const uint32_t qthink = QALLOC_QTHINK;
+    must_set_param(ai, "qthink", &qthink);
+    ai->go(ai, NULL);
+
+    before = test_qallocs();
+    ai->go(ai, NULL);
+    check_no_allocs(before, "mcts go");
+
+    free_ctx();
+    return 0;
+}
+
+#define QPERFT_THREADS  3
+
+static uint64_t ref_perft(
+    struct state * const * const states,
+    const int depth)
+{
+    uint64_t result = 0;
+    steps_t steps = state_get_steps(states[0]);
+    while (steps != 0) {
+        const enum step step = extract_step(&steps);
+        state_copy(states[1], states[0]);
+        const int ball = state_step(states[1], step);
+        if (ball == NO_WAY) {
+            continue;
         }
 
-        state_copy(current, state);
+        if (depth == 1) {
+            ++result;
+        } else if (ball >= 0) {
+            result += ref_perft(states + 1, depth - 1);
+        }
+    }
+    return result;
+}
 
-        // All steps except last should stay in penalty situation
-        for (int j = 0; j < qsteps - 1; ++j) {
-            enum step step = serie->steps[j];
-            if (step < 0 || step >= QSTEPS) {
-                test_fail("Serie %d step %d is invalid: %d", i, j, step);
-            }
+static uint64_t sum_counts(const uint64_t * const counts)
+{
+    uint64_t result = 0;
+    for (enum step step = 0; step < QSTEPS; ++step) {
+        result += counts[step];
+    }
+    return result;
+}
 
-            int ball = state_step(current, step);
-            if (ball == NO_WAY) {
-                test_fail("Serie %d step %d (%s) is blocked", i, j, step_names[step]);
+int test_perft(void)
+{
+    const struct perft_reference * ref = perft_references;
+    for (; ref->protocol != NULL; ++ref) {
+        const struct game_protocol * const protocol = ref->protocol;
+        struct geometry * restrict const geometry = must_create_protocol_geometry(protocol);
+
+        struct state * states[ref->depth + 1];
+        for (int i = 0; i <= ref->depth; ++i) {
+            states[i] = create_state(geometry);
+            if (states[i] == NULL) {
+                test_fail("create_state(geometry) failed, errno = %d.", errno);
             }
+        }
 
-            if (!is_free_kick_situation(current)) {
-                test_fail("Serie %d step %d exits penalty before end", i, j);
+        struct state * restrict const state = states[0];
+        for (int i = 0; i < ref->qsteps; ++i) {
+            if (state_step(state, protocol->steps[i]) == NO_WAY) {
+                test_fail("%s: step %d is invalid.", protocol->name, i);
             }
         }
 
-        // Last step should exit penalty
-        enum step last_step = serie->steps[qsteps - 1];
-        int ball = state_step(current, last_step);
-        if (ball == NO_WAY) {
-            test_fail("Serie %d last step (%s) is blocked", i, step_names[last_step]);
+        const uint64_t expected = ref->count;
+        const uint64_t ref_count = ref_perft(states, ref->depth);
+        if (ref_count != expected) {
+            test_fail("%s: reference perft %d = %" PRIu64 ", expected %" PRIu64 ".",
+                protocol->name, ref->depth, ref_count, expected);
         }
 
-        if (ball != serie->ball) {
-            test_fail("Serie %d: final ball %d != expected %d", i, ball, serie->ball);
+        uint64_t counts[QSTEPS];
+        const uint8_t * const lines = state->lines;
+        uint8_t saved[geometry->qpoints];
+        memcpy(saved, lines, geometry->qpoints);
+        const int ball = state->ball;
+
+        int status = state_perft(state, ref->depth, counts);
+        if (status != 0) {
+            test_fail("%s: state_perft failed with code %d.", protocol->name, status);
         }
 
-        if (ball >= 0 && ball < geometry->qpoints && is_free_kick_situation(current)) {
-            test_fail("Serie %d ends in penalty situation at ball=%d", i, ball);
+        if (sum_counts(counts) != expected) {
+            test_fail("%s: state_perft %d = %" PRIu64 ", expected %" PRIu64 ".",
+                protocol->name, ref->depth, sum_counts(counts), expected);
         }
 
-        if (is_free_kick_situation(current)) {
-            test_fail("Serie %d still in penalty after all steps", i);
+        if (state->ball != ball || memcmp(saved, lines, geometry->qpoints) != 0) {
+            test_fail("%s: state is not restored after state_perft.", protocol->name);
         }
-    }
 
-    destroy_state(current);
-    free_state(state);
-    free(lines);
-    destroy_geometry(geometry);
-    return fks;
-}
+        uint64_t parallel_counts[QSTEPS];
+        status = perft_parallel(state, ref->depth, QPERFT_THREADS, parallel_counts);
+        if (status != 0) {
+            test_fail("%s: perft_parallel failed with code %d.", protocol->name, status);
+        }
 
-int test_gen_complete_free_kicks(void)
-{
-    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_fastest_free_kick1, 0);
-    if (fks->qseries != 8) {
-        test_fail("bsf_gen returned %d series, expected 8", fks->qseries);
+        if (memcmp(counts, parallel_counts, sizeof(counts)) != 0) {
+            test_fail("%s: perft_parallel %d = %" PRIu64 " is split differently.",
+                protocol->name, ref->depth, sum_counts(parallel_counts));
+        }
+
+        for (int i = 0; i <= ref->depth; ++i) {
+            destroy_state(states[i]);
+        }
+        destroy_geometry(geometry);
     }
 
-    destroy_bsf_free_kicks(fks);
     return 0;
 }
 
-int test_gen_complete_free_kicks_win(void)
+#endif
+
+
+
+#ifdef MICROBENCH
+
+#include "insider.h"
+
+/* Microbenchmarks over recorded free kick positions and their series */
+
+struct bsf_bench
 {
-    // Short game ending with penalty and goal
-    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000461, 0);
+    struct recording * recording;
+    struct bsf_free_kicks ** fks;
+    struct bsf_parallel ** pools;
+    struct warns warns;
+    uint64_t sink;
+};
 
-    if (fks->win == NULL) {
-        test_fail("Win path not detected in game 000461");
+static void * create_bsf_bench_threads(const int qthreads)
+{
+    struct bsf_bench * restrict const me = calloc(1, sizeof(struct bsf_bench));
+    if (me == NULL) {
+        test_fail("calloc bsf_bench failed, errno = %d.", errno);
     }
 
-    if (fks->win->ball != GOAL_1) {
-        test_fail("Win path leads to wrong goal: %d (expected GOAL_1=%d)", fks->win->ball, GOAL_1);
+    struct recording * restrict const recording = must_create_recording();
+    me->recording = recording;
+    me->fks = calloc(recording->qgeometries, sizeof(struct bsf_free_kicks *));
+    me->pools = calloc(recording->qgeometries, sizeof(struct bsf_parallel *));
+    if (me->fks == NULL || me->pools == NULL) {
+        test_fail("calloc bsf_bench fks failed, errno = %d.", errno);
     }
 
-    if (fks->win->qsteps != 1) {
-        test_fail("Win path has %d steps, expected 1", fks->win->qsteps);
+    for (int i = 0; i < recording->qgeometries; ++i) {
+        me->fks[i] = create_bsf_free_kicks(recording->geometries[i], BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+        if (me->fks[i] == NULL) {
+            test_fail("create_bsf_free_kicks failed, errno = %d.", errno);
+        }
+
+        if (qthreads > 0) {
+            me->pools[i] = create_bsf_parallel(recording->geometries[i], qthreads, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+            if (me->pools[i] == NULL) {
+                test_fail("create_bsf_parallel(%d threads) failed, errno = %d.", qthreads, errno);
+            }
+        }
     }
 
-    destroy_bsf_free_kicks(fks);
-    return 0;
+    warns_init(&me->warns);
+    return me;
 }
 
-int test_long_free_kick_to_win(void)
+static void * create_bsf_bench(void)
 {
-    // Last move sequence: NW N SE (regular move) + W SE SW SW (4-step penalty to GOAL_2)
-    // We run BFS on position before last penalty (cut last 4 steps)
-    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000050, 4);
+    return create_bsf_bench_threads(0);
+}
 
-    if (fks->win == NULL) {
-        test_fail("Win path not detected in game 000050");
-    }
+static void * create_parallel2_bench(void)
+{
+    return create_bsf_bench_threads(2);
+}
 
-    if (fks->win->ball != GOAL_2) {
-        test_fail("Win path leads to wrong goal: %d (expected GOAL_2=%d)", fks->win->ball, GOAL_2);
+static void * create_parallel4_bench(void)
+{
+    return create_bsf_bench_threads(4);
+}
+
+static void destroy_bsf_bench(void * data)
+{
+    struct bsf_bench * restrict const me = data;
+    for (int i = 0; i < me->recording->qgeometries; ++i) {
+        destroy_bsf_free_kicks(me->fks[i]);
+        if (me->pools[i] != NULL) {
+            destroy_bsf_parallel(me->pools[i]);
+        }
     }
 
-    if (fks->win->qsteps > 4) {
-        test_fail("Win path has %d steps, expected <= 4", fks->win->qsteps);
+    destroy_recording(me->recording);
+    free(me->pools);
+    free(me->fks);
+    free(me);
+}
+
+/* One call of the generator per recorded free kick position */
+static uint64_t run_bsf_bench(
+    struct bsf_bench * restrict const me,
+    const int is_parallel)
+{
+    const struct recording * const recording = me->recording;
+    uint64_t qops = 0;
+
+    for (int i = 0; i < recording->qpositions; ++i) {
+        const struct state * const state = recording->positions[i].state;
+        if (!is_free_kick_situation(state)) {
+            continue;
+        }
+
+        const int igeometry = recording_geometry_index(recording, state->geometry);
+        warns_reset(&me->warns);
+        if (!is_parallel) {
+            struct bsf_free_kicks * restrict const bsf = me->fks[igeometry];
+            bsf_gen(&me->warns, bsf, state);
+            me->sink += bsf->qseries;
+        } else {
+            const struct bsf_free_kicks * const bsf = bsf_gen_parallel(&me->warns, me->pools[igeometry], state);
+            me->sink += bsf->qseries;
+        }
+        ++qops;
     }
 
-    destroy_bsf_free_kicks(fks);
-    return 0;
+    return qops;
 }
 
-int test_long_free_kick_to_loose(void)
+static uint64_t run_bsf_gen(void * data)
 {
-    // Last moves:
-    //   1 NW NW S + NE W E W S N NE
-    //   2 NW N SE + W SE SW SW
-    // 14 steps before we have a free kick with loose
-    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_000050, 14);
+    return run_bsf_bench(data, 0);
+}
 
-    if (fks->loose == NULL) {
-        test_fail("Loose path not detected in game 000050");
+static uint64_t run_bsf_gen_parallel(void * data)
+{
+    return run_bsf_bench(data, 1);
+}
+
+/* Kicks of every recorded serie, a guard is reset before each serie */
+struct guard_bench
+{
+    int qseries;
+    int * qkicks;
+    struct kick * kicks;
+    struct cycle_guard guard;
+    uint64_t sink;
+};
+
+static void * create_guard_bench(void)
+{
+    struct recording * restrict const recording = must_create_recording();
+    struct guard_bench * restrict const me = calloc(1, sizeof(struct guard_bench));
+    if (me == NULL) {
+        test_fail("calloc guard_bench failed, errno = %d.", errno);
     }
 
-    destroy_bsf_free_kicks(fks);
-    return 0;
+    me->qseries = recording->qseries;
+    me->qkicks = calloc(recording->qseries + 1, sizeof(int));
+    me->kicks = calloc(recording->qseries * MAX_FREE_KICK_SERIE + 1, sizeof(struct kick));
+    me->guard.capacity = MAX_FREE_KICK_SERIE;
+    me->guard.kicks = calloc(MAX_FREE_KICK_SERIE, sizeof(struct kick));
+    if (me->qkicks == NULL || me->kicks == NULL || me->guard.kicks == NULL) {
+        test_fail("calloc guard_bench kicks failed, errno = %d.", errno);
+    }
+
+    struct kick * kick = me->kicks;
+    for (int i = 0; i < recording->qseries; ++i) {
+        const struct recorded_serie * const recorded = recording->series + i;
+        const struct geometry * const geometry = recorded->position->state->geometry;
+        int ball = recorded->position->state->ball;
+        for (int j = 0; j < recorded->serie.qsteps && ball >= 0; ++j) {
+            const int to = geometry->free_kicks[QSTEPS * ball + serie_step(&recorded->serie, j)];
+            kick->from = ball;
+            kick->to = to;
+            ++kick;
+            ++me->qkicks[i];
+            ball = to;
+        }
+    }
+
+    destroy_recording(recording);
+    return me;
 }
 
-int test_gen_complete_free_kicks_long(void)
+static void destroy_guard_bench(void * data)
 {
-    struct bsf_free_kicks * restrict const fks = run_bsf(&protocol_with_hang, 0);
+    struct guard_bench * restrict const me = data;
+    free(me->guard.kicks);
+    free(me->kicks);
+    free(me->qkicks);
+    free(me);
+}
 
-    if (fks->qseries == 0) {
-        test_fail("No series generated for real hung game penalty situation");
+static uint64_t run_cycle_guard_push(void * data)
+{
+    struct guard_bench * restrict const me = data;
+    const struct kick * kick = me->kicks;
+    uint64_t qops = 0;
+
+    for (int i = 0; i < me->qseries; ++i) {
+        cycle_guard_reset(&me->guard);
+        for (int j = 0; j < me->qkicks[i]; ++j) {
+            me->sink += cycle_guard_push(&me->guard, kick->from, kick->to);
+            ++kick;
+        }
+        qops += me->qkicks[i];
     }
 
-    destroy_bsf_free_kicks(fks);
-    return 0;
+    return qops;
 }
 
+const struct microbench enginelib_microbenches[] = {
+    { "bsf_gen", create_bsf_bench, NULL, run_bsf_gen, destroy_bsf_bench },
+    { "bsf_gen_parallel2", create_parallel2_bench, NULL, run_bsf_gen_parallel, destroy_bsf_bench },
+    { "bsf_gen_parallel4", create_parallel4_bench, NULL, run_bsf_gen_parallel, destroy_bsf_bench },
+    { "cycle_guard_push", create_guard_bench, NULL, run_cycle_guard_push, destroy_guard_bench },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
 #endif
@@ -1,5 +1,12 @@
 #include "paper-football.h"
 
+#if defined(__SSE2__)
+#define STEP12_SIMD 1
+#include <immintrin.h>
+#else
+#define STEP12_SIMD 0
+#endif
+
 const char * step_names[QSTEPS] = {
     "NW", "N", "NE", "E", "SE", "S", "SW", "W"
 };
@@ -17,6 +24,15 @@ struct three_step {
 
 steps_t magic_step3[64];
 
+/* Table-driven step12: lines around an inner ball are loaded as a 5x5 block */
+#define STEP12_BLOCK_SIDE   5
+#define STEP12_BLOCK_CENTER 12
+static uint8_t magic_step3_bytes[64];
+static uint8_t step12_cells1[QSTEPS];
+static uint8_t step12_cells2[64];
+static uint8_t step12_shuffle_lo[64];
+static uint8_t step12_shuffle_hi[64];
+
 
 
 static inline int check_dim(const int value)
@@ -139,6 +155,23 @@ static int init_magic_step3(void)
         return EINVAL;
     }
 
+    static const int delta_x[QSTEPS] = { -1,  0, +1, +1, +1,  0, -1, -1 };
+    static const int delta_y[QSTEPS] = { +1, +1, +1,  0, -1, -1, -1,  0 };
+    const int side = STEP12_BLOCK_SIDE;
+    for (enum step step1=0; step1<QSTEPS; ++step1) {
+        const int x1 = 2 + delta_x[step1];
+        const int y1 = 2 + delta_y[step1];
+        step12_cells1[step1] = y1 * side + x1;
+        for (enum step step2=0; step2<QSTEPS; ++step2) {
+            const int index = 8*step1 + step2;
+            const int cell = (y1 + delta_y[step2]) * side + x1 + delta_x[step2];
+            magic_step3_bytes[index] = magic_step3[index];
+            step12_cells2[index] = cell;
+            step12_shuffle_lo[index] = cell < 16 ? cell : 0x80;
+            step12_shuffle_hi[index] = cell >= 16 ? cell - 16 : 0x80;
+        }
+    }
+
     return 0;
 }
 
@@ -149,6 +182,74 @@ static inline int distance_squared(const int x1, const int y1, const int x2, con
     return dx * dx + dy * dy;
 }
 
+static void init_step_lines(
+    const int32_t * const connections,
+    const uint32_t qpoints,
+    uint32_t * restrict const step_lines,
+    uint8_t * restrict const qstep_lines)
+{
+    for (uint32_t point = 0; point < qpoints; ++point) {
+        const int32_t * const point_connections = connections + QSTEPS * point;
+        for (enum step step=0; step<QSTEPS; ++step) {
+            const size_t index = QSTEPS * point + step;
+            uint32_t * restrict ptr = step_lines + STEP_LINES_STRIDE * index;
+            const uint32_t * const start = ptr;
+
+            const int32_t next = point_connections[step];
+            if (next < 0) {
+                qstep_lines[index] = 0;
+                continue;
+            }
+
+            /* Next point is occupied: lines from all neighbours */
+            for (enum step back=0; back<QSTEPS; ++back) {
+                const int32_t neighbour = connections[QSTEPS*next + back];
+                if (neighbour >= 0) {
+                    *ptr++ = QSTEPS * neighbour + BACK(back);
+                }
+            }
+
+            /*
+             *   A ----- P
+             *   |     / |
+             *   |   /   |
+             *   | /     |
+             *   N ----- B
+             *
+             *   Diagonal step PN (here 'SW') crosses AB, so AB and BA are set.
+             *   Near borders A or B is taken from N when P has NO_WAY there.
+             */
+            if ((step & 1) == 0) {
+                const enum step PA = (step + 1) & 0x07;
+                const enum step PB = (step - 1) & 0x07;
+                int32_t A = point_connections[PA];
+                int32_t B = point_connections[PB];
+
+                if (A == NO_WAY) {
+                    A = connections[QSTEPS*next + BACK(PB)];
+                }
+
+                if (B == NO_WAY) {
+                    B = connections[QSTEPS*next + BACK(PA)];
+                }
+
+                const enum step BA = (step + 2) & 0x07;
+                const enum step AB = (step - 2) & 0x07;
+
+                if (A >= 0) {
+                    *ptr++ = QSTEPS * A + AB;
+                }
+
+                if (B >= 0) {
+                    *ptr++ = QSTEPS * B + BA;
+                }
+            }
+
+            qstep_lines[index] = ptr - start;
+        }
+    }
+}
+
 struct geometry * create_std_geometry(
     const int width,
     const int height,
@@ -171,15 +272,18 @@ struct geometry * create_std_geometry(
     const size_t board_map_sz = qpoints * QSTEPS * sizeof(uint32_t);
     const size_t straight_sz = qpoints * sizeof(enum step);
     const size_t dist_sz = qpoints * sizeof(uint32_t);
-    const size_t sizes[8] = {
+    const size_t step_lines_sz = qpoints * QSTEPS * STEP_LINES_STRIDE * sizeof(uint32_t);
+    const size_t sizes[11] = {
         sizeof(struct geometry),
         board_map_sz, board_map_sz,
         (1 << QSTEPS) * QSTEPS,
         straight_sz, straight_sz,
-        dist_sz, dist_sz
+        dist_sz, dist_sz,
+        qpoints,
+        step_lines_sz, qpoints * QSTEPS
     };
-    void * ptrs[8];
-    void * data = multialloc(8, sizes, ptrs, 256);
+    void * ptrs[11];
+    void * data = multialloc(11, sizes, ptrs, 256);
 
     if (data == NULL) {
         return NULL;
@@ -353,8 +457,20 @@ struct geometry * create_std_geometry(
         }
     }
 
+    uint8_t * restrict inner = ptrs[8];
+    for (int32_t offset = 0; offset < width*height; ++offset) {
+        const int x = offset % width;
+        const int y = offset / width;
+        inner[offset] = x >= 2 && x < width-2 && y >= 2 && y < height-2;
+    }
+
+    init_step_lines(connections, qpoints, ptrs[9], ptrs[10]);
+
     me->qpoints = qpoints;
     me->free_kick_len = free_kick_len;
+    me->width = width;
+    me->height = height;
+    me->goal_width = goal_width;
     me->connections = ptrs[1];
     me->free_kicks = ptrs[2];
     me->bit_index_table = ptrs[3];
@@ -362,6 +478,10 @@ struct geometry * create_std_geometry(
     me->straight_free_kick2 = ptrs[5];
     me->dist_goal1 = ptrs[6];
     me->dist_goal2 = ptrs[7];
+    me->inner_points = ptrs[8];
+    me->row_delta = width;
+    me->step_lines = ptrs[9];
+    me->qstep_lines = ptrs[10];
     return me;
 }
 
@@ -391,7 +511,7 @@ static void init_lines(
     }
 }
 
-static inline int add_step_change(
+static inline void add_step_change(
     struct state * restrict const me,
     const int what,
     uint32_t data)
@@ -401,29 +521,14 @@ static inline int add_step_change(
         const uint8_t mask = 1 << data;
         const int is_set = (lines[what] & mask) != 0;
         if (is_set) {
-            return 0;
+            return;
         }
         lines[what] |= mask;
     }
 
-    const unsigned int capacity = me->step_changes_capacity;
-    const unsigned int qitems = me->qstep_changes;
-    if (qitems == capacity) {
-        const unsigned int new_capacity = 256 + 2*capacity;
-        const size_t sz = new_capacity * sizeof(struct step_change);
-        void * new_ptr = realloc(me->step_changes, sz);
-        if (new_ptr == NULL) {
-            return errno;
-        }
-        me->step_changes = new_ptr;
-        me->step_changes_capacity = new_capacity;
-    }
-
-    struct step_change * restrict const step_change = me->step_changes + qitems;
+    struct step_change * restrict const step_change = me->step_changes + me->qstep_changes++;
     step_change->what = what;
     step_change->data = data;
-    ++me->qstep_changes;
-    return 0;
 }
 
 static inline void mark_occuped(
@@ -441,72 +546,40 @@ static inline void mark_occuped(
     }
 }
 
-static inline void mark_diag(
+static inline void mark_step(
     struct state * restrict const me,
     const int point,
     const enum step step)
 {
-    if ((step & 1) == 1) {
-        /* This is not a diagonal step */
-        return;
-    }
-
-    const int32_t * const connections = me->geometry->connections;
-    const int32_t * const point_connections = connections + QSTEPS * point;
-
-    const int32_t next = point_connections[step];
-    if (next < 0) {
-        return;
-    }
-
-    /*
-     *   A ----- P
-     *   |     / |
-     *   |   /   |
-     *   | /     |
-     *   N ----- B
-     *
-     *   Point are single capital letters: P = point, N = next;
-     *   Steps are two letters: point from and point to: step = PN = 'SW'
-     *
-     */
-
-    enum step PA = (step + 1) & 0x07;
-    enum step PB = (step - 1) & 0x07;
-
-    int32_t A = point_connections[PA];
-    int32_t B = point_connections[PB];
-
-    if (A == NO_WAY) {
-        const int index = next * QSTEPS + BACK(PB);
-        A = connections[index];
-    }
-
-    if (B == NO_WAY) {
-        const int index = next * QSTEPS + BACK(PA);
-        B = connections[index];
-    }
-
-    enum step BA = (step + 2) & 0x07;
-    enum step AB = (step - 2) & 0x07;
+    const struct geometry * const geometry = me->geometry;
+    const size_t index = QSTEPS * point + step;
+    const uint32_t * ptr = geometry->step_lines + STEP_LINES_STRIDE * index;
+    const uint32_t * const end = ptr + geometry->qstep_lines[index];
 
-    if (A >= 0) {
-        add_step_change(me, A, AB);
+    uint8_t * restrict const lines = me->lines;
+    struct step_change * restrict change = me->step_changes + me->qstep_changes;
+    for (; ptr != end; ++ptr) {
+        const int line_point = *ptr / QSTEPS;
+        const enum step line_step = *ptr % QSTEPS;
+        const uint8_t mask = 1 << line_step;
+        if ((lines[line_point] & mask) == 0) {
+            lines[line_point] |= mask;
+            change->what = line_point;
+            change->data = line_step;
+            ++change;
+        }
     }
 
-    if (B >= 0) {
-        add_step_change(me, B, BA);
-    }
+    me->qstep_changes = change - me->step_changes;
 }
 
-static uint64_t state_gen_step12(const struct state * const me)
+static uint64_t generic_gen_step12(const struct state * const me)
 {
     uint64_t result = 0;
     const int ball0 = me->ball;
     const int32_t * const connections = me->geometry->connections;
-    const uint8_t * const lines = me->lines;
 
-    steps_t possible0 = lines[ball0] ^ 0xFF;
+    steps_t possible0 = me->lines[ball0] ^ 0xFF;
     while (possible0 != 0) {
         enum step step1 = extract_step(&possible0);
         const int ball1 = connections[QSTEPS*ball0 + step1];
@@ -515,7 +588,7 @@ static uint64_t state_gen_step12(const struct state * const me)
             continue;
         }
 
-        steps_t possible1 = ball1 < 0 ? 0xFF : lines[ball1] ^ 0xFF;
+        steps_t possible1 = ball1 < 0 ? 0xFF : me->lines[ball1] ^ 0xFF;
         while (possible1 != 0) {
             enum step step2 = extract_step(&possible1);
             const int ball2 = connections[QSTEPS*ball1 + step2];
@@ -530,7 +603,7 @@ static uint64_t state_gen_step12(const struct state * const me)
                 continue;
             }
 
-            steps_t possible2 = (lines[ball2] ^ 0xFF) & magic_step3[index];
+            steps_t possible2 = (me->lines[ball2] ^ 0xFF) & magic_step3[index];
             if (possible2 != 0) {
                 result |= 1ull << index;
             }
@@ -540,6 +613,90 @@ static uint64_t state_gen_step12(const struct state * const me)
     return result;
 }
 
+#if STEP12_SIMD
+
+/*
+ * Free direction masks of the ball's neighbours and second neighbours are
+ * loaded as a 5x5 block, then all 64 (step1, step2) cells are matched
+ * against magic_step3 at once (SSSE3/AVX2 shuffles, plain SSE2 gathers the
+ * cells first). Only for inner points: no goals and no NO_WAY connections
+ * are reachable in two steps there. Everything else uses the scalar loop.
+ */
+static uint64_t inner_gen_step12(const struct state * const me)
+{
+    const int ball0 = me->ball;
+    const int32_t row_delta = me->geometry->row_delta;
+    const uint8_t * const lines = me->lines;
+
+    uint8_t block[32] __attribute__ ((aligned (16))) = { 0 };
+    for (int i=0; i<STEP12_BLOCK_SIDE; ++i) {
+        const uint8_t * const row = lines + ball0 + (i-2) * row_delta - 2;
+        memcpy(block + STEP12_BLOCK_SIDE*i, row, STEP12_BLOCK_SIDE);
+    }
+
+    const steps_t possible0 = block[STEP12_BLOCK_CENTER] ^ 0xFF;
+    uint64_t allowed = 0;
+    for (enum step step1 = 0; step1 < QSTEPS; ++step1) {
+        const uint64_t possible1 = block[step12_cells1[step1]] ^ 0xFF;
+        const uint64_t row = -(uint64_t)((possible0 >> step1) & 1);
+        allowed |= (possible1 & row) << (8*step1);
+    }
+
+    uint64_t hits = 0;
+
+#if defined(__AVX2__)
+    const __m128i lo128 = _mm_load_si128((const __m128i *)block);
+    const __m128i hi128 = _mm_load_si128((const __m128i *)(block + 16));
+    const __m256i lo = _mm256_broadcastsi128_si256(lo128);
+    const __m256i hi = _mm256_broadcastsi128_si256(hi128);
+    for (int i=0; i<64; i+=32) {
+        const __m256i shuffle_lo = _mm256_loadu_si256((const __m256i *)(step12_shuffle_lo + i));
+        const __m256i shuffle_hi = _mm256_loadu_si256((const __m256i *)(step12_shuffle_hi + i));
+        const __m256i cells = _mm256_or_si256(_mm256_shuffle_epi8(lo, shuffle_lo), _mm256_shuffle_epi8(hi, shuffle_hi));
+        const __m256i magic = _mm256_loadu_si256((const __m256i *)(magic_step3_bytes + i));
+        const __m256i blocked = _mm256_cmpeq_epi8(_mm256_andnot_si256(cells, magic), _mm256_setzero_si256());
+        hits |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(blocked) << i;
+    }
+#elif defined(__SSSE3__)
+    const __m128i lo = _mm_load_si128((const __m128i *)block);
+    const __m128i hi = _mm_load_si128((const __m128i *)(block + 16));
+    for (int i=0; i<64; i+=16) {
+        const __m128i shuffle_lo = _mm_loadu_si128((const __m128i *)(step12_shuffle_lo + i));
+        const __m128i shuffle_hi = _mm_loadu_si128((const __m128i *)(step12_shuffle_hi + i));
+        const __m128i cells = _mm_or_si128(_mm_shuffle_epi8(lo, shuffle_lo), _mm_shuffle_epi8(hi, shuffle_hi));
+        const __m128i magic = _mm_loadu_si128((const __m128i *)(magic_step3_bytes + i));
+        const __m128i blocked = _mm_cmpeq_epi8(_mm_andnot_si128(cells, magic), _mm_setzero_si128());
+        hits |= (uint64_t)(~_mm_movemask_epi8(blocked) & 0xFFFF) << i;
+    }
+#else
+    uint8_t cells[64] __attribute__ ((aligned (16)));
+    for (int i=0; i<64; ++i) {
+        cells[i] = block[step12_cells2[i]];
+    }
+    for (int i=0; i<64; i+=16) {
+        const __m128i lines = _mm_load_si128((const __m128i *)(cells + i));
+        const __m128i magic = _mm_loadu_si128((const __m128i *)(magic_step3_bytes + i));
+        const __m128i blocked = _mm_cmpeq_epi8(_mm_andnot_si128(lines, magic), _mm_setzero_si128());
+        hits |= (uint64_t)(~_mm_movemask_epi8(blocked) & 0xFFFF) << i;
+    }
+#endif
+
+    return hits & allowed;
+}
+
+#endif
+
+static uint64_t state_gen_step12(const struct state * const me)
+{
+#if STEP12_SIMD
+    if (me->geometry->inner_points[me->ball]) {
+        return inner_gen_step12(me);
+    }
+#endif
+
+    return generic_gen_step12(me);
+}
+
 static steps_t get_first_steps(const struct state * const me)
 {
     const uint64_t step12 = me->step12;
@@ -583,10 +740,16 @@ static steps_t get_second_steps(const struct state * const me)
     return 0xFF & (me->step12 >> (me->step1 << 3));
 }
 
-void init_state(
+unsigned int state_journal_capacity(const struct geometry * const geometry)
+{
+    return geometry->free_kick_len * STEP_LINES_STRIDE + QSCALAR_CHANGES;
+}
+
+void init_state_with_journal(
     struct state * restrict const me,
     const struct geometry * const geometry,
-    uint8_t * const lines)
+    uint8_t * const lines,
+    struct step_change * const journal)
 {
     const uint32_t qpoints = geometry->qpoints;
     const int ball = qpoints / 2;
@@ -598,9 +761,10 @@ void init_state(
 
     init_lines(geometry, lines);
 
-    me->step_changes = NULL;
+    me->step_changes = journal;
     me->qstep_changes = 0;
-    me->step_changes_capacity = 0;
+    me->step_changes_capacity = state_journal_capacity(geometry);
+    me->own_step_changes = 0;
 
     me->step1 = INVALID_STEP;
     me->step2 = INVALID_STEP;
@@ -610,26 +774,43 @@ void init_state(
     me->qstep_changes = 0;
 }
 
+int init_state(
+    struct state * restrict const me,
+    const struct geometry * const geometry,
+    uint8_t * const lines)
+{
+    const size_t sz = state_journal_capacity(geometry) * sizeof(struct step_change);
+    struct step_change * const journal = malloc(sz);
+    if (journal == NULL) {
+        return ENOMEM;
+    }
+
+    init_state_with_journal(me, geometry, lines, journal);
+    me->own_step_changes = 1;
+    return 0;
+}
+
 struct state * create_state(const struct geometry * const geometry)
 {
     const uint32_t qpoints = geometry->qpoints;
+    const size_t journal_sz = state_journal_capacity(geometry) * sizeof(struct step_change);
 
-    const size_t sizes[2] = { sizeof(struct state), qpoints };
-    void * ptrs[2];
-    void * data = multialloc(2, sizes, ptrs, 64);
+    const size_t sizes[3] = { sizeof(struct state), qpoints, journal_sz };
+    void * ptrs[3];
+    void * data = multialloc(3, sizes, ptrs, 64);
 
     if (data == NULL) {
         return NULL;
     }
 
     struct state * restrict const me = data;
-    init_state(me, geometry, ptrs[1]);
+    init_state_with_journal(me, geometry, ptrs[1], ptrs[2]);
     return me;
 }
 
 void free_state(struct state * restrict const me)
 {
-    if (me->step_changes) {
+    if (me->own_step_changes) {
         free(me->step_changes);
     }
 }
@@ -724,13 +905,12 @@ static inline int free_kick_step(struct state * restrict const me, const enum st
     const int free_kick_len = me->geometry->free_kick_len;
     int next = ball;
     for (int i=0; i<free_kick_len; ++i) {
-        mark_diag(me, next, step);
+        mark_step(me, next, step);
         next = connections[QSTEPS * next + step];
         if (next < 0) {
             add_step_change(me, CHANGE_BALL, me->ball);
             break;
         }
-        mark_occuped(me, next);
     }
 
     return last_step(me, CHANGE_FREE_KICK, step, next);
@@ -740,6 +920,11 @@ int state_step(struct state * restrict const me, const enum step step)
 {
     me->qstep_changes = 0;
 
+    if (me->step_changes_capacity < state_journal_capacity(me->geometry)) {
+        errno = ENOBUFS;
+        return NO_WAY;
+    }
+
     const int32_t * const connections = me->geometry->connections;
     const int ball = me->ball;
     if (ball < 0) {
@@ -767,8 +952,7 @@ int state_step(struct state * restrict const me, const enum step step)
         if (occupied) {
             return NO_WAY;
         }
-        mark_occuped(me, next);
-        mark_diag(me, ball, step);
+        mark_step(me, ball, step);
         add_step_change(me, CHANGE_STEP1, me->step1);
         me->step1 = step;
         add_step_change(me, CHANGE_PASS, step);
@@ -781,8 +965,7 @@ int state_step(struct state * restrict const me, const enum step step)
         if (occupied) {
             return NO_WAY;
         }
-        mark_occuped(me, next);
-        mark_diag(me, ball, step);
+        mark_step(me, ball, step);
         add_step_change(me, CHANGE_STEP2, me->step2);
         me->step2 = step;
         add_step_change(me, CHANGE_PASS, step);
@@ -794,8 +977,7 @@ int state_step(struct state * restrict const me, const enum step step)
     if (occupied) {
         return NO_WAY;
     }
-    mark_occuped(me, next);
-    mark_diag(me, ball, step);
+    mark_step(me, ball, step);
     add_step_change(me, CHANGE_STEP1, me->step1);
     add_step_change(me, CHANGE_STEP2, me->step2);
     me->step1 = INVALID_STEP;
@@ -816,7 +998,6 @@ int state_rollback(
     const int32_t * const connections = geometry->connections;
     const int32_t * const free_kicks = geometry->free_kicks;
 
-    uint8_t * restrict const lines = me->lines;
     const struct step_change * ptr = changes + qchanges;
     const struct step_change * const end = changes;
     while (ptr-- != end) {
@@ -849,7 +1030,7 @@ int state_rollback(
                 ball = ptr->data;
                 break;
             default:
-                lines[ptr->what] ^= 1 << ptr->data;
+                me->lines[ptr->what] ^= 1 << ptr->data;
                 continue;
         }
 
@@ -865,11 +1046,23 @@ void init_history(struct history * restrict const me)
     me->qstep_changes = 0;
     me->capacity = 0;
     me->step_changes = NULL;
+    me->fixed = 0;
+}
+
+void init_fixed_history(
+    struct history * restrict const me,
+    struct step_change * const step_changes,
+    const unsigned int capacity)
+{
+    me->qstep_changes = 0;
+    me->capacity = capacity;
+    me->step_changes = step_changes;
+    me->fixed = 1;
 }
 
 void free_history(struct history * restrict const me)
 {
-    if (me->step_changes != NULL) {
+    if (me->step_changes != NULL && !me->fixed) {
         free(me->step_changes);
     }
 }
@@ -883,6 +1076,10 @@ int history_push(struct history * restrict const me, const struct state * state)
 
     const unsigned int required_capacity = me->qstep_changes + state_qstep_changes;
     if (required_capacity > me->capacity) {
+        if (me->fixed) {
+            return ENOBUFS;
+        }
+
         unsigned int new_capacity = me->capacity;
         do {
             new_capacity = 256 + 2*new_capacity;
@@ -902,97 +1099,481 @@ int history_push(struct history * restrict const me, const struct state * state)
     return 0;
 }
 
-#ifdef MAKE_CHECK
 
-#include "insider.h"
 
-#define BW   15
-#define BH   23
-#define GW    4
-#define FK    5
+static uint64_t perft_go(
+    struct state * restrict const me,
+    struct step_change * restrict const changes,
+    const unsigned int capacity,
+    const int depth)
+{
+    uint64_t result = 0;
+    steps_t steps = state_get_steps(me);
+    while (steps != 0) {
+        const enum step step = extract_step(&steps);
+        const int ball = state_step(me, step);
+        if (ball == NO_WAY) {
+            continue;
+        }
 
-#define STOP  QSTEPS
+        const unsigned int qchanges = me->qstep_changes;
+        if (depth == 1 || ball < 0) {
+            result += depth == 1;
+            state_rollback(me, me->step_changes, qchanges);
+            continue;
+        }
 
-static int make_point(const int x, const int y)
-{
-    return y * BW + x;
+        memcpy(changes, me->step_changes, qchanges * sizeof(struct step_change));
+        result += perft_go(me, changes + capacity, capacity, depth - 1);
+        state_rollback(me, changes, qchanges);
+    }
+
+    return result;
 }
 
-static void check_steps(
-    const struct geometry * const me,
-    const int x, const int y,
-    const int * const expected)
+int state_perft(
+    struct state * restrict const me,
+    const int depth,
+    uint64_t * restrict const counts)
 {
-    const int point = make_point(x, y);
-    for (enum step step=0; step<QSTEPS; ++step) {
-        const int next = me->connections[QSTEPS*point + step];
-        if (next != expected[step]) {
-            test_fail("Unexpected step: x=%d, y=%d, step=%d, next=%d, expected next=%d.", x, y, step, next, expected[step]);
+    if (depth < 1) {
+        return EINVAL;
+    }
+
+    memset(counts, 0, QSTEPS * sizeof(uint64_t));
+    if (me->ball < 0) {
+        return 0;
+    }
+
+    const unsigned int capacity = state_journal_capacity(me->geometry);
+    struct step_change * restrict const changes = malloc(depth * capacity * sizeof(struct step_change));
+    if (changes == NULL) {
+        return ENOMEM;
+    }
+
+    steps_t steps = state_get_steps(me);
+    while (steps != 0) {
+        const enum step step = extract_step(&steps);
+        const int ball = state_step(me, step);
+        if (ball == NO_WAY) {
+            continue;
+        }
+
+        const unsigned int qchanges = me->qstep_changes;
+        memcpy(changes, me->step_changes, qchanges * sizeof(struct step_change));
+        if (depth == 1) {
+            counts[step] = 1;
+        } else if (ball >= 0) {
+            counts[step] = perft_go(me, changes + capacity, capacity, depth - 1);
         }
+        state_rollback(me, changes, qchanges);
     }
+
+    me->qstep_changes = 0;
+    free(changes);
+    return 0;
 }
 
-static void check_free_kick(
-    const struct geometry * const me,
-    const int x, const int y,
-    const int * const expected)
+
+
+size_t position_record_size(const struct geometry * const geometry)
 {
-    const int point = make_point(x, y);
+    return sizeof(struct position_record) + geometry->qpoints;
+}
+
+void state_save_position(
+    const struct state * const me,
+    struct position_record * restrict const record)
+{
+    const struct geometry * const geometry = me->geometry;
+    const uint32_t qpoints = geometry->qpoints;
+
+    record->width = geometry->width;
+    record->height = geometry->height;
+    record->goal_width = geometry->goal_width;
+    record->free_kick_len = geometry->free_kick_len;
+    record->ball = me->ball;
+    record->active = me->active;
+    record->step1 = me->step1;
+    record->step2 = me->step2;
+    record->flags = is_free_kick_situation(me) ? POSITION_FREE_KICK : 0;
+    record->step12 = me->step12;
+
+    memcpy(record->lines, me->lines, qpoints);
+}
+
+/* All lines to the point are drawn: the ball has been there */
+static int is_visited_point(
+    const struct geometry * const geometry,
+    const uint8_t * const lines,
+    const int point)
+{
+    const int32_t * const connections = geometry->connections + QSTEPS * point;
     for (enum step step=0; step<QSTEPS; ++step) {
-        const int next = me->free_kicks[QSTEPS*point + step];
-        if (next != expected[step]) {
-            test_fail("Unexpected free kick: x=%d, y=%d, step=%d, next=%d, expected next=%d.", x, y, step, next, expected[step]);
+        const int32_t next = connections[step];
+        if (next >= 0 && (lines[next] & (1 << BACK(step))) == 0) {
+            return 0;
         }
     }
+    return 1;
 }
 
-static int apply_path(
-    const struct geometry * const me,
-    int point, const enum step path[])
+/*
+ * Lines which state_step can draw: borders are closed, ways to goals are
+ * never closed, a line without its pair leads to a visited point (a crossed
+ * diagonal closes both directions), and the ball is on a visited point.
+ */
+static int is_valid_lines(
+    const struct geometry * const geometry,
+    const uint8_t * const lines,
+    const int ball)
 {
-    const enum step * current = path;
-    while (point >= 0 && *current != STOP) {
-        point = me->connections[QSTEPS*point + (*current++)];
+    const uint32_t qpoints = geometry->qpoints;
+    const int32_t * const connections = geometry->connections;
+
+    for (uint32_t point = 0; point < qpoints; ++point) {
+        for (enum step step=0; step<QSTEPS; ++step) {
+            const int32_t next = connections[QSTEPS*point + step];
+            const int is_set = (lines[point] & (1 << step)) != 0;
+
+            if (next == NO_WAY) {
+                if (!is_set) {
+                    return 0;
+                }
+                continue;
+            }
+
+            if (next < 0) {
+                if (is_set) {
+                    return 0;
+                }
+                continue;
+            }
+
+            const int is_back_set = (lines[next] & (1 << BACK(step))) != 0;
+            if (is_set && !is_back_set && !is_visited_point(geometry, lines, next)) {
+                return 0;
+            }
+        }
     }
 
-    return point;
+    return ball < 0 || is_visited_point(geometry, lines, ball);
 }
 
-static void check_map(
-    const struct geometry * restrict const me,
-    const int start, const int expected,
-    const enum step path[])
+/*
+ * At the start of a turn step12 is generated from the lines. In the middle
+ * of a turn the ball came by step1 (and step2) from points of the board,
+ * and the second steps left in step12 are not closed at the ball.
+ */
+static int is_valid_turn(
+    const struct geometry * const geometry,
+    const struct position_record * const record)
 {
-    const int finish = apply_path(me, start, path);
-    if (finish != expected) {
-        test_fail("Unexpected apply_path: start=%d, finish=%d, expected finish=%d.", start, finish, expected);
+    const int32_t * const connections = geometry->connections;
+    const int ball = record->ball;
+    const enum step step1 = record->step1;
+    const enum step step2 = record->step2;
+
+    if (step1 == INVALID_STEP) {
+        if (step2 != INVALID_STEP) {
+            return 0;
+        }
+
+        struct state state = {
+            .geometry = geometry,
+            .lines = (uint8_t *)record->lines,
+            .ball = ball,
+        };
+        return record->step12 == state_gen_step12(&state);
+    }
+
+    const steps_t second_steps = 0xFF & (record->step12 >> (step1 << 3));
+    if (step2 == INVALID_STEP) {
+        const int ball0 = connections[QSTEPS*ball + BACK(step1)];
+        return ball0 >= 0 && second_steps != 0 && (second_steps & record->lines[ball]) == 0;
+    }
+
+    const int ball1 = connections[QSTEPS*ball + BACK(step2)];
+    if (ball1 < 0 || connections[QSTEPS*ball1 + BACK(step1)] < 0) {
+        return 0;
     }
+
+    return (second_steps & (1 << step2)) != 0;
 }
 
-int test_std_geometry(void)
+int state_set_position(
+    struct state * restrict const me,
+    const struct position_record * const record)
 {
-    struct geometry * restrict const me = create_std_geometry(BW, BH, GW, FK);
-    if (me == NULL) {
-        test_fail("create_std_geometry(%d, %d, %d, %d) fails, return value is NULL, errno is %d.",
-            BW, BH, GW, FK, errno);
+    const struct geometry * const geometry = me->geometry;
+    const uint32_t qpoints = geometry->qpoints;
+
+    const int is_same_geometry = 1
+        && record->width == geometry->width
+        && record->height == geometry->height
+        && record->goal_width == geometry->goal_width
+        && record->free_kick_len == geometry->free_kick_len
+    ;
+
+    if (!is_same_geometry) {
+        return EINVAL;
     }
 
-    if (me->free_kick_len != FK) {
-        test_fail("free_kick_len is set wrong, actual value is %d, expected %d.", me->free_kick_len, FK);
+    const int ball = record->ball;
+    if (ball >= (int)qpoints || (ball < 0 && ball != GOAL_1 && ball != GOAL_2)) {
+        return EINVAL;
     }
 
-    const int center = make_point(BW/2, BH/2);
+    if (record->active != 1 && record->active != 2) {
+        return EINVAL;
+    }
 
-    const int expected_from_center[QSTEPS] = {
-        make_point(6, 12), make_point(7, 12), make_point(8, 12), make_point(8, 11),
-        make_point(8, 10), make_point(7, 10), make_point(6, 10), make_point(6, 11)
-    };
-    check_steps(me, 7, 11, expected_from_center);
+    if (record->step1 > INVALID_STEP || record->step2 > INVALID_STEP) {
+        return EINVAL;
+    }
 
-    const int nw_corner[QSTEPS] = {
-        NO_WAY, NO_WAY, NO_WAY, NO_WAY, make_point(1, BH-2), NO_WAY, NO_WAY, NO_WAY
-    };
-    check_steps(me, 0, BH-1, nw_corner);
+    const int is_free_kick = record->step1 == INVALID_STEP && record->step12 == 0;
+    if (is_free_kick != !!(record->flags & POSITION_FREE_KICK)) {
+        return EINVAL;
+    }
+
+    if (!is_valid_lines(geometry, record->lines, ball)) {
+        return EINVAL;
+    }
+
+    if (ball >= 0 && !is_valid_turn(geometry, record)) {
+        return EINVAL;
+    }
+
+    me->ball = ball;
+    me->active = record->active;
+    me->step1 = record->step1;
+    me->step2 = record->step2;
+    me->step12 = record->step12;
+    me->qstep_changes = 0;
+
+    memcpy(me->lines, record->lines, qpoints);
+
+    return 0;
+}
+
+
+
+struct turn_gen
+{
+    struct state * state;
+    struct turn * turns;
+    int capacity;
+    int qturns;
+    uint64_t keys[2 * MAX_TURNS];
+};
+
+static uint64_t lines_key(
+    const struct step_change * const changes,
+    const unsigned int qchanges)
+{
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < qchanges; ++i) {
+        const int what = changes[i].what;
+        if (what >= 0) {
+            result ^= mix64(1 + 8 * (uint64_t)what + changes[i].data);
+        }
+    }
+    return result;
+}
+
+static int add_turn(
+    struct turn_gen * restrict const me,
+    uint64_t key,
+    const uint32_t packed,
+    const int qsteps)
+{
+    key += key == 0;
+    const unsigned int mask = ARRAY_LEN(me->keys) - 1;
+    unsigned int i = key & mask;
+    for (; me->keys[i] != 0; i = (i + 1) & mask) {
+        if (me->keys[i] == key) {
+            return 0;
+        }
+    }
+
+    if (me->qturns >= me->capacity) {
+        return ENOBUFS;
+    }
+
+    me->keys[i] = key;
+    struct turn * restrict const turn = me->turns + me->qturns++;
+    turn->key = key;
+    turn->packed = packed;
+    turn->ball = me->state->ball;
+    turn->qsteps = qsteps;
+    return 0;
+}
+
+static int gen_turns(
+    struct turn_gen * restrict const me,
+    const uint64_t key,
+    const uint32_t packed,
+    const int qsteps)
+{
+    struct state * restrict const state = me->state;
+    struct step_change changes[STEP_LINES_STRIDE + QSCALAR_CHANGES];
+
+    steps_t steps = state_get_steps(state);
+    while (steps != 0) {
+        const enum step step = extract_step(&steps);
+        const int ball = state_step(state, step);
+        if (ball == NO_WAY) {
+            continue;
+        }
+
+        const unsigned int qchanges = state->qstep_changes;
+        memcpy(changes, state->step_changes, qchanges * sizeof(struct step_change));
+
+        const uint32_t next_packed = packed | (uint32_t)step << (SERIE_STEP_BITS * qsteps);
+        /* A dead end finishes the turn too, the position is lost then */
+        const int turn_over = ball < 0 || state->step1 == INVALID_STEP || state_get_steps(state) == 0;
+
+        int status;
+        if (!turn_over) {
+            const uint64_t next_key = key ^ lines_key(changes, qchanges);
+            status = gen_turns(me, next_key, next_packed, qsteps + 1);
+        } else if (ball < 0) {
+            /* All goals to the same gate are the same position */
+            status = add_turn(me, mix64(~(uint64_t)ball), next_packed, qsteps + 1);
+        } else {
+            const uint64_t position = (uint64_t)ball << 2 | state->active;
+            const uint64_t next_key = key ^ lines_key(changes, qchanges) ^ mix64(~position);
+            status = add_turn(me, next_key, next_packed, qsteps + 1);
+        }
+
+        state_rollback(state, changes, qchanges);
+        if (status != 0) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+int state_gen_turns(
+    struct state * restrict const me,
+    struct turn * restrict const turns,
+    const int capacity)
+{
+    if (me->ball < 0 || is_free_kick_situation(me)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct turn_gen gen;
+    gen.state = me;
+    gen.turns = turns;
+    gen.capacity = capacity;
+    gen.qturns = 0;
+    memset(gen.keys, 0, sizeof(gen.keys));
+
+    const int status = gen_turns(&gen, 0, 0, 0);
+    me->qstep_changes = 0;
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+
+    return gen.qturns;
+}
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#define BW   15
+#define BH   23
+#define GW    4
+#define FK    5
+
+#define STOP  QSTEPS
+
+static int make_point(const int x, const int y)
+{
+    return y * BW + x;
+}
+
+static void check_steps(
+    const struct geometry * const me,
+    const int x, const int y,
+    const int * const expected)
+{
+    const int point = make_point(x, y);
+    for (enum step step=0; step<QSTEPS; ++step) {
+        const int next = me->connections[QSTEPS*point + step];
+        if (next != expected[step]) {
+            test_fail("Unexpected step: x=%d, y=%d, step=%d, next=%d, expected next=%d.", x, y, step, next, expected[step]);
+        }
+    }
+}
+
+static void check_free_kick(
+    const struct geometry * const me,
+    const int x, const int y,
+    const int * const expected)
+{
+    const int point = make_point(x, y);
+    for (enum step step=0; step<QSTEPS; ++step) {
+        const int next = me->free_kicks[QSTEPS*point + step];
+        if (next != expected[step]) {
+            test_fail("Unexpected free kick: x=%d, y=%d, step=%d, next=%d, expected next=%d.", x, y, step, next, expected[step]);
+        }
+    }
+}
+
+static int apply_path(
+    const struct geometry * const me,
+    int point, const enum step path[])
+{
+    const enum step * current = path;
+    while (point >= 0 && *current != STOP) {
+        point = me->connections[QSTEPS*point + (*current++)];
+    }
+
+    return point;
+}
+
+static void check_map(
+    const struct geometry * restrict const me,
+    const int start, const int expected,
+    const enum step path[])
+{
+    const int finish = apply_path(me, start, path);
+    if (finish != expected) {
+        test_fail("Unexpected apply_path: start=%d, finish=%d, expected finish=%d.", start, finish, expected);
+    }
+}
+
+int test_std_geometry(void)
+{
+    struct geometry * restrict const me = create_std_geometry(BW, BH, GW, FK);
+    if (me == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d, %d) fails, return value is NULL, errno is %d.",
+            BW, BH, GW, FK, errno);
+    }
+
+    if (me->free_kick_len != FK) {
+        test_fail("free_kick_len is set wrong, actual value is %d, expected %d.", me->free_kick_len, FK);
+    }
+
+    const int center = make_point(BW/2, BH/2);
+
+    const int expected_from_center[QSTEPS] = {
+        make_point(6, 12), make_point(7, 12), make_point(8, 12), make_point(8, 11),
+        make_point(8, 10), make_point(7, 10), make_point(6, 10), make_point(6, 11)
+    };
+    check_steps(me, 7, 11, expected_from_center);
+
+    const int nw_corner[QSTEPS] = {
+        NO_WAY, NO_WAY, NO_WAY, NO_WAY, make_point(1, BH-2), NO_WAY, NO_WAY, NO_WAY
+    };
+    check_steps(me, 0, BH-1, nw_corner);
 
     const int right_side[QSTEPS] = {
         make_point(BW-2, 7), NO_WAY, NO_WAY, NO_WAY, NO_WAY, NO_WAY,
@@ -1320,110 +1901,400 @@ int test_history(void)
     return 0;
 }
 
-int test_step12_overflow_error(void)
+static int check_gen_step12(const struct state * const me, const char * const name, const int istep)
 {
-    const struct game_protocol * const protocol = &protocol_step12_overflow_bug_example;
-
-    must_init_ctx(protocol);
-    struct ai * restrict const ai = ctx->ai;
-    const enum step * const steps = protocol->steps;
-    const int qsteps = protocol->qsteps;
-
-    int status = ai->do_steps(ai, qsteps, steps);
-    if (status != 0) {
-        test_fail("Failed to apply %d moves, status %d, error: %s", qsteps, status, ai->error);
+    if (me->ball < 0) {
+        return 0;
     }
 
-    const int invalid_status = ai->do_step(ai, NORTH_EAST);
-    if (invalid_status == 0) {
-        test_fail("AI incorrectly accepted invalid NE move after penalty");
+    const uint64_t actual = state_gen_step12(me);
+    const uint64_t expected = generic_gen_step12(me);
+    if (actual != expected) {
+        test_fail("%s, step %d, ball %d: step12 0x%016lX, expected 0x%016lX.",
+            name, istep, me->ball, (unsigned long)actual, (unsigned long)expected);
     }
 
-    free_ctx();
-    return 0;
+    return me->geometry->inner_points[me->ball];
 }
 
-int test_geometry_straight_dist(void)
-{
-    const int width = 15;
-    const int height = 23;
-    const int goal_width = 6;
-    const int free_kick_len = 5;
-
-    struct geometry * restrict const me = create_std_geometry(width, height, goal_width, free_kick_len);
-    if (me == NULL) {
-        test_fail("create_std_geometry(%d, %d, %d, %d) failed, errno = %d.",
-            width, height, goal_width, free_kick_len, errno);
-    }
-
-    const int qpoints = width * height;
-    const int32_t * const free_kicks = me->free_kicks;
+#define QRANDOM_GAMES  200
+#define QRANDOM_STEPS  1000
 
-    struct test_data {
-        int player;
-        const enum step * straight;
-        const uint32_t * dist;
-        int32_t own_goal;
-        int32_t target_goal;
+int test_gen_step12(void)
+{
+    const struct game_protocol * const protocols[] = {
+        &protocol_empty,
+        &protocol_fastest_free_kick1,
+        &protocol_fastest_free_kick2,
+        &protocol_step12_overflow_bug_example,
+        &protocol_with_hang,
+        &protocol_000050,
+        &protocol_000461,
+        &protocol_002255,
     };
 
-    const struct test_data test_cases[] = {
-        { 1, me->straight_free_kick1, me->dist_goal1, GOAL_2, GOAL_1 },
-        { 2, me->straight_free_kick2, me->dist_goal2, GOAL_1, GOAL_2 },
-    };
+    int qinner = 0;
+    for (size_t i=0; i<ARRAY_LEN(protocols); ++i) {
+        const struct game_protocol * const protocol = protocols[i];
+        struct geometry * restrict const geometry = must_create_protocol_geometry(protocol);
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
 
-    for (int idata = 0; idata < ARRAY_LEN(test_cases); ++idata) {
-        const struct test_data * const data = &test_cases[idata];
-        const int player = data->player;
-        const enum step * const straight = data->straight;
-        const uint32_t * const dist = data->dist;
-        const int32_t own_goal = data->own_goal;
-        const int32_t target_goal = data->target_goal;
+        qinner += check_gen_step12(state, protocol->name, 0);
+        for (int j=0; j<protocol->qsteps; ++j) {
+            if (state_step(state, protocol->steps[j]) == NO_WAY) {
+                test_fail("%s, step %d: state_step failed.", protocol->name, j+1);
+            }
+            qinner += check_gen_step12(state, protocol->name, j+1);
+        }
 
-        for (int32_t offset = 0; offset < qpoints; ++offset) {
-            const int32_t x = offset % width;
-            const int32_t y = offset / width;
+        destroy_state(state);
+        destroy_geometry(geometry);
+    }
 
-            /* Find best direction for player */
-            const enum step best_step = straight[offset];
-            const int32_t destination = free_kicks[offset * QSTEPS + best_step];
+    struct geometry * restrict const geometry = create_std_geometry(BW, BH, GW, FK);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d) failed, errno = %d.", BW, BH, GW, errno);
+    }
 
-            if (destination == own_goal) {
-                test_fail("straight%d[%d] (%d, %d) = %s leads to own goal",
-                    player, offset, x, y, step_names[best_step]);
-            }
+    srand(20261018);
+    for (int i=0; i<QRANDOM_GAMES; ++i) {
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
 
-            if (destination == NO_WAY) {
-                test_fail("straight%d[%d] (%d, %d) = %s is blocked (NO_WAY)",
-                    player, offset, x, y, step_names[best_step]);
+        qinner += check_gen_step12(state, "random", 0);
+        for (int j=1; j <= QRANDOM_STEPS && state_status(state) == IN_PROGRESS; ++j) {
+            steps_t steps = state_get_steps(state);
+            if (steps == 0) {
+                break;
             }
 
-            /* Find distance to target goal */
-            if (destination == target_goal) {
-                const uint32_t d = dist[offset];
-                if (d > free_kick_len) {
-                    test_fail("straight%d[%d] (%d, %d) = %s leads to goal, but dist = %u > free_kick_len %d",
-                        player, offset, x, y, step_names[best_step], d, free_kick_len);
-                }
-                continue; /* Goal is the best, nothing to check */
+            for (int skip = rand() % step_count(steps); skip > 0; --skip) {
+                steps &= steps - 1;
             }
 
-            const uint32_t min_dist = dist[destination];
+            state_step(state, extract_step(&steps));
+            qinner += check_gen_step12(state, "random", j);
+        }
 
-            /* Check all other directions don't have better distance */
-            for (enum step step = 0; step < QSTEPS; ++step) {
-                const int32_t target = free_kicks[offset * QSTEPS + step];
+        destroy_state(state);
+    }
 
-                if (target == target_goal) {
-                    test_fail("straight%d[%d] (%d, %d) = %s doesn't lead to goal, but %s does",
-                        player, offset, x, y, step_names[best_step], step_names[step]);
-                }
+#if STEP12_SIMD
+    if (qinner == 0) {
+        test_fail("No inner positions were checked.");
+    }
+#endif
 
-                if (target < 0) {
-                    continue; /* NO_WAY or goal */
-                }
+    destroy_geometry(geometry);
+    return 0;
+}
 
-                if (target >= qpoints) {
+static void ref_set_line(uint8_t * restrict const lines, const int point, const enum step step)
+{
+    lines[point] |= 1 << step;
+}
+
+static void ref_mark_occuped(
+    const struct geometry * const geometry,
+    uint8_t * restrict const lines,
+    const int point)
+{
+    for (enum step step=0; step<QSTEPS; ++step) {
+        const int32_t next = geometry->connections[QSTEPS*point + step];
+        if (next >= 0) {
+            ref_set_line(lines, next, BACK(step));
+        }
+    }
+}
+
+static void ref_mark_diag(
+    const struct geometry * const geometry,
+    uint8_t * restrict const lines,
+    const int point,
+    const enum step step)
+{
+    const int32_t * const connections = geometry->connections;
+    const int32_t next = connections[QSTEPS*point + step];
+    if ((step & 1) == 1 || next < 0) {
+        return;
+    }
+
+    const enum step PA = (step + 1) & 0x07;
+    const enum step PB = (step - 1) & 0x07;
+    int32_t A = connections[QSTEPS*point + PA];
+    int32_t B = connections[QSTEPS*point + PB];
+    if (A == NO_WAY) {
+        A = connections[QSTEPS*next + BACK(PB)];
+    }
+    if (B == NO_WAY) {
+        B = connections[QSTEPS*next + BACK(PA)];
+    }
+
+    if (A >= 0) {
+        ref_set_line(lines, A, (step - 2) & 0x07);
+    }
+    if (B >= 0) {
+        ref_set_line(lines, B, (step + 2) & 0x07);
+    }
+}
+
+static void ref_step(
+    const struct geometry * const geometry,
+    uint8_t * restrict const lines,
+    const int free_kick,
+    int ball,
+    const enum step step)
+{
+    const int32_t * const connections = geometry->connections;
+    const int len = free_kick ? geometry->free_kick_len : 1;
+    for (int i=0; i<len && ball >= 0; ++i) {
+        ref_mark_diag(geometry, lines, ball, step);
+        ball = connections[QSTEPS*ball + step];
+        if (ball >= 0) {
+            ref_mark_occuped(geometry, lines, ball);
+        }
+    }
+}
+
+static void run_step_lines(const int width, const int height, const int goal_width, const int free_kick_len)
+{
+    struct geometry * restrict const geometry = create_std_geometry(width, height, goal_width, free_kick_len);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d) failed, errno = %d.", width, height, goal_width, errno);
+    }
+
+    const uint32_t qpoints = geometry->qpoints;
+    uint8_t * restrict const expected = malloc(qpoints);
+    if (expected == NULL) {
+        test_fail("malloc(%u) failed.", qpoints);
+    }
+
+    for (int i=0; i<QRANDOM_GAMES; ++i) {
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
+
+        for (uint32_t point = 0; point < qpoints; ++point) {
+            expected[point] = state->lines[point];
+        }
+
+        for (int j=1; j <= QRANDOM_STEPS && state_status(state) == IN_PROGRESS; ++j) {
+            steps_t steps = state_get_steps(state);
+            if (steps == 0) {
+                break;
+            }
+
+            for (int skip = rand() % step_count(steps); skip > 0; --skip) {
+                steps &= steps - 1;
+            }
+
+            const enum step step = extract_step(&steps);
+            const int free_kick = is_free_kick_situation(state);
+            ref_step(geometry, expected, free_kick, state->ball, step);
+            state_step(state, step);
+
+            for (uint32_t point = 0; point < qpoints; ++point) {
+                if (state->lines[point] != expected[point]) {
+                    test_fail("%dx%d, game %d, step %d, point %u: lines 0x%02X, expected 0x%02X.",
+                        width, height, i, j, point, state->lines[point], expected[point]);
+                }
+            }
+        }
+
+        destroy_state(state);
+    }
+
+    free(expected);
+    destroy_geometry(geometry);
+}
+
+int test_step_lines(void)
+{
+    srand(20261019);
+    run_step_lines(BW, BH, GW, FK);
+    run_step_lines(11, 13, 2, 4);
+    return 0;
+}
+
+int test_journal_overflow(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(BW, BH, GW, FK);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d) failed, errno = %d.", BW, BH, GW, errno);
+    }
+
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+
+    if (state->step_changes_capacity != state_journal_capacity(geometry)) {
+        test_fail("Journal capacity %u, expected %u.", state->step_changes_capacity, state_journal_capacity(geometry));
+    }
+
+    if (state_step(state, NORTH) < 0 || state->qstep_changes == 0) {
+        test_fail("state_step(NORTH) failed, qstep_changes = %u.", state->qstep_changes);
+    }
+
+    /* A short journal fails the step and leaves the state as it is */
+    struct state * restrict const expected = create_state(geometry);
+    if (expected == NULL) {
+        test_fail("create_state(geometry) failed, errno = %d.", errno);
+    }
+    state_copy(expected, state);
+
+    const unsigned int capacity = 3;
+    state->step_changes_capacity = capacity;
+    for (enum step step = 0; step < QSTEPS; ++step) {
+        errno = 0;
+        const int ball = state_step(state, step);
+        if (ball != NO_WAY || errno != ENOBUFS) {
+            test_fail("Short journal: state_step(%s) returns %d, errno = %d, NO_WAY and ENOBUFS expected.", step_names[step], ball, errno);
+        }
+
+        const int is_same = state->ball == expected->ball && state->active == expected->active
+            && state->step1 == expected->step1 && state->step2 == expected->step2
+            && state->step12 == expected->step12 && state->qstep_changes == 0
+            && memcmp(state->lines, expected->lines, geometry->qpoints) == 0;
+        if (!is_same) {
+            test_fail("Failed state_step(%s) changes the state.", step_names[step]);
+        }
+    }
+    destroy_state(expected);
+
+    state->step_changes_capacity = state_journal_capacity(geometry);
+    if (state_step(state, NORTH) < 0 || state->qstep_changes == 0) {
+        test_fail("state_step(NORTH) with a full journal failed.");
+    }
+
+    struct history storage;
+    struct history * restrict const history = &storage;
+    struct step_change buf[state->qstep_changes];
+
+    init_fixed_history(history, buf, state->qstep_changes);
+    if (history_push(history, state) != 0) {
+        test_fail("history_push to a fixed history failed.");
+    }
+    if (history_push(history, state) != ENOBUFS) {
+        test_fail("Fixed history overflow is not reported.");
+    }
+    free_history(history);
+
+    destroy_state(state);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+int test_step12_overflow_error(void)
+{
+    const struct game_protocol * const protocol = &protocol_step12_overflow_bug_example;
+
+    must_init_ctx(protocol);
+    struct ai * restrict const ai = ctx->ai;
+    const enum step * const steps = protocol->steps;
+    const int qsteps = protocol->qsteps;
+
+    int status = ai->do_steps(ai, qsteps, steps);
+    if (status != 0) {
+        test_fail("Failed to apply %d moves, status %d, error: %s", qsteps, status, ai->error);
+    }
+
+    const int invalid_status = ai->do_step(ai, NORTH_EAST);
+    if (invalid_status == 0) {
+        test_fail("AI incorrectly accepted invalid NE move after penalty");
+    }
+
+    free_ctx();
+    return 0;
+}
+
+int test_geometry_straight_dist(void)
+{
+    const int width = 15;
+    const int height = 23;
+    const int goal_width = 6;
+    const int free_kick_len = 5;
+
+    struct geometry * restrict const me = create_std_geometry(width, height, goal_width, free_kick_len);
+    if (me == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d, %d) failed, errno = %d.",
+            width, height, goal_width, free_kick_len, errno);
+    }
+
+    const int qpoints = width * height;
+    const int32_t * const free_kicks = me->free_kicks;
+
+    struct test_data {
+        int player;
+        const enum step * straight;
+        const uint32_t * dist;
+        int32_t own_goal;
+        int32_t target_goal;
+    };
+
+    const struct test_data test_cases[] = {
+        { 1, me->straight_free_kick1, me->dist_goal1, GOAL_2, GOAL_1 },
+        { 2, me->straight_free_kick2, me->dist_goal2, GOAL_1, GOAL_2 },
+    };
+
+    for (int idata = 0; idata < ARRAY_LEN(test_cases); ++idata) {
+        const struct test_data * const data = &test_cases[idata];
+        const int player = data->player;
+        const enum step * const straight = data->straight;
+        const uint32_t * const dist = data->dist;
+        const int32_t own_goal = data->own_goal;
+        const int32_t target_goal = data->target_goal;
+
+        for (int32_t offset = 0; offset < qpoints; ++offset) {
+            const int32_t x = offset % width;
+            const int32_t y = offset / width;
+
+            /* Find best direction for player */
+            const enum step best_step = straight[offset];
+            const int32_t destination = free_kicks[offset * QSTEPS + best_step];
+
+            if (destination == own_goal) {
+                test_fail("straight%d[%d] (%d, %d) = %s leads to own goal",
+                    player, offset, x, y, step_names[best_step]);
+            }
+
+            if (destination == NO_WAY) {
+                test_fail("straight%d[%d] (%d, %d) = %s is blocked (NO_WAY)",
+                    player, offset, x, y, step_names[best_step]);
+            }
+
+            /* Find distance to target goal */
+            if (destination == target_goal) {
+                const uint32_t d = dist[offset];
+                if (d > free_kick_len) {
+                    test_fail("straight%d[%d] (%d, %d) = %s leads to goal, but dist = %u > free_kick_len %d",
+                        player, offset, x, y, step_names[best_step], d, free_kick_len);
+                }
+                continue; /* Goal is the best, nothing to check */
+            }
+
+            const uint32_t min_dist = dist[destination];
+
+            /* Check all other directions don't have better distance */
+            for (enum step step = 0; step < QSTEPS; ++step) {
+                const int32_t target = free_kicks[offset * QSTEPS + step];
+
+                if (target == target_goal) {
+                    test_fail("straight%d[%d] (%d, %d) = %s doesn't lead to goal, but %s does",
+                        player, offset, x, y, step_names[best_step], step_names[step]);
+                }
+
+                if (target < 0) {
+                    continue; /* NO_WAY or goal */
+                }
+
+                if (target >= qpoints) {
                     test_fail("free_kicks[%d] (%d, %d) [%s] = %d is out of bounds (qpoints = %d)",
                         offset, x, y, step_names[step], target, qpoints);
                 }
@@ -1440,4 +2311,653 @@ int test_geometry_straight_dist(void)
     return 0;
 }
 
+
+
+#define QRECORD_GAMES  32
+
+static void check_position_records(
+    const struct state * const state,
+    struct state * restrict const restored,
+    struct position_record * restrict const record,
+    struct position_record * restrict const record2,
+    const size_t sz)
+{
+    state_save_position(state, record);
+    const int status = state_set_position(restored, record);
+    if (status != 0) {
+        test_fail("state_set_position failed with code %d.", status);
+    }
+
+    const int is_same = 1
+        && restored->ball == state->ball
+        && restored->active == state->active
+        && restored->step1 == state->step1
+        && restored->step2 == state->step2
+        && restored->step12 == state->step12
+        && restored->qstep_changes == 0
+        && state_status(restored) == state_status(state)
+    ;
+
+    if (!is_same) {
+        test_fail("Restored state differs from the saved one.");
+    }
+
+    if (state_status(state) == IN_PROGRESS && state_get_steps(restored) != state_get_steps(state)) {
+        test_fail("Restored state has different possible steps.");
+    }
+
+    const uint32_t qpoints = state->geometry->qpoints;
+    for (uint32_t point = 0; point < qpoints; ++point) {
+        if (restored->lines[point] != state->lines[point]) {
+            test_fail("Restored lines differ at point %u.", point);
+        }
+    }
+
+    state_save_position(restored, record2);
+    if (memcmp(record, record2, sz) != 0) {
+        test_fail("Position record is not stable after round trip.");
+    }
+}
+
+static void check_bad_record(
+    struct state * restrict const state,
+    const struct position_record * const record,
+    struct position_record * restrict const bad,
+    const size_t sz,
+    const char * const what)
+{
+    const int status = state_set_position(state, bad);
+    if (status != EINVAL) {
+        test_fail("Bad record (%s) is not rejected, status = %d.", what, status);
+    }
+    memcpy(bad, record, sz);
+}
+
+static int find_line(
+    const struct geometry * const geometry,
+    const uint8_t * const lines,
+    const int next_kind,
+    const int is_set,
+    enum step * restrict const step)
+{
+    const int32_t * const connections = geometry->connections;
+    for (uint32_t point = 0; point < geometry->qpoints; ++point) {
+        for (enum step i=0; i<QSTEPS; ++i) {
+            const int32_t next = connections[QSTEPS*point + i];
+            const int kind = next >= 0 ? 0 : next;
+            if (kind == next_kind && !!(lines[point] & (1 << i)) == is_set) {
+                *step = i;
+                return point;
+            }
+        }
+    }
+
+    test_fail("No line of kind %d with is_set %d.", next_kind, is_set);
+    return -1;
+}
+
+/* Lines and turns which state_step can not make, the restored state is not changed */
+static void check_bad_lines(
+    const struct state * const start,
+    struct state * restrict const restored,
+    struct position_record * restrict const record,
+    struct position_record * restrict const bad,
+    const size_t sz)
+{
+    const struct geometry * const geometry = start->geometry;
+    const int32_t * const connections = geometry->connections;
+
+    /* Start position and a turn with step1 (north) and step2 (north-west) made */
+    struct state * restrict const game = create_state(geometry);
+    if (game == NULL) {
+        test_fail("create_state failed, errno = %d.", errno);
+    }
+
+    state_copy(game, start);
+    state_save_position(game, record);
+    memcpy(bad, record, sz);
+
+    enum step step;
+    int point = find_line(geometry, record->lines, NO_WAY, 1, &step);
+    bad->lines[point] ^= 1 << step;
+    check_bad_record(restored, record, bad, sz, "open border");
+
+    point = find_line(geometry, record->lines, GOAL_1, 0, &step);
+    bad->lines[point] ^= 1 << step;
+    check_bad_record(restored, record, bad, sz, "closed way to the goal");
+
+    /* Far from the ball: neither point is visited */
+    point = make_point(2, 2);
+    bad->lines[point] |= 1 << EAST;
+    check_bad_record(restored, record, bad, sz, "one-sided line");
+
+    /* No line comes to the ball, and step12 matches the lines */
+    const int ball = record->ball;
+    for (enum step i=0; i<QSTEPS; ++i) {
+        bad->lines[connections[QSTEPS*ball + i]] &= ~(1 << BACK(i));
+    }
+    struct state bad_state = {
+        .geometry = geometry,
+        .lines = bad->lines,
+        .ball = ball,
+    };
+    bad->step12 = state_gen_step12(&bad_state);
+    check_bad_record(restored, record, bad, sz, "ball on a not visited point");
+
+    bad->step12 ^= 1ull << 9;
+    check_bad_record(restored, record, bad, sz, "step12 of another position");
+
+    bad->step2 = NORTH;
+    check_bad_record(restored, record, bad, sz, "step2 without step1");
+
+    /* Both lines of an open way are drawn: a crossing of two diagonals */
+    bad->lines[point] |= 1 << EAST;
+    bad->lines[point + 1] |= 1 << WEST;
+    if (state_set_position(restored, bad) != 0) {
+        test_fail("Position with a crossed diagonal is rejected.");
+    }
+    memcpy(bad, record, sz);
+
+    state_step(game, NORTH);
+    state_save_position(game, record);
+    memcpy(bad, record, sz);
+    if (state_set_position(restored, record) != 0) {
+        test_fail("Position after step1 is rejected.");
+    }
+
+    bad->step12 &= ~(0xFFull << (8 * NORTH));
+    check_bad_record(restored, record, bad, sz, "no second steps");
+
+    bad->step12 |= 1ull << (8 * NORTH + SOUTH);
+    check_bad_record(restored, record, bad, sz, "second step back to the start");
+
+    steps_t second_steps = 0xFF & (record->step12 >> (8 * NORTH));
+    const enum step step2 = extract_step(&second_steps);
+    state_step(game, step2);
+    state_save_position(game, record);
+    memcpy(bad, record, sz);
+    if (state_set_position(restored, record) != 0) {
+        test_fail("Position after step2 is rejected.");
+    }
+
+    bad->step12 &= ~(1ull << (8 * NORTH + step2));
+    check_bad_record(restored, record, bad, sz, "step2 is not in step12");
+
+    /* A rejected record does not change the state */
+    state_save_position(restored, bad);
+    if (memcmp(bad, record, sz) != 0) {
+        test_fail("Rejected records change the state.");
+    }
+
+    destroy_state(game);
+}
+
+int test_position_record(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(BW, BH, GW, FK);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d) failed, errno = %d.", BW, BH, GW, errno);
+    }
+
+    const size_t sz = position_record_size(geometry);
+    struct position_record * restrict const record = malloc(sz);
+    struct position_record * restrict const record2 = malloc(sz);
+    struct state * restrict const start = create_state(geometry);
+    struct state * restrict const game = create_state(geometry);
+    struct state * restrict const restored = create_state(geometry);
+    if (record == NULL || record2 == NULL || start == NULL || game == NULL || restored == NULL) {
+        test_fail("Allocation failed, errno = %d.", errno);
+    }
+
+    srand(20261019);
+    for (int i=0; i<QRECORD_GAMES; ++i) {
+        state_copy(game, start);
+        while (state_status(game) == IN_PROGRESS) {
+            check_position_records(game, restored, record, record2, sz);
+
+            steps_t steps = state_get_steps(game);
+            if (steps == 0) {
+                break;
+            }
+
+            for (int skip = rand() % step_count(steps); skip > 0; --skip) {
+                steps &= steps - 1;
+            }
+
+            state_step(game, extract_step(&steps));
+        }
+
+        check_position_records(game, restored, record, record2, sz);
+    }
+
+    state_save_position(game, record);
+    memcpy(record2, record, sz);
+
+    record2->width = BW + 2;
+    check_bad_record(restored, record, record2, sz, "width");
+    record2->free_kick_len = FK + 1;
+    check_bad_record(restored, record, record2, sz, "free kick length");
+    record2->ball = geometry->qpoints;
+    check_bad_record(restored, record, record2, sz, "ball");
+    record2->active = 3;
+    check_bad_record(restored, record, record2, sz, "active");
+    record2->step1 = INVALID_STEP + 1;
+    check_bad_record(restored, record, record2, sz, "step1");
+    record2->flags ^= POSITION_FREE_KICK;
+    check_bad_record(restored, record, record2, sz, "free kick flag");
+
+    check_bad_lines(start, restored, record, record2, sz);
+
+    destroy_state(restored);
+    destroy_state(game);
+    destroy_state(start);
+    free(record2);
+    free(record);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+
+
+#define QTURN_GAMES   20
+#define QTURN_STEPS   60
+
+struct turn_positions
+{
+    struct state * state;
+    const struct turn * turns;
+    int qturns;
+    uint8_t * lines;
+    int qsequences;
+};
+
+static int ref_turn_over(const struct state * const state, const int ball)
+{
+    return ball < 0 || state->step1 == INVALID_STEP || state_get_steps(state) == 0;
+}
+
+static int find_turn_position(
+    const struct turn_positions * const me,
+    const struct state * const state)
+{
+    const int qpoints = state->geometry->qpoints;
+    for (int i=0; i<me->qturns; ++i) {
+        if (me->turns[i].ball != state->ball) {
+            continue;
+        }
+        if (state->ball < 0) {
+            return i;
+        }
+        if (memcmp(me->lines + i * qpoints, state->lines, qpoints) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void ref_gen_turns(
+    struct turn_positions * restrict const me,
+    const struct state * const prev,
+    const int qsteps)
+{
+    steps_t steps = state_get_steps(prev);
+    while (steps != 0) {
+        const enum step step = extract_step(&steps);
+        struct state * restrict const state = me->state + qsteps;
+        state_copy(state, prev);
+        const int ball = state_step(state, step);
+        if (ball == NO_WAY) {
+            continue;
+        }
+
+        if (!ref_turn_over(state, ball)) {
+            if (qsteps + 1 >= MAX_TURN_STEPS) {
+                test_fail("Turn is longer than %d steps.", MAX_TURN_STEPS);
+            }
+            ref_gen_turns(me, state, qsteps + 1);
+            continue;
+        }
+
+        ++me->qsequences;
+        if (find_turn_position(me, state) < 0) {
+            test_fail("Turn to ball %d is not generated.", ball);
+        }
+    }
+}
+
+static void check_gen_turns(
+    struct state * restrict const state,
+    struct state * restrict const tmp,
+    uint8_t * restrict const lines)
+{
+    const int qpoints = state->geometry->qpoints;
+    const int ball = state->ball;
+    const int active = state->active;
+    const uint64_t step12 = state->step12;
+    memcpy(lines, state->lines, qpoints);
+
+    struct turn turns[MAX_TURNS];
+    const int qturns = state_gen_turns(state, turns, MAX_TURNS);
+    if (qturns <= 0) {
+        test_fail("state_gen_turns returns %d, errno = %d.", qturns, errno);
+    }
+
+    if (state->ball != ball || state->active != active || state->step12 != step12) {
+        test_fail("State is not restored after state_gen_turns.");
+    }
+
+    if (memcmp(state->lines, lines, qpoints) != 0) {
+        test_fail("Lines are not restored after state_gen_turns.");
+    }
+
+    uint8_t * restrict const turn_lines = lines + qpoints;
+    for (int i=0; i<qturns; ++i) {
+        const struct turn * const turn = turns + i;
+        if (turn->qsteps < 1 || turn->qsteps > MAX_TURN_STEPS) {
+            test_fail("Turn %d has %d steps.", i, turn->qsteps);
+        }
+
+        state_copy(tmp, state);
+        for (int j=0; j<turn->qsteps; ++j) {
+            const enum step step = (turn->packed >> (SERIE_STEP_BITS * j)) & 7;
+            const int next = state_step(tmp, step);
+            if (next == NO_WAY) {
+                test_fail("Turn %d step %d is invalid.", i, j);
+            }
+            if (ref_turn_over(tmp, next) != (j == turn->qsteps - 1)) {
+                test_fail("Turn %d ends at step %d of %d.", i, j, turn->qsteps);
+            }
+        }
+
+        if (tmp->ball != turn->ball) {
+            test_fail("Turn %d ball %d, expected %d.", i, turn->ball, tmp->ball);
+        }
+
+        memcpy(turn_lines + i * qpoints, tmp->lines, qpoints);
+    }
+
+    struct turn_positions positions = { tmp, turns, 0, turn_lines, 0 };
+    for (int i=0; i<qturns; ++i) {
+        state_copy(tmp, state);
+        for (int j=0; j<turns[i].qsteps; ++j) {
+            state_step(tmp, (turns[i].packed >> (SERIE_STEP_BITS * j)) & 7);
+        }
+        if (find_turn_position(&positions, tmp) >= 0) {
+            test_fail("Turn %d duplicates a previous turn.", i);
+        }
+        ++positions.qturns;
+    }
+
+    positions.state = tmp + 1;
+    ref_gen_turns(&positions, state, 0);
+    if (positions.qsequences < qturns) {
+        test_fail("%d turns from %d step sequences.", qturns, positions.qsequences);
+    }
+}
+
+int test_gen_turns(void)
+{
+    struct geometry * restrict const geometry = create_std_geometry(BW, BH, GW, FK);
+    if (geometry == NULL) {
+        test_fail("create_std_geometry(%d, %d, %d) failed, errno = %d.", BW, BH, GW, errno);
+    }
+
+    const int qpoints = geometry->qpoints;
+    uint8_t * restrict const lines = malloc((MAX_TURNS + 1) * qpoints);
+    struct state * restrict const state = create_state(geometry);
+    if (lines == NULL || state == NULL) {
+        test_fail("Allocation failed, errno = %d.", errno);
+    }
+
+    struct state tmp[MAX_TURN_STEPS + 1];
+    for (int i=0; i<=MAX_TURN_STEPS; ++i) {
+        uint8_t * const tmp_lines = malloc(qpoints);
+        if (tmp_lines == NULL || init_state(tmp + i, geometry, tmp_lines) != 0) {
+            test_fail("init_state failed, errno = %d.", errno);
+        }
+    }
+
+    struct turn turns[QSTEPS];
+    if (state_gen_turns(state, turns, QSTEPS) != -1 || errno != ENOBUFS) {
+        test_fail("Turns overflow is not reported, errno = %d.", errno);
+    }
+
+    int qfree_kicks = 0;
+    srand(20261018);
+    for (int i=0; i<QTURN_GAMES; ++i) {
+        struct state * restrict const game = create_state(geometry);
+        if (game == NULL) {
+            test_fail("create_state(geometry) failed, errno = %d.", errno);
+        }
+
+        for (int j=0; j <= QTURN_STEPS && state_status(game) == IN_PROGRESS; ++j) {
+            state_copy(state, game);
+            if (is_free_kick_situation(state)) {
+                errno = 0;
+                if (state_gen_turns(state, NULL, 0) != -1 || errno != EINVAL) {
+                    test_fail("Free kick situation is not rejected, errno = %d.", errno);
+                }
+                ++qfree_kicks;
+            } else {
+                check_gen_turns(state, tmp, lines);
+            }
+
+            steps_t steps = state_get_steps(game);
+            if (steps == 0) {
+                break;
+            }
+
+            for (int skip = rand() % step_count(steps); skip > 0; --skip) {
+                steps &= steps - 1;
+            }
+
+            state_step(game, extract_step(&steps));
+        }
+
+        destroy_state(game);
+    }
+
+    if (qfree_kicks == 0) {
+        test_fail("No free kick situations were checked.");
+    }
+
+    for (int i=0; i<=MAX_TURN_STEPS; ++i) {
+        free(tmp[i].lines);
+        free_state(tmp + i);
+    }
+
+    destroy_state(state);
+    free(lines);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+#endif
+
+
+
+#ifdef MICROBENCH
+
+#include "insider.h"
+
+/* Microbenchmarks over recorded positions, work states are changed by kernels */
+
+enum state_bench_filter { ALL_POSITIONS, STEP_POSITIONS, FREE_KICK_POSITIONS };
+
+struct state_bench
+{
+    struct recording * recording;
+    int qinputs;
+    const struct recorded_position ** inputs;
+    struct state ** work;
+    uint64_t sink;
+};
+
+static void * create_state_bench(const enum state_bench_filter filter)
+{
+    struct state_bench * restrict const me = calloc(1, sizeof(struct state_bench));
+    if (me == NULL) {
+        test_fail("calloc state_bench failed, errno = %d.", errno);
+    }
+
+    struct recording * restrict const recording = must_create_recording();
+    me->recording = recording;
+    me->inputs = calloc(recording->qpositions, sizeof(struct recorded_position *));
+    me->work = calloc(recording->qpositions, sizeof(struct state *));
+    if (me->inputs == NULL || me->work == NULL) {
+        test_fail("calloc state_bench inputs failed, errno = %d.", errno);
+    }
+
+    for (int i = 0; i < recording->qpositions; ++i) {
+        const struct recorded_position * const position = recording->positions + i;
+        const int is_free_kick = is_free_kick_situation(position->state);
+        if (filter == STEP_POSITIONS && is_free_kick) {
+            continue;
+        }
+        if (filter == FREE_KICK_POSITIONS && !is_free_kick) {
+            continue;
+        }
+
+        struct state * restrict const work = create_state(position->state->geometry);
+        if (work == NULL) {
+            test_fail("create_state failed, errno = %d.", errno);
+        }
+
+        me->inputs[me->qinputs] = position;
+        me->work[me->qinputs] = work;
+        ++me->qinputs;
+    }
+
+    return me;
+}
+
+static void destroy_state_bench(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        destroy_state(me->work[i]);
+    }
+
+    destroy_recording(me->recording);
+    free(me->inputs);
+    free(me->work);
+    free(me);
+}
+
+static void * create_all_bench(void)
+{
+    return create_state_bench(ALL_POSITIONS);
+}
+
+static void * create_step_bench(void)
+{
+    return create_state_bench(STEP_POSITIONS);
+}
+
+static void * create_free_kick_bench(void)
+{
+    return create_state_bench(FREE_KICK_POSITIONS);
+}
+
+static void prepare_copies(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        state_copy(me->work[i], me->inputs[i]->state);
+    }
+}
+
+static void prepare_steps(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        state_copy(me->work[i], me->inputs[i]->state);
+        state_step(me->work[i], me->inputs[i]->step);
+    }
+}
+
+static uint64_t run_state_step(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        me->sink += state_step(me->work[i], me->inputs[i]->step);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_free_kick_step(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        struct state * restrict const work = me->work[i];
+        work->qstep_changes = 0;
+        me->sink += free_kick_step(work, me->inputs[i]->step);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_state_rollback(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        struct state * restrict const work = me->work[i];
+        me->sink += state_rollback(work, work->step_changes, work->qstep_changes);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_state_copy(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        me->sink += state_copy(me->work[i], me->inputs[i]->state);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_state_gen_step12(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        me->sink += state_gen_step12(me->inputs[i]->state);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_state_get_steps(void * data)
+{
+    struct state_bench * restrict const me = data;
+    for (int i = 0; i < me->qinputs; ++i) {
+        me->sink += state_get_steps(me->inputs[i]->state);
+    }
+    return me->qinputs;
+}
+
+static uint64_t run_state_gen_turns(void * data)
+{
+    struct state_bench * restrict const me = data;
+    struct turn turns[MAX_TURNS];
+    uint64_t qturns = 0;
+    for (int i = 0; i < me->qinputs; ++i) {
+        const int result = state_gen_turns(me->work[i], turns, MAX_TURNS);
+        if (result < 0) {
+            test_fail("state_gen_turns failed, errno = %d.", errno);
+        }
+        qturns += result;
+        me->sink += turns[0].key;
+    }
+    return qturns;
+}
+
+const struct microbench game_microbenches[] = {
+    { "state_step", create_step_bench, prepare_copies, run_state_step, destroy_state_bench },
+    { "free_kick_step", create_free_kick_bench, prepare_copies, run_free_kick_step, destroy_state_bench },
+    { "state_rollback", create_all_bench, prepare_steps, run_state_rollback, destroy_state_bench },
+    { "state_copy", create_all_bench, NULL, run_state_copy, destroy_state_bench },
+    { "state_gen_step12", create_all_bench, NULL, run_state_gen_step12, destroy_state_bench },
+    { "state_get_steps", create_all_bench, NULL, run_state_get_steps, destroy_state_bench },
+    { "state_gen_turns", create_step_bench, prepare_copies, run_state_gen_turns, destroy_state_bench },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
 #endif
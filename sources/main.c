@@ -3,10 +3,21 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #define MAX_ENGINE_STEPS 100
 
+#define SELFPLAY_NAME_SZ    64
+#define SELFPLAY_BATCH      16 /* Games per thread in one run */
+
+#define SPRT_DEF_GAMES      20000
+#define SPRT_DEF_OPENING    4
+#define SPRT_DEF_ALPHA      0.05
+#define SPRT_DEF_BETA       0.05
+
 #define KW_QUIT             1
 #define KW_PING             2
 #define KW_STATUS           3
@@ -24,6 +35,26 @@
 #define KW_SRAND           15
 #define KW_LOAD            16
 #define KW_DEBUG           17
+#define KW_PERFT           18
+#define KW_DIVIDE          19
+#define KW_THREADS         20
+#define KW_ANALYZE         21
+#define KW_ANNOTATE        22
+#define KW_POSITION        23
+#define KW_SAVE            24
+#define KW_SELFPLAY        25
+#define KW_PLAYER          26
+#define KW_SPRT            27
+#define KW_OPENING         28
+#define KW_GAMES           29
+#define KW_ALPHA           30
+#define KW_BETA            31
+#define KW_ARCHIVE         32
+#define KW_SHOW            33
+#define KW_REPLAY          34
+#define KW_STATS           35
+#define KW_TRACE           36
+#define KW_DECODE          37
 
 #define ITEM(name) { #name, KW_##name }
 struct keyword_desc keywords[] = {
@@ -45,10 +76,37 @@ struct keyword_desc keywords[] = {
     ITEM(SRAND),
     ITEM(LOAD),
     ITEM(DEBUG),
+    ITEM(PERFT),
+    ITEM(DIVIDE),
+    ITEM(THREADS),
+    ITEM(ANALYZE),
+    ITEM(ANNOTATE),
+    ITEM(POSITION),
+    ITEM(SAVE),
+    ITEM(SELFPLAY),
+    ITEM(PLAYER),
+    ITEM(SPRT),
+    ITEM(OPENING),
+    ITEM(GAMES),
+    ITEM(ALPHA),
+    ITEM(BETA),
+    ITEM(ARCHIVE),
+    ITEM(SHOW),
+    ITEM(REPLAY),
+    ITEM(STATS),
+    ITEM(TRACE),
+    ITEM(DECODE),
     { NULL, 0 }
 };
 
-enum ai_go_flags { EXPLAIN_TIME, EXPLAIN_SCORE, EXPLAIN_STEPS, EXPLAIN_CACHE };
+enum ai_go_flags { EXPLAIN_TIME, EXPLAIN_SCORE, EXPLAIN_STEPS, EXPLAIN_CACHE, EXPLAIN_STATS };
+
+struct selfplay_player
+{
+    const struct ai_desc * ai_desc; /* NULL if the player is not set */
+    struct ai ai;
+    char name[SELFPLAY_NAME_SZ];
+};
 
 struct cmd_parser
 {
@@ -61,12 +119,16 @@ struct cmd_parser
     struct geometry * geometry;
     struct state * state;
     struct state * backup;
+    struct state * root; /* History starts here, NULL for the start position */
 
     struct history history;
 
     struct ai * ai;
     const struct ai_desc * ai_desc;
     struct ai ai_storage;
+    struct search_explanation last_search; /* For AI STATS */
+
+    struct selfplay_player players[2];
 };
 
 
@@ -105,6 +167,10 @@ static void destroy_game(const struct cmd_parser * const me)
     if (me->backup) {
         destroy_state(me->backup);
     }
+
+    if (me->root) {
+        destroy_state(me->root);
+    }
 }
 
 static void free_ai(struct cmd_parser * restrict const me)
@@ -159,6 +225,7 @@ static int new_game(
     me->geometry = geometry;
     me->state = state;
     me->backup = backup;
+    me->root = NULL;
 
     me->history.qstep_changes = 0;
     return 0;
@@ -264,6 +331,7 @@ static void set_ai(
     const struct ai_desc * const ai_desc)
 {
     struct ai storage;
+    memset(&storage, 0, sizeof(storage));
 
     const int status = ai_desc->init_ai(&storage, me->geometry);
     if (status != 0) {
@@ -271,6 +339,15 @@ static void set_ai(
         return;
     }
 
+    if (me->root) {
+        const int status = storage.set_state ? storage.set_state(&storage, me->root) : ENOTSUP;
+        if (status != 0) {
+            fprintf(stderr, "Cannot set AI: cannot set position, status = %d.\n", status);
+            storage.free(&storage);
+            return;
+        }
+    }
+
     const struct step_change * step_change = me->history.step_changes;
     const struct step_change * const end = step_change + me->history.qstep_changes;
     for (; step_change != end; ++step_change) {
@@ -313,7 +390,11 @@ static void restore_ai(
     struct ai * restrict const ai = me->ai;
     restore_backup(me, history_qsteps);
 
-    const int status = ai->reset(ai, me->geometry);
+    int status = ai->reset(ai, me->geometry);
+    if (status == 0 && me->root) {
+        status = ai->set_state ? ai->set_state(ai, me->root) : ENOTSUP;
+    }
+
     if (status != 0) {
         fprintf(stderr, "Cannot reset AI, AI turned off.\n");
         free_ai(me);
@@ -362,6 +443,69 @@ static void notify_warns(struct ai * restrict const ai)
     }
 }
 
+static void print_search_stats(const struct search_explanation * const search)
+{
+    static const char * const node_type_names[QNODE_TYPES] = { "T", "S", "B", "P" };
+
+    const double total_time = 1e-9 * search->time_ns;
+    const double speed = total_time > 0.0 ? search->qplayouts / total_time : 0.0;
+    printf("      playouts %" PRIu64 " (%.0f/s), state_step calls %" PRIu64 "\n",
+        search->qplayouts, speed, search->qstate_steps);
+
+    const double avg_len = search->qrollouts > 0 ? (double)search->rollout_steps / search->qrollouts : 0.0;
+    printf("      rollouts %" PRIu64 ", length avg %.1f max %u, cut by max_depth %" PRIu64 "\n",
+        search->qrollouts, avg_len, search->max_rollout_len, search->qcut_rollouts);
+
+    printf("      bsf_gen calls %" PRIu64 ", series %" PRIu64 ", max_hist_len %u\n",
+        search->qbsf_gen, search->qseries, search->max_hist_len);
+
+    printf("      branching");
+    for (int i = 0; i < QNODE_TYPES; ++i) {
+        const uint64_t qexpanded = search->qexpanded[i];
+        const double branching = qexpanded > 0 ? (double)search->qanswers[i] / qexpanded : 0.0;
+        printf(" %s %.2f (%" PRIu64 ")", node_type_names[i], branching, qexpanded);
+    }
+    printf("\n");
+
+    printf("      depth");
+    for (int i = 0; i < MAX_STATS_DEPTH; ++i) {
+        if (search->depths[i] > 0) {
+            const char * const more = i == MAX_STATS_DEPTH - 1 ? "+" : "";
+            printf(" %d%s:%" PRIu64, i, more, search->depths[i]);
+        }
+    }
+    printf("\n");
+
+    printf("      time %.3fs\n", total_time);
+
+#if CYCLE_COUNTERS
+    static const char * const phase_names[QPHASES] = { "descent", "expansion", "rollout", "backprop" };
+
+    uint64_t phases_ns = 0;
+    for (int i = 0; i < QPHASES; ++i) {
+        phases_ns += search->phase_ns[i];
+    }
+
+    printf("      phases");
+    for (int i = 0; i < QPHASES; ++i) {
+        const double pct = phases_ns > 0 ? 100.0 * search->phase_ns[i] / phases_ns : 0.0;
+        printf(" %s %.1f%%", phase_names[i], pct);
+    }
+    printf("\n");
+
+    static const char * const cycle_phase_names[QCYCLE_PHASES] = {
+        "select", "calc_answers", "bsf_gen", "alloc_answers", "rollout", "update_history"
+    };
+
+    printf("      cycles/playout");
+    for (int i = 0; i < QCYCLE_PHASES; ++i) {
+        const double per_playout = (double)search->cycles.cycles[i] / search->qplayouts;
+        printf(" %s %.0f (%" PRIu64 " calls)", cycle_phase_names[i], per_playout, search->cycles.calls[i]);
+    }
+    printf("\n");
+#endif
+}
+
 static void explain_step(
     const enum step step,
     const unsigned int flags,
@@ -375,8 +519,9 @@ static void explain_step(
     const unsigned int score_mask = 1 << EXPLAIN_SCORE;
     const unsigned int step_mask = 1 << EXPLAIN_STEPS;
     const unsigned int cache_mask = 1 << EXPLAIN_CACHE;
+    const unsigned int stats_mask = 1 << EXPLAIN_STATS;
 
-    const unsigned int line_mask = time_mask | score_mask | cache_mask;
+    const unsigned int line_mask = time_mask | score_mask | cache_mask | stats_mask;
     if (flags & line_mask) {
         printf("  %2s", step_names[step]);
         if (flags & time_mask) {
@@ -402,6 +547,10 @@ static void explain_step(
         printf("\n");
     }
 
+    if ((flags & stats_mask) && explanation->search.qplayouts > 0) {
+        print_search_stats(&explanation->search);
+    }
+
     if (flags & step_mask) {
         const struct choice_stat * ptr = explanation->stats;
         const struct choice_stat * const end = ptr + explanation->qstats;
@@ -451,7 +600,7 @@ static void ai_go(
     struct state * restrict const state = me->state;
     const int active = state->active;
 
-    enum step step = ai->go(ai, flags ? &explanation : NULL);
+    enum step step = ai->go(ai, &explanation);
     if (step == INVALID_STEP) {
         fprintf(stderr, "AI move: invalid step.\n");
         return;
@@ -473,6 +622,10 @@ static void ai_go(
         explain_step(step, flags, &explanation);
         notify_warns(ai);
 
+        if (explanation.search.qplayouts > 0) {
+            me->last_search = explanation.search;
+        }
+
         const int status = me->ai->do_step(me->ai, step);
         if (status != 0) {
             printf("\n");
@@ -495,7 +648,7 @@ static void ai_go(
             break;
         }
 
-        step = ai->go(ai, flags ? &explanation : NULL);
+        step = ai->go(ai, &explanation);
         if (step == INVALID_STEP) {
             printf("\n");
             fprintf(stderr, "AI move: invalid step.\n");
@@ -578,6 +731,13 @@ void free_cmd_parser(struct cmd_parser * restrict const me)
     destroy_game(me);
     free_ai(me);
 
+    for (int i=0; i<2; ++i) {
+        struct selfplay_player * restrict const player = me->players + i;
+        if (player->ai_desc) {
+            player->ai.free(&player->ai);
+        }
+    }
+
     free_history(&me->history);
 }
 
@@ -587,8 +747,12 @@ int init_cmd_parser(struct cmd_parser * restrict const me)
     me->geometry = NULL;
     me->state = NULL;
     me->backup = NULL;
+    me->root = NULL;
     me->ai = NULL;
     me->ai_desc = NULL;
+    me->players[0].ai_desc = NULL;
+    me->players[1].ai_desc = NULL;
+    memset(&me->last_search, 0, sizeof(me->last_search));
 
     me->tracker = create_keyword_tracker(keywords, KW_TRACKER__IGNORE_CASE);
     if (me->tracker == NULL) {
@@ -961,6 +1125,9 @@ void process_ai_go(struct cmd_parser * restrict const me)
             case KW_CACHE:
                 flags |= 1 << EXPLAIN_CACHE;
                 break;
+            case KW_STATS:
+                flags |= 1 << EXPLAIN_STATS;
+                break;
             default:
                 error(lp, "Invalid explain flag in AI GO command.");
                 return;
@@ -973,7 +1140,11 @@ void process_ai_go(struct cmd_parser * restrict const me)
         }
     }
 
+    /* Searches of all server sessions share the slots, a slot for every search thread */
+    const int qslots = ai_qthreads(get_ai(me));
+    search_slots_acquire(qslots);
     ai_go(me, flags);
+    search_slots_release(qslots);
 }
 
 void process_ai_info(struct cmd_parser * restrict const me)
@@ -987,6 +1158,22 @@ void process_ai_info(struct cmd_parser * restrict const me)
     ai_info(me);
 }
 
+void process_ai_stats(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    if (!parser_check_eol(lp)) {
+        error(lp, "End of line expected (AI STATS command is parsed), but someting was found.");
+        return;
+    }
+
+    if (me->last_search.qplayouts == 0) {
+        fprintf(stderr, "No search statistics, AI GO with a search is expected before.\n");
+        return;
+    }
+
+    print_search_stats(&me->last_search);
+}
+
 void process_ai_debug(struct cmd_parser * restrict const me)
 {
     struct line_parser * restrict const lp = &me->line_parser;
@@ -1015,6 +1202,8 @@ void process_ai(struct cmd_parser * restrict const me)
             return process_ai_info(me);
         case KW_DEBUG:
             return process_ai_debug(me);
+        case KW_STATS:
+            return process_ai_stats(me);
     }
 
     error(lp, "Invalid action in AI command.");
@@ -1038,27 +1227,22 @@ void process_srand(struct cmd_parser * restrict const me)
     srand((unsigned int)value);
 }
 
-void process_load(struct cmd_parser * restrict const me)
+static int load_game(
+    struct cmd_parser * restrict const me,
+    const char * const filename)
 {
     struct line_parser * restrict const lp = &me->line_parser;
 
-    int status = parser_read_last_path(lp);
-    if (status != 0) {
-        error(lp, "Filename expected in LOAD command.");
-        return;
-    }
-
-    const size_t filename_len = lp->current - lp->lexem_start;
-    char filename[filename_len + 1];
-    memcpy(filename, lp->lexem_start, filename_len);
-    filename[filename_len] = '\0';
-
     FILE * file = fopen(filename, "r");
     if (!file) {
+        const int status = errno;
         error(lp, "Cannot open file %s.", filename);
-        return;
+        return status;
     }
 
+    int status;
+    int result = 0;
+
     char * line = NULL;
     size_t len = 0;
     ssize_t read;
@@ -1076,12 +1260,14 @@ void process_load(struct cmd_parser * restrict const me)
 
             if (game_created) {
                 printf("GAME occured twice\n");
+                result = EINVAL;
                 break;
             }
 
             status = process_new(me);
             if (status != 0) {
                 printf("Failed to create game, status %d\n", status);
+                result = EINVAL;
                 break;
             }
 
@@ -1114,106 +1300,1672 @@ void process_load(struct cmd_parser * restrict const me)
         free(line);
     }
     fclose(file);
+    return game_created ? result : EINVAL;
 }
 
-void process_debug(struct cmd_parser * restrict const me)
+void process_load(struct cmd_parser * restrict const me)
 {
-    /* Put debug code here, user debug_trap for breaks */
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    int status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Filename expected in LOAD command.");
+        return;
+    }
+
+    const size_t filename_len = lp->current - lp->lexem_start;
+    char filename[filename_len + 1];
+    memcpy(filename, lp->lexem_start, filename_len);
+    filename[filename_len] = '\0';
+
+    load_game(me, filename);
 }
 
-int process_cmd(struct cmd_parser * restrict const me, const char * const line)
+void process_perft(struct cmd_parser * restrict const me)
 {
     struct line_parser * restrict const lp = &me->line_parser;
-    parser_set_line(lp, line);
 
-    if (parser_check_eol(lp)) {
-        return 0;
+    int depth;
+    parser_skip_spaces(lp);
+    int status = parser_try_int(lp, &depth);
+    if (status != 0 || depth < 1) {
+        error(lp, "Positive depth expected in PERFT command.");
+        return;
     }
 
-    const int keyword = read_keyword(me);
-    if (keyword == -1) {
-        error(lp, "Invalid lexem at the begginning of the line.");
-        return 0;
+    int divide = 0;
+    int qthreads = 1;
+    while (!parser_check_eol(lp)) {
+        const int keyword = read_keyword(me);
+        if (keyword == -1) {
+            error(lp, "Invalid lexem in PERFT command.");
+            return;
+        }
+
+        switch (keyword) {
+            case KW_DIVIDE:
+                divide = 1;
+                break;
+            case KW_THREADS:
+                parser_skip_spaces(lp);
+                status = parser_try_int(lp, &qthreads);
+                if (status != 0 || qthreads < 1) {
+                    error(lp, "Positive number of threads expected in PERFT command.");
+                    return;
+                }
+                break;
+            default:
+                error(lp, "Invalid flag in PERFT command.");
+                return;
+        }
     }
 
-    if (keyword == 0) {
-        error(lp, "Invalid keyword at the begginning of the line.");
-        return 0;
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t counts[QSTEPS];
+    status = perft_parallel(me->state, depth, qthreads, counts);
+    if (status != 0) {
+        fprintf(stderr, "perft failed with code %d.\n", status);
+        return;
     }
 
-    if (keyword == KW_QUIT) {
-        return process_quit(me);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    const double time = (finish.tv_sec - start.tv_sec) + 1e-9 * (finish.tv_nsec - start.tv_nsec);
+
+    uint64_t total = 0;
+    for (enum step step = 0; step < QSTEPS; ++step) {
+        total += counts[step];
+        if (divide && counts[step] > 0) {
+            printf("%4s %" PRIu64 "\n", step_names[step], counts[step]);
+        }
     }
 
-    switch (keyword) {
-        case KW_PING:
-            printf("pong%s", lp->current);
-            fflush(stdout);
-            fflush(stderr);
-            break;
-        case KW_STATUS:
-            process_status(me);
-            break;
-        case KW_NEW:
-            process_new(me);
-            break;
-        case KW_STEP:
-            process_step(me);
-            break;
-        case KW_HISTORY:
-            process_history(me);
-            break;
-        case KW_SET:
-            process_set(me);
-            break;
-        case KW_AI:
-            process_ai(me);
-            break;
-        case KW_SRAND:
-            process_srand(me);
-            break;
-        case KW_LOAD:
-            process_load(me);
-            break;
-        case KW_DEBUG:
-            process_debug(me);
-            break;
-        default:
-            error(lp, "Unexpected keyword at the begginning of the line.");
-            break;
+    const double nps = time > 0.0 ? total / time : 0.0;
+    printf("perft %d: %" PRIu64 " nodes in %.3fs, %.0f nodes/sec\n", depth, total, time, nps);
+}
+
+struct batch_job
+{
+    struct ai_analysis analysis;
+    size_t offset;
+    int line_num;
+    int active;
+};
+
+struct batch
+{
+    enum step * steps;
+    size_t qsteps;
+    size_t steps_capacity;
+    struct batch_job * jobs;
+    int qjobs;
+    int jobs_capacity;
+};
+
+static void free_batch(struct batch * restrict const me)
+{
+    free(me->steps);
+    free(me->jobs);
+}
+
+static int add_batch_step(
+    struct batch * restrict const me,
+    const enum step step)
+{
+    if (me->qsteps >= me->steps_capacity) {
+        const size_t capacity = me->steps_capacity ? 2 * me->steps_capacity : 1024;
+        enum step * const steps = realloc(me->steps, capacity * sizeof(enum step));
+        if (steps == NULL) {
+            return ENOMEM;
+        }
+        me->steps = steps;
+        me->steps_capacity = capacity;
     }
 
+    me->steps[me->qsteps++] = step;
     return 0;
 }
 
-int main()
+static struct batch_job * add_batch_job(struct batch * restrict const me)
 {
-    struct cmd_parser cmd_parser;
-    const int status = init_cmd_parser(&cmd_parser);
-    if (status != 0) {
-        fprintf(stderr, "Fatal: cannot init command line parser, error code is %d.\n", status);
-        return status;
+    if (me->qjobs >= me->jobs_capacity) {
+        const int capacity = me->jobs_capacity ? 2 * me->jobs_capacity : 64;
+        struct batch_job * const jobs = realloc(me->jobs, capacity * sizeof(struct batch_job));
+        if (jobs == NULL) {
+            return NULL;
+        }
+        me->jobs = jobs;
+        me->jobs_capacity = capacity;
     }
 
-    char * line = 0;
-    size_t len = 0;
-    for (;; ) {
-        const ssize_t has_read = getline(&line, &len, stdin);
-        if (has_read == -1) {
-            break;
-        }
+    struct batch_job * restrict const job = me->jobs + me->qjobs++;
+    job->offset = me->qsteps;
+    job->analysis.qsteps = 0;
+    job->analysis.played = NULL;
+    job->analysis.qplayed = 0;
+    return job;
+}
 
-        const int is_quit = process_cmd(&cmd_parser, line);
-        if (is_quit) {
+static int read_threads(
+    struct cmd_parser * restrict const me,
+    int * restrict const qthreads)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    const unsigned char * const saved = lp->current;
+
+    parser_skip_spaces(lp);
+    if (read_keyword(me) != KW_THREADS) {
+        lp->current = saved;
+        const long qcpus = sysconf(_SC_NPROCESSORS_ONLN);
+        *qthreads = qcpus > 0 ? qcpus : 1;
+        return 0;
+    }
+
+    parser_skip_spaces(lp);
+    const int status = parser_try_int(lp, qthreads);
+    if (status != 0 || *qthreads < 1) {
+        error(lp, "Positive number of threads expected.");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+static void print_serie(
+    const enum step * const steps,
+    const int qsteps)
+{
+    printf(" %s", step_names[steps[0]]);
+    for (int i=1; i<qsteps; ++i) {
+        printf("-%s", step_names[steps[i]]);
+    }
+}
+
+static void print_score(const double score)
+{
+    if (score >= 0.0 && score <= 1.0) {
+        printf(" %.1f%%", 100.0 * score);
+    } else {
+        printf(" N/A");
+    }
+}
+
+static void print_analysis(
+    void * const job,
+    void * const arg)
+{
+    const struct batch_job * const me = job;
+    const struct ai_analysis * const analysis = &me->analysis;
+
+    if (analysis->status != 0) {
+        printf("%d error %d\n", me->line_num, analysis->status);
+        fflush(stdout);
+        return;
+    }
+
+    printf("%d", me->line_num);
+    print_serie(analysis->best, analysis->qbest);
+    print_score(analysis->score);
+    printf(" %d\n", analysis->qgames);
+    fflush(stdout);
+}
+
+static void print_annotation(
+    void * const job,
+    void * const arg)
+{
+    const struct batch_job * const me = job;
+    const struct ai_analysis * const analysis = &me->analysis;
+
+    printf("%d %d", me->line_num, me->active);
+    print_serie(analysis->played, analysis->qplayed);
+
+    if (analysis->status != 0) {
+        printf(" error %d\n", analysis->status);
+        fflush(stdout);
+        return;
+    }
+
+    print_score(analysis->played_score);
+    print_serie(analysis->best, analysis->qbest);
+    print_score(analysis->score);
+
+    const double played_score = analysis->played_score;
+    const double score = analysis->score;
+    if (played_score >= 0.0 && score >= 0.0) {
+        const double loss = score > played_score ? score - played_score : 0.0;
+        printf(" %.1f\n", 100.0 * loss);
+    } else {
+        printf(" N/A\n");
+    }
+    fflush(stdout);
+}
+
+static int split_batch_turns(
+    struct batch * restrict const batch,
+    const struct geometry * const geometry)
+{
+    const size_t qsteps = batch->qsteps;
+    unsigned int * restrict const offsets = malloc((qsteps + 1) * sizeof(unsigned int));
+    int * restrict const actives = malloc((qsteps + 1) * sizeof(int));
+    const int qturns = offsets != NULL && actives != NULL ? split_turns(geometry, batch->steps, qsteps, offsets, actives) : -1;
+
+    int status = qturns < 0 ? ENOMEM : 0;
+    for (int i=0; i<qturns && status == 0; ++i) {
+        struct batch_job * restrict const job = add_batch_job(batch);
+        if (job == NULL) {
+            status = ENOMEM;
             break;
         }
+
+        const unsigned int next = i + 1 < qturns ? offsets[i+1] : qsteps;
+        job->offset = offsets[i];
+        job->line_num = i + 1;
+        job->active = actives[i];
+        job->analysis.steps = batch->steps;
+        job->analysis.qsteps = offsets[i];
+        job->analysis.played = batch->steps + offsets[i];
+        job->analysis.qplayed = next - offsets[i];
     }
 
-    free_cmd_parser(&cmd_parser);
+    free(actives);
+    free(offsets);
+    return status;
+}
 
-    if (line) {
-        free(line);
+static void run_batch(
+    struct cmd_parser * restrict const me,
+    struct batch * restrict const batch,
+    int qthreads,
+    ai_job_done done)
+{
+    struct ai * restrict const ai = get_ai(me);
+    if (ai == NULL) {
+        return;
+    }
+
+    if (qthreads > batch->qjobs) {
+        qthreads = batch->qjobs > 0 ? batch->qjobs : 1;
+    }
+
+    struct ai_pool * restrict const pool = create_ai_pool(ai, me->ai_desc->init_ai, me->geometry, me->root, qthreads);
+    if (pool == NULL) {
+        fprintf(stderr, "Cannot create AI pool, error code %d.\n", errno);
+        return;
+    }
+
+    const int status = ai_pool_run(pool, batch->jobs, sizeof(struct batch_job), batch->qjobs, ai_analyse, done, NULL);
+    if (status != 0) {
+        fprintf(stderr, "Analysis failed with code %d.\n", status);
     }
 
+    destroy_ai_pool(pool);
+}
+
+void process_annotate(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    int qthreads;
+    int status = read_threads(me, &qthreads);
+    if (status != 0) {
+        return;
+    }
+
+    status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Filename expected in ANNOTATE command.");
+        return;
+    }
+
+    const size_t filename_len = lp->current - lp->lexem_start;
+    char filename[filename_len + 1];
+    memcpy(filename, lp->lexem_start, filename_len);
+    filename[filename_len] = '\0';
+
+    status = load_game(me, filename);
+    if (status != 0) {
+        fprintf(stderr, "Cannot load game from %s.\n", filename);
+        return;
+    }
+
+    struct batch batch = { 0 };
+    const struct step_change * ptr = me->history.step_changes;
+    const struct step_change * const end = ptr + me->history.qstep_changes;
+    for (; ptr != end && status == 0; ++ptr) {
+        const int what = ptr->what;
+        if (what == CHANGE_PASS || what == CHANGE_FREE_KICK) {
+            status = add_batch_step(&batch, ptr->data);
+        }
+    }
+
+    if (status == 0) {
+        status = split_batch_turns(&batch, me->geometry);
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "Cannot split game into turns, error code %d.\n", status);
+        free_batch(&batch);
+        return;
+    }
+
+    run_batch(me, &batch, qthreads, print_annotation);
+    free_batch(&batch);
+}
+
+void process_analyze(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    int qthreads;
+    int status = read_threads(me, &qthreads);
+    if (status != 0) {
+        return;
+    }
+
+    status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Filename expected in ANALYZE command.");
+        return;
+    }
+
+    const size_t filename_len = lp->current - lp->lexem_start;
+    char filename[filename_len + 1];
+    memcpy(filename, lp->lexem_start, filename_len);
+    filename[filename_len] = '\0';
+
+    FILE * file = fopen(filename, "r");
+    if (!file) {
+        error(lp, "Cannot open file %s.", filename);
+        return;
+    }
+
+    struct batch batch = { 0 };
+    char * line = NULL;
+    size_t len = 0;
+    int line_num = 0;
+
+    /* Each line is a position: steps from the start of the current game */
+    while (getline(&line, &len, file) != -1) {
+        ++line_num;
+        parser_set_line(lp, line);
+        parser_skip_spaces(lp);
+        if (parser_check_eol(lp) || *lp->current == '#') {
+            continue;
+        }
+
+        struct batch_job * restrict const job = add_batch_job(&batch);
+        if (job == NULL) {
+            status = ENOMEM;
+            break;
+        }
+        job->line_num = line_num;
+
+        while (!parser_check_eol(lp)) {
+            status = parser_read_id(lp);
+            const enum step step = status != 0 ? QSTEPS : find_step(lp->lexem_start, lp->current - lp->lexem_start);
+            if (step == QSTEPS) {
+                error(lp, "Invalid step direction in line %d.", line_num);
+                status = EINVAL;
+                break;
+            }
+
+            status = add_batch_step(&batch, step);
+            if (status != 0) {
+                break;
+            }
+            parser_skip_spaces(lp);
+        }
+
+        if (status != 0) {
+            break;
+        }
+    }
+
+    if (line) {
+        free(line);
+    }
+    fclose(file);
+
+    if (status != 0) {
+        free_batch(&batch);
+        return;
+    }
+
+    for (int i=0; i<batch.qjobs; ++i) {
+        struct batch_job * restrict const job = batch.jobs + i;
+        const size_t end = i + 1 < batch.qjobs ? batch.jobs[i+1].offset : batch.qsteps;
+        job->analysis.steps = batch.steps + job->offset;
+        job->analysis.qsteps = end - job->offset;
+    }
+
+    run_batch(me, &batch, qthreads, print_analysis);
+    free_batch(&batch);
+}
+
+static void position_save(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    if (!parser_check_eol(lp)) {
+        error(lp, "End of line expected (POSITION SAVE command is parsed), but someting was found.");
+        return;
+    }
+
+    const size_t sz = position_record_size(me->geometry);
+    uint8_t * restrict const buf = malloc(sz);
+    if (buf == NULL) {
+        fprintf(stderr, "Cannot allocate position record.\n");
+        return;
+    }
+
+    state_save_position(me->state, (struct position_record *)buf);
+
+    printf("position set ");
+    for (size_t i=0; i<sz; ++i) {
+        printf("%02x", buf[i]);
+    }
+    printf("\n");
+    free(buf);
+}
+
+static int hex_digit(const int ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static int read_hex(
+    struct line_parser * restrict const lp,
+    uint8_t * restrict const buf,
+    const size_t sz)
+{
+    for (size_t i=0; i<sz; ++i) {
+        const int hi = hex_digit(lp->current[0]);
+        const int lo = hi < 0 ? -1 : hex_digit(lp->current[1]);
+        if (lo < 0) {
+            return EINVAL;
+        }
+        buf[i] = hi << 4 | lo;
+        lp->current += 2;
+    }
+    return 0;
+}
+
+/* Parses and validates the whole record in a state of record geometry,
+ * current game is changed only after the record is accepted. */
+static int parse_position(
+    struct line_parser * restrict const lp,
+    const struct geometry * const geometry,
+    uint8_t * restrict const buf,
+    const size_t sz)
+{
+    const size_t header_sz = sizeof(struct position_record);
+    int status = read_hex(lp, buf + header_sz, sz - header_sz);
+    if (status != 0 || !parser_check_eol(lp)) {
+        error(lp, "Invalid position record lines.");
+        return EINVAL;
+    }
+
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        fprintf(stderr, "Cannot allocate position state.\n");
+        return ENOMEM;
+    }
+
+    status = state_set_position(state, (const struct position_record *)buf);
+    if (status != 0) {
+        error(lp, "Invalid position record, error code %d.", status);
+    }
+
+    destroy_state(state);
+    return status;
+}
+
+static void position_set(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    parser_skip_spaces(lp);
+    lp->lexem_start = lp->current;
+
+    struct position_record header;
+    int status = read_hex(lp, (uint8_t *)&header, sizeof(header));
+    if (status != 0) {
+        error(lp, "Position record expected in POSITION SET command.");
+        return;
+    }
+
+    /* Two hex digits per point, a short line cannot hold the lines of header geometry */
+    const size_t qpoints = (size_t)header.width * (size_t)header.height;
+    if (qpoints > strlen((const char *)lp->current) / 2) {
+        error(lp, "Invalid position record lines.");
+        return;
+    }
+
+    const int is_same_geometry = 1
+        && header.width == me->geometry->width
+        && header.height == me->geometry->height
+        && header.goal_width == me->geometry->goal_width
+        && header.free_kick_len == me->geometry->free_kick_len
+    ;
+
+    struct geometry * restrict const record_geometry = is_same_geometry ? NULL
+        : create_std_geometry(header.width, header.height, header.goal_width, header.free_kick_len);
+    if (!is_same_geometry && record_geometry == NULL) {
+        error(lp, "Invalid geometry in position record, error code %d.", errno);
+        return;
+    }
+
+    const struct geometry * const geometry = is_same_geometry ? me->geometry : record_geometry;
+    const size_t sz = position_record_size(geometry);
+    uint8_t * restrict const buf = malloc(sz);
+    if (buf == NULL) {
+        fprintf(stderr, "Cannot allocate position record.\n");
+        if (record_geometry) {
+            destroy_geometry(record_geometry);
+        }
+        return;
+    }
+
+    memcpy(buf, &header, sizeof(header));
+    status = parse_position(lp, geometry, buf, sz);
+    if (record_geometry) {
+        destroy_geometry(record_geometry);
+    }
+
+    if (status == 0 && !is_same_geometry) {
+        status = new_game(me, header.width, header.height, header.goal_width, header.free_kick_len);
+        if (status != 0) {
+            error(lp, "Cannot start a game for position record geometry, error code %d.", status);
+        }
+    }
+
+    struct state * restrict const root = status != 0 || me->root ? me->root : create_state(me->geometry);
+    if (status == 0 && root == NULL) {
+        fprintf(stderr, "Cannot allocate position state.\n");
+        status = ENOMEM;
+    }
+
+    if (status == 0) {
+        status = state_set_position(root, (const struct position_record *)buf);
+    }
+
+    free(buf);
+    if (status != 0) {
+        if (root != me->root) {
+            destroy_state(root);
+        }
+        return;
+    }
+
+    me->root = root;
+    state_copy(me->state, root);
+    me->history.qstep_changes = 0;
+
+    struct ai * restrict const ai = me->ai;
+    if (ai) {
+        status = ai->set_state ? ai->set_state(ai, root) : ENOTSUP;
+        if (status != 0) {
+            fprintf(stderr, "AI cannot set position (status %d), AI turned off.\n", status);
+            free_ai(me);
+        }
+    }
+}
+
+void process_position(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    const int keyword = read_keyword(me);
+
+    switch (keyword) {
+        case KW_SAVE:
+            return position_save(me);
+        case KW_SET:
+            return position_set(me);
+    }
+
+    error(lp, "Invalid action in POSITION command, SAVE or SET expected.");
+}
+
+static void selfplay_player(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    parser_skip_spaces(lp);
+
+    int num;
+    int status = parser_try_int(lp, &num);
+    if (status != 0 || num < 1 || num > 2) {
+        error(lp, "Player number (1 or 2) expected in SELFPLAY PLAYER command.");
+        return;
+    }
+
+    status = parser_read_last_path(lp);
+    const size_t name_len = lp->current - lp->lexem_start;
+    if (status != 0 || name_len >= SELFPLAY_NAME_SZ) {
+        error(lp, "Player name (up to %d characters) expected.", SELFPLAY_NAME_SZ - 1);
+        return;
+    }
+
+    const struct ai * const ai = get_ai(me);
+    if (ai == NULL) {
+        return;
+    }
+
+    struct ai storage;
+    memset(&storage, 0, sizeof(storage));
+
+    status = me->ai_desc->init_ai(&storage, me->geometry);
+    if (status != 0) {
+        fprintf(stderr, "Cannot set player: init failed with code %d.\n", status);
+        return;
+    }
+
+    copy_ai_params(&storage, ai);
+
+    struct selfplay_player * restrict const player = me->players + num - 1;
+    if (player->ai_desc) {
+        player->ai.free(&player->ai);
+    }
+
+    player->ai = storage;
+    player->ai_desc = me->ai_desc;
+    memcpy(player->name, lp->lexem_start, name_len);
+    player->name[name_len] = '\0';
+}
+
+struct selfplay_output
+{
+    const struct cmd_parser * parser;
+    const char * dirname; /* NULL if games are not written as text */
+    struct archive_writer * archive;
+    const struct state * start;
+    struct state * state;
+    int wins[2];
+    int qfailed;
+    int qunfinished;
+    int status;
+
+    struct sprt * sprt; /* NULL if games are not tested */
+    int pair_points;
+    enum sprt_decision decision;
+};
+
+static int make_dir(const char * const dirname)
+{
+    if (mkdir(dirname, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    return 0;
+}
+
+static void print_player(
+    FILE * const file,
+    const int num,
+    const struct selfplay_player * const player)
+{
+    fprintf(file, "PLAYER%d %s ai=%s", num, player->name, player->ai_desc->name);
+
+    const struct ai_param * ptr = player->ai.get_params(&player->ai);
+    for (; ptr->name != NULL; ++ptr) {
+        switch (ptr->type) {
+            case I32:
+                fprintf(file, " %s=%d", ptr->name, *(int32_t*)ptr->value);
+                break;
+            case U32:
+                fprintf(file, " %s=%u", ptr->name, *(uint32_t*)ptr->value);
+                break;
+            case F32:
+                fprintf(file, " %s=%g", ptr->name, *(float*)ptr->value);
+                break;
+            default:
+                break;
+        }
+    }
+
+    fprintf(file, "\n");
+}
+
+/* Next game number is the number of lines in games/stats.txt plus one */
+static int append_stats(
+    const char * const filename,
+    const struct selfplay_player * const player1,
+    const struct selfplay_player * const player2,
+    const char * const result,
+    const unsigned int qsteps,
+    const char * const ts,
+    const char * const fail)
+{
+    FILE * file = fopen(filename, "a+");
+    if (file == NULL) {
+        return -1;
+    }
+
+    flock(fileno(file), LOCK_EX);
+
+    int num = 1;
+    rewind(file);
+    for (int ch; (ch = getc(file)) != EOF; ) {
+        num += ch == '\n';
+    }
+
+    fprintf(file, "%6d\t%-15s\t%-15s\t%s\t%3u\t%s\t%s\n", num, player1->name, player2->name, result, qsteps, ts, fail);
+    fflush(file);
+
+    flock(fileno(file), LOCK_UN);
+    fclose(file);
+    return num;
+}
+
+/* Move lines are "player steps...", a move ends when the active player changes */
+static void write_moves(
+    FILE * const file,
+    struct state * restrict const state,
+    const uint8_t * const steps,
+    const unsigned int qsteps)
+{
+    int active = 0;
+    for (unsigned int i=0; i<qsteps; ++i) {
+        if (state->active != active) {
+            active = state->active;
+            fprintf(file, "%s%d", i > 0 ? "\n" : "", active);
+        }
+
+        const enum step step = steps[i];
+        fprintf(file, " %s", step_names[step]);
+        state_step(state, step);
+    }
+
+    fprintf(file, "%s", qsteps > 0 ? "\n" : "");
+}
+
+static void write_game(
+    struct selfplay_output * restrict const me,
+    const struct selfplay_game * const game)
+{
+    const struct selfplay_player * const players = me->parser->players;
+    const struct selfplay_player * const player1 = players + !!game->swap;
+    const struct selfplay_player * const player2 = players + !game->swap;
+
+    const char * const result = game->winner == 1 ? "1-0" : game->winner == 2 ? "0-1" : "???";
+    char fail[64] = "OK";
+    if (game->status != 0) {
+        snprintf(fail, sizeof(fail), "AI error %d", game->status);
+    } else if (game->failed) {
+        snprintf(fail, sizeof(fail), "Invalid step from player %d", game->failed);
+    } else if (game->winner == 0) {
+        snprintf(fail, sizeof(fail), "Infinite game");
+    }
+
+    const time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char ts[32];
+    char date[16];
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+
+    const size_t path_sz = strlen(me->dirname) + 64;
+    char path[path_sz];
+    snprintf(path, path_sz, "%s/games", me->dirname);
+    me->status = make_dir(me->dirname);
+    if (me->status == 0) {
+        me->status = make_dir(path);
+    }
+
+    if (me->status != 0) {
+        return;
+    }
+
+    snprintf(path, path_sz, "%s/games/stats.txt", me->dirname);
+    const int num = append_stats(path, player1, player2, result, game->qsteps, ts, fail);
+    if (num < 0) {
+        me->status = errno;
+        return;
+    }
+
+    snprintf(path, path_sz, "%s/games/%s", me->dirname, date);
+    me->status = make_dir(path);
+    if (me->status != 0) {
+        return;
+    }
+
+    snprintf(path, path_sz, "%s/games/%s/%06d.txt", me->dirname, date, num);
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        me->status = errno;
+        return;
+    }
+
+    const struct cmd_parser * const parser = me->parser;
+    fprintf(file, "DATE %s\n", ts);
+    print_player(file, 1, player1);
+    print_player(file, 2, player2);
+    fprintf(file, "RESULT %s\n", result);
+    fprintf(file, "GAME %d %d %d %u\n", parser->width, parser->height, parser->goal_width, parser->geometry->free_kick_len);
+
+    state_copy(me->state, me->start);
+    write_moves(file, me->state, game->steps, game->qsteps);
+    fclose(file);
+}
+
+static void append_archive(
+    struct selfplay_output * restrict const me,
+    const struct selfplay_game * const game)
+{
+    const struct cmd_parser * const parser = me->parser;
+    const struct selfplay_player * const players = parser->players;
+    const char * const names[2] = {
+        players[!!game->swap].name,
+        players[!game->swap].name,
+    };
+
+    const struct archive_game record = {
+        .qsteps = game->qsteps,
+        .width = parser->width,
+        .height = parser->height,
+        .goal_width = parser->goal_width,
+        .free_kick_len = parser->geometry->free_kick_len,
+        .seed = game->seed,
+        .time = time(NULL),
+        .result = game->winner,
+        .failed = game->failed,
+    };
+
+    me->status = archive_append(me->archive, &record, names, game->steps);
+}
+
+static void selfplay_game_done(const struct selfplay_game * const game, void * const arg)
+{
+    struct selfplay_output * restrict const me = arg;
+    if (me->status != 0 || me->decision != SPRT_CONTINUE) {
+        return;
+    }
+
+    /* Half-points of the first player */
+    int points = 1;
+    if (game->winner == 0) {
+        ++me->qunfinished;
+    } else {
+        /* Colours alternate, swap means the second player has the first colour */
+        const int player = (game->winner - 1) ^ !!game->swap;
+        ++me->wins[player];
+        points = player == 0 ? 2 : 0;
+    }
+
+    me->qfailed += game->failed != 0 || game->status != 0;
+    if (me->dirname) {
+        write_game(me, game);
+    }
+
+    if (me->archive && me->status == 0) {
+        append_archive(me, game);
+    }
+
+    struct sprt * restrict const sprt = me->sprt;
+    if (sprt == NULL) {
+        return;
+    }
+
+    /* A pair is the same opening played with both colours */
+    if (!game->swap) {
+        me->pair_points = points;
+        return;
+    }
+
+    ++sprt->penta[me->pair_points + points];
+
+    struct sprt_result result;
+    sprt_eval(sprt, &result);
+    me->decision = result.decision;
+}
+
+static void print_sprt(const struct sprt * const sprt)
+{
+    struct sprt_result result;
+    sprt_eval(sprt, &result);
+
+    const uint32_t * const penta = sprt->penta;
+    printf("pairs %u [%u %u %u %u %u] score %.1f%% elo %.1f +- %.1f llr %.2f (%.2f, %.2f)\n",
+        result.qpairs, penta[0], penta[1], penta[2], penta[3], penta[4],
+        100.0 * result.score, result.elo, result.elo_error,
+        result.llr, result.lower, result.upper);
+    fflush(stdout);
+}
+
+static void run_selfplay(
+    struct cmd_parser * restrict const me,
+    const int qgames,
+    const int qthreads,
+    const unsigned int qopening,
+    const char * const output_name,
+    const int is_archive,
+    struct sprt * restrict const sprt)
+{
+    const struct selfplay_player * const players = me->players;
+    if (players[0].ai_desc == NULL || players[1].ai_desc == NULL) {
+        fprintf(stderr, "Both players should be set with SELFPLAY PLAYER command.\n");
+        return;
+    }
+
+    const struct ai * const ais[2] = { &players[0].ai, &players[1].ai };
+    const ai_init inits[2] = { players[0].ai_desc->init_ai, players[1].ai_desc->init_ai };
+    struct selfplay * restrict const selfplay = create_selfplay(ais, inits, me->geometry, qthreads);
+    if (selfplay == NULL) {
+        fprintf(stderr, "Cannot create self-play workers, error code %d.\n", errno);
+        return;
+    }
+
+    const int batch_sz = qthreads * SELFPLAY_BATCH;
+    struct selfplay_game * restrict const games = malloc(batch_sz * sizeof(struct selfplay_game));
+    struct state * restrict const start = create_state(me->geometry);
+    struct state * restrict const state = create_state(me->geometry);
+    struct archive_writer * restrict const archive = is_archive ? open_archive_writer(output_name) : NULL;
+    if (games == NULL || start == NULL || state == NULL || (is_archive && archive == NULL)) {
+        fprintf(stderr, "Cannot allocate self-play games or open the archive, error code %d.\n", errno);
+        free(games);
+        if (start) {
+            destroy_state(start);
+        }
+        if (state) {
+            destroy_state(state);
+        }
+        if (archive) {
+            close_archive_writer(archive);
+        }
+        destroy_selfplay(selfplay);
+        return;
+    }
+
+    struct selfplay_output output = {
+        .parser = me,
+        .dirname = is_archive ? NULL : output_name,
+        .archive = archive,
+        .start = start,
+        .state = state,
+        .sprt = sprt,
+        .decision = SPRT_CONTINUE,
+    };
+
+    /* Both games of a pair have the same opening, srand makes openings reproducible */
+    const uint64_t seed = mix64(rand());
+
+    int status = 0;
+    for (int first = 0; first < qgames && status == 0 && output.status == 0; first += batch_sz) {
+        const int qbatch = qgames - first < batch_sz ? qgames - first : batch_sz;
+        for (int i=0; i<qbatch; ++i) {
+            games[i].swap = (first + i) & 1;
+            games[i].seed = mix64(seed + (first + i) / 2);
+            games[i].qopening = qopening;
+        }
+
+        status = selfplay_run(selfplay, games, qbatch, selfplay_game_done, &output);
+
+        if (sprt) {
+            print_sprt(sprt);
+            if (output.decision != SPRT_CONTINUE) {
+                break;
+            }
+        }
+    }
+
+    if (status == 0) {
+        status = output.status;
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "Self-play failed with code %d.\n", status);
+    }
+
+    const int qplayed = output.wins[0] + output.wins[1] + output.qunfinished;
+    printf("%s %d %s %d unfinished %d failed %d\n",
+        players[0].name, output.wins[0], players[1].name, output.wins[1], output.qunfinished, output.qfailed);
+
+    if (qplayed > 0) {
+        printf("score %.1f%%\n", 100.0 * (output.wins[0] + 0.5 * output.qunfinished) / qplayed);
+    }
+
+    if (sprt) {
+        static const char * const decisions[] = {
+            [SPRT_CONTINUE] = "inconclusive",
+            [SPRT_H0] = "H0 accepted",
+            [SPRT_H1] = "H1 accepted",
+        };
+        printf("sprt %s\n", decisions[output.decision]);
+    }
+
+    if (archive) {
+        close_archive_writer(archive);
+    }
+
+    destroy_state(state);
+    destroy_state(start);
+    free(games);
+    destroy_selfplay(selfplay);
+}
+
+/* Games are written to "dirname" as text, to "archive filename" or nowhere */
+static int read_games_output(
+    struct cmd_parser * restrict const me,
+    int * restrict const is_archive,
+    size_t * restrict const len)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    *is_archive = 0;
+    *len = 0;
+
+    if (parser_check_eol(lp)) {
+        return 0;
+    }
+
+    const unsigned char * const saved = lp->current;
+    if (read_keyword(me) == KW_ARCHIVE) {
+        *is_archive = 1;
+    } else {
+        lp->current = saved;
+    }
+
+    const int status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Directory or archive name expected.");
+        return EINVAL;
+    }
+
+    *len = lp->current - lp->lexem_start;
+    return 0;
+}
+
+void process_selfplay(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    const unsigned char * const saved = lp->current;
+
+    if (read_keyword(me) == KW_PLAYER) {
+        return selfplay_player(me);
+    }
+
+    lp->current = saved;
+
+    int qthreads;
+    int status = read_threads(me, &qthreads);
+    if (status != 0) {
+        return;
+    }
+
+    int qgames;
+    parser_skip_spaces(lp);
+    lp->lexem_start = lp->current;
+    status = parser_try_int(lp, &qgames);
+    if (status != 0 || qgames < 1) {
+        error(lp, "Positive number of games expected in SELFPLAY command.");
+        return;
+    }
+
+    int is_archive;
+    size_t output_len;
+    status = read_games_output(me, &is_archive, &output_len);
+    if (status != 0) {
+        return;
+    }
+
+    char output_name[output_len + 1];
+    memcpy(output_name, lp->lexem_start, output_len);
+    output_name[output_len] = '\0';
+
+    if (qthreads > qgames) {
+        qthreads = qgames;
+    }
+
+    run_selfplay(me, qgames, qthreads, 0, output_len > 0 ? output_name : NULL, is_archive, NULL);
+}
+
+static int read_probability(
+    struct line_parser * restrict const lp,
+    double * restrict const value)
+{
+    float tmp;
+    const int status = parser_read_float(lp, &tmp);
+    if (status != 0 || tmp <= 0.0 || tmp >= 0.5) {
+        error(lp, "Probability in (0, 0.5) expected.");
+        return EINVAL;
+    }
+
+    *value = tmp;
+    return 0;
+}
+
+void process_sprt(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    const long qcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int qthreads = qcpus > 0 ? qcpus : 1;
+    int qgames = SPRT_DEF_GAMES;
+    int qopening = SPRT_DEF_OPENING;
+    struct sprt sprt = {
+        .alpha = SPRT_DEF_ALPHA,
+        .beta = SPRT_DEF_BETA,
+    };
+
+    for (;;) {
+        const unsigned char * const saved = lp->current;
+        const int keyword = read_keyword(me);
+
+        int status = 0;
+        switch (keyword) {
+            case KW_THREADS:
+                parser_skip_spaces(lp);
+                status = parser_try_int(lp, &qthreads) != 0 || qthreads < 1;
+                break;
+            case KW_GAMES:
+                parser_skip_spaces(lp);
+                status = parser_try_int(lp, &qgames) != 0 || qgames < 2;
+                break;
+            case KW_OPENING:
+                parser_skip_spaces(lp);
+                status = parser_try_int(lp, &qopening) != 0 || qopening < 0;
+                break;
+            case KW_ALPHA:
+                if (read_probability(lp, &sprt.alpha) != 0) {
+                    return;
+                }
+                continue;
+            case KW_BETA:
+                if (read_probability(lp, &sprt.beta) != 0) {
+                    return;
+                }
+                continue;
+            default:
+                lp->current = saved;
+                break;
+        }
+
+        if (status != 0) {
+            error(lp, "Positive number expected after the option in SPRT command.");
+            return;
+        }
+
+        if (lp->current == saved) {
+            break;
+        }
+    }
+
+    float elo0;
+    float elo1;
+    parser_skip_spaces(lp);
+    lp->lexem_start = lp->current;
+    int status = parser_read_float(lp, &elo0);
+    if (status == 0) {
+        status = parser_read_float(lp, &elo1);
+    }
+
+    if (status != 0 || elo0 >= elo1) {
+        error(lp, "Elo bounds elo0 < elo1 expected in SPRT command.");
+        return;
+    }
+
+    sprt.elo0 = elo0;
+    sprt.elo1 = elo1;
+
+    int is_archive;
+    size_t output_len;
+    status = read_games_output(me, &is_archive, &output_len);
+    if (status != 0) {
+        return;
+    }
+
+    char output_name[output_len + 1];
+    memcpy(output_name, lp->lexem_start, output_len);
+    output_name[output_len] = '\0';
+
+    /* Pairs of games, both colours for every opening */
+    qgames &= ~1;
+    if (qthreads > qgames) {
+        qthreads = qgames;
+    }
+
+    run_selfplay(me, qgames, qthreads, qopening, output_len > 0 ? output_name : NULL, is_archive, &sprt);
+}
+
+static void archive_info(const struct archive * const archive)
+{
+    const size_t qgames = archive_qgames(archive);
+    size_t qsteps = 0;
+    size_t qbroken = 0;
+    size_t results[3] = { 0, 0, 0 };
+    for (size_t i=0; i<qgames; ++i) {
+        const struct archive_game * const game = archive_get(archive, i);
+        if (game == NULL) {
+            ++qbroken;
+            continue;
+        }
+        qsteps += game->qsteps;
+        ++results[game->result <= 2 ? game->result : 0];
+    }
+
+    printf("games %zu\n", qgames);
+    printf("steps %zu\n", qsteps);
+    printf("wins1 %zu\n", results[1]);
+    printf("wins2 %zu\n", results[2]);
+    printf("unfinished %zu\n", results[0]);
+    printf("broken %zu\n", qbroken);
+}
+
+static void archive_show(
+    struct cmd_parser * restrict const me,
+    const struct archive * const archive,
+    const int index)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    const struct archive_game * const game = archive_get(archive, index);
+    if (game == NULL) {
+        error(lp, "Game %d is not found or broken, archive has %zu games.", index, archive_qgames(archive));
+        return;
+    }
+
+    struct geometry * restrict const geometry = create_std_geometry(game->width, game->height, game->goal_width, game->free_kick_len);
+    if (geometry == NULL) {
+        error(lp, "Invalid geometry %u %u %u %u, error code %d.", game->width, game->height, game->goal_width, game->free_kick_len, errno);
+        return;
+    }
+
+    struct state * restrict const state = create_state(geometry);
+    uint8_t * restrict const steps = malloc(game->qsteps + 1);
+    if (state == NULL || steps == NULL) {
+        fprintf(stderr, "Cannot allocate state to replay game.\n");
+        free(steps);
+        if (state) {
+            destroy_state(state);
+        }
+        destroy_geometry(geometry);
+        return;
+    }
+
+    const time_t when = game->time;
+    struct tm tm;
+    localtime_r(&when, &tm);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    const char * const names = (const char *)game->data;
+    const char * const result = game->result == 1 ? "1-0" : game->result == 2 ? "0-1" : "???";
+    printf("DATE %s\n", ts);
+    printf("PLAYER1 %.*s\n", game->name_lens[0], names);
+    printf("PLAYER2 %.*s\n", game->name_lens[1], names + game->name_lens[0]);
+    printf("RESULT %s\n", result);
+    printf("SEED %016" PRIx64 "\n", game->seed);
+    printf("GAME %u %u %u %u\n", game->width, game->height, game->goal_width, game->free_kick_len);
+
+    archive_unpack_steps(game, steps);
+    write_moves(stdout, state, steps, game->qsteps);
+
+    free(steps);
+    destroy_state(state);
+    destroy_geometry(geometry);
+}
+
+void process_archive(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    const int keyword = read_keyword(me);
+    if (keyword != KW_INFO && keyword != KW_SHOW) {
+        error(lp, "Invalid action in ARCHIVE command, INFO or SHOW expected.");
+        return;
+    }
+
+    int index = 0;
+    if (keyword == KW_SHOW) {
+        parser_skip_spaces(lp);
+        lp->lexem_start = lp->current;
+        const int status = parser_try_int(lp, &index);
+        if (status != 0 || index < 0) {
+            error(lp, "Game index expected in ARCHIVE SHOW command.");
+            return;
+        }
+    }
+
+    const int status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Archive filename expected in ARCHIVE command.");
+        return;
+    }
+
+    const size_t filename_len = lp->current - lp->lexem_start;
+    char filename[filename_len + 1];
+    memcpy(filename, lp->lexem_start, filename_len);
+    filename[filename_len] = '\0';
+
+    struct archive * restrict const archive = open_archive(filename);
+    if (archive == NULL) {
+        error(lp, "Cannot open archive %s, error code %d.", filename, errno);
+        return;
+    }
+
+    if (keyword == KW_INFO) {
+        archive_info(archive);
+    } else {
+        archive_show(me, archive, index);
+    }
+
+    close_archive(archive);
+}
+
+void process_replay(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+
+    int qthreads;
+    int status = read_threads(me, &qthreads);
+    if (status != 0) {
+        return;
+    }
+
+    int is_archive;
+    size_t input_len;
+    status = read_games_output(me, &is_archive, &input_len);
+    if (status != 0) {
+        return;
+    }
+
+    if (input_len == 0) {
+        error(lp, "Directory or archive name expected in REPLAY command.");
+        return;
+    }
+
+    char input_name[input_len + 1];
+    memcpy(input_name, lp->lexem_start, input_len);
+    input_name[input_len] = '\0';
+
+    struct archive * archive = NULL;
+    if (is_archive) {
+        archive = open_archive(input_name);
+        if (archive == NULL) {
+            error(lp, "Cannot open archive %s, error code %d.", input_name, errno);
+            return;
+        }
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct replay_report report;
+    status = archive ? replay_archive(archive, qthreads, &report) : replay_dir(input_name, qthreads, &report);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    const double time = (finish.tv_sec - start.tv_sec) + 1e-9 * (finish.tv_nsec - start.tv_nsec);
+
+    if (archive) {
+        close_archive(archive);
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "replay failed with code %d.\n", status);
+        return;
+    }
+
+    /* Archive records are numbered from 0, stats.txt lines from 1 */
+    for (size_t i=0; i<report.qbad; ++i) {
+        const struct replay_bad * const bad = report.bad + i;
+        printf("bad %zu %s %u\n", bad->index, replay_verdict_names[bad->verdict], bad->step);
+    }
+
+    const double sps = time > 0.0 ? report.qsteps / time : 0.0;
+    printf("replay: %zu games, %" PRIu64 " steps, %zu bad in %.3fs, %.0f steps/sec, %.0f per thread\n",
+        report.qgames, report.qsteps, report.qbad, time, sps, sps / qthreads);
+
+    free(report.bad);
+}
+
+void process_trace(struct cmd_parser * restrict const me)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    if (read_keyword(me) != KW_DECODE) {
+        error(lp, "Invalid action in TRACE command, DECODE expected.");
+        return;
+    }
+
+    const int status = parser_read_last_path(lp);
+    if (status != 0) {
+        error(lp, "Trace filename expected in TRACE DECODE command.");
+        return;
+    }
+
+    const size_t filename_len = lp->current - lp->lexem_start;
+    char filename[filename_len + 1];
+    memcpy(filename, lp->lexem_start, filename_len);
+    filename[filename_len] = '\0';
+
+    const int decode_status = trace_decode(filename, stdout);
+    fflush(stdout);
+    if (decode_status != 0) {
+        error(lp, "Cannot decode trace %s, error code %d.", filename, decode_status);
+    }
+}
+
+void process_debug(struct cmd_parser * restrict const me)
+{
+    /* Put debug code here, user debug_trap for breaks */
+}
+
+int process_cmd(struct cmd_parser * restrict const me, const char * const line)
+{
+    struct line_parser * restrict const lp = &me->line_parser;
+    parser_set_line(lp, line);
+
+    if (parser_check_eol(lp)) {
+        return 0;
+    }
+
+    const int keyword = read_keyword(me);
+    if (keyword == -1) {
+        error(lp, "Invalid lexem at the begginning of the line.");
+        return 0;
+    }
+
+    if (keyword == 0) {
+        error(lp, "Invalid keyword at the begginning of the line.");
+        return 0;
+    }
+
+    if (keyword == KW_QUIT) {
+        return process_quit(me);
+    }
+
+    switch (keyword) {
+        case KW_PING:
+            printf("pong%s", lp->current);
+            fflush(stdout);
+            fflush(stderr);
+            break;
+        case KW_STATUS:
+            process_status(me);
+            break;
+        case KW_NEW:
+            process_new(me);
+            break;
+        case KW_STEP:
+            process_step(me);
+            break;
+        case KW_HISTORY:
+            process_history(me);
+            break;
+        case KW_SET:
+            process_set(me);
+            break;
+        case KW_AI:
+            process_ai(me);
+            break;
+        case KW_SRAND:
+            process_srand(me);
+            break;
+        case KW_LOAD:
+            process_load(me);
+            break;
+        case KW_DEBUG:
+            process_debug(me);
+            break;
+        case KW_PERFT:
+            process_perft(me);
+            break;
+        case KW_ANALYZE:
+            process_analyze(me);
+            break;
+        case KW_ANNOTATE:
+            process_annotate(me);
+            break;
+        case KW_POSITION:
+            process_position(me);
+            break;
+        case KW_SELFPLAY:
+            process_selfplay(me);
+            break;
+        case KW_SPRT:
+            process_sprt(me);
+            break;
+        case KW_ARCHIVE:
+            process_archive(me);
+            break;
+        case KW_REPLAY:
+            process_replay(me);
+            break;
+        case KW_TRACE:
+            process_trace(me);
+            break;
+        default:
+            error(lp, "Unexpected keyword at the begginning of the line.");
+            break;
+    }
+
+    return 0;
+}
+
+static int run_session(void * arg);
+
+static void run_commands(struct cmd_parser * restrict const me)
+{
+    char * line = 0;
+    size_t len = 0;
+    for (;; ) {
+        const ssize_t has_read = getline(&line, &len, stdin);
+        if (has_read == -1) {
+            break;
+        }
+
+        if (line[0] == '@') {
+            const int status = mux_command(line, run_session, NULL);
+            if (status != 0) {
+                fprintf(stderr, "Session command failed with code %d: %s", status, line);
+            }
+            continue;
+        }
+
+        const int is_quit = process_cmd(me, line);
+        if (is_quit) {
+            break;
+        }
+    }
+
+    mux_finish();
+
+    if (line) {
+        free(line);
+    }
+}
+
+/*
+ * Every session has its own parser: AI worker threads of the parent do not exist
+ * in the forked process, so the parent parser is neither used nor freed here.
+ */
+static int run_session(void * arg)
+{
+    (void)arg;
+
+    struct cmd_parser cmd_parser;
+    const int status = init_cmd_parser(&cmd_parser);
+    if (status != 0) {
+        fprintf(stderr, "Fatal: cannot init session parser, error code is %d.\n", status);
+        return status;
+    }
+
+    run_commands(&cmd_parser);
+    free_cmd_parser(&cmd_parser);
+    return 0;
+}
+
+static int read_server_params(
+    const int argc,
+    char * const argv[],
+    struct server_params * restrict const params)
+{
+    const long qcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    params->path = NULL;
+    params->max_sessions = DEF_SERVER_SESSIONS;
+    params->qslots = qcpus > 0 ? qcpus : 1;
+    params->cache_budget = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char * const value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            fprintf(stderr, "Value expected after %s.\n", argv[i]);
+            return EINVAL;
+        }
+
+        char * end;
+        const long num = strtol(value, &end, 10);
+        const int is_num = *value != '\0' && *end == '\0' && num >= 0;
+
+        if (strcmp(argv[i], "--server") == 0) {
+            params->path = value;
+        } else if (strcmp(argv[i], "--sessions") == 0 && is_num && num > 0) {
+            params->max_sessions = num;
+        } else if (strcmp(argv[i], "--searches") == 0 && is_num && num <= MAX_SERVER_SLOTS) {
+            params->qslots = num;
+        } else if (strcmp(argv[i], "--cache-budget") == 0 && is_num) {
+            params->cache_budget = (uint64_t)num << 20;
+        } else {
+            fprintf(stderr, "Invalid option %s %s.\n", argv[i], value);
+            return EINVAL;
+        }
+
+        ++i;
+    }
+
+    if (params->path == NULL) {
+        fprintf(stderr, "Usage: %s [--server path [--sessions n] [--searches n] [--cache-budget MB]]\n", argv[0]);
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    struct server_params params;
+    if (argc > 1) {
+        const int status = read_server_params(argc, argv, &params);
+        if (status != 0) {
+            return status;
+        }
+    }
+
+    if (argc > 1) {
+        const int status = run_server(&params, run_session, NULL);
+        if (status != 0) {
+            fprintf(stderr, "Fatal: server failed, error code is %d.\n", status);
+        }
+        return status;
+    }
+
+    struct cmd_parser cmd_parser;
+    const int status = init_cmd_parser(&cmd_parser);
+    if (status != 0) {
+        fprintf(stderr, "Fatal: cannot init command line parser, error code is %d.\n", status);
+        return status;
+    }
+
+    run_commands(&cmd_parser);
+    free_cmd_parser(&cmd_parser);
     return 0;
 }
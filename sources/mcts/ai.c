@@ -11,13 +11,14 @@ struct bsf_serie;
 struct ball_move;
 
 LOG_FUNC void mcts_log_node(
-    const char * name,
+    const enum trace_title title,
+    const int indent,
     const struct mcts_ai * const me,
     const struct node * const node)
 LOG_BODY
 
 LOG_FUNC void mcts_log_exnode(
-    const char * name,
+    const int title,
     const struct mcts_ai * const me,
     const struct exnode * const exnode)
 LOG_BODY
@@ -32,26 +33,28 @@ LOG_FUNC void mcts_log_snapshot(
 LOG_BODY
 
 LOG_FUNC void mcts_log_state(
-    const char * name,
+    const enum trace_title title,
     const struct state * const state)
 LOG_BODY
 
 #define EXNODE_CHILDREN (QSTEPS + 4)
+#define MAX_EXNODE_ANSWERS (QSTEPS * EXNODE_CHILDREN)
 #define ERROR_BUF_SZ   256
 
-#define QPARAMS   4
+#define QPARAMS   5
 
 static const uint32_t    def_qthink =          1024 * 1024;
 static const uint32_t     def_cache = CACHE_AUTO_CALCULATE;
 static const uint32_t def_max_depth =                  128;
 static const  float           def_C =                  1.4;
+static const uint32_t def_bsf_threads =                  1;
 
 struct mcts_ai
 {
     struct state * state;
     struct state * backup;
     struct bsf_free_kicks * bsf;
-    struct kick * cycle_guard_kicks;
+    struct bsf_parallel * bsf_pool;
     char * error_buf;
     struct ai_param params[QPARAMS+1];
     struct choice_stat stats[MAX_QANSWERS];
@@ -62,8 +65,11 @@ struct mcts_ai
     uint32_t qthink;
     uint32_t max_depth;
     float    C;
+    uint32_t bsf_threads;
+    uint64_t seed;
 
     struct node * nodes;
+    uint32_t nodes_sz;
     uint32_t total_nodes;
     uint32_t used_nodes;
     uint32_t good_node_alloc;
@@ -74,6 +80,10 @@ struct mcts_ai
     struct hist_item * hist_last;
     uint32_t max_hist_len;
 
+    struct search_explanation search;
+    enum search_phase phase;  /* QPHASES out of search */
+    uint64_t phase_start;
+
     struct warns * warns;
 };
 
@@ -116,6 +126,17 @@ struct exnode
     int32_t children[EXNODE_CHILDREN];
 };
 
+/*
+ * Continuous exnodes of a wide node are one flat array of children, it may be
+ * longer than one struct exnode, so it is not indexed through the struct.
+ */
+static inline int32_t * wide_children(
+    const struct mcts_ai * const me,
+    const int32_t index)
+{
+    return (int32_t *) (void *) (me->nodes + index);
+}
+
 static enum step ai_go(
     struct mcts_ai * restrict const me,
     struct ai_explanation * restrict const explanation);
@@ -126,6 +147,7 @@ static struct ai_param def_params[QPARAMS+1] = {
     {     "cache",     &def_cache, U32, OFFSET(cache) },
     { "max_depth", &def_max_depth, U32, OFFSET(max_depth) },
     {         "C",         &def_C, F32, OFFSET(C) },
+    { "bsf_threads", &def_bsf_threads, U32, OFFSET(bsf_threads) },
     { NULL, NULL, NO_TYPE, 0 }
 };
 
@@ -142,9 +164,11 @@ static void free_cache(struct mcts_ai * restrict const me)
 {
     if (me->nodes) {
         free(me->nodes);
+        cache_budget_return(me->nodes_sz);
         me->nodes = NULL;
     }
 
+    me->nodes_sz = 0;
     me->total_nodes = 0;
     reset_cache(me);
 }
@@ -157,12 +181,20 @@ static int init_cache(struct mcts_ai * restrict const me, unsigned int cache_sz)
         return 0;
     }
 
+    if (cache_budget_take(cache_sz) != 0) {
+        snprintf(me->error_buf, ERROR_BUF_SZ, "Cache budget exceeded, %u bytes requested.", cache_sz);
+        return ENOMEM;
+    }
+
     me->nodes = malloc(cache_sz);
     if (me->nodes == NULL) {
+        cache_budget_return(cache_sz);
         snprintf(me->error_buf, ERROR_BUF_SZ, "Bad alloc %u bytes (nodes).", me->cache);
         return ENOMEM;
     }
 
+    me->nodes_sz = cache_sz;
+
     me->total_nodes = cache_sz / sizeof(struct node);
     reset_cache(me);
     return 0;
@@ -196,8 +228,7 @@ static int set_cache(
         return EINVAL;
     }
 
-    init_cache(me, cache_sz);
-    return 0;
+    return init_cache(me, cache_sz);
 }
 
 static void set_qthink(
@@ -209,6 +240,30 @@ static void set_qthink(
     }
 }
 
+static int set_bsf_threads(
+    struct mcts_ai * restrict const me,
+    const uint32_t * value)
+{
+    const uint32_t qthreads = *value;
+    if (qthreads == 0 || qthreads > QSTEPS) {
+        snprintf(me->error_buf, ERROR_BUF_SZ, "Wrong value for bsf_threads, should be in range 1..%d.", QSTEPS);
+        return EINVAL;
+    }
+
+    struct bsf_parallel * pool = NULL;
+    if (qthreads > 1) {
+        pool = create_bsf_parallel(me->state->geometry, qthreads, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+        if (pool == NULL) {
+            snprintf(me->error_buf, ERROR_BUF_SZ, "Cannot start %u BSF threads, errno is %d.", qthreads, errno);
+            return errno;
+        }
+    }
+
+    destroy_bsf_parallel(me->bsf_pool);
+    me->bsf_pool = pool;
+    return 0;
+}
+
 static int set_param(
     struct mcts_ai * restrict const me,
     const struct ai_param * const param,
@@ -227,6 +282,9 @@ static int set_param(
         case OFFSET(cache):
             status = set_cache(me, value);
             break;
+        case OFFSET(bsf_threads):
+            status = set_bsf_threads(me, value);
+            break;
     }
 
     if (status == 0) {
@@ -255,34 +313,33 @@ static void free_ai(struct mcts_ai * restrict const me)
     }
     free_state(me->state);
     free_state(me->backup);
+    destroy_bsf_parallel(me->bsf_pool);
     destroy_bsf_free_kicks(me->bsf);
     free(me);
 }
 
 struct mcts_ai * create_mcts_ai(const struct geometry * const geometry)
 {
-    struct bsf_free_kicks * bsf = create_bsf_free_kicks(geometry, 1 << QANSWERS_BITS, MAX_FREE_KICK_SERIE, 8, 8);
+    struct bsf_free_kicks * bsf = create_bsf_free_kicks(geometry, BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
     if (bsf == NULL) {
         return NULL;
     }
 
     const uint32_t qpoints = geometry->qpoints;
-    const uint32_t free_kick_len = geometry->free_kick_len;
-    const uint32_t free_kick_reduce = (free_kick_len - 1) * (free_kick_len - 1);
-    const size_t cycle_guard_capacity = 4 + qpoints / free_kick_reduce;
-    const size_t sizes[8] = {
+    const size_t journal_sz = state_journal_capacity(geometry) * sizeof(struct step_change);
+    const size_t sizes[9] = {
         sizeof(struct mcts_ai),
         sizeof(struct state),
         qpoints,
         sizeof(struct state),
         qpoints,
-        cycle_guard_capacity * sizeof(struct kick),
         MAX_QANSWERS * MAX_FREE_KICK_SERIE * sizeof(enum step),
-        ERROR_BUF_SZ
+        ERROR_BUF_SZ,
+        journal_sz, journal_sz
     };
 
-    void * ptrs[8];
-    void * data = multialloc(8, sizes, ptrs, 64);
+    void * ptrs[9];
+    void * data = multialloc(9, sizes, ptrs, 64);
 
     if (data == NULL) {
         destroy_bsf_free_kicks(bsf);
@@ -294,33 +351,37 @@ struct mcts_ai * create_mcts_ai(const struct geometry * const geometry)
     uint8_t * restrict const lines = ptrs[2];
     struct state * restrict const backup = ptrs[3];
     uint8_t * restrict const backup_lines = ptrs[4];
-    struct kick * restrict cycle_guard_kicks = ptrs[5];
-    enum step * const explanation_steps = ptrs[6];
-    char * const error_buf = ptrs[7];
+    enum step * const explanation_steps = ptrs[5];
+    char * const error_buf = ptrs[6];
 
     me->state = state;
     me->backup = backup;
     me->bsf = bsf;
+    me->bsf_pool = NULL;
     me->explanation_steps = explanation_steps;
-    me->cycle_guard_kicks = cycle_guard_kicks;
     me->error_buf = error_buf;
 
     me->nodes = NULL;
+    me->nodes_sz = 0;
     reset_cache(me);
 
     me->hist = NULL;
     me->hist_last = NULL;
     me->hist_ptr = NULL;
     me->max_hist_len = 0;
+    memset(&me->search, 0, sizeof(me->search));
+    me->phase = QPHASES;
+    me->seed = mix64(rand()) | 1;
     preparation_reset(&me->prep);
 
+    init_state_with_journal(state, geometry, lines, ptrs[7]);
+    init_state_with_journal(backup, geometry, backup_lines, ptrs[8]);
+
     memcpy(me->params, def_params, sizeof(me->params));
     for (int i=0; i<QPARAMS; ++i) {
         init_param(me, i);
     }
 
-    init_state(state, geometry, lines);
-    init_state(backup, geometry, backup_lines);
     return me;
 }
 
@@ -554,6 +615,25 @@ const struct state * mcts_ai_get_state(const struct ai * const ai)
     return me->state;
 }
 
+int mcts_ai_set_state(
+    struct ai * restrict const ai,
+    const struct state * const state)
+{
+    ai->error = NULL;
+    struct mcts_ai * restrict const me = ai->data;
+
+    const int status = state_copy(me->state, state);
+    if (status != 0) {
+        snprintf(me->error_buf, ERROR_BUF_SZ, "State geometry mismatch.");
+        ai->error = me->error_buf;
+        return status;
+    }
+
+    ai->history.qstep_changes = 0;
+    preparation_reset(&me->prep);
+    return 0;
+}
+
 int init_mcts_ai(
     struct ai * restrict const ai,
     const struct geometry * const geometry)
@@ -586,6 +666,7 @@ int init_mcts_ai(
     ai->get_params = mcts_ai_get_params;
     ai->set_param = mcts_ai_set_param;
     ai->get_state = mcts_ai_get_state;
+    ai->set_state = mcts_ai_set_state;
     ai->get_warn = ai_get_warn;
     ai->free = free_mcts_ai;
 
@@ -602,12 +683,12 @@ static struct node * alloc_node(
     enum step step)
 {
     if (me->used_nodes >= me->total_nodes) {
-        log_line("Func %s - overflow", __func__);
+        trace_add(TRACE_ALLOC_OVERFLOW, 0, 0, 0, 0, 0);
         ++me->bad_node_alloc;
         return NULL;
     }
 
-    log_line("Func %s - new %s-node %d", __func__, node_types[type], me->used_nodes);
+    trace_add(TRACE_ALLOC_NODE, me->used_nodes, node_types[type][0], 0, 0, 0);
     struct node * restrict const result = me->nodes + me->used_nodes;
     ++me->good_node_alloc;
     ++me->used_nodes;
@@ -620,7 +701,20 @@ static struct node * alloc_node(
     return result;
 }
 
-static inline enum step random_step(steps_t steps)
+/* xorshift64*, rollouts do not share the rand() lock between threads */
+static inline uint32_t rollout_rand(uint64_t * restrict const seed)
+{
+    uint64_t x = *seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *seed = x;
+    return (x * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static inline enum step random_step(
+    steps_t steps,
+    uint64_t * restrict const seed)
 {
     enum step alternatives[QSTEPS];
     int qalternatives = 0;
@@ -630,14 +724,45 @@ static inline enum step random_step(steps_t steps)
             alternatives[qalternatives++] = step;
         }
     }
-    const int choice = rand() % qalternatives;
+    const int choice = rollout_rand(seed) % qalternatives;
     return alternatives[choice];
 }
 
+static inline uint64_t search_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if CYCLE_COUNTERS
+
+/* Time since the previous switch goes to the previous phase */
+static void switch_phase(
+    struct mcts_ai * restrict const me,
+    const enum search_phase phase)
+{
+    const uint64_t now = search_clock();
+    if (me->phase != QPHASES) {
+        me->search.phase_ns[me->phase] += now - me->phase_start;
+    }
+    me->phase = phase;
+    me->phase_start = now;
+}
+
+#else
+
+static inline void switch_phase(
+    struct mcts_ai * restrict const me,
+    const enum search_phase phase) {}
+
+#endif
+
 static int rollout(
     struct state * restrict const state,
     uint32_t max_steps,
-    uint32_t * qthink)
+    uint32_t * qthink,
+    uint64_t * restrict const seed)
 {
     for (;;) {
         const int status = state_status(state);
@@ -660,7 +785,7 @@ static int rollout(
         }
 
         const int multiple_ways = answers & (answers - 1);
-        const enum step step = multiple_ways ? random_step(answers) : first_step(answers);
+        const enum step step = multiple_ways ? random_step(answers, seed) : first_step(answers);
 
         state_step(state, step);
         ++*qthink;
@@ -671,6 +796,9 @@ static void update_history(
     struct mcts_ai * restrict const me,
     const int32_t score)
 {
+    switch_phase(me, PHASE_BACKPROP);
+    const uint64_t cycles_start = cycles_begin();
+
     const struct hist_item * ptr = me->hist;
     const struct hist_item * const end = me->hist_ptr;
     for (; ptr != end; ++ptr) {
@@ -683,6 +811,14 @@ static void update_history(
     if (hist_len > me->max_hist_len) {
         me->max_hist_len = hist_len;
     }
+
+    struct search_explanation * restrict const search = &me->search;
+    ++search->depths[hist_len < MAX_STATS_DEPTH ? hist_len : MAX_STATS_DEPTH - 1];
+    if (hist_len > search->max_hist_len) {
+        search->max_hist_len = hist_len;
+    }
+
+    cycles_end(&search->cycles, CYCLES_UPDATE_HISTORY, cycles_start);
 }
 
 static void add_history(
@@ -742,6 +878,13 @@ static inline struct node * get_answer(
         return NULL;
     }
 
+    if (qanswers > MAX_EXNODE_ANSWERS) {
+        /* Wide node: children[0] is the first of continuous exnodes */
+        const int32_t * const children = wide_children(me, node->children[0]);
+        const int inode = children[answer];
+        return me->nodes + inode;
+    }
+
     const int extra = extra_nodes(qanswers);
     const int q0 = QSTEPS - extra;
 
@@ -763,23 +906,23 @@ int select_answer(
     const struct node * const node,
     int qanswers)
 {
-    log_line("Func %s - enter", __func__);
-    mcts_log_node("  node", me, node);
+    trace_add(TRACE_SELECT_ENTER, 0, 0, 0, 0, 0);
+    mcts_log_node(TRACE_TITLE_NODE, 2, me, node);
 
     /* Only one answer - return it */
     if (qanswers == 1) {
-        log_line("  only one answer, return 0");
+        trace_add(TRACE_SELECT_ONE, 0, 0, 0, 0, 0);
         return 0;
     }
 
     int qbest = 0;
-    int best_answers[QSTEPS * EXNODE_CHILDREN];
+    int best_answers[qanswers];
     float best_weight = -1.0e+10f;
 
     const int qgames = node->qgames;
     if (qgames <= 0) {
         int result = rand() % qanswers;
-        log_line("  clean paren node (free kick) return random %d", result);
+        trace_add(TRACE_SELECT_RANDOM, 0, result, 0, 0, 0);
         return result;
     }
 
@@ -789,7 +932,7 @@ int select_answer(
     for (int answer = 0; answer < qanswers; ++answer) {
         const struct node * const child = get_answer(me, node, answer);
         if (child == NULL) {
-            log_line("  child %d: NULL", answer);
+            trace_add(TRACE_SELECT_CHILD_NULL, 0, answer, 0, 0, 0);
             continue;
         }
 
@@ -799,7 +942,7 @@ int select_answer(
 
         if (qgames == 0) {
             /* Unexplored node - prioritize it */
-            log_line("  child %d (node %d): unexplored, return %d", answer, ichild, answer);
+            trace_add(TRACE_SELECT_UNEXPLORED, ichild, answer, answer, 0, 0);
             return answer;
         }
 
@@ -807,7 +950,7 @@ int select_answer(
         const float investigation = sqrt(log_total / qgames);
         const float weight = ev + me->C * investigation;
 
-        log_line("  child %d (node %d): ev=%.4f qgames=%.0f weight=%.4f", answer, ichild, ev, qgames, weight);
+        trace_add(TRACE_SELECT_CHILD, ichild, answer, TRACE_FIXED * ev, TRACE_FIXED * qgames, TRACE_FIXED * weight);
 
         if (weight >= best_weight) {
             if (weight != best_weight) {
@@ -820,13 +963,13 @@ int select_answer(
 
     if (qbest == 0) {
         /* No valid answers found - return first */
-        log_line("  no valid answers, return 0");
+        trace_add(TRACE_SELECT_NONE, 0, 0, 0, 0, 0);
         return 0;
     }
 
     const int index = qbest == 1 ? 0 : rand() % qbest;
     const int result = best_answers[index];
-    log_line("  return %d from qbest=%d", result, qbest);
+    trace_add(TRACE_SELECT_RESULT, 0, result, qbest, 0, 0);
     return result;
 }
 
@@ -835,25 +978,18 @@ static int pack_serie(
     const struct bsf_serie * serie)
 {
     const int qsteps = serie->qsteps;
-    const enum step * const steps = serie->steps;
-
     if (qsteps > MAX_FREE_KICK_SERIE) {
         /* WARN */
         return 1;
     }
 
-    /* Pack steps in reverse order: first step ends up in lowest bits */
-    uint64_t packed = 0;
-    for (int i = qsteps - 1; i >= 0; --i) {
-        packed = (packed << 3) | steps[i];
-    }
-
-    /* Split into 3 parts:
+    /* Serie is packed with first step in lowest bits, split into 3 parts:
      * bits [0..2]     = first step → opts.step (3 bits)
      * bits [3..18]    = middle 16 bits → mpack (16 bits)
      * bits [19..50]   = high 32 bits → children[QSTEPS-1] (32 bits)
      * Total: 51 bits = 17 steps max
      */
+    const uint64_t packed = serie->packed;
     node->opts.step = packed & 7;
     node->mpack = (packed >> 3) & 0xFFFF;
     node->children[QSTEPS-1] = packed >> (3 + 16);
@@ -880,7 +1016,8 @@ static void unpack_serie(
     }
 }
 
-static void apply_answer(
+/* Returns count of steps */
+static int apply_answer(
     const struct mcts_ai * const me,
     struct state * restrict const state,
     const struct node * const node)
@@ -888,14 +1025,14 @@ static void apply_answer(
     /* For regular steps */
     if (node->opts.type == NODE_S) {
         enum step step = node->opts.step;
-        log_line("Step %s", step_names[step]);
+        trace_add(TRACE_STEP, 0, step, 0, 0, 0);
         state_step(state, step);
-        return;
+        return 1;
     }
 
     /* For ball_move - nothing to apply */
     if (node->opts.type == NODE_B) {
-        return;
+        return 0;
     }
 
     /* For path - unpack and apply serie */
@@ -906,24 +1043,63 @@ static void apply_answer(
 
         for (int i = 0; i < qsteps; ++i) {
             enum step step = steps[i];
-            log_line("Step %s", step_names[step]);
+            trace_add(TRACE_STEP, 0, step, 0, 0, 0);
             state_step(state, step);
         }
+        return qsteps;
     }
+
+    return 0;
 }
 
-static int alloc_answers(
+static int alloc_wide_answers(
     struct mcts_ai * const me,
     struct node * restrict const node,
     int qanswers,
     enum node_type type)
 {
-    const int max_answers = QSTEPS * EXNODE_CHILDREN;
-    if (qanswers > max_answers) {
+    if (qanswers > MAX_QANSWERS) {
         /* WARN */
         return 1;
     }
 
+    /* Nodes are allocated sequentially, so exnodes are continuous */
+    const int qexnodes = (qanswers + EXNODE_CHILDREN - 1) / EXNODE_CHILDREN;
+    struct node * restrict const first = alloc_node(me, 0, 0);
+    if (first == NULL) {
+        return 1;
+    }
+
+    for (int i=1; i<qexnodes; ++i) {
+        if (alloc_node(me, 0, 0) == NULL) {
+            return 1;
+        }
+    }
+
+    int32_t * restrict const children = wide_children(me, first - me->nodes);
+    for (int i=0; i<qanswers; ++i) {
+        struct node * child = alloc_node(me, type, INVALID_STEP);
+        if (child == NULL) {
+            return 1;
+        }
+        children[i] = child - me->nodes;
+    }
+
+    node->children[0] = first - me->nodes;
+    node->opts.qanswers = qanswers;
+    return 0;
+}
+
+static int alloc_answer_nodes(
+    struct mcts_ai * const me,
+    struct node * restrict const node,
+    int qanswers,
+    enum node_type type)
+{
+    if (qanswers > MAX_EXNODE_ANSWERS) {
+        return alloc_wide_answers(me, node, qanswers, type);
+    }
+
     int extra = extra_nodes(qanswers);
     if (extra < 0 || extra > EXNODE_CHILDREN) {
         /* WARN */
@@ -986,14 +1162,25 @@ static int alloc_answers(
     }
 
     for (int i=0; i<extra; ++i) {
-        char buf[2] = { '0' + extra, '\0' };
-        mcts_log_exnode(buf, me, exnodes[i]);
+        mcts_log_exnode('0' + extra, me, exnodes[i]);
     }
 
     node->opts.qanswers = qanswers;
     return 0;
 }
 
+static int alloc_answers(
+    struct mcts_ai * const me,
+    struct node * restrict const node,
+    int qanswers,
+    enum node_type type)
+{
+    const uint64_t cycles_start = cycles_begin();
+    const int status = alloc_answer_nodes(me, node, qanswers, type);
+    cycles_end(&me->search.cycles, CYCLES_ALLOC_ANSWERS, cycles_start);
+    return status;
+}
+
 struct ball_move
 {
     int ball;
@@ -1062,18 +1249,18 @@ static int bsf_ball_move(
     const int count = bm->count;
     const struct bsf_serie * const * const sorted = bm->series;
 
-    log_line("Func %s - node=%d index=%d ball=%d count=%d", __func__, node - me->nodes, index, ball, count);
-    mcts_log_node("node", me, node);
+    trace_add(TRACE_BALL_MOVE, node - me->nodes, index, ball, count, 0);
+    mcts_log_node(TRACE_TITLE_NODE, 0, me, node);
 
     if (count < 0 || count >= MAX_QANSWERS) {
         /* WARN */
-        log_line("  count out of range");
+        trace_add(TRACE_BALL_MOVE_COUNT_OOR, 0, 0, 0, 0, 0);
         return EFAULT;
     }
 
     int status = alloc_answers(me, node, count, NODE_P);
     if (status != 0) {
-        log_line("  alloc_answers failed");
+        trace_add(TRACE_BALL_MOVE_ALLOC_FAILED, 0, 0, 0, 0, 0);
         return ENOMEM;
     }
 
@@ -1081,14 +1268,14 @@ static int bsf_ball_move(
         struct node * restrict const pnode = get_answer(me, node, i);
         if (pnode == NULL) {
             /* WARN */
-            log_line("  pnode %d is NULL", i);
+            trace_add(TRACE_BALL_MOVE_PNODE_NULL, 0, i, 0, 0, 0);
             return EFAULT;
         }
 
         pack_serie(pnode, sorted[i]);
 
-        log_line("");
-        mcts_log_node("pnode", me, pnode);
+        trace_add(TRACE_EOL, 0, 0, 0, 0, 0);
+        mcts_log_node(TRACE_TITLE_PNODE, 0, me, pnode);
     }
 
     node->opts.qanswers = count;
@@ -1107,16 +1294,11 @@ static int compare_series(
     return (*a)->ball - (*b)->ball;
 }
 
-static int calc_answers(
+static int expand_answers(
     struct mcts_ai * restrict const me,
     struct node * restrict const node,
     struct state * restrict const state)
 {
-    const int qanswers = node->opts.qanswers;
-    if (qanswers != BAD_QANSWERS) {
-        return qanswers;
-    }
-
     const int is_free_kick = is_free_kick_situation(state);
     if (!is_free_kick) {
         steps_t steps = state_get_steps(state);
@@ -1126,17 +1308,21 @@ static int calc_answers(
         return qanswers;
     }
 
-    struct cycle_guard cycle_guard_storage;
-    struct cycle_guard * restrict const guard = &cycle_guard_storage;
-    guard->kicks = me->cycle_guard_kicks;
-    cycle_guard_reset(guard);
-
+    const uint64_t cycles_start = cycles_begin();
     struct bsf_free_kicks * bsf = me->bsf;
-    bsf_gen(me->warns, bsf, state, guard);
+    if (me->bsf_pool != NULL) {
+        bsf = bsf_gen_parallel(me->warns, me->bsf_pool, state);
+    } else {
+        bsf_gen(me->warns, bsf, state);
+    }
+
+    cycles_end(&me->search.cycles, CYCLES_BSF_GEN, cycles_start);
+    ++me->search.qbsf_gen;
+    me->search.qseries += bsf->qseries;
 
     const struct bsf_serie * const win = bsf->win;
     if (win != NULL) {
-        log_line("Func %s - found win", __func__);
+        trace_add(TRACE_EXPAND_WIN, 0, 0, 0, 0, 0);
         struct node * restrict const win_node = alloc_node(me, NODE_B, INVALID_STEP);
         if (win_node == NULL) {
             return BAD_QANSWERS;
@@ -1151,14 +1337,14 @@ static int calc_answers(
 
         pack_serie(pnode, bsf->win);
         pnode->opts.qanswers = 0;
-        mcts_log_node("pwin", me, win_node);
+        mcts_log_node(TRACE_TITLE_PWIN, 0, me, win_node);
 
         win_node->score = 2;
         win_node->qgames = 1;
         win_node->opts.qanswers = 1;
         win_node->ball = ball;
         win_node->children[0] = pnode - me->nodes;
-        mcts_log_node("mwin", me, win_node);
+        mcts_log_node(TRACE_TITLE_MWIN, 0, me, win_node);
 
         node->children[0] = win_node - me->nodes;
         node->ball = ball;
@@ -1166,7 +1352,7 @@ static int calc_answers(
         return 1;
     }
 
-    log_line("Func %s - found %d series", __func__, bsf->qseries);
+    trace_add(TRACE_EXPAND_SERIES, 0, bsf->qseries, 0, 0, 0);
 
     const int qseries = bsf->qseries;
     if (qseries == 0) {
@@ -1195,12 +1381,12 @@ static int calc_answers(
 
     const int status = alloc_answers(me, node, qballs, NODE_B);
     if (status != 0) {
-        log_line("Func %s - alloc_answers failed with code %d", __func__, status);
+        trace_add(TRACE_EXPAND_ALLOC_FAILED, 0, status, 0, 0, 0);
         return BAD_QANSWERS;
     }
 
-    log_line("");
-    mcts_log_node("children", me, node);
+    trace_add(TRACE_EOL, 0, 0, 0, 0, 0);
+    mcts_log_node(TRACE_TITLE_CHILDREN, 0, me, node);
 
     const uint32_t * const dists = state->active == 1
         ? state->geometry->dist_goal1
@@ -1237,7 +1423,7 @@ static int calc_answers(
     qsort(ball_moves, qballs, sizeof(struct ball_move), compare_ball_moves);
     mcts_log_ball_moves(ball_moves, qballs);
 
-    mcts_log_node("node", me, node);
+    mcts_log_node(TRACE_TITLE_NODE, 0, me, node);
 
     if (qballs > MAX_QANSWERS) {
         /* WARN */
@@ -1246,7 +1432,7 @@ static int calc_answers(
 
     /* Create nodes in sorted order */
     for (int i=0; i<qballs; ++i) {
-        log_line("Func %s - get_answer %d for node %d", __func__, i, node - me->nodes);
+        trace_add(TRACE_EXPAND_GET_ANSWER, node - me->nodes, i, 0, 0, 0);
         struct node * restrict const bnode = get_answer(me, node, i);
         if (bnode == NULL) {
             /* WARN */
@@ -1256,14 +1442,65 @@ static int calc_answers(
         if (status != 0) {
             return BAD_QANSWERS;
         }
-        mcts_log_node("ballmove", me, bnode);
+        mcts_log_node(TRACE_TITLE_BALLMOVE, 0, me, bnode);
     }
 
-    mcts_log_node("result", me, node);
+    mcts_log_node(TRACE_TITLE_RESULT, 0, me, node);
     node->opts.qanswers = qballs;
     return qballs;
 }
 
+static int calc_answers(
+    struct mcts_ai * restrict const me,
+    struct node * restrict const node,
+    struct state * restrict const state)
+{
+    const int qanswers = node->opts.qanswers;
+    if (qanswers != BAD_QANSWERS) {
+        return qanswers;
+    }
+
+    const enum search_phase phase = me->phase;
+    switch_phase(me, PHASE_EXPANSION);
+
+    const uint64_t cycles_start = cycles_begin();
+    const int result = expand_answers(me, node, state);
+    cycles_end(&me->search.cycles, CYCLES_CALC_ANSWERS, cycles_start);
+    if (result != BAD_QANSWERS) {
+        const enum node_type type = node->opts.type;
+        ++me->search.qexpanded[type];
+        me->search.qanswers[type] += result;
+    }
+
+    switch_phase(me, phase);
+    return result;
+}
+
+static int32_t search_rollout(
+    struct mcts_ai * restrict const me,
+    struct state * restrict const state,
+    uint32_t * restrict const qthink)
+{
+    switch_phase(me, PHASE_ROLLOUT);
+
+    const uint32_t start = *qthink;
+    const uint64_t cycles_start = cycles_begin();
+    const int32_t score = rollout(state, me->max_depth, qthink, &me->seed);
+    const uint32_t len = *qthink - start;
+
+    struct search_explanation * restrict const search = &me->search;
+    cycles_end(&search->cycles, CYCLES_ROLLOUT, cycles_start);
+    ++search->qrollouts;
+    search->rollout_steps += len;
+    search->qstate_steps += len;
+    search->qcut_rollouts += score == 0;
+    if (len > search->max_rollout_len) {
+        search->max_rollout_len = len;
+    }
+
+    return score;
+}
+
 static uint32_t simulate(
     struct mcts_ai * restrict const me,
     struct node * restrict node)
@@ -1282,14 +1519,15 @@ static uint32_t simulate(
 
     uint32_t qthink = 1;
     me->hist_ptr = me->hist;
+    switch_phase(me, PHASE_DESCENT);
 
     enum step last_step = INVALID_STEP;
     int last_answer = -1;
 
     for (;;) {
-        log_line("\n\n-------- new simulation iteration ---------------------\n");
-        mcts_log_state("current", state);
-        mcts_log_node("current", me, node);
+        trace_add(TRACE_ITERATION, 0, 0, 0, 0, 0);
+        mcts_log_state(TRACE_TITLE_CURRENT, state);
+        mcts_log_node(TRACE_TITLE_CURRENT, 0, me, node);
 
         const int active = state->active;
 
@@ -1299,13 +1537,15 @@ static uint32_t simulate(
         }
 
         if (qanswers == 0) {
-            log_line("Func %s - no answers available, active=%d", __func__, state->active);
+            trace_add(TRACE_NO_ANSWERS, 0, state->active, 0, 0, 0);
             update_history(me, active != 1 ? +1 : -1);
             return qthink;
         }
 
+        const uint64_t cycles_start = cycles_begin();
         int answer = select_answer(me, node, qanswers);
-        log_line("<-- select_answer: result=%d from qanswers=%d\n", answer, qanswers);
+        cycles_end(&me->search.cycles, CYCLES_SELECT, cycles_start);
+        trace_add(TRACE_SELECTED, 0, answer, qanswers, 0, 0);
         ++qthink;
 
         struct node * restrict child = get_answer(me, node, answer);
@@ -1315,36 +1555,36 @@ static uint32_t simulate(
             return 0;
         }
 
-        log_line("Func %s - next child, index=%d", __func__, child - me->nodes);
+        trace_add(TRACE_NEXT_CHILD, child - me->nodes, 0, 0, 0, 0);
         if (child == zero) {
             last_step = get_step(me, node, answer);
             last_answer = answer;
             break;
         }
 
-        apply_answer(me, state, child);
-        log_line("Func %s - apply answer %d from node %d", __func__, answer, child - me->nodes);
+        me->search.qstate_steps += apply_answer(me, state, child);
+        trace_add(TRACE_APPLY_ANSWER, child - me->nodes, answer, 0, 0, 0);
 
         add_history(me, child, active);
-        log_line("Func %s - push node %d to history, active=%d", __func__, child - me->nodes, active);
+        trace_add(TRACE_PUSH_HISTORY, child - me->nodes, active, 0, 0, 0);
 
-        mcts_log_state("next", state);
+        mcts_log_state(TRACE_TITLE_NEXT, state);
         enum state_status status = state_status(state);
 
         if (status == WIN_1) {
-            log_line("Func %s - WIN_1 detected", __func__);
+            trace_add(TRACE_WIN_1, 0, 0, 0, 0, 0);
             update_history(me, +1);
             return qthink;
         }
 
         if (status == WIN_2) {
-            log_line("Func %s - WIN_2 detected", __func__);
+            trace_add(TRACE_WIN_2, 0, 0, 0, 0, 0);
             update_history(me, -1);
             return qthink;
         }
 
         node = child;
-        log_line("iteration done");
+        trace_add(TRACE_ITERATION_DONE, 0, 0, 0, 0, 0);
     }
 
     if (last_step == INVALID_STEP) {
@@ -1359,30 +1599,31 @@ static uint32_t simulate(
 
     const int old_active = state->active;
     const int new_ball = state_step(state, last_step);
+    ++me->search.qstate_steps;
 
     struct node * restrict const child = alloc_node(me, NODE_S, last_step);
     if (child == NULL) {
-        log_line("Func %s - out of nodes", __func__);
+        trace_add(TRACE_OUT_OF_NODES, 0, 0, 0, 0, 0);
         return 0;
     }
 
     child->ball = new_ball;
     node->children[last_answer] = child - me->nodes;
-    log_line("Func %s - allocated new child, index=%d", __func__, child - me->nodes);
+    trace_add(TRACE_NEW_CHILD, child - me->nodes, 0, 0, 0, 0);
 
     add_history(me, child, old_active);
-    log_line("Func %s - push node %d to history, active=%d", __func__, child - me->nodes, old_active);
+    trace_add(TRACE_PUSH_HISTORY, child - me->nodes, old_active, 0, 0, 0);
 
-    log_line("\n\n------------- rollout ----------------------------\n");
-    mcts_log_state("last", state);
-    mcts_log_node("last", me, node);
-    const int32_t score = rollout(state, me->max_depth, &qthink);
-    log_line("Rollout %s%d", score > 0 ? "+" : "-", score > 0 ? score : -score);
+    trace_add(TRACE_ROLLOUT_START, 0, 0, 0, 0, 0);
+    mcts_log_state(TRACE_TITLE_LAST, state);
+    mcts_log_node(TRACE_TITLE_LAST, 0, me, node);
+    const int32_t score = search_rollout(me, state, &qthink);
+    trace_add(TRACE_ROLLOUT, 0, score > 0 ? '+' : '-', score > 0 ? score : -score, 0, 0);
 
     update_history(me, score);
-    log_line("\n\n------------------ snapshot ----------------------\n");
+    trace_add(TRACE_SNAPSHOT_START, 0, 0, 0, 0, 0);
     mcts_log_snapshot(me);
-    log_line("\n\n-------- simulation finished ---------------------\n");
+    trace_add(TRACE_SIMULATION_DONE, 0, 0, 0, 0, 0);
     return qthink;
 }
 
@@ -1402,7 +1643,7 @@ static enum step best_preparation(
     const struct node * const bnode)
 {
     int ibest = best_answer(me, bnode);
-    log_line("Func %s - ibest = %d", __func__, ibest);
+    trace_add(TRACE_BEST_PREPARATION, 0, ibest, 0, 0, 0);
 
     const struct node * const pnode = get_answer(me, bnode, ibest);
     if (pnode == NULL) {
@@ -1410,7 +1651,7 @@ static enum step best_preparation(
         return INVALID_STEP;
     }
     const int qsteps = pnode->opts.qsteps;
-    mcts_log_node("pnode", me, pnode);
+    mcts_log_node(TRACE_TITLE_PNODE, 0, me, pnode);
 
     struct preparation * restrict const prep = &me->prep;
     prep->qpreps = qsteps;
@@ -1436,12 +1677,13 @@ static enum step ai_go(
         explanation->cache.total = 0;
         explanation->cache.good_alloc = 0;
         explanation->cache.bad_alloc = 0;
+        memset(&explanation->search, 0, sizeof(explanation->search));
     }
 
     struct preparation * restrict const prep = &me->prep;
     enum step prepared = preparation_peek(prep);
     if (prepared != INVALID_STEP) {
-        log_line("Func %s - return preparaion %s", __func__, step_names[prepared]);
+        trace_add(TRACE_RETURN_PREPARATION, 0, prepared, 0, 0, 0);
         return prepared;
     }
 
@@ -1462,6 +1704,10 @@ static enum step ai_go(
     }
 
     reset_cache(me);
+    memset(&me->search, 0, sizeof(me->search));
+
+    /* Rollouts are reseeded on every search, so srand reproduces it */
+    me->seed = mix64(rand()) | 1;
 
     struct node * restrict const zero = alloc_node(me, NODE_T, INVALID_STEP);
     if (zero == NULL) {
@@ -1484,6 +1730,7 @@ static enum step ai_go(
 
     if (qanswers > 1) {
         uint32_t qthink = 0;
+        const uint64_t search_start = search_clock();
 
         for (;;) {
             const uint32_t delta_think = simulate(me, root);
@@ -1493,37 +1740,41 @@ static enum step ai_go(
 
             qthink += delta_think;
             ++root->qgames;
+            ++me->search.qplayouts;
 
-            log_line("Func %s - qgames=%d qthink=%d of %d", __func__, root->qgames, qthink, me->qthink);
+            trace_add(TRACE_GO_PROGRESS, 0, root->qgames, qthink, me->qthink, 0);
             if (qthink >= me->qthink) {
                 break;
             }
         }
+
+        switch_phase(me, QPHASES);
+        me->search.time_ns = search_clock() - search_start;
     }
 
-    log_line("\n\n======== ai=>go, choosing answer =================\n");
+    trace_add(TRACE_GO_START, 0, 0, 0, 0, 0);
 
-    mcts_log_node("root", me, root);
+    mcts_log_node(TRACE_TITLE_ROOT, 0, me, root);
     for (int i=0; i<root->opts.qanswers; ++i) {
         const struct node * const child = get_answer(me, root, i);
         if (child != NULL) {
-            mcts_log_node("child", me, child);
+            mcts_log_node(TRACE_TITLE_CHILD, 0, me, child);
         } else {
-            log_line("Func %s answer[%d] is NULL", __func__, i);
+            trace_add(TRACE_GO_ANSWER_NULL, 0, i, 0, 0, 0);
         }
     }
 
     int best = best_answer(me, root);
 
-    log_line("Func %s best_answer=%d", __func__, best);
+    trace_add(TRACE_GO_BEST, 0, best, 0, 0, 0);
 
     const struct node * const  best_node = get_answer(me, root, best);
     if (best_node == NULL) {
         /* WARN */
-        log_line("Func %s best node is null for answer %d", __func__, best);
+        trace_add(TRACE_GO_BEST_NULL, 0, best, 0, 0, 0);
         return INVALID_STEP;
     }
-    mcts_log_node("best", me, best_node);
+    mcts_log_node(TRACE_TITLE_BEST, 0, me, best_node);
 
     const enum node_type best_type = best_node->opts.type;
 
@@ -1536,7 +1787,7 @@ static enum step ai_go(
             result = best_preparation(me, best_node);
             break;
         default:
-            log_line("Func %s unexpected best node type!", __func__);
+            trace_add(TRACE_GO_BAD_TYPE, 0, 0, 0, 0, 0);
             return INVALID_STEP;
     }
 
@@ -1609,6 +1860,8 @@ static enum step ai_go(
         explanation->cache.total = me->total_nodes;
         explanation->cache.good_alloc = me->good_node_alloc;
         explanation->cache.bad_alloc = me->bad_node_alloc;
+
+        explanation->search = me->search;
     }
 
     return result;
@@ -1619,155 +1872,111 @@ static enum step ai_go(
 #if ENABLE_LOGS
 
 void mcts_log_node(
-    const char * title,
+    const enum trace_title title,
+    const int indent,
     const struct mcts_ai * const me,
     const struct node * const node)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
-    int indent = 0;
-    while (*title == ' ') {
-        ++title;
-        ++indent;
-    }
-
     const int index = node - me->nodes;
     const int type = node->opts.type;
     const int step = node->opts.step;
     const int qsteps = node->opts.qsteps;
     const int qchildren = type != NODE_P ? QSTEPS : QSTEPS - 1;
 
-    fprintf(f, "%*sNode #%d <%s> score=%d qgames=%d\n",
-        indent, "", index, title, node->score, node->qgames);
-
-    fprintf(f, "%*sopts:", indent+2, "");
-    fprintf(f, " type=%s", node_types[type]);
+    trace_add(TRACE_NODE, index, indent, title, node->score, node->qgames);
+    trace_add(TRACE_NODE_TYPE, index, indent, node_types[type][0], 0, 0);
     if (step >= 0 && step < QSTEPS) {
-        fprintf(f, " step=%s", step_names[step]);
+        trace_add(TRACE_NODE_STEP, index, step, 0, 0, 0);
     }
     if (node->opts.qanswers != BAD_QANSWERS) {
-        fprintf(f, " qanswers=%d", node->opts.qanswers);
+        trace_add(TRACE_NODE_QANSWERS, index, node->opts.qanswers, 0, 0, 0);
     }
-    fprintf(f, " qsteps=%d", qsteps);
-    fprintf(f, " steps=%02X", node->opts.steps);
-    fprintf(f, "\n");
+    trace_add(TRACE_NODE_QSTEPS, index, qsteps, node->opts.steps, 0, 0);
 
-    fprintf(f, "%*schildren:", indent+2, "");
+    trace_add(TRACE_NODE_CHILDREN, index, indent, 0, 0, 0);
     for (int i=0; i<qchildren; ++i) {
-        fprintf(f, " %d", node->children[i]);
+        trace_add(TRACE_CHILD, index, node->children[i], 0, 0, 0);
     }
-    fprintf(f, "\n");
+    trace_add(TRACE_EOL, index, 0, 0, 0, 0);
 
     if (type == NODE_P) {
         enum step path[qsteps];
         unpack_serie(node, path);
-        fprintf(f, "%*spath:", indent+2, "");
+        trace_add(TRACE_NODE_PATH, index, indent, 0, 0, 0);
         for (int i=0; i<qsteps; ++i) {
-            fprintf(f, " %s", step_names[path[i]]);
+            trace_add(TRACE_PATH_STEP, index, path[i], 0, 0, 0);
         }
-        fprintf(f, "\n");
+        trace_add(TRACE_EOL, index, 0, 0, 0, 0);
     }
-    fprintf(f, "\n");
-
-    fflush(f);
+    trace_add(TRACE_EOL, index, 0, 0, 0, 0);
 }
 
 void mcts_log_exnode(
-    const char * title,
+    const int title,
     const struct mcts_ai * const me,
     const struct exnode * const exnode)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
-    int indent = 0;
-    while (*title == ' ') {
-        ++title;
-        ++indent;
-    }
-
     const int index = (const struct node*) exnode - me->nodes;
-    fprintf(f, "%*sExNode #%d <%s>", indent, "", index, title);
+    trace_add(TRACE_EXNODE, index, title, 0, 0, 0);
 
     for (int i=0; i<EXNODE_CHILDREN; ++i) {
-        fprintf(f, " %d", exnode->children[i]);
+        trace_add(TRACE_CHILD, index, exnode->children[i], 0, 0, 0);
     }
-    fprintf(f, "\n");
-
-    fflush(f);
+    trace_add(TRACE_EOL, index, 0, 0, 0, 0);
 }
 
 void mcts_log_serie(int index, const struct bsf_serie * serie)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
-    fprintf(f, "    [%d] -", index);
+    trace_add(TRACE_SERIE, 0, index, 0, 0, 0);
     for (int i = 0; i < serie->qsteps; ++i) {
-        fprintf(f, " %s", step_names[serie->steps[i]]);
+        trace_add(TRACE_PATH_STEP, 0, serie_step(serie, i), 0, 0, 0);
     }
-    fprintf(f, "\n");
-    fflush(f);
+    trace_add(TRACE_EOL, 0, 0, 0, 0, 0);
 }
 
 void mcts_log_ball_moves(const struct ball_move * ball_moves, int qballs)
 {
-    log_line("BallMoves - qballs=%d (sorted by distance)", qballs);
+    trace_add(TRACE_BALL_MOVES, 0, qballs, 0, 0, 0);
     for (int i = 0; i < qballs; ++i) {
         const struct ball_move * bm = &ball_moves[i];
-        log_line("  [%d] - ball=%d distance=%u count=%d", i, bm->ball, bm->distance, bm->count);
+        trace_add(TRACE_BALL_MOVES_ITEM, 0, i, bm->ball, bm->distance, bm->count);
         for (int j = 0; j < bm->count; ++j) {
             mcts_log_serie(j, bm->series[j]);
         }
     }
-    log_line("");
+    trace_add(TRACE_EOL, 0, 0, 0, 0, 0);
 }
 
 void snode_print_steps(const struct node * const snode)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
     steps_t steps = snode->opts.steps;
     if (steps == 0) {
-        fprintf(f, " steps=0");
+        trace_add(TRACE_SNAPSHOT_NO_STEPS, 0, 0, 0, 0, 0);
         return;
     }
 
-    fprintf(f, " ");
     const enum step step = extract_step(&steps);
-    fprintf(f, "%s", step_names[step]);
+    trace_add(TRACE_SNAPSHOT_STEP, 0, step, 0, 0, 0);
     while (steps != 0) {
         const enum step step = extract_step(&steps);
-        fprintf(f, "|%s", step_names[step]);
+        trace_add(TRACE_SNAPSHOT_NEXT_STEP, 0, step, 0, 0, 0);
     }
 }
 
 void mnode_print_ball(
-    FILE * f,
     const struct node * const bnode)
 {
-    fprintf(f, " ball=%d", bnode->ball);
+    trace_add(TRACE_SNAPSHOT_BALL, 0, bnode->ball, 0, 0, 0);
 }
 
 void pnode_print_path(
-    FILE * f,
     const struct node * const pnode)
 {
     const int qsteps = pnode->opts.qsteps;
     enum step path[qsteps];
     unpack_serie(pnode, path);
     for (int i = 0; i < qsteps; ++i) {
-        fprintf(f, " %s", step_names[path[i]]);
+        trace_add(TRACE_PATH_STEP, 0, path[i], 0, 0, 0);
     }
 }
 
@@ -1777,32 +1986,26 @@ void snapshot_item(const struct mcts_ai * const me, const struct node * const no
         return;
     }
 
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
     const int inode = node - me->nodes;
 
     const int type = node->opts.type;
-    fprintf(f, "%*snode-%s #%d: ", 2*depth, "", node_types[type], inode);
-    fprintf(f, "score=%d qgames=%d", node->score, node->qgames);
+    trace_add(TRACE_SNAPSHOT_NODE, inode, 2*depth, node_types[type][0], node->score, node->qgames);
 
     switch (type) {
         case NODE_S:
             snode_print_steps(node);
             break;
         case NODE_B:
-            mnode_print_ball(f, node);
+            mnode_print_ball(node);
             break;
         case NODE_P:
-            pnode_print_path(f, node);
+            pnode_print_path(node);
             break;
         case NODE_T:
             break;
     }
 
-    fprintf(f, "\n");
+    trace_add(TRACE_EOL, inode, 0, 0, 0, 0);
 
     const int qanswers = node->opts.qanswers;
     if (qanswers != BAD_QANSWERS) {
@@ -1813,14 +2016,12 @@ void snapshot_item(const struct mcts_ai * const me, const struct node * const no
             }
         }
     }
-
-    fflush(f);
 }
 
+/* The whole tree on every simulation, only for the full mode */
 void mcts_log_snapshot(const struct mcts_ai * const me)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
+    if (!trace_is_full()) {
         return;
     }
 
@@ -1828,29 +2029,23 @@ void mcts_log_snapshot(const struct mcts_ai * const me)
     snapshot_item(me, root, 0);
 }
 
-void mcts_log_state(const char * title, const struct state * const state)
+void mcts_log_state(const enum trace_title title, const struct state * const state)
 {
-    FILE * f = get_flog();
-    if (f == NULL) {
-        return;
-    }
-
-    fprintf(f, "State <%s>: active=%d ball=%d", title, state->active, state->ball);
+    trace_add(TRACE_STATE, 0, title, state->active, state->ball, 0);
 
     if (state->step1 != INVALID_STEP) {
-        fprintf(f, " step1=%s", step_names[state->step1]);
+        trace_add(TRACE_STATE_STEP1, 0, state->step1, 0, 0, 0);
     }
 
     if (state->step2 != INVALID_STEP) {
-        fprintf(f, " step2=%s", step_names[state->step2]);
+        trace_add(TRACE_STATE_STEP2, 0, state->step2, 0, 0, 0);
     }
 
     if (state->step12 != 0) {
-        fprintf(f, " step12=%016llX", state->step12);
+        trace_add(TRACE_STATE_STEP12, 0, state->step12, 0, 0, 0);
     }
 
-    fprintf(f, "\n");
-    fflush(f);
+    trace_add(TRACE_EOL, 0, 0, 0, 0, 0);
 }
 
 #endif
@@ -1861,6 +2056,8 @@ void mcts_log_state(const char * title, const struct state * const state)
 
 #include "insider.h"
 
+#include <inttypes.h>
+
 #define BW   15
 #define BH   23
 #define GW    4
@@ -1899,11 +2096,12 @@ int test_rollout(void)
         test_fail("create_state(geometry) fails, fails, return value is NULL, errno is %d.", errno);
     }
 
+    uint64_t seed = 20261018;
     for (int i=0; i<QROLLOUTS; ++i) {
         state_copy(state, base);
 
         uint32_t qthink = 0;
-        const int score = rollout(state, BW*BH*8, &qthink);
+        const int score = rollout(state, BW*BH*8, &qthink, &seed);
         if (score != -1 && score != +1) {
             test_fail("rollout %d returns unexpected score %d (-1 or +1 expected).", i, score);
         }
@@ -1915,7 +2113,7 @@ int test_rollout(void)
 
     state_copy(state, base);
     uint32_t qthink = 0;
-    const int score = rollout(state, 4, &qthink);
+    const int score = rollout(state, 4, &qthink, &seed);
     if (score != 0) {
         test_fail("short rollout returns unexpected score %d, 0 expected.", score);
     }
@@ -2057,13 +2255,13 @@ int test_ucb_formula(void)
 
     me->C = 1.4;
 
-    const int qanswers = 4;
-    const struct { int qgames; int score; } stats[qanswers] = {
+    const struct { int qgames; int score; } stats[] = {
         { 3, 1 }, /* NORTH - weight 1.55985508 */
         { 4, 2 }, /* EAST  - weight 1.56219899 BEST */
         { 5, 3 }, /* SOUTH - weight 1.55005966 */
         { 6, 4 }, /* WEST  - weight 1.53394851 */
     };
+    const int qanswers = ARRAY_LEN(stats);
 
     struct node * restrict const node = must_alloc_node(me, NODE_S);
     node->opts.qanswers = qanswers;
@@ -2138,7 +2336,7 @@ static int run_simulation(const struct game_protocol * const protocol, int qsimu
 
     root->qgames = 1;
     for (int i=0; i<qsimulations; ++i) {
-        log_line("\nSimulation %d", i);
+        trace_add(TRACE_SIMULATION, 0, i, 0, 0, 0);
         simulate(me, root);
         ++root->qgames;
     }
@@ -2217,6 +2415,110 @@ int test_mcts_ai_unstep(void)
     return 0;
 }
 
+int test_mcts_srand(void)
+{
+    const uint32_t qthink = MIN_QTHINK;
+
+    must_init_ctx(&protocol_empty);
+    struct ai * restrict const ai = ctx->ai;
+    must_set_param(ai, "qthink", &qthink);
+
+    struct ai_explanation explanation;
+    srand(20261018);
+    const enum step step = ai->go(ai, &explanation);
+    const uint64_t rollout_steps = explanation.search.rollout_steps;
+    const size_t qstats = explanation.qstats;
+    int32_t qgames[QSTEPS];
+    for (size_t i = 0; i < qstats && i < QSTEPS; ++i) {
+        qgames[i] = explanation.stats[i].qgames;
+    }
+
+    srand(20261018);
+    if (ai->go(ai, &explanation) != step) {
+        test_fail("Same srand seed gives another step.");
+    }
+
+    if (explanation.search.rollout_steps != rollout_steps || explanation.qstats != qstats) {
+        test_fail("Same srand seed gives %" PRIu64 " rollout steps, %" PRIu64 " expected.", explanation.search.rollout_steps, rollout_steps);
+    }
+
+    for (size_t i = 0; i < qstats && i < QSTEPS; ++i) {
+        if (explanation.stats[i].qgames != qgames[i]) {
+            test_fail("Same srand seed gives %d games for choice %zu, %d expected.", explanation.stats[i].qgames, i, qgames[i]);
+        }
+    }
+
+    free_ctx();
+    return 0;
+}
+
+int test_search_stats(void)
+{
+    const uint32_t qthink = MIN_QTHINK;
+
+    must_init_ctx(&protocol_empty);
+    struct ai * restrict const ai = ctx->ai;
+    must_set_param(ai, "qthink", &qthink);
+
+    unsigned int qsearches = 0;
+    const struct state * const state = ai->get_state(ai);
+    for (int i = 0; i < QROLLOUTS && state_status(state) == IN_PROGRESS; ++i) {
+        struct ai_explanation explanation;
+        const enum step step = ai->go(ai, &explanation);
+        if (step < 0 || step >= INVALID_STEP) {
+            test_fail("ai->go returns invalid step %d, error: %s", step, ai->error);
+        }
+
+        const struct search_explanation * const search = &explanation.search;
+        if (search->qplayouts > 0) {
+            ++qsearches;
+
+            uint64_t qdepths = 0;
+            for (int depth = 0; depth < MAX_STATS_DEPTH; ++depth) {
+                qdepths += search->depths[depth];
+            }
+
+            if (qdepths != search->qplayouts) {
+                test_fail("Depth histogram counts %" PRIu64 " playouts, %" PRIu64 " expected.", qdepths, search->qplayouts);
+            }
+
+            if (search->qrollouts > search->qplayouts || search->rollout_steps > search->qstate_steps) {
+                test_fail("Rollout counters exceed search counters.");
+            }
+
+            if (search->max_rollout_len > def_max_depth || search->qcut_rollouts > search->qrollouts) {
+                test_fail("Rollout length %u is out of max_depth.", search->max_rollout_len);
+            }
+
+            if (search->qexpanded[NODE_T] == 0) {
+                test_fail("Root is not counted as expanded node.");
+            }
+
+            if (search->time_ns == 0) {
+                test_fail("Search time is not measured.");
+            }
+
+#if CYCLE_COUNTERS
+            if (search->qrollouts > 0 && search->phase_ns[PHASE_ROLLOUT] == 0) {
+                test_fail("Rollout time is not measured.");
+            }
+#endif
+        }
+
+        const int status = ai->do_step(ai, step);
+        if (status != 0) {
+            test_fail("ai->do_step(%s) failed, status %d.", step_names[step], status);
+        }
+    }
+
+    if (qsearches == 0) {
+        test_fail("No searches with statistics.");
+    }
+
+    free_ctx();
+    return 0;
+}
+
 static void run_pack_unpack_test(
     struct node * restrict const node,
     const enum step * const steps,
@@ -2224,7 +2526,10 @@ static void run_pack_unpack_test(
 {
     struct bsf_serie test_serie;
     test_serie.qsteps = qsteps;
-    test_serie.steps = (enum step *)steps;
+    test_serie.packed = 0;
+    for (int i = qsteps - 1; i >= 0; --i) {
+        test_serie.packed = (test_serie.packed << SERIE_STEP_BITS) | steps[i];
+    }
 
     node->opts.qsteps = test_serie.qsteps;
 
@@ -2234,18 +2539,18 @@ static void run_pack_unpack_test(
     }
 
     /* Check that first step is stored in opts.step */
-    if (node->opts.step != test_serie.steps[0]) {
+    if (node->opts.step != steps[0]) {
         test_fail("node->opts.step mismatch for %d steps: expected %s, got %s",
-            qsteps, step_names[test_serie.steps[0]], step_names[node->opts.step]);
+            qsteps, step_names[steps[0]], step_names[node->opts.step]);
     }
 
     enum step unpacked[MAX_FREE_KICK_SERIE];
     unpack_serie(node, unpacked);
 
     for (int i = 0; i < test_serie.qsteps; ++i) {
-        if (unpacked[i] != test_serie.steps[i]) {
+        if (unpacked[i] != steps[i]) {
             test_fail("pack/unpack mismatch at step %d (of %d): expected %s, got %s",
-                i, qsteps, step_names[test_serie.steps[i]], step_names[unpacked[i]]);
+                i, qsteps, step_names[steps[i]], step_names[unpacked[i]]);
         }
     }
 }
@@ -2295,6 +2600,54 @@ int test_pack_unpack_serie(void)
     return 0;
 }
 
+int test_many_answers(void)
+{
+    const uint32_t cache = 8192 * sizeof(struct node);
+    const int counts[] = { 1, QSTEPS, QSTEPS + 1, MAX_EXNODE_ANSWERS, MAX_EXNODE_ANSWERS + 1, 255, 256, 1000, MAX_QANSWERS - 1 };
+
+    must_init_ctx(&protocol_empty);
+    struct ai * restrict const ai = ctx->ai;
+    struct mcts_ai * restrict const me = ctx->mcts;
+
+    must_set_param(ai, "cache", &cache);
+
+    for (int i = 0; i < ARRAY_LEN(counts); ++i) {
+        const int qanswers = counts[i];
+        reset_cache(me);
+
+        struct node * restrict const node = must_alloc_node(me, NODE_B);
+        const int status = alloc_answers(me, node, qanswers, NODE_P);
+        if (status != 0) {
+            test_fail("alloc_answers(%d) failed with status %d.", qanswers, status);
+        }
+
+        if (node->opts.qanswers != qanswers) {
+            test_fail("node->opts.qanswers is %d, expected %d.", node->opts.qanswers, qanswers);
+        }
+
+        for (int answer = 0; answer < qanswers; ++answer) {
+            struct node * restrict const child = get_answer(me, node, answer);
+            if (child == NULL) {
+                test_fail("get_answer(%d) of %d returns NULL.", answer, qanswers);
+            }
+            if (child->opts.type != NODE_P || child->qgames != 0) {
+                test_fail("get_answer(%d) of %d returns wrong or shared node.", answer, qanswers);
+            }
+            child->qgames = answer + 1;
+        }
+
+        for (int answer = 0; answer < qanswers; ++answer) {
+            const struct node * const child = get_answer(me, node, answer);
+            if (child->qgames != answer + 1) {
+                test_fail("get_answer(%d) of %d is not stable.", answer, qanswers);
+            }
+        }
+    }
+
+    free_ctx();
+    return 0;
+}
+
 static int run_ai_go(const struct game_protocol * const protocol, const int qmoves)
 {
     const uint32_t qthink = MIN_QTHINK;
@@ -2355,3 +2708,195 @@ int debug_simulate(void)
 }
 
 #endif
+
+
+
+#ifdef MICROBENCH
+
+#include "insider.h"
+
+/* Microbenchmarks over the tree of one search and the recorded series */
+
+#define BENCH_QSTEPS             60
+#define BENCH_QTHINK    (64 * 1024)
+
+struct tree_bench
+{
+    struct geometry * geometry;
+    struct ai ai;
+    int qnodes;
+    int nodes_capacity;
+    const struct node ** nodes;
+    uint64_t sink;
+};
+
+static void collect_bench_nodes(
+    struct tree_bench * restrict const me,
+    const struct mcts_ai * const mcts,
+    const struct node * const node)
+{
+    const int qanswers = node->opts.qanswers;
+    if (qanswers == BAD_QANSWERS) {
+        return;
+    }
+
+    if (qanswers > 1 && node->qgames > 0) {
+        if (me->qnodes >= me->nodes_capacity) {
+            me->nodes_capacity = me->nodes_capacity > 0 ? 2 * me->nodes_capacity : 1024;
+            me->nodes = realloc(me->nodes, me->nodes_capacity * sizeof(struct node *));
+            if (me->nodes == NULL) {
+                test_fail("realloc tree_bench nodes failed, errno = %d.", errno);
+            }
+        }
+        me->nodes[me->qnodes++] = node;
+    }
+
+    for (int i = 0; i < qanswers; ++i) {
+        const struct node * const child = get_answer(mcts, node, i);
+        if (child != NULL && child != mcts->nodes) {
+            collect_bench_nodes(me, mcts, child);
+        }
+    }
+}
+
+static void * create_tree_bench(void)
+{
+    struct tree_bench * restrict const me = calloc(1, sizeof(struct tree_bench));
+    if (me == NULL) {
+        test_fail("calloc tree_bench failed, errno = %d.", errno);
+    }
+
+    const struct game_protocol * const protocol = &protocol_with_hang;
+    me->geometry = must_create_protocol_geometry(protocol);
+
+    struct ai * restrict const ai = &me->ai;
+    init_mcts_ai(ai, me->geometry);
+
+    const uint32_t qthink = BENCH_QTHINK;
+    must_set_param(ai, "qthink", &qthink);
+
+    srand(1);
+    const int status = ai->do_steps(ai, BENCH_QSTEPS, protocol->steps);
+    if (status != 0) {
+        test_fail("ai->do_steps failed with code %d, %s.", status, ai->error);
+    }
+
+    const enum step step = ai->go(ai, NULL);
+    if (step < 0 || step >= INVALID_STEP) {
+        test_fail("ai->go returns invalid step %d.", step);
+    }
+
+    const struct mcts_ai * const mcts = ai->data;
+    collect_bench_nodes(me, mcts, mcts->nodes + 1);
+    if (me->qnodes == 0) {
+        test_fail("search tree has no nodes with several answers.");
+    }
+
+    return me;
+}
+
+static void destroy_tree_bench(void * data)
+{
+    struct tree_bench * restrict const me = data;
+    me->ai.free(&me->ai);
+    destroy_geometry(me->geometry);
+    free(me->nodes);
+    free(me);
+}
+
+static uint64_t run_select_answer(void * data)
+{
+    struct tree_bench * restrict const me = data;
+    const struct mcts_ai * const mcts = me->ai.data;
+    for (int i = 0; i < me->qnodes; ++i) {
+        const struct node * const node = me->nodes[i];
+        me->sink += select_answer(mcts, node, node->opts.qanswers);
+    }
+    return me->qnodes;
+}
+
+static uint64_t run_get_answer(void * data)
+{
+    struct tree_bench * restrict const me = data;
+    const struct mcts_ai * const mcts = me->ai.data;
+    uint64_t qops = 0;
+    for (int i = 0; i < me->qnodes; ++i) {
+        const struct node * const node = me->nodes[i];
+        const int qanswers = node->opts.qanswers;
+        for (int answer = 0; answer < qanswers; ++answer) {
+            me->sink += get_answer(mcts, node, answer) - mcts->nodes;
+        }
+        qops += qanswers;
+    }
+    return qops;
+}
+
+struct serie_bench
+{
+    int qseries;
+    struct bsf_serie * series;
+    struct node * nodes;
+    uint64_t sink;
+};
+
+static void * create_serie_bench(void)
+{
+    struct recording * restrict const recording = must_create_recording();
+    struct serie_bench * restrict const me = calloc(1, sizeof(struct serie_bench));
+    if (me == NULL) {
+        test_fail("calloc serie_bench failed, errno = %d.", errno);
+    }
+
+    me->qseries = recording->qseries;
+    me->series = calloc(recording->qseries + 1, sizeof(struct bsf_serie));
+    me->nodes = calloc(recording->qseries + 1, sizeof(struct node));
+    if (me->series == NULL || me->nodes == NULL) {
+        test_fail("calloc serie_bench series failed, errno = %d.", errno);
+    }
+
+    for (int i = 0; i < recording->qseries; ++i) {
+        me->series[i] = recording->series[i].serie;
+        pack_serie(me->nodes + i, me->series + i);
+    }
+
+    destroy_recording(recording);
+    return me;
+}
+
+static void destroy_serie_bench(void * data)
+{
+    struct serie_bench * restrict const me = data;
+    free(me->nodes);
+    free(me->series);
+    free(me);
+}
+
+static uint64_t run_pack_serie(void * data)
+{
+    struct serie_bench * restrict const me = data;
+    for (int i = 0; i < me->qseries; ++i) {
+        me->sink += pack_serie(me->nodes + i, me->series + i);
+    }
+    return me->qseries;
+}
+
+static uint64_t run_unpack_serie(void * data)
+{
+    struct serie_bench * restrict const me = data;
+    enum step steps[MAX_FREE_KICK_SERIE];
+    for (int i = 0; i < me->qseries; ++i) {
+        unpack_serie(me->nodes + i, steps);
+        me->sink += steps[0];
+    }
+    return me->qseries;
+}
+
+const struct microbench mcts_microbenches[] = {
+    { "select_answer", create_tree_bench, NULL, run_select_answer, destroy_tree_bench },
+    { "get_answer", create_tree_bench, NULL, run_get_answer, destroy_tree_bench },
+    { "pack_serie", create_serie_bench, NULL, run_pack_serie, destroy_serie_bench },
+    { "unpack_serie", create_serie_bench, NULL, run_unpack_serie, destroy_serie_bench },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+#endif
@@ -210,7 +210,8 @@ static struct mcts_ai * create_mcts_ai(const struct geometry * const geometry)
     const uint32_t free_kick_len = geometry->free_kick_len;
     const uint32_t free_kick_reduce = (free_kick_len - 1) * (free_kick_len - 1);
     const size_t cycle_guard_capacity = 4 + qpoints / free_kick_reduce;
-    const size_t sizes[8] = {
+    const size_t journal_sz = state_journal_capacity(geometry) * sizeof(struct step_change);
+    const size_t sizes[10] = {
         sizeof(struct mcts_ai),
         sizeof(struct state),
         qpoints,
@@ -218,11 +219,12 @@ static struct mcts_ai * create_mcts_ai(const struct geometry * const geometry)
         qpoints,
         cycle_guard_capacity * sizeof(struct kick),
         cycle_guard_capacity * sizeof(struct kick),
-        ERROR_BUF_SZ
+        ERROR_BUF_SZ,
+        journal_sz, journal_sz
     };
 
-    void * ptrs[8];
-    void * data = multialloc(8, sizes, ptrs, 64);
+    void * ptrs[10];
+    void * data = multialloc(10, sizes, ptrs, 64);
 
     if (data == NULL) {
         return NULL;
@@ -262,8 +264,8 @@ static struct mcts_ai * create_mcts_ai(const struct geometry * const geometry)
         init_param(me, i);
     }
 
-    init_state(state, geometry, lines);
-    init_state(backup, geometry, backup_lines);
+    init_state_with_journal(state, geometry, lines, ptrs[8]);
+    init_state_with_journal(backup, geometry, backup_lines, ptrs[9]);
     return me;
 }
 
@@ -0,0 +1,638 @@
+#include "paper-football.h"
+
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MUX_LINE_SZ   65536
+
+struct mux_session
+{
+    char id[MAX_MUX_ID_LEN + 1];
+    pid_t pid;
+    int fd;  /* Write end of the session stdin, -1 after quit */
+};
+
+static struct mux_session * sessions = NULL;
+static int qsessions = 0;
+static int max_sessions = 0;
+
+
+
+/* Output of a session: lines from the pipe are written with the prefix */
+struct mux_stream
+{
+    int fd;
+    int out_fd;
+    size_t len;
+    char buf[MUX_LINE_SZ];
+};
+
+struct mux_tagger
+{
+    char prefix[MAX_MUX_ID_LEN + 2];
+    size_t prefix_len;
+    struct mux_stream streams[2];
+};
+
+static void write_line(
+    const struct mux_tagger * const me,
+    const int fd,
+    const char * const line,
+    const size_t len)
+{
+    struct iovec iov[3] = {
+        { .iov_base = (void *)me->prefix, .iov_len = me->prefix_len },
+        { .iov_base = (void *)line, .iov_len = len },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+
+    while (writev(fd, iov, 3) < 0 && errno == EINTR) {
+    }
+}
+
+/* Returns 0 on EOF */
+static int tag_stream(
+    const struct mux_tagger * const me,
+    struct mux_stream * restrict const stream)
+{
+    const ssize_t qread = read(stream->fd, stream->buf + stream->len, MUX_LINE_SZ - stream->len);
+    if (qread < 0 && errno == EINTR) {
+        return 1;
+    }
+
+    if (qread <= 0) {
+        if (stream->len > 0) {
+            write_line(me, stream->out_fd, stream->buf, stream->len);
+            stream->len = 0;
+        }
+        return 0;
+    }
+
+    stream->len += qread;
+
+    const char * ptr = stream->buf;
+    const char * const end = stream->buf + stream->len;
+    for (;;) {
+        const char * const eol = memchr(ptr, '\n', end - ptr);
+        if (eol == NULL) {
+            break;
+        }
+        write_line(me, stream->out_fd, ptr, eol - ptr);
+        ptr = eol + 1;
+    }
+
+    stream->len = end - ptr;
+    if (stream->len == MUX_LINE_SZ) {
+        /* Too long line is split */
+        write_line(me, stream->out_fd, stream->buf, stream->len);
+        stream->len = 0;
+    } else {
+        memmove(stream->buf, ptr, stream->len);
+    }
+
+    return 1;
+}
+
+static void * tagger_main(void * arg)
+{
+    struct mux_tagger * restrict const me = arg;
+    struct pollfd pfds[2];
+    for (int i = 0; i < 2; ++i) {
+        pfds[i].fd = me->streams[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    int qopened = 2;
+    while (qopened > 0) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (pfds[i].fd >= 0 && pfds[i].revents != 0) {
+                if (!tag_stream(me, me->streams + i)) {
+                    pfds[i].fd = -1;
+                    --qopened;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+
+static int parse_id(
+    const char * const line,
+    char * restrict const id,
+    const char ** restrict const cmd)
+{
+    const char * ptr = line + 1;
+    size_t len = 0;
+    while (isalnum(*ptr) || *ptr == '_' || *ptr == '-' || *ptr == '.') {
+        if (len == MAX_MUX_ID_LEN) {
+            return EINVAL;
+        }
+        id[len++] = *ptr++;
+    }
+    id[len] = '\0';
+
+    if (len == 0 || (*ptr != '\0' && !isspace(*ptr))) {
+        return EINVAL;
+    }
+
+    while (*ptr == ' ' || *ptr == '\t') {
+        ++ptr;
+    }
+
+    *cmd = ptr;
+    return 0;
+}
+
+static int is_quit(const char * const cmd)
+{
+    return strncasecmp(cmd, "quit", 4) == 0 && (cmd[4] == '\0' || isspace(cmd[4]));
+}
+
+static void end_session(struct mux_session * restrict const item)
+{
+    if (item->fd >= 0) {
+        close(item->fd);
+        item->fd = -1;
+    }
+}
+
+/* Finished sessions are removed, with options == 0 all sessions are waited */
+static void reap_sessions(const int options)
+{
+    int qalive = 0;
+    for (int i = 0; i < qsessions; ++i) {
+        struct mux_session * restrict const item = sessions + i;
+        if (item->fd >= 0 || waitpid(item->pid, NULL, options) == 0) {
+            sessions[qalive++] = *item;
+        }
+    }
+    qsessions = qalive;
+}
+
+static void run_mux_session(
+    const char * const id,
+    const int in_fd,
+    session_main entry,
+    void * arg)
+{
+    /* Pipes of other sessions stay opened in the parent only */
+    for (int i = 0; i < qsessions; ++i) {
+        end_session(sessions + i);
+    }
+    free(sessions);
+    sessions = NULL;
+    qsessions = 0;
+    max_sessions = 0;
+
+    static struct mux_tagger tagger;
+    tagger.prefix_len = snprintf(tagger.prefix, sizeof(tagger.prefix), "@%s ", id);
+
+    for (int i = 0; i < 2; ++i) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            _exit(errno);
+        }
+
+        struct mux_stream * restrict const stream = tagger.streams + i;
+        stream->fd = fds[0];
+        stream->out_fd = dup(i + 1);
+        stream->len = 0;
+        dup2(fds[1], i + 1);
+        close(fds[1]);
+    }
+
+    dup2(in_fd, 0);
+    close(in_fd);
+
+    /* Input of the parent is not a part of the session */
+    __fpurge(stdin);
+    clearerr(stdin);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, tagger_main, &tagger) != 0) {
+        _exit(EAGAIN);
+    }
+
+    const int status = entry(arg);
+
+    fflush(stdout);
+    fflush(stderr);
+    close(1);
+    close(2);
+    pthread_join(thread, NULL);
+    _exit(status);
+}
+
+static struct mux_session * start_session(
+    const char * const id,
+    session_main entry,
+    void * arg)
+{
+    if (qsessions == max_sessions) {
+        const int new_max = max_sessions > 0 ? 2 * max_sessions : 16;
+        struct mux_session * const new_sessions = realloc(sessions, new_max * sizeof(struct mux_session));
+        if (new_sessions == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        sessions = new_sessions;
+        max_sessions = new_max;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return NULL;
+    }
+
+    /* A died session is reported by EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    fflush(stdout);
+    fflush(stderr);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[1]);
+        run_mux_session(id, fds[0], entry, arg);
+    }
+
+    close(fds[0]);
+    if (pid < 0) {
+        const int saved = errno;
+        close(fds[1]);
+        errno = saved;
+        return NULL;
+    }
+
+    struct mux_session * restrict const item = sessions + qsessions++;
+    strcpy(item->id, id);
+    item->pid = pid;
+    item->fd = fds[1];
+    return item;
+}
+
+static int write_all(
+    const int fd,
+    const char * ptr,
+    size_t len)
+{
+    while (len > 0) {
+        const ssize_t qwritten = write(fd, ptr, len);
+        if (qwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        ptr += qwritten;
+        len -= qwritten;
+    }
+    return 0;
+}
+
+int mux_command(
+    const char * const line,
+    session_main entry,
+    void * arg)
+{
+    char id[MAX_MUX_ID_LEN + 1];
+    const char * cmd;
+    if (line[0] != '@' || parse_id(line, id, &cmd) != 0) {
+        return EINVAL;
+    }
+
+    reap_sessions(WNOHANG);
+
+    struct mux_session * restrict item = NULL;
+    for (int i = 0; i < qsessions; ++i) {
+        if (sessions[i].fd >= 0 && strcmp(sessions[i].id, id) == 0) {
+            item = sessions + i;
+            break;
+        }
+    }
+
+    if (is_quit(cmd)) {
+        if (item != NULL) {
+            end_session(item);
+        }
+        return 0;
+    }
+
+    if (item == NULL) {
+        item = start_session(id, entry, arg);
+        if (item == NULL) {
+            return errno;
+        }
+    }
+
+    const size_t len = strlen(cmd);
+    int status = write_all(item->fd, cmd, len);
+    if (status == 0 && (len == 0 || cmd[len - 1] != '\n')) {
+        status = write_all(item->fd, "\n", 1);
+    }
+
+    if (status != 0) {
+        end_session(item);
+    }
+
+    return status;
+}
+
+void mux_finish(void)
+{
+    for (int i = 0; i < qsessions; ++i) {
+        end_session(sessions + i);
+    }
+
+    reap_sessions(0);
+    free(sessions);
+    sessions = NULL;
+    max_sessions = 0;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#include <fcntl.h>
+#include <time.h>
+
+#define MUX_TEST_SLEEP   300000
+
+/* Commands: "inc" prints the incremented counter, "echo s", "err s" and "sleep" */
+static int test_mux_session(void * arg)
+{
+    int * restrict const counter = arg;
+    char * line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, stdin) != -1) {
+        if (strncmp(line, "inc", 3) == 0) {
+            printf("%d\n", ++*counter);
+        } else if (strncmp(line, "echo ", 5) == 0) {
+            printf("%s", line + 5);
+        } else if (strncmp(line, "err ", 4) == 0) {
+            fprintf(stderr, "%s", line + 4);
+        } else if (strncmp(line, "sleep", 5) == 0) {
+            usleep(MUX_TEST_SLEEP);
+            printf("slept\n");
+        }
+    }
+
+    free(line);
+    return 0;
+}
+
+/* Position before the last step of the free kick, threads of bsf_gen_parallel search it */
+static const struct game_protocol * const bsf_protocol = &protocol_fastest_free_kick1;
+
+static struct ai * must_init_bsf_ai(
+    struct ai * restrict const ai,
+    struct geometry * restrict const geometry)
+{
+    const uint32_t qthreads = 4;
+    const uint32_t qthink = 2000;
+
+    init_mcts_ai(ai, geometry);
+    must_set_param(ai, "bsf_threads", &qthreads);
+    must_set_param(ai, "qthink", &qthink);
+
+    const int status = ai->do_steps(ai, bsf_protocol->qsteps - 1, bsf_protocol->steps);
+    if (status != 0) {
+        test_fail("ai->do_steps failed with code %d, %s.", status, ai->error);
+    }
+
+    return ai;
+}
+
+static enum step must_go(struct ai * restrict const ai)
+{
+    struct ai_explanation explanation;
+    const enum step step = ai->go(ai, &explanation);
+    if (step < 0 || step >= INVALID_STEP) {
+        test_fail("ai->go returns invalid step %d.", step);
+    }
+    return step;
+}
+
+/* Command "go" prints the step of the own AI, as a session of the engine does */
+static int test_mux_bsf_session(void * arg)
+{
+    (void)arg;
+
+    struct geometry * restrict const geometry = must_create_protocol_geometry(bsf_protocol);
+    struct ai ai;
+    must_init_bsf_ai(&ai, geometry);
+
+    char * line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, stdin) != -1) {
+        if (strncmp(line, "go", 2) == 0) {
+            printf("%s\n", step_names[must_go(&ai)]);
+        }
+    }
+
+    free(line);
+    ai.free(&ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+static const char * find_line(
+    const char * const text,
+    const char * const line)
+{
+    const char * const ptr = strstr(text, line);
+    if (ptr == NULL) {
+        test_fail("Line \"%.*s\" is not found in output:\n%s", (int)strlen(line) - 1, line, text);
+    }
+    return ptr;
+}
+
+int test_mux(void)
+{
+    char filename[] = "/tmp/pf-mux-XXXXXX";
+    const int tmp_fd = mkstemp(filename);
+    if (tmp_fd < 0) {
+        test_fail("mkstemp failed, errno = %d.", errno);
+    }
+    close(tmp_fd);
+
+    const int fd = open(filename, O_RDWR | O_APPEND);
+    unlink(filename);
+    if (fd < 0) {
+        test_fail("open failed, errno = %d.", errno);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    const int saved_out = dup(1);
+    const int saved_err = dup(2);
+    dup2(fd, 1);
+    dup2(fd, 2);
+
+    static const char * const commands[] = {
+        "@a inc\n", "@b inc\n", "@a inc\n", "@b err oops\n",
+        "@c sleep\n", "@d sleep\n",
+        "@a quit\n", "@a inc\n", "@b echo last",
+    };
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int counter = 0;
+    int status = 0;
+    const int qcommands = sizeof(commands) / sizeof(commands[0]);
+    for (int i = 0; i < qcommands && status == 0; ++i) {
+        status = mux_command(commands[i], test_mux_session, &counter);
+    }
+
+    const int bad_status = mux_command("@bad! inc\n", test_mux_session, &counter);
+    mux_finish();
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    dup2(saved_out, 1);
+    dup2(saved_err, 2);
+    close(saved_out);
+    close(saved_err);
+
+    if (status != 0) {
+        test_fail("mux_command failed with code %d.", status);
+    }
+
+    if (bad_status != EINVAL) {
+        test_fail("Invalid id is accepted, status = %d.", bad_status);
+    }
+
+    if (counter != 0) {
+        test_fail("Sessions changed the state of the engine.");
+    }
+
+    const long elapsed = (finish.tv_sec - start.tv_sec) * 1000000 + (finish.tv_nsec - start.tv_nsec) / 1000;
+    if (elapsed >= 2 * MUX_TEST_SLEEP) {
+        test_fail("Sessions did not run concurrently, %ld us elapsed.", elapsed);
+    }
+
+    char text[1024];
+    const ssize_t qread = pread(fd, text, sizeof(text) - 1, 0);
+    close(fd);
+    if (qread < 0) {
+        test_fail("pread failed, errno = %d.", errno);
+    }
+    text[qread] = '\0';
+
+    /* Two sessions named "a" print 1, 2 and 1 */
+    const char * const first = find_line(text, "@a 1\n");
+    if (find_line(text, "@a 2\n") < first) {
+        test_fail("Session output is reordered:\n%s", text);
+    }
+    find_line(first + 1, "@a 1\n");
+
+    find_line(text, "@b 1\n");
+    find_line(text, "@b oops\n");
+    find_line(text, "@b last\n");
+    find_line(text, "@c slept\n");
+    find_line(text, "@d slept\n");
+
+    int qlines = 0;
+    for (const char * ptr = text; *ptr != '\0'; ++qlines) {
+        if (*ptr != '@') {
+            test_fail("Untagged line in output:\n%s", text);
+        }
+        ptr = strchr(ptr, '\n') + 1;
+    }
+
+    if (qlines != 8) {
+        test_fail("%d lines in output, 8 expected:\n%s", qlines, text);
+    }
+
+    return 0;
+}
+
+/* The engine holds BSF worker threads, they are not copied into sessions */
+int test_mux_bsf(void)
+{
+    struct geometry * restrict const geometry = must_create_protocol_geometry(bsf_protocol);
+    struct ai ai;
+    must_init_bsf_ai(&ai, geometry);
+    must_go(&ai);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        test_fail("pipe failed, errno = %d.", errno);
+    }
+
+    fflush(stdout);
+    const int saved_out = dup(1);
+    dup2(fds[1], 1);
+    close(fds[1]);
+
+    static const char * const commands[] = { "@x go\n", "@y go\n", "@x go\n", "@y quit\n" };
+
+    int status = 0;
+    const int qcommands = sizeof(commands) / sizeof(commands[0]);
+    for (int i = 0; i < qcommands && status == 0; ++i) {
+        status = mux_command(commands[i], test_mux_bsf_session, NULL);
+    }
+    mux_finish();
+
+    fflush(stdout);
+    dup2(saved_out, 1);
+    close(saved_out);
+
+    char text[1024];
+    size_t text_len = 0;
+    for (;;) {
+        const ssize_t qread = read(fds[0], text + text_len, sizeof(text) - 1 - text_len);
+        if (qread <= 0) {
+            break;
+        }
+        text_len += qread;
+    }
+    close(fds[0]);
+    text[text_len] = '\0';
+
+    if (status != 0) {
+        test_fail("mux_command failed with code %d.", status);
+    }
+
+    int qlines[2] = { 0, 0 };
+    for (const char * ptr = text; *ptr != '\0'; ptr = strchr(ptr, '\n') + 1) {
+        if (strncmp(ptr, "@x ", 3) != 0 && strncmp(ptr, "@y ", 3) != 0) {
+            test_fail("Unexpected line in output:\n%s", text);
+        }
+        ++qlines[ptr[1] - 'x'];
+    }
+
+    if (qlines[0] != 2 || qlines[1] != 1) {
+        test_fail("Sessions x and y print %d and %d lines, 2 and 1 expected:\n%s", qlines[0], qlines[1], text);
+    }
+
+    /* Workers of the engine still serve it */
+    must_go(&ai);
+    ai.free(&ai);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+#endif
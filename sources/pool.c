@@ -0,0 +1,598 @@
+#include "paper-football.h"
+
+#include <pthread.h>
+
+struct ai_pool_worker
+{
+    struct ai ai;
+    struct ai_pool * pool;
+    pthread_t thread;
+};
+
+struct ai_pool
+{
+    int qworkers;
+    struct ai_pool_worker * workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+
+    char * jobs;
+    size_t job_sz;
+    int qjobs;
+    int next;
+    uint8_t * finished;
+    ai_job_run run;
+};
+
+void copy_ai_params(
+    struct ai * restrict const dest,
+    const struct ai * const src)
+{
+    const struct ai_param * ptr = src->get_params(src);
+    for (; ptr->name != NULL; ++ptr) {
+        dest->set_param(dest, ptr->name, ptr->value);
+    }
+}
+
+int ai_qthreads(const struct ai * const ai)
+{
+    const struct ai_param * ptr = ai->get_params(ai);
+    for (; ptr->name != NULL; ++ptr) {
+        if (ptr->type == U32 && strcmp(ptr->name, "bsf_threads") == 0) {
+            return *(const uint32_t *)ptr->value;
+        }
+    }
+
+    return 1;
+}
+
+struct ai_pool * create_ai_pool(
+    const struct ai * const ai,
+    ai_init init_ai,
+    const struct geometry * const geometry,
+    const struct state * const root,
+    const int qworkers)
+{
+    if (qworkers < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const size_t sizes[2] = {
+        sizeof(struct ai_pool),
+        qworkers * sizeof(struct ai_pool_worker),
+    };
+
+    void * ptrs[2];
+    void * data = multialloc(2, sizes, ptrs, 64);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    struct ai_pool * restrict const me = data;
+    me->workers = ptrs[1];
+    me->qworkers = 0;
+    pthread_mutex_init(&me->mutex, NULL);
+    pthread_cond_init(&me->done, NULL);
+
+    for (int i = 0; i < qworkers; ++i) {
+        struct ai_pool_worker * restrict const worker = me->workers + i;
+        memset(&worker->ai, 0, sizeof(struct ai));
+        int status = init_ai(&worker->ai, geometry);
+        if (status != 0) {
+            destroy_ai_pool(me);
+            errno = status;
+            return NULL;
+        }
+
+        worker->pool = me;
+        ++me->qworkers;
+        copy_ai_params(&worker->ai, ai);
+
+        if (root != NULL) {
+            struct ai * restrict const worker_ai = &worker->ai;
+            status = worker_ai->set_state ? worker_ai->set_state(worker_ai, root) : ENOTSUP;
+            if (status != 0) {
+                destroy_ai_pool(me);
+                errno = status;
+                return NULL;
+            }
+        }
+    }
+
+    return me;
+}
+
+void destroy_ai_pool(struct ai_pool * restrict const me)
+{
+    for (int i = 0; i < me->qworkers; ++i) {
+        struct ai * restrict const ai = &me->workers[i].ai;
+        ai->free(ai);
+    }
+
+    pthread_cond_destroy(&me->done);
+    pthread_mutex_destroy(&me->mutex);
+    free(me);
+}
+
+static void * ai_pool_worker_main(void * arg)
+{
+    struct ai_pool_worker * restrict const worker = arg;
+    struct ai_pool * restrict const me = worker->pool;
+    const int qslots = ai_qthreads(&worker->ai);
+    search_slots_acquire(qslots);
+
+    for (;;) {
+        const int ijob = __atomic_fetch_add(&me->next, 1, __ATOMIC_RELAXED);
+        if (ijob >= me->qjobs) {
+            break;
+        }
+
+        me->run(&worker->ai, me->jobs + ijob * me->job_sz);
+
+        pthread_mutex_lock(&me->mutex);
+        me->finished[ijob] = 1;
+        pthread_cond_broadcast(&me->done);
+        pthread_mutex_unlock(&me->mutex);
+    }
+
+    search_slots_release(qslots);
+    return NULL;
+}
+
+int ai_pool_run(
+    struct ai_pool * restrict const me,
+    void * const jobs,
+    const size_t job_sz,
+    const int qjobs,
+    ai_job_run run,
+    ai_job_done done,
+    void * const arg)
+{
+    if (qjobs <= 0) {
+        return 0;
+    }
+
+    uint8_t * restrict const finished = calloc(qjobs, 1);
+    if (finished == NULL) {
+        return ENOMEM;
+    }
+
+    me->jobs = jobs;
+    me->job_sz = job_sz;
+    me->qjobs = qjobs;
+    me->next = 0;
+    me->finished = finished;
+    me->run = run;
+
+    int qstarted = 0;
+    for (; qstarted < me->qworkers && qstarted < qjobs; ++qstarted) {
+        struct ai_pool_worker * restrict const worker = me->workers + qstarted;
+        if (pthread_create(&worker->thread, NULL, ai_pool_worker_main, worker) != 0) {
+            break;
+        }
+    }
+
+    if (qstarted == 0) {
+        /* No threads, the caller does all jobs */
+        ai_pool_worker_main(me->workers);
+    }
+
+    /* Results are reported in the job order while the rest is in progress */
+    for (int i = 0; i < qjobs; ++i) {
+        pthread_mutex_lock(&me->mutex);
+        while (!finished[i]) {
+            pthread_cond_wait(&me->done, &me->mutex);
+        }
+        pthread_mutex_unlock(&me->mutex);
+
+        if (done != NULL) {
+            done((char *)jobs + i * job_sz, arg);
+        }
+    }
+
+    for (int i = 0; i < qstarted; ++i) {
+        pthread_join(me->workers[i].thread, NULL);
+    }
+
+    free(finished);
+    return 0;
+}
+
+/* Choice scores are for the first player, explanation score is for the active one */
+static double find_played_score(
+    const struct ai_analysis * const me,
+    const struct ai_explanation * const explanation,
+    const int active)
+{
+    if (explanation->qstats == 0) {
+        return me->score;
+    }
+
+    /* The longest choice which is a prefix of the played move */
+    double result = -1.0;
+    int qmatched = 0;
+    const struct choice_stat * ptr = explanation->stats;
+    const struct choice_stat * const end = ptr + explanation->qstats;
+    for (; ptr != end; ++ptr) {
+        const int qsteps = ptr->qsteps;
+        if (qsteps <= qmatched || qsteps > (int)me->qplayed) {
+            continue;
+        }
+
+        if (memcmp(ptr->steps, me->played, qsteps * sizeof(enum step)) == 0) {
+            const double score = ptr->score;
+            result = score >= 0.0 && active == 2 ? 1.0 - score : score;
+            qmatched = qsteps;
+        }
+    }
+
+    return result;
+}
+
+void ai_analyse(
+    struct ai * restrict const ai,
+    void * const job)
+{
+    struct ai_analysis * restrict const me = job;
+    me->qbest = 0;
+    me->score = -1.0;
+    me->played_score = -1.0;
+    me->qgames = 0;
+    me->time = 0.0;
+
+    me->status = ai->do_steps(ai, me->qsteps, me->steps);
+    if (me->status != 0) {
+        return;
+    }
+
+    const struct state * const state = ai->get_state(ai);
+    if (state_status(state) != IN_PROGRESS) {
+        me->status = EINVAL;
+        ai->undo_steps(ai, me->qsteps);
+        return;
+    }
+
+    const int active = state->active;
+
+    struct ai_explanation explanation = {0};
+    const enum step step = ai->go(ai, &explanation);
+    if (step == INVALID_STEP) {
+        me->status = EINVAL;
+        ai->undo_steps(ai, me->qsteps);
+        return;
+    }
+
+    me->best[0] = step;
+    me->qbest = 1;
+    me->score = explanation.score;
+    me->time = explanation.time;
+
+    if (explanation.qstats > 0) {
+        const struct choice_stat * const best = explanation.stats;
+        const int qbest = best->qsteps < MAX_FREE_KICK_SERIE ? best->qsteps : MAX_FREE_KICK_SERIE;
+        memcpy(me->best, best->steps, qbest * sizeof(enum step));
+        me->qbest = qbest;
+        me->qgames = best->qgames;
+    }
+
+    if (me->qplayed > 0) {
+        me->played_score = find_played_score(me, &explanation, active);
+    }
+
+    /* Step and undo it to drop the prepared serie of the AI */
+    me->status = ai->do_step(ai, step);
+    const unsigned int qundo = me->qsteps + (me->status == 0);
+    const int status = ai->undo_steps(ai, qundo);
+    if (me->status == 0) {
+        me->status = status;
+    }
+}
+
+int split_turns(
+    const struct geometry * const geometry,
+    const enum step * const steps,
+    const unsigned int qsteps,
+    unsigned int * restrict const offsets,
+    int * restrict const actives)
+{
+    struct state * restrict const state = create_state(geometry);
+    if (state == NULL) {
+        return -1;
+    }
+
+    int qturns = 0;
+    int is_done = 1;
+    for (unsigned int i = 0; i < qsteps; ++i) {
+        const int active = state->active;
+        if (is_done) {
+            offsets[qturns] = i;
+            actives[qturns] = active;
+            ++qturns;
+        }
+
+        state_step(state, steps[i]);
+        is_done = state_status(state) != IN_PROGRESS || state->active != active;
+    }
+
+    destroy_state(state);
+    return qturns;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#define QPOOL_WORKERS    3
+#define QPOOL_QTHINK     (16 * 1024)
+
+struct pool_check
+{
+    const struct game_protocol * protocol;
+    struct state * state;
+    struct state * start;
+    int qdone;
+};
+
+static void check_pool_job(
+    void * const job,
+    void * const arg)
+{
+    const struct ai_analysis * const analysis = job;
+    struct pool_check * restrict const check = arg;
+    const int index = check->qdone++;
+
+    if (analysis->qsteps != (unsigned int)index) {
+        test_fail("Job %d is reported at position %d.", (int)analysis->qsteps, index);
+    }
+
+    if (analysis->status != 0) {
+        test_fail("Job %d failed with status %d.", index, analysis->status);
+    }
+
+    if (analysis->qbest < 1) {
+        test_fail("Job %d: no best steps.", index);
+    }
+
+    struct state * restrict const state = check->state;
+    state_copy(state, check->start);
+    for (unsigned int i = 0; i < analysis->qsteps; ++i) {
+        state_step(state, check->protocol->steps[i]);
+    }
+
+    const double played_score = analysis->played_score;
+    const int is_found = played_score >= 0.0 && played_score <= 1.0;
+    if (!is_found && !is_free_kick_situation(state)) {
+        test_fail("Job %d: played step score %f is not found.", index, played_score);
+    }
+
+    const int ball = state_step(state, analysis->best[0]);
+    if (ball == NO_WAY) {
+        test_fail("Job %d: best step %s is invalid.", index, step_names[analysis->best[0]]);
+    }
+}
+
+int test_ai_pool(void)
+{
+    const struct game_protocol * const protocol = &protocol_000050;
+    must_init_ctx(protocol);
+    struct ai * restrict const ai = ctx->ai;
+
+    const uint32_t qthink = QPOOL_QTHINK;
+    must_set_param(ai, "qthink", &qthink);
+
+    struct ai_pool * restrict const pool = create_ai_pool(ai, init_mcts_ai, ctx->geometry, NULL, QPOOL_WORKERS);
+    if (pool == NULL) {
+        test_fail("create_ai_pool failed, errno = %d.", errno);
+    }
+
+    const int qjobs = 3 * QPOOL_WORKERS + 1;
+    struct ai_analysis jobs[qjobs];
+    for (int i = 0; i < qjobs; ++i) {
+        jobs[i].steps = protocol->steps;
+        jobs[i].qsteps = i;
+        jobs[i].played = protocol->steps + i;
+        jobs[i].qplayed = protocol->qsteps - i;
+    }
+
+    struct state * restrict const state = create_state(ctx->geometry);
+    struct state * restrict const start = create_state(ctx->geometry);
+
+    /* The second pass reuses the AI instances */
+    for (int pass = 0; pass < 2; ++pass) {
+        struct pool_check check = { protocol, state, start, 0 };
+        const int status = ai_pool_run(pool, jobs, sizeof(struct ai_analysis), qjobs, ai_analyse, check_pool_job, &check);
+        if (status != 0) {
+            test_fail("ai_pool_run failed with code %d.", status);
+        }
+
+        if (check.qdone != qjobs) {
+            test_fail("%d jobs of %d are reported.", check.qdone, qjobs);
+        }
+    }
+
+    destroy_state(start);
+    destroy_state(state);
+    destroy_ai_pool(pool);
+    free_ctx();
+    return 0;
+}
+
+
+
+/* In game 000050 it is a free kick, played serie is not the best one to its ball */
+#define ANNOTATE_FREE_KICK_BACK   14
+
+struct annotate_check
+{
+    const struct game_protocol * protocol;
+    const unsigned int * offsets;
+    struct state * state;
+    const struct state * start;
+    int qturns;
+    int qdone;
+    int qforced;
+};
+
+static void check_annotation(
+    void * const job,
+    void * const arg)
+{
+    const struct ai_analysis * const analysis = job;
+    struct annotate_check * restrict const check = arg;
+    const int index = check->qdone++;
+    const enum step * const steps = check->protocol->steps;
+    const unsigned int offset = check->offsets[index];
+
+    if (analysis->status != 0) {
+        test_fail("Job %d failed with status %d.", index, analysis->status);
+    }
+
+    if (analysis->qsteps != offset || analysis->played != steps + offset) {
+        test_fail("Job %d is reported at step %u, expected %u.", index, analysis->qsteps, offset);
+    }
+
+    struct state * restrict const state = check->state;
+    state_copy(state, check->start);
+    for (unsigned int i = 0; i < analysis->qsteps; ++i) {
+        state_step(state, steps[i]);
+    }
+
+    const int active = state->active;
+    const int is_free_kick = is_free_kick_situation(state);
+    const int is_forced = step_count(state_get_steps(state)) == 1;
+    const double played_score = analysis->played_score;
+    const double score = analysis->score;
+    const int is_na = played_score < 0.0 || played_score > 1.0;
+
+    if (is_free_kick != (index == check->qturns)) {
+        test_fail("Job %d: free kick situation is %d.", index, is_free_kick);
+    }
+
+    /* Best move is a step or a whole free kick serie */
+    if (analysis->qbest < 1 || (is_free_kick ? analysis->qbest < 2 : analysis->qbest != 1)) {
+        test_fail("Job %d: %d best steps.", index, analysis->qbest);
+    }
+
+    for (int i = 0; i < analysis->qbest; ++i) {
+        if (state_status(state) != IN_PROGRESS || state->active != active) {
+            test_fail("Job %d: best step %d of %d is after the turn end.", index, i, analysis->qbest);
+        }
+
+        if (state_step(state, analysis->best[i]) == NO_WAY) {
+            test_fail("Job %d: best step %d (%s) is invalid.", index, i, step_names[analysis->best[i]]);
+        }
+    }
+
+    if (is_free_kick && is_free_kick_situation(state) && state->active == active) {
+        test_fail("Job %d: best serie does not finish the free kick.", index);
+    }
+
+    /* Forced step is not searched, there is no score at all */
+    if (is_forced) {
+        ++check->qforced;
+        if (!is_na || score >= 0.0) {
+            test_fail("Job %d: forced step has scores %f and %f, N/A expected.", index, played_score, score);
+        }
+        return;
+    }
+
+    if (score < 0.0 || score > 1.0) {
+        test_fail("Job %d: best score %f is out of range.", index, score);
+    }
+
+    /* Free kick choices are the best series to every ball, so another serie has no score */
+    if (is_na != is_free_kick) {
+        test_fail("Job %d: played score %f, N/A is expected only in the free kick.", index, played_score);
+    }
+
+    const int is_best_played = memcmp(analysis->played, analysis->best, analysis->qbest * sizeof(enum step)) == 0;
+    if (is_best_played && played_score != score) {
+        test_fail("Job %d: played the best move with score %f, but played score is %f.", index, score, played_score);
+    }
+}
+
+int test_annotate(void)
+{
+    const struct game_protocol * const protocol = &protocol_000050;
+    must_init_ctx(protocol);
+    struct ai * restrict const ai = ctx->ai;
+
+    const uint32_t qthink = QPOOL_QTHINK;
+    must_set_param(ai, "qthink", &qthink);
+
+    const unsigned int qsteps = protocol->qsteps;
+    unsigned int offsets[qsteps + 1];
+    int actives[qsteps];
+    const int qturns = split_turns(ctx->geometry, protocol->steps, qsteps, offsets, actives);
+    if (qturns <= 0) {
+        test_fail("split_turns returns %d, errno = %d.", qturns, errno);
+    }
+
+    /* Turns cover the game, the player is the same inside a turn and changes after it */
+    struct state * restrict const state = create_state(ctx->geometry);
+    struct state * restrict const start = create_state(ctx->geometry);
+    for (int i = 0; i < qturns; ++i) {
+        const unsigned int next = i + 1 < qturns ? offsets[i+1] : qsteps;
+        if (i == 0 ? offsets[i] != 0 : offsets[i] <= offsets[i-1]) {
+            test_fail("Turn %d starts at step %u.", i, offsets[i]);
+        }
+
+        if (state->active != actives[i]) {
+            test_fail("Turn %d: player %d, expected %d.", i, actives[i], state->active);
+        }
+
+        for (unsigned int j = offsets[i]; j < next; ++j) {
+            if (state->active != actives[i] || state_status(state) != IN_PROGRESS) {
+                test_fail("Turn %d: step %u is made after the turn end.", i, j);
+            }
+            state_step(state, protocol->steps[j]);
+        }
+
+        if (next < qsteps && state->active == actives[i]) {
+            test_fail("Turn %d: the player is not changed after step %u.", i, next);
+        }
+    }
+
+    /* Every turn and a free kick inside the last turns */
+    const int qjobs = qturns + 1;
+    offsets[qturns] = qsteps - ANNOTATE_FREE_KICK_BACK;
+    struct ai_analysis jobs[qjobs];
+    for (int i = 0; i < qjobs; ++i) {
+        const unsigned int next = i + 1 < qturns ? offsets[i+1] : qsteps;
+        jobs[i].steps = protocol->steps;
+        jobs[i].qsteps = offsets[i];
+        jobs[i].played = protocol->steps + offsets[i];
+        jobs[i].qplayed = next - offsets[i];
+    }
+
+    struct ai_pool * restrict const pool = create_ai_pool(ai, init_mcts_ai, ctx->geometry, NULL, 1);
+    if (pool == NULL) {
+        test_fail("create_ai_pool failed, errno = %d.", errno);
+    }
+
+    struct annotate_check check = { protocol, offsets, state, start, qturns, 0, 0 };
+    const int status = ai_pool_run(pool, jobs, sizeof(struct ai_analysis), qjobs, ai_analyse, check_annotation, &check);
+    if (status != 0) {
+        test_fail("ai_pool_run failed with code %d.", status);
+    }
+
+    if (check.qdone != qjobs) {
+        test_fail("%d jobs of %d are reported.", check.qdone, qjobs);
+    }
+
+    if (check.qforced == 0) {
+        test_fail("No forced steps in %s.", protocol->name);
+    }
+
+    destroy_state(start);
+    destroy_state(state);
+    destroy_ai_pool(pool);
+    free_ctx();
+    return 0;
+}
+
+#endif
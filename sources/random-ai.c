@@ -19,17 +19,19 @@ static const struct ai_param terminator = { NULL, NULL, NO_TYPE, 0 };
 struct random_ai * create_random_ai(const struct geometry * const geometry)
 {
     const uint32_t qpoints = geometry->qpoints;
-    const size_t sizes[6] = {
+    const size_t journal_sz = state_journal_capacity(geometry) * sizeof(struct step_change);
+    const size_t sizes[8] = {
         sizeof(struct random_ai),
         sizeof(struct state),
         qpoints,
         sizeof(struct state),
         qpoints,
-        ERROR_BUF_SZ
+        ERROR_BUF_SZ,
+        journal_sz, journal_sz
     };
 
-    void * ptrs[6];
-    void * data = multialloc(6, sizes, ptrs, 64);
+    void * ptrs[8];
+    void * data = multialloc(8, sizes, ptrs, 64);
 
     if (data == NULL) {
         return NULL;
@@ -46,8 +48,8 @@ struct random_ai * create_random_ai(const struct geometry * const geometry)
     me->backup = backup;
     me->error_buf = error_buf;
 
-    init_state(state, geometry, lines);
-    init_state(backup, geometry, backup_lines);
+    init_state_with_journal(state, geometry, lines, ptrs[6]);
+    init_state_with_journal(backup, geometry, backup_lines, ptrs[7]);
     return me;
 }
 
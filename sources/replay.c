@@ -0,0 +1,881 @@
+#include "paper-football.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Games taken by a worker at once */
+#define REPLAY_CHUNK    64
+
+const char * replay_verdict_names[QREPLAY_VERDICTS] = {
+    "ok", "unreadable", "geometry", "illegal", "result", "qsteps"
+};
+
+/* Outcome declared by the game writer */
+struct replay_expect
+{
+    int result;            /* Winner 1 or 2, 0 for an unfinished game */
+    int failed;
+    int64_t qsteps;        /* Negative if unknown */
+};
+
+/* Line of stats.txt */
+struct replay_job
+{
+    int num;               /* Game file number, negative for a broken line */
+    char date[16];
+    struct replay_expect expect;
+};
+
+struct replay;
+
+struct replay_worker
+{
+    struct replay * replay;
+    int dims[4];
+    struct geometry * geometry;
+    struct state * start;
+    struct state * state;
+    char * buf;
+    size_t buf_sz;
+    size_t qgames;
+    uint64_t qsteps;
+    size_t qbad;
+    size_t bad_capacity;
+    struct replay_bad * bad;
+    int status;
+    pthread_t thread;
+};
+
+struct replay
+{
+    const struct archive * archive;
+    const char * dirname;
+    const struct replay_job * jobs;
+    size_t qjobs;
+    size_t next;
+    int qworkers;
+    struct replay_worker * workers;
+};
+
+
+
+static void free_worker_geometry(struct replay_worker * restrict const me)
+{
+    if (me->state) {
+        destroy_state(me->state);
+    }
+    if (me->start) {
+        destroy_state(me->start);
+    }
+    if (me->geometry) {
+        destroy_geometry(me->geometry);
+    }
+
+    me->state = NULL;
+    me->start = NULL;
+    me->geometry = NULL;
+}
+
+/* Geometry is cached, a game usually has the same dimensions as the previous one */
+static enum replay_verdict start_game(
+    struct replay_worker * restrict const me,
+    const int width,
+    const int height,
+    const int goal_width,
+    const int free_kick_len)
+{
+    const int dims[4] = { width, height, goal_width, free_kick_len };
+    if (me->geometry == NULL || memcmp(me->dims, dims, sizeof(dims)) != 0) {
+        free_worker_geometry(me);
+        me->geometry = create_std_geometry(width, height, goal_width, free_kick_len);
+        if (me->geometry == NULL) {
+            return REPLAY_GEOMETRY;
+        }
+
+        me->start = create_state(me->geometry);
+        me->state = create_state(me->geometry);
+        if (me->start == NULL || me->state == NULL) {
+            free_worker_geometry(me);
+            me->status = ENOMEM;
+            return REPLAY_GEOMETRY;
+        }
+
+        memcpy(me->dims, dims, sizeof(dims));
+    }
+
+    state_copy(me->state, me->start);
+    return REPLAY_OK;
+}
+
+static inline enum replay_verdict replay_step(
+    struct state * restrict const state,
+    const enum step step)
+{
+    if (state_status(state) != IN_PROGRESS || state_step(state, step) == NO_WAY) {
+        return REPLAY_ILLEGAL;
+    }
+    return REPLAY_OK;
+}
+
+static enum replay_verdict check_result(
+    const struct state * const state,
+    const struct replay_expect * const expect,
+    const uint64_t qsteps)
+{
+    if (expect->qsteps >= 0 && (uint64_t)expect->qsteps != qsteps) {
+        return REPLAY_QSTEPS;
+    }
+
+    const enum state_status status = state_status(state);
+    if (expect->failed || expect->result == 0) {
+        return status == IN_PROGRESS ? REPLAY_OK : REPLAY_RESULT;
+    }
+
+    return status == (expect->result == 1 ? WIN_1 : WIN_2) ? REPLAY_OK : REPLAY_RESULT;
+}
+
+static int reserve_buf(
+    struct replay_worker * restrict const me,
+    const size_t sz)
+{
+    if (sz <= me->buf_sz) {
+        return 0;
+    }
+
+    const size_t new_sz = sz > 2 * me->buf_sz ? sz : 2 * me->buf_sz;
+    char * const buf = realloc(me->buf, new_sz);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+
+    me->buf = buf;
+    me->buf_sz = new_sz;
+    return 0;
+}
+
+static void add_game(
+    struct replay_worker * restrict const me,
+    const size_t index,
+    const enum replay_verdict verdict,
+    const uint64_t qsteps)
+{
+    ++me->qgames;
+    me->qsteps += qsteps;
+    if (verdict == REPLAY_OK) {
+        return;
+    }
+
+    if (me->qbad == me->bad_capacity) {
+        const size_t capacity = me->bad_capacity > 0 ? 2 * me->bad_capacity : 16;
+        struct replay_bad * const bad = realloc(me->bad, capacity * sizeof(struct replay_bad));
+        if (bad == NULL) {
+            me->status = ENOMEM;
+            return;
+        }
+        me->bad = bad;
+        me->bad_capacity = capacity;
+    }
+
+    struct replay_bad * restrict const item = me->bad + me->qbad++;
+    item->index = index;
+    item->verdict = verdict;
+    item->step = qsteps;
+}
+
+
+
+static void replay_record(
+    struct replay_worker * restrict const me,
+    const size_t index)
+{
+    const struct archive_game * const game = archive_get(me->replay->archive, index);
+    if (game == NULL) {
+        return add_game(me, index, REPLAY_UNREADABLE, 0);
+    }
+
+    enum replay_verdict verdict = start_game(me, game->width, game->height, game->goal_width, game->free_kick_len);
+    if (verdict != REPLAY_OK) {
+        return add_game(me, index, verdict, 0);
+    }
+
+    if (reserve_buf(me, game->qsteps) != 0) {
+        me->status = ENOMEM;
+        return;
+    }
+
+    uint8_t * const steps = (uint8_t *)me->buf;
+    archive_unpack_steps(game, steps);
+
+    uint32_t qsteps = 0;
+    for (; qsteps < game->qsteps; ++qsteps) {
+        verdict = replay_step(me->state, steps[qsteps]);
+        if (verdict != REPLAY_OK) {
+            return add_game(me, index, verdict, qsteps);
+        }
+    }
+
+    const struct replay_expect expect = {
+        .result = game->result,
+        .failed = game->failed,
+        .qsteps = game->qsteps,
+    };
+
+    add_game(me, index, check_result(me->state, &expect, qsteps), qsteps);
+}
+
+/* Whole file is read into the worker buffer with a terminating zero */
+static int read_file(
+    struct replay_worker * restrict const me,
+    const char * const filename)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || reserve_buf(me, st.st_size + 1) != 0) {
+        close(fd);
+        return EIO;
+    }
+
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        const ssize_t qread = read(fd, me->buf + len, st.st_size - len);
+        if (qread <= 0) {
+            break;
+        }
+        len += qread;
+    }
+
+    close(fd);
+    me->buf[len] = '\0';
+    return 0;
+}
+
+static inline const char * skip_spaces(const char * ptr)
+{
+    while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r') {
+        ++ptr;
+    }
+    return ptr;
+}
+
+static enum step read_step(const char ** const ptr)
+{
+    const char * str = *ptr;
+    const int ch1 = toupper(str[0]);
+    const int ch2 = toupper(str[1]);
+
+    enum step step;
+    switch (ch1) {
+        case 'N':
+            step = ch2 == 'W' ? NORTH_WEST : ch2 == 'E' ? NORTH_EAST : NORTH;
+            break;
+        case 'S':
+            step = ch2 == 'W' ? SOUTH_WEST : ch2 == 'E' ? SOUTH_EAST : SOUTH;
+            break;
+        case 'E':
+            step = EAST;
+            break;
+        case 'W':
+            step = WEST;
+            break;
+        default:
+            return INVALID_STEP;
+    }
+
+    str += (step == NORTH || step == SOUTH || step == EAST || step == WEST) ? 1 : 2;
+    if (*str != '\0' && !isspace(*str)) {
+        return INVALID_STEP;
+    }
+
+    *ptr = str;
+    return step;
+}
+
+/* The format of load: GAME and RESULT lines, move lines "player steps..." */
+static enum replay_verdict replay_text(
+    struct replay_worker * restrict const me,
+    struct replay_expect * restrict const expect,
+    uint64_t * restrict const qsteps)
+{
+    int has_game = 0;
+    const char * ptr = me->buf;
+    while (*ptr != '\0') {
+        ptr = skip_spaces(ptr);
+
+        if (isalpha(*ptr)) {
+            const char * const id = ptr;
+            while (isalnum(*ptr)) {
+                ++ptr;
+            }
+
+            const size_t id_len = ptr - id;
+            if (id_len == 4 && memcmp(id, "GAME", 4) == 0) {
+                if (has_game) {
+                    return REPLAY_UNREADABLE;
+                }
+
+                char * end;
+                long dims[4];
+                for (int i = 0; i < 4; ++i) {
+                    dims[i] = strtol(ptr, &end, 10);
+                    if (end == ptr) {
+                        return REPLAY_UNREADABLE;
+                    }
+                    ptr = end;
+                }
+
+                const enum replay_verdict verdict = start_game(me, dims[0], dims[1], dims[2], dims[3]);
+                if (verdict != REPLAY_OK) {
+                    return verdict;
+                }
+
+                has_game = 1;
+            } else if (id_len == 6 && memcmp(id, "RESULT", 6) == 0) {
+                ptr = skip_spaces(ptr);
+                expect->result = strncmp(ptr, "1-0", 3) == 0 ? 1 : strncmp(ptr, "0-1", 3) == 0 ? 2 : 0;
+            }
+        } else if (isdigit(*ptr)) {
+            const int player = strtol(ptr, (char **)&ptr, 10);
+            if (player == 1 || player == 2) {
+                if (!has_game) {
+                    const enum replay_verdict verdict = start_game(me, 15, 23, 4, 5);
+                    if (verdict != REPLAY_OK) {
+                        return verdict;
+                    }
+                    has_game = 1;
+                }
+
+                if (player != me->state->active) {
+                    return REPLAY_ILLEGAL;
+                }
+
+                for (;;) {
+                    ptr = skip_spaces(ptr);
+                    if (*ptr == '\n' || *ptr == '\0') {
+                        break;
+                    }
+
+                    const enum step step = read_step(&ptr);
+                    if (step == INVALID_STEP) {
+                        return REPLAY_UNREADABLE;
+                    }
+
+                    if (replay_step(me->state, step) != REPLAY_OK) {
+                        return REPLAY_ILLEGAL;
+                    }
+
+                    ++*qsteps;
+                }
+            }
+        }
+
+        while (*ptr != '\n' && *ptr != '\0') {
+            ++ptr;
+        }
+        ptr += *ptr == '\n';
+    }
+
+    return has_game ? REPLAY_OK : REPLAY_UNREADABLE;
+}
+
+static void replay_file(
+    struct replay_worker * restrict const me,
+    const size_t index)
+{
+    const struct replay * const replay = me->replay;
+    const struct replay_job * const job = replay->jobs + index;
+    if (job->num < 0) {
+        return add_game(me, index + 1, REPLAY_UNREADABLE, 0);
+    }
+
+    const size_t path_sz = strlen(replay->dirname) + 64;
+    char path[path_sz];
+    snprintf(path, path_sz, "%s/games/%s/%06d.txt", replay->dirname, job->date, job->num);
+    if (read_file(me, path) != 0) {
+        return add_game(me, index + 1, REPLAY_UNREADABLE, 0);
+    }
+
+    struct replay_expect expect = job->expect;
+    uint64_t qsteps = 0;
+    enum replay_verdict verdict = replay_text(me, &expect, &qsteps);
+    if (verdict == REPLAY_OK) {
+        verdict = check_result(me->state, &expect, qsteps);
+    }
+
+    add_game(me, index + 1, verdict, qsteps);
+}
+
+static void * replay_worker_main(void * arg)
+{
+    struct replay_worker * restrict const me = arg;
+    struct replay * restrict const replay = me->replay;
+
+    search_slots_acquire(1);
+    for (;;) {
+        const size_t first = __atomic_fetch_add(&replay->next, REPLAY_CHUNK, __ATOMIC_RELAXED);
+        if (first >= replay->qjobs) {
+            break;
+        }
+
+        const size_t last = first + REPLAY_CHUNK < replay->qjobs ? first + REPLAY_CHUNK : replay->qjobs;
+        for (size_t i = first; i < last && me->status == 0; ++i) {
+            if (replay->archive) {
+                replay_record(me, i);
+            } else {
+                replay_file(me, i);
+            }
+        }
+    }
+
+    search_slots_release(1);
+    return NULL;
+}
+
+static int compare_bad(const void * a, const void * b)
+{
+    const struct replay_bad * const bad1 = a;
+    const struct replay_bad * const bad2 = b;
+    return (bad1->index > bad2->index) - (bad1->index < bad2->index);
+}
+
+static int run_replay(
+    struct replay * restrict const me,
+    int qthreads,
+    struct replay_report * restrict const report)
+{
+    memset(report, 0, sizeof(*report));
+    if (qthreads < 1) {
+        return EINVAL;
+    }
+
+    const size_t qchunks = (me->qjobs + REPLAY_CHUNK - 1) / REPLAY_CHUNK;
+    if ((size_t)qthreads > qchunks) {
+        qthreads = qchunks > 0 ? qchunks : 1;
+    }
+
+    struct replay_worker workers[qthreads];
+    memset(workers, 0, sizeof(workers));
+    me->workers = workers;
+    me->qworkers = qthreads;
+    me->next = 0;
+
+    int qstarted = 1;
+    for (int i = 0; i < qthreads; ++i) {
+        workers[i].replay = me;
+    }
+
+    for (; qstarted < qthreads; ++qstarted) {
+        if (pthread_create(&workers[qstarted].thread, NULL, replay_worker_main, workers + qstarted) != 0) {
+            break;
+        }
+    }
+
+    replay_worker_main(workers);
+
+    int status = 0;
+    size_t qbad = 0;
+    for (int i = 0; i < qthreads; ++i) {
+        if (i > 0 && i < qstarted) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        qbad += workers[i].qbad;
+    }
+
+    report->bad = malloc((qbad > 0 ? qbad : 1) * sizeof(struct replay_bad));
+    if (report->bad == NULL) {
+        status = ENOMEM;
+    }
+
+    for (int i = 0; i < qthreads; ++i) {
+        struct replay_worker * restrict const worker = workers + i;
+        if (worker->status != 0) {
+            status = worker->status;
+        }
+
+        report->qgames += worker->qgames;
+        report->qsteps += worker->qsteps;
+        if (report->bad) {
+            memcpy(report->bad + report->qbad, worker->bad, worker->qbad * sizeof(struct replay_bad));
+            report->qbad += worker->qbad;
+        }
+
+        free_worker_geometry(worker);
+        free(worker->bad);
+        free(worker->buf);
+    }
+
+    if (report->bad) {
+        qsort(report->bad, report->qbad, sizeof(struct replay_bad), compare_bad);
+    }
+
+    if (status != 0) {
+        free(report->bad);
+        report->bad = NULL;
+        report->qbad = 0;
+    }
+
+    return status;
+}
+
+int replay_archive(
+    const struct archive * const archive,
+    const int qthreads,
+    struct replay_report * restrict const report)
+{
+    struct replay replay = {
+        .archive = archive,
+        .qjobs = archive_qgames(archive),
+    };
+
+    return run_replay(&replay, qthreads, report);
+}
+
+
+
+/* Line "num\tname1\tname2\tresult\tqsteps\ttimestamp\tfail", fields may be padded */
+static void parse_stats_line(
+    struct replay_job * restrict const job,
+    char * const line)
+{
+    job->num = -1;
+
+    char * fields[7];
+    char * ptr = line;
+    for (int i = 0; i < 7; ++i) {
+        fields[i] = ptr;
+        ptr = strchr(ptr, i < 6 ? '\t' : '\n');
+        if (ptr == NULL) {
+            if (i < 6) {
+                return;
+            }
+        } else {
+            *ptr++ = '\0';
+        }
+    }
+
+    char * end;
+    const long num = strtol(fields[0], &end, 10);
+    const long qsteps = strtol(fields[4], &end, 10);
+    if (num < 0 || qsteps < 0 || end == fields[4]) {
+        return;
+    }
+
+    const char * const result = skip_spaces(fields[3]);
+    const char * const ts = skip_spaces(fields[5]);
+    const char * const fail = skip_spaces(fields[6]);
+    if (strlen(ts) < 10) {
+        return;
+    }
+
+    job->num = num;
+    memcpy(job->date, ts, 10);
+    job->date[10] = '\0';
+    job->expect.result = strncmp(result, "1-0", 3) == 0 ? 1 : strncmp(result, "0-1", 3) == 0 ? 2 : 0;
+    job->expect.failed = job->expect.result != 0 && strncmp(fail, "OK", 2) != 0;
+    job->expect.qsteps = qsteps;
+}
+
+int replay_dir(
+    const char * const dirname,
+    const int qthreads,
+    struct replay_report * restrict const report)
+{
+    memset(report, 0, sizeof(*report));
+
+    const size_t path_sz = strlen(dirname) + 32;
+    char path[path_sz];
+    snprintf(path, path_sz, "%s/games/stats.txt", dirname);
+
+    struct replay_worker reader = { 0 };
+    int status = read_file(&reader, path);
+    if (status != 0) {
+        free(reader.buf);
+        return status;
+    }
+
+    size_t qlines = 0;
+    for (const char * ptr = reader.buf; *ptr != '\0'; ++ptr) {
+        qlines += *ptr == '\n';
+    }
+
+    struct replay_job * restrict const jobs = malloc((qlines > 0 ? qlines : 1) * sizeof(struct replay_job));
+    if (jobs == NULL) {
+        free(reader.buf);
+        return ENOMEM;
+    }
+
+    char * line = reader.buf;
+    for (size_t i = 0; i < qlines; ++i) {
+        char * const next = strchr(line, '\n') + 1;
+        parse_stats_line(jobs + i, line);
+        line = next;
+    }
+
+    free(reader.buf);
+
+    struct replay replay = {
+        .dirname = dirname,
+        .jobs = jobs,
+        .qjobs = qlines,
+    };
+
+    status = run_replay(&replay, qthreads, report);
+    free(jobs);
+    return status;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#define QREPLAY_GAMES     40
+#define QREPLAY_THREADS   3
+
+/* Bad games: the result is swapped, illegal step, step after the end */
+#define REPLAY_BAD_RESULT   7
+#define REPLAY_BAD_STEP     13
+#define REPLAY_BAD_TAIL     28
+
+/* Random legal game, unfinished if it is too long */
+static unsigned int random_game(
+    struct state * restrict const state,
+    uint8_t * restrict const steps,
+    const unsigned int max_qsteps,
+    uint64_t seed)
+{
+    unsigned int qsteps = 0;
+    while (state_status(state) == IN_PROGRESS && qsteps < max_qsteps) {
+        const steps_t possible = state_get_steps(state);
+        seed = mix64(seed + 1);
+        steps_t rest = possible;
+        for (int skip = seed % step_count(possible); skip > 0; --skip) {
+            rest &= rest - 1;
+        }
+
+        const enum step step = extract_step(&rest);
+        if (state_step(state, step) == NO_WAY) {
+            test_fail("Possible step %s is rejected.", step_names[step]);
+        }
+
+        steps[qsteps++] = step;
+    }
+
+    return qsteps;
+}
+
+static unsigned int make_game(
+    struct state * restrict const state,
+    const struct state * const start,
+    struct archive_game * restrict const game,
+    uint8_t * restrict const steps,
+    const int index)
+{
+    memset(game, 0, sizeof(*game));
+    game->width = 15;
+    game->height = 23;
+    game->goal_width = 4;
+    game->free_kick_len = 5;
+    game->seed = index;
+
+    state_copy(state, start);
+    game->qsteps = random_game(state, steps, index % 5 == 4 ? 10 : 4000, mix64(index));
+    const enum state_status status = state_status(state);
+    game->result = status == WIN_1 ? 1 : status == WIN_2 ? 2 : 0;
+
+    if (index == REPLAY_BAD_RESULT) {
+        game->result = game->result == 1 ? 2 : 1;
+    }
+
+    if (index == REPLAY_BAD_STEP) {
+        state_copy(state, start);
+        state_step(state, steps[0]);
+        const steps_t possible = state_get_steps(state);
+        enum step step = 0;
+        while (possible & (1 << step)) {
+            ++step;
+        }
+        steps[1] = step;
+    }
+
+    if (index == REPLAY_BAD_TAIL) {
+        steps[game->qsteps++] = NORTH;
+    }
+
+    return game->qsteps;
+}
+
+static void check_report(
+    const struct replay_report * const report,
+    const size_t shift,
+    const int * const expected,
+    const size_t qexpected)
+{
+    if (report->qgames != QREPLAY_GAMES) {
+        test_fail("%zu games replayed, %d expected.", report->qgames, QREPLAY_GAMES);
+    }
+
+    if (report->qbad != qexpected) {
+        test_fail("%zu bad games, %zu expected.", report->qbad, qexpected);
+    }
+
+    for (size_t i = 0; i < qexpected; ++i) {
+        const struct replay_bad * const bad = report->bad + i;
+        if (bad->index != expected[2*i] + shift || (int)bad->verdict != expected[2*i+1]) {
+            test_fail("Bad game %zu is %zu (%s), %zu (%s) expected.", i,
+                bad->index, replay_verdict_names[bad->verdict],
+                expected[2*i] + shift, replay_verdict_names[expected[2*i+1]]);
+        }
+    }
+}
+
+static void write_text_game(
+    const char * const path,
+    const struct archive_game * const game,
+    const uint8_t * const steps,
+    struct state * restrict const state)
+{
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        test_fail("Cannot create %s, errno = %d.", path, errno);
+    }
+
+    const char * const result = game->result == 1 ? "1-0" : game->result == 2 ? "0-1" : "???";
+    fprintf(file, "DATE 2024-01-02T03:04:05\nPLAYER1 a\nPLAYER2 b\nRESULT %s\n", result);
+    fprintf(file, "GAME %u %u %u %u\n", game->width, game->height, game->goal_width, game->free_kick_len);
+
+    int active = 0;
+    for (unsigned int i = 0; i < game->qsteps; ++i) {
+        if (state->active != active) {
+            active = state->active;
+            fprintf(file, "%s%d", i > 0 ? "\n" : "", active);
+        }
+        fprintf(file, " %s", step_names[steps[i]]);
+        if (state_status(state) == IN_PROGRESS) {
+            state_step(state, steps[i]);
+        }
+    }
+
+    fprintf(file, "\n");
+    fclose(file);
+}
+
+int test_replay(void)
+{
+    char dirname[] = "/tmp/pf-replay-XXXXXX";
+    if (mkdtemp(dirname) == NULL) {
+        test_fail("mkdtemp failed, errno = %d.", errno);
+    }
+
+    const size_t path_sz = sizeof(dirname) + 64;
+    char archive_name[path_sz];
+    char path[path_sz];
+    snprintf(archive_name, path_sz, "%s/games.pfa", dirname);
+
+    struct geometry * restrict const geometry = create_std_geometry(15, 23, 4, 5);
+    struct state * restrict const start = create_state(geometry);
+    struct state * restrict const state = create_state(geometry);
+    struct archive_writer * restrict const writer = open_archive_writer(archive_name);
+    if (geometry == NULL || start == NULL || state == NULL || writer == NULL) {
+        test_fail("Cannot create geometry, states or archive writer, errno = %d.", errno);
+    }
+
+    snprintf(path, path_sz, "%s/games", dirname);
+    mkdir(path, 0777);
+    snprintf(path, path_sz, "%s/games/2024-01-02", dirname);
+    mkdir(path, 0777);
+    snprintf(path, path_sz, "%s/games/stats.txt", dirname);
+    FILE * stats = fopen(path, "w");
+    if (stats == NULL) {
+        test_fail("Cannot create %s, errno = %d.", path, errno);
+    }
+
+    static uint8_t steps[4096];
+    const char * const names[2] = { "a", "b" };
+    for (int i = 0; i < QREPLAY_GAMES; ++i) {
+        struct archive_game game;
+        const unsigned int qsteps = make_game(state, start, &game, steps, i);
+        const int status = archive_append(writer, &game, names, steps);
+        if (status != 0) {
+            test_fail("archive_append failed with code %d.", status);
+        }
+
+        /* Text games: the count of the last game is wrong in stats.txt */
+        const char * const result = game.result == 1 ? "1-0" : game.result == 2 ? "0-1" : "???";
+        const unsigned int stats_qsteps = qsteps + (i == QREPLAY_GAMES - 1);
+        fprintf(stats, "%6d\ta\tb\t%s\t%3u\t2024-01-02T03:04:05\tOK\n", i + 1, result, stats_qsteps);
+
+        snprintf(path, path_sz, "%s/games/2024-01-02/%06d.txt", dirname, i + 1);
+        state_copy(state, start);
+        write_text_game(path, &game, steps, state);
+    }
+
+    fclose(stats);
+    close_archive_writer(writer);
+
+    struct archive * restrict const archive = open_archive(archive_name);
+    if (archive == NULL) {
+        test_fail("open_archive failed, errno = %d.", errno);
+    }
+
+    static const int expected[] = {
+        REPLAY_BAD_RESULT, REPLAY_RESULT,
+        REPLAY_BAD_STEP, REPLAY_ILLEGAL,
+        REPLAY_BAD_TAIL, REPLAY_ILLEGAL,
+        QREPLAY_GAMES - 1, REPLAY_QSTEPS,
+    };
+
+    struct replay_report report;
+    int status = replay_archive(archive, QREPLAY_THREADS, &report);
+    if (status != 0) {
+        test_fail("replay_archive failed with code %d.", status);
+    }
+
+    /* The step count of an archive record is always consistent */
+    check_report(&report, 0, expected, 3);
+    if (report.bad[1].step != 1) {
+        test_fail("Illegal step %u is reported, 1 expected.", report.bad[1].step);
+    }
+
+    free(report.bad);
+    close_archive(archive);
+
+    status = replay_dir(dirname, QREPLAY_THREADS, &report);
+    if (status != 0) {
+        test_fail("replay_dir failed with code %d.", status);
+    }
+
+    check_report(&report, 1, expected, 4);
+    free(report.bad);
+
+    for (int i = 0; i < QREPLAY_GAMES; ++i) {
+        snprintf(path, path_sz, "%s/games/2024-01-02/%06d.txt", dirname, i + 1);
+        unlink(path);
+    }
+
+    snprintf(path, path_sz, "%s/games/stats.txt", dirname);
+    unlink(path);
+    snprintf(path, path_sz, "%s/games/2024-01-02", dirname);
+    rmdir(path);
+    snprintf(path, path_sz, "%s/games", dirname);
+    rmdir(path);
+    snprintf(path, path_sz, "%s.idx", archive_name);
+    unlink(path);
+    unlink(archive_name);
+    rmdir(dirname);
+
+    destroy_state(state);
+    destroy_state(start);
+    destroy_geometry(geometry);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,474 @@
+#include "paper-football.h"
+
+#include <pthread.h>
+
+struct selfplay_worker
+{
+    struct ai ais[2];
+    int qais;
+    struct state * state;
+    struct selfplay * selfplay;
+    pthread_t thread;
+};
+
+struct selfplay
+{
+    int qworkers;
+    struct selfplay_worker * workers;
+    const struct geometry * geometry;
+    struct state * start;
+    const struct ai * players[2];
+    ai_init inits[2];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+
+    struct selfplay_game * games;
+    int qgames;
+    int next;
+    uint8_t * finished;
+};
+
+struct selfplay * create_selfplay(
+    const struct ai * const players[2],
+    const ai_init inits[2],
+    const struct geometry * const geometry,
+    const int qworkers)
+{
+    if (qworkers < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const size_t sizes[2] = {
+        sizeof(struct selfplay),
+        qworkers * sizeof(struct selfplay_worker),
+    };
+
+    void * ptrs[2];
+    void * data = multialloc(2, sizes, ptrs, 64);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    struct selfplay * restrict const me = data;
+    me->workers = ptrs[1];
+    me->qworkers = 0;
+    me->geometry = geometry;
+    me->players[0] = players[0];
+    me->players[1] = players[1];
+    me->inits[0] = inits[0];
+    me->inits[1] = inits[1];
+    pthread_mutex_init(&me->mutex, NULL);
+    pthread_cond_init(&me->done, NULL);
+
+    me->start = create_state(geometry);
+    if (me->start == NULL) {
+        destroy_selfplay(me);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (int i = 0; i < qworkers; ++i) {
+        struct selfplay_worker * restrict const worker = me->workers + i;
+        worker->selfplay = me;
+        worker->qais = 0;
+        worker->state = create_state(geometry);
+        ++me->qworkers;
+
+        if (worker->state == NULL) {
+            destroy_selfplay(me);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        for (int j = 0; j < 2; ++j) {
+            struct ai * restrict const ai = worker->ais + j;
+            memset(ai, 0, sizeof(struct ai));
+            const int status = inits[j](ai, geometry);
+            if (status != 0) {
+                destroy_selfplay(me);
+                errno = status;
+                return NULL;
+            }
+
+            ++worker->qais;
+            copy_ai_params(ai, players[j]);
+        }
+    }
+
+    return me;
+}
+
+void destroy_selfplay(struct selfplay * restrict const me)
+{
+    for (int i = 0; i < me->qworkers; ++i) {
+        struct selfplay_worker * restrict const worker = me->workers + i;
+        for (int j = 0; j < worker->qais; ++j) {
+            struct ai * restrict const ai = worker->ais + j;
+            ai->free(ai);
+        }
+
+        if (worker->state) {
+            destroy_state(worker->state);
+        }
+    }
+
+    if (me->start) {
+        destroy_state(me->start);
+    }
+
+    pthread_cond_destroy(&me->done);
+    pthread_mutex_destroy(&me->mutex);
+    free(me);
+}
+
+static int push_step(
+    struct selfplay_worker * restrict const worker,
+    struct selfplay_game * restrict const game,
+    unsigned int qdone[2],
+    const enum step step)
+{
+    game->steps[game->qsteps++] = step;
+
+    for (int i = 0; i < 2; ++i) {
+        struct ai * restrict const player = worker->ais + i;
+        game->status = player->do_step(player, step);
+        if (game->status != 0) {
+            return game->status;
+        }
+        ++qdone[i];
+    }
+
+    return 0;
+}
+
+/* Random steps which do not finish the game, the same seed gives the same opening */
+static int play_opening(
+    struct selfplay_worker * restrict const worker,
+    struct selfplay_game * restrict const game,
+    unsigned int qdone[2])
+{
+    struct state * restrict const state = worker->state;
+    uint64_t seed = game->seed;
+
+    for (unsigned int i = 0; i < game->qopening && game->qsteps < MAX_SELFPLAY_STEPS; ++i) {
+        steps_t steps = state_get_steps(state);
+        enum step step = INVALID_STEP;
+        while (steps != 0) {
+            seed = mix64(seed + 0x9E3779B97F4A7C15ull);
+            steps_t rest = steps;
+            for (int skip = seed % step_count(steps); skip > 0; --skip) {
+                rest &= rest - 1;
+            }
+
+            const enum step candidate = extract_step(&rest);
+            steps &= ~((steps_t)1 << candidate);
+            if (state_step(state, candidate) == NO_WAY) {
+                continue;
+            }
+
+            if (state_status(state) == IN_PROGRESS) {
+                step = candidate;
+                break;
+            }
+
+            state_rollback(state, state->step_changes, state->qstep_changes);
+        }
+
+        if (step == INVALID_STEP) {
+            return 0;
+        }
+
+        if (push_step(worker, game, qdone, step) != 0) {
+            return game->status;
+        }
+    }
+
+    return 0;
+}
+
+static void play_game(
+    struct selfplay_worker * restrict const worker,
+    struct selfplay_game * restrict const game,
+    unsigned int qdone[2])
+{
+    struct state * restrict const state = worker->state;
+    state_copy(state, worker->selfplay->start);
+
+    if (play_opening(worker, game, qdone) != 0) {
+        return;
+    }
+
+    while (state_status(state) == IN_PROGRESS) {
+        if (game->qsteps == MAX_SELFPLAY_STEPS) {
+            return;
+        }
+
+        const int active = state->active;
+        struct ai * restrict const ai = worker->ais + ((active - 1) ^ !!game->swap);
+        const enum step step = ai->go(ai, NULL);
+        if (step == INVALID_STEP || state_step(state, step) == NO_WAY) {
+            game->failed = active;
+            game->winner = 3 - active;
+            return;
+        }
+
+        if (push_step(worker, game, qdone, step) != 0) {
+            return;
+        }
+    }
+
+    game->winner = state_status(state) == WIN_1 ? 1 : 2;
+}
+
+/* AIs are returned to the start position by undo, a new instance replaces a failed one */
+static int rewind_ais(
+    struct selfplay_worker * restrict const worker,
+    const unsigned int qdone[2])
+{
+    const struct selfplay * const me = worker->selfplay;
+    for (int i = 0; i < 2; ++i) {
+        struct ai * restrict const ai = worker->ais + i;
+        if (ai->undo_steps(ai, qdone[i]) == 0) {
+            continue;
+        }
+
+        ai->free(ai);
+        memset(ai, 0, sizeof(struct ai));
+        const int status = me->inits[i](ai, me->geometry);
+        if (status != 0) {
+            /* The worker is out of the game */
+            for (int j = i + 1; j < 2; ++j) {
+                worker->ais[j].free(worker->ais + j);
+            }
+            worker->qais = i;
+            return status;
+        }
+
+        copy_ai_params(ai, me->players[i]);
+    }
+
+    return 0;
+}
+
+static void * selfplay_worker_main(void * arg)
+{
+    struct selfplay_worker * restrict const worker = arg;
+    struct selfplay * restrict const me = worker->selfplay;
+
+    /* Players search in turn, slots are for the player with more threads */
+    const int qthreads1 = ai_qthreads(me->players[0]);
+    const int qthreads2 = ai_qthreads(me->players[1]);
+    const int qslots = qthreads1 > qthreads2 ? qthreads1 : qthreads2;
+    search_slots_acquire(qslots);
+
+    for (;;) {
+        const int igame = __atomic_fetch_add(&me->next, 1, __ATOMIC_RELAXED);
+        if (igame >= me->qgames) {
+            break;
+        }
+
+        struct selfplay_game * restrict const game = me->games + igame;
+        game->status = 0;
+        game->winner = 0;
+        game->failed = 0;
+        game->qsteps = 0;
+
+        if (worker->qais == 2) {
+            unsigned int qdone[2] = { 0, 0 };
+            play_game(worker, game, qdone);
+            const int status = rewind_ais(worker, qdone);
+            if (game->status == 0) {
+                game->status = status;
+            }
+        } else {
+            game->status = ENOTRECOVERABLE;
+        }
+
+        pthread_mutex_lock(&me->mutex);
+        me->finished[igame] = 1;
+        pthread_cond_broadcast(&me->done);
+        pthread_mutex_unlock(&me->mutex);
+    }
+
+    search_slots_release(qslots);
+    return NULL;
+}
+
+int selfplay_run(
+    struct selfplay * restrict const me,
+    struct selfplay_game * restrict const games,
+    const int qgames,
+    selfplay_done done,
+    void * const arg)
+{
+    if (qgames <= 0) {
+        return 0;
+    }
+
+    uint8_t * restrict const finished = calloc(qgames, 1);
+    if (finished == NULL) {
+        return ENOMEM;
+    }
+
+    me->games = games;
+    me->qgames = qgames;
+    me->next = 0;
+    me->finished = finished;
+
+    int qstarted = 0;
+    for (; qstarted < me->qworkers && qstarted < qgames; ++qstarted) {
+        struct selfplay_worker * restrict const worker = me->workers + qstarted;
+        if (pthread_create(&worker->thread, NULL, selfplay_worker_main, worker) != 0) {
+            break;
+        }
+    }
+
+    if (qstarted == 0) {
+        /* No threads, the caller plays all games */
+        selfplay_worker_main(me->workers);
+    }
+
+    for (int i = 0; i < qgames; ++i) {
+        pthread_mutex_lock(&me->mutex);
+        while (!finished[i]) {
+            pthread_cond_wait(&me->done, &me->mutex);
+        }
+        pthread_mutex_unlock(&me->mutex);
+
+        if (done != NULL) {
+            done(games + i, arg);
+        }
+    }
+
+    for (int i = 0; i < qstarted; ++i) {
+        pthread_join(me->workers[i].thread, NULL);
+    }
+
+    free(finished);
+    return 0;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#define QSELFPLAY_WORKERS   2
+#define QSELFPLAY_GAMES     5
+#define QSELFPLAY_OPENING   6
+#define QSELFPLAY_QTHINK    (16 * 1024)
+
+struct selfplay_check
+{
+    struct state * state;
+    const struct state * start;
+    int qdone;
+};
+
+static void check_selfplay_game(
+    const struct selfplay_game * const game,
+    void * const arg)
+{
+    struct selfplay_check * restrict const check = arg;
+    const int index = check->qdone++;
+
+    if (game->swap != (index & 1)) {
+        test_fail("Game %d is reported out of order.", index);
+    }
+
+    if (game->status != 0 || game->failed != 0) {
+        test_fail("Game %d: status %d, failed player %d.", index, game->status, game->failed);
+    }
+
+    struct state * restrict const state = check->state;
+    state_copy(state, check->start);
+    for (unsigned int i = 0; i < game->qsteps; ++i) {
+        if (state_status(state) != IN_PROGRESS) {
+            test_fail("Game %d: step %u after the end of the game.", index, i);
+        }
+
+        if (state_step(state, game->steps[i]) == NO_WAY) {
+            test_fail("Game %d: step %u (%s) is invalid.", index, i, step_names[game->steps[i]]);
+        }
+    }
+
+    const int winner = state_status(state) == WIN_1 ? 1 : state_status(state) == WIN_2 ? 2 : 0;
+    if (winner == 0 || winner != game->winner) {
+        test_fail("Game %d: winner %d is reported, the game result is %d.", index, game->winner, winner);
+    }
+}
+
+int test_selfplay(void)
+{
+    must_init_ctx(&protocol_empty);
+    struct ai * restrict const ai = ctx->ai;
+
+    const uint32_t qthink = QSELFPLAY_QTHINK;
+    must_set_param(ai, "qthink", &qthink);
+
+    struct ai random_ai;
+    memset(&random_ai, 0, sizeof(random_ai));
+    if (init_random_ai(&random_ai, ctx->geometry) != 0) {
+        test_fail("init_random_ai failed.");
+    }
+
+    const struct ai * const players[2] = { ai, &random_ai };
+    const ai_init inits[2] = { init_mcts_ai, init_random_ai };
+    struct selfplay * restrict const selfplay = create_selfplay(players, inits, ctx->geometry, QSELFPLAY_WORKERS);
+    if (selfplay == NULL) {
+        test_fail("create_selfplay failed, errno = %d.", errno);
+    }
+
+    struct selfplay_game * restrict const games = malloc(QSELFPLAY_GAMES * sizeof(struct selfplay_game));
+    struct state * restrict const state = create_state(ctx->geometry);
+    struct state * restrict const start = create_state(ctx->geometry);
+    if (games == NULL || state == NULL || start == NULL) {
+        test_fail("Allocation failed, errno = %d.", errno);
+    }
+
+    /* The second pass reuses the AI instances and plays paired openings */
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < QSELFPLAY_GAMES; ++i) {
+            games[i].swap = i & 1;
+            games[i].seed = i / 2;
+            games[i].qopening = pass * QSELFPLAY_OPENING;
+        }
+
+        struct selfplay_check check = { state, start, 0 };
+        const int status = selfplay_run(selfplay, games, QSELFPLAY_GAMES, check_selfplay_game, &check);
+        if (status != 0) {
+            test_fail("selfplay_run failed with code %d.", status);
+        }
+
+        if (check.qdone != QSELFPLAY_GAMES) {
+            test_fail("%d games of %d are reported.", check.qdone, QSELFPLAY_GAMES);
+        }
+
+        for (int i = 1; i < QSELFPLAY_GAMES; i += 2) {
+            const struct selfplay_game * const first = games + i - 1;
+            const unsigned int qopening = games[i].qopening;
+            const int is_paired = 1
+                && first->qsteps >= qopening
+                && games[i].qsteps >= qopening
+                && memcmp(first->steps, games[i].steps, qopening) == 0
+            ;
+
+            if (!is_paired) {
+                test_fail("Games %d and %d have different openings.", i - 1, i);
+            }
+        }
+    }
+
+    destroy_state(start);
+    destroy_state(state);
+    free(games);
+    destroy_selfplay(selfplay);
+    random_ai.free(&random_ai);
+    free_ctx();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,623 @@
+#include "paper-football.h"
+
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SERVER_BACKLOG  64
+
+struct server_session
+{
+    pid_t pid;             /* 0 for a free entry, -1 while forking */
+    uint64_t cache_used;
+};
+
+/* Shared between the server and all sessions */
+struct server_shared
+{
+    uint64_t cache_budget;
+    uint64_t cache_used;
+    int qslots;
+    sem_t free_slots;
+    sem_t acquire_lock;
+    pid_t lock_holder;
+    pid_t slot_holders[MAX_SERVER_SLOTS];
+    int max_sessions;
+    struct server_session sessions[];
+};
+
+/* Both are NULL in a standalone engine */
+static struct server_shared * shared = NULL;
+static struct server_session * session = NULL;
+
+static volatile sig_atomic_t is_stopped = 0;
+
+
+
+static void wait_sem(sem_t * restrict const sem)
+{
+    while (sem_wait(sem) != 0 && errno == EINTR) {
+    }
+}
+
+static void take_slot(const pid_t pid)
+{
+    wait_sem(&shared->free_slots);
+
+    /* The semaphore counts free holders, so one of them is free */
+    for (;;) {
+        for (int i = 0; i < shared->qslots; ++i) {
+            pid_t expected = 0;
+            if (__atomic_compare_exchange_n(shared->slot_holders + i, &expected, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+}
+
+static inline int limit_slots(const int count)
+{
+    if (shared == NULL) {
+        return 0;
+    }
+
+    return count < shared->qslots ? count : shared->qslots;
+}
+
+void search_slots_acquire(const int count)
+{
+    const int qslots = limit_slots(count);
+    if (qslots <= 0) {
+        return;
+    }
+
+    const pid_t pid = getpid();
+    if (qslots == 1) {
+        take_slot(pid);
+        return;
+    }
+
+    wait_sem(&shared->acquire_lock);
+    __atomic_store_n(&shared->lock_holder, pid, __ATOMIC_RELEASE);
+    for (int i = 0; i < qslots; ++i) {
+        take_slot(pid);
+    }
+    __atomic_store_n(&shared->lock_holder, 0, __ATOMIC_RELEASE);
+    sem_post(&shared->acquire_lock);
+}
+
+void search_slots_release(const int count)
+{
+    const int qslots = limit_slots(count);
+    if (qslots <= 0) {
+        return;
+    }
+
+    const pid_t pid = getpid();
+    int qreleased = 0;
+    for (int i = 0; i < shared->qslots && qreleased < qslots; ++i) {
+        pid_t expected = pid;
+        if (__atomic_compare_exchange_n(shared->slot_holders + i, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            sem_post(&shared->free_slots);
+            ++qreleased;
+        }
+    }
+}
+
+int cache_budget_take(const size_t sz)
+{
+    if (shared == NULL) {
+        return 0;
+    }
+
+    const uint64_t used = __atomic_add_fetch(&shared->cache_used, sz, __ATOMIC_RELAXED);
+    if (shared->cache_budget > 0 && used > shared->cache_budget) {
+        __atomic_sub_fetch(&shared->cache_used, sz, __ATOMIC_RELAXED);
+        return ENOMEM;
+    }
+
+    if (session) {
+        __atomic_add_fetch(&session->cache_used, sz, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+void cache_budget_return(const size_t sz)
+{
+    if (shared == NULL) {
+        return;
+    }
+
+    __atomic_sub_fetch(&shared->cache_used, sz, __ATOMIC_RELAXED);
+    if (session) {
+        __atomic_sub_fetch(&session->cache_used, sz, __ATOMIC_RELAXED);
+    }
+}
+
+
+
+/* Slots and cache bytes of a finished (maybe killed) session are returned */
+static void end_session(const pid_t pid)
+{
+    for (int i = 0; i < shared->max_sessions; ++i) {
+        struct server_session * restrict const item = shared->sessions + i;
+        if (item->pid == pid) {
+            __atomic_sub_fetch(&shared->cache_used, item->cache_used, __ATOMIC_RELAXED);
+            item->cache_used = 0;
+            item->pid = 0;
+            break;
+        }
+    }
+
+    for (int i = 0; i < shared->qslots; ++i) {
+        pid_t expected = pid;
+        if (__atomic_compare_exchange_n(shared->slot_holders + i, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            sem_post(&shared->free_slots);
+        }
+    }
+
+    pid_t expected = pid;
+    if (__atomic_compare_exchange_n(&shared->lock_holder, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        sem_post(&shared->acquire_lock);
+    }
+}
+
+static int reap_sessions(const int options)
+{
+    int qfinished = 0;
+    for (;;) {
+        const pid_t pid = waitpid(-1, NULL, options);
+        if (pid <= 0) {
+            return qfinished;
+        }
+
+        end_session(pid);
+        ++qfinished;
+        if (options != WNOHANG) {
+            return qfinished;
+        }
+    }
+}
+
+static void on_stop(int signum)
+{
+    is_stopped = 1;
+}
+
+static void on_child(int signum)
+{
+    /* Only interrupts accept */
+}
+
+static void set_handler(const int signum, void (* handler)(int))
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signum, &sa, NULL);
+}
+
+/* Client fds are moved to 0, 1 and 2, with passed fds the connection stays open to signal the end of session */
+static int start_session(
+    const int fd,
+    session_main entry,
+    void * arg)
+{
+    set_handler(SIGINT, SIG_DFL);
+    set_handler(SIGTERM, SIG_DFL);
+    set_handler(SIGCHLD, SIG_DFL);
+
+    char byte;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    const ssize_t qread = recvmsg(fd, &msg, 0);
+    if (qread <= 0) {
+        return EIO;
+    }
+
+    int fds[3] = { fd, fd, fd };
+    const struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+    const int has_fds = cmsg != NULL
+        && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(fds));
+
+    if (has_fds) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        if (dup2(fds[i], i) < 0) {
+            return errno;
+        }
+    }
+
+    if (has_fds) {
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] > 2) {
+                close(fds[i]);
+            }
+        }
+    } else {
+        /* The first byte is a part of the first command */
+        close(fd);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        ungetc(byte, stdin);
+    }
+
+    return entry(arg);
+}
+
+static int listen_socket(const char * const path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        const int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+int run_server(
+    const struct server_params * const params,
+    session_main entry,
+    void * arg)
+{
+    if (params->max_sessions < 1 || params->qslots < 0 || params->qslots > MAX_SERVER_SLOTS) {
+        return EINVAL;
+    }
+
+    const size_t shared_sz = sizeof(struct server_shared) + params->max_sessions * sizeof(struct server_session);
+    void * const ptr = mmap(NULL, shared_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return errno;
+    }
+
+    memset(ptr, 0, shared_sz);
+    shared = ptr;
+    shared->cache_budget = params->cache_budget;
+    shared->qslots = params->qslots;
+    shared->max_sessions = params->max_sessions;
+    if (sem_init(&shared->free_slots, 1, params->qslots) != 0) {
+        const int status = errno;
+        munmap(ptr, shared_sz);
+        shared = NULL;
+        return status;
+    }
+
+    if (sem_init(&shared->acquire_lock, 1, 1) != 0) {
+        const int status = errno;
+        sem_destroy(&shared->free_slots);
+        munmap(ptr, shared_sz);
+        shared = NULL;
+        return status;
+    }
+
+    const int listen_fd = listen_socket(params->path);
+    if (listen_fd < 0) {
+        const int status = errno;
+        sem_destroy(&shared->acquire_lock);
+        sem_destroy(&shared->free_slots);
+        munmap(ptr, shared_sz);
+        shared = NULL;
+        return status;
+    }
+
+    is_stopped = 0;
+    set_handler(SIGINT, on_stop);
+    set_handler(SIGTERM, on_stop);
+    set_handler(SIGCHLD, on_child);
+
+    int status = 0;
+    int qsessions = 0;
+    while (!is_stopped) {
+        qsessions -= reap_sessions(WNOHANG);
+        if (qsessions == params->max_sessions) {
+            qsessions -= reap_sessions(0);
+            continue;
+        }
+
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            status = errno;
+            break;
+        }
+
+        struct server_session * restrict item = shared->sessions;
+        while (item->pid != 0) {
+            ++item;
+        }
+        item->pid = -1;
+
+        fflush(stdout);
+        fflush(stderr);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            session = item;
+            exit(start_session(fd, entry, arg));
+        }
+
+        close(fd);
+        if (pid < 0) {
+            item->pid = 0;
+            continue;
+        }
+
+        item->pid = pid;
+        ++qsessions;
+    }
+
+    close(listen_fd);
+    unlink(params->path);
+
+    for (int i = 0; i < params->max_sessions; ++i) {
+        if (shared->sessions[i].pid > 0) {
+            kill(shared->sessions[i].pid, SIGTERM);
+        }
+    }
+
+    while (qsessions > 0) {
+        const int qfinished = reap_sessions(0);
+        if (qfinished == 0 && errno == ECHILD) {
+            break;
+        }
+        qsessions -= qfinished;
+    }
+
+    set_handler(SIGINT, SIG_DFL);
+    set_handler(SIGTERM, SIG_DFL);
+    set_handler(SIGCHLD, SIG_DFL);
+
+    sem_destroy(&shared->acquire_lock);
+    sem_destroy(&shared->free_slots);
+    munmap(ptr, shared_sz);
+    shared = NULL;
+    return status;
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+#include <poll.h>
+
+#define SERVER_TEST_BUDGET     1000
+#define SERVER_TEST_TIMEOUT    5000
+
+/* Commands: "take n" prints the status of cache_budget_take, "slot n" waits for n search slots */
+static int test_session(void * arg)
+{
+    char * line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, stdin) != -1) {
+        if (strncmp(line, "take ", 5) == 0) {
+            printf("%d\n", cache_budget_take(atoi(line + 5)));
+        } else if (strncmp(line, "slot", 4) == 0) {
+            search_slots_acquire(atoi(line + 4));
+            printf("slot\n");
+        }
+        fflush(stdout);
+    }
+
+    free(line);
+    return 0;
+}
+
+static int connect_server(const char * const path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            test_fail("socket failed, errno = %d.", errno);
+        }
+
+        if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+
+        close(fd);
+        usleep(20000);
+    }
+
+    test_fail("Cannot connect to %s, errno = %d.", path, errno);
+    return -1;
+}
+
+/* NULL on timeout */
+static const char * read_reply(
+    const int fd,
+    char * restrict const buf,
+    const size_t buf_sz,
+    const int timeout)
+{
+    size_t len = 0;
+    while (len + 1 < buf_sz) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) != 1 || read(fd, buf + len, 1) != 1) {
+            return NULL;
+        }
+
+        if (buf[len] == '\n') {
+            break;
+        }
+        ++len;
+    }
+
+    buf[len] = '\0';
+    return buf;
+}
+
+static void check_reply(
+    const int fd,
+    const char * const expected)
+{
+    char buf[64];
+    const char * const reply = read_reply(fd, buf, sizeof(buf), SERVER_TEST_TIMEOUT);
+    if (reply == NULL) {
+        test_fail("No reply, \"%s\" expected.", expected);
+    }
+
+    if (strcmp(reply, expected) != 0) {
+        test_fail("Reply \"%s\", \"%s\" expected.", reply, expected);
+    }
+}
+
+static void send_line(
+    const int fd,
+    const char * const line)
+{
+    const ssize_t len = strlen(line);
+    if (write(fd, line, len) != len) {
+        test_fail("Cannot write \"%s\", errno = %d.", line, errno);
+    }
+}
+
+int test_server(void)
+{
+    char dirname[] = "/tmp/pf-server-XXXXXX";
+    if (mkdtemp(dirname) == NULL) {
+        test_fail("mkdtemp failed, errno = %d.", errno);
+    }
+
+    char path[sizeof(dirname) + 8];
+    snprintf(path, sizeof(path), "%s/sock", dirname);
+
+    const struct server_params params = {
+        .path = path,
+        .max_sessions = 4,
+        .qslots = 2,
+        .cache_budget = SERVER_TEST_BUDGET,
+    };
+
+    const pid_t server = fork();
+    if (server < 0) {
+        test_fail("fork failed, errno = %d.", errno);
+    }
+
+    if (server == 0) {
+        _exit(run_server(&params, test_session, NULL));
+    }
+
+    /* Session A uses the connection */
+    const int fd1 = connect_server(path);
+    send_line(fd1, "take 600\n");
+    check_reply(fd1, "0");
+
+    /* Session B passes pipes, as the Python client does */
+    const int fd2 = connect_server(path);
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) {
+        test_fail("pipe failed, errno = %d.", errno);
+    }
+
+    const int fds[3] = { in[0], out[1], out[1] };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    char byte = '\n';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd2, &msg, 0) != 1) {
+        test_fail("sendmsg failed, errno = %d.", errno);
+    }
+
+    close(in[0]);
+    close(out[1]);
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%d", ENOMEM);
+    send_line(in[1], "take 600\n");
+    check_reply(out[0], buf);
+
+    /* A slot is held by A, B asks for more slots than the pool has and waits
+     * for both slots until A ends without release */
+    send_line(fd1, "slot 1\n");
+    check_reply(fd1, "slot");
+    send_line(in[1], "slot 3\n");
+    if (read_reply(out[0], buf, sizeof(buf), 200) != NULL) {
+        test_fail("Search slots are acquired while one of them is held.");
+    }
+
+    close(fd1);
+    check_reply(out[0], "slot");
+    send_line(in[1], "take 600\n");
+    check_reply(out[0], "0");
+
+    kill(server, SIGTERM);
+    int wstatus;
+    if (waitpid(server, &wstatus, 0) != server || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        test_fail("Server is not finished properly, status %d.", wstatus);
+    }
+
+    if (read_reply(out[0], buf, sizeof(buf), SERVER_TEST_TIMEOUT) != NULL) {
+        test_fail("Session B is alive after the server stop.");
+    }
+
+    close(in[1]);
+    close(out[0]);
+    close(fd2);
+    rmdir(dirname);
+    return 0;
+}
+
+#endif
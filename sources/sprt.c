@@ -0,0 +1,124 @@
+#include "paper-football.h"
+
+#include <math.h>
+
+static double logistic_score(const double elo)
+{
+    return 1.0 / (1.0 + pow(10.0, -elo / 400.0));
+}
+
+static double logistic_elo(const double score)
+{
+    return -400.0 * log10(1.0 / score - 1.0);
+}
+
+#define SPRT_PRIOR_PAIRS    2.0
+#define SPRT_PRIOR_VARIANCE 0.0625
+#define SPRT_Z95            1.959964
+
+void sprt_eval(
+    const struct sprt * const me,
+    struct sprt_result * restrict const result)
+{
+    uint32_t qpairs = 0;
+    double sum = 0.0;
+    for (int i = 0; i < 5; ++i) {
+        qpairs += me->penta[i];
+        sum += 0.25 * i * me->penta[i];
+    }
+
+    result->qpairs = qpairs;
+    result->lower = log(me->beta / (1.0 - me->alpha));
+    result->upper = log((1.0 - me->beta) / me->alpha);
+    result->decision = SPRT_CONTINUE;
+
+    if (qpairs == 0) {
+        result->score = 0.5;
+        result->elo = 0.0;
+        result->elo_error = INFINITY;
+        result->llr = 0.0;
+        return;
+    }
+
+    const double score = sum / qpairs;
+    double variance = 0.0;
+    for (int i = 0; i < 5; ++i) {
+        const double delta = 0.25 * i - score;
+        variance += delta * delta * me->penta[i];
+    }
+
+    /* Prior pairs keep the variance sane on a few games without losses (or wins) */
+    variance += SPRT_PRIOR_PAIRS * SPRT_PRIOR_VARIANCE;
+    variance /= qpairs + SPRT_PRIOR_PAIRS;
+
+    const double eps = 0.25 / qpairs;
+    const double clamped = score < eps ? eps : score > 1.0 - eps ? 1.0 - eps : score;
+    const double margin = SPRT_Z95 * sqrt(variance / qpairs);
+    const double low = clamped - margin < eps ? eps : clamped - margin;
+    const double high = clamped + margin > 1.0 - eps ? 1.0 - eps : clamped + margin;
+
+    result->score = score;
+    result->elo = logistic_elo(clamped);
+    result->elo_error = 0.5 * (logistic_elo(high) - logistic_elo(low));
+
+    const double s0 = logistic_score(me->elo0);
+    const double s1 = logistic_score(me->elo1);
+    result->llr = qpairs * (s1 - s0) * (2.0 * score - s0 - s1) / (2.0 * variance);
+
+    if (result->llr >= result->upper) {
+        result->decision = SPRT_H1;
+    } else if (result->llr <= result->lower) {
+        result->decision = SPRT_H0;
+    }
+}
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+struct sprt_case
+{
+    uint32_t penta[5];
+    double elo;
+    enum sprt_decision decision;
+};
+
+int test_sprt(void)
+{
+    static const struct sprt_case cases[] = {
+        { { 0, 0, 0, 0, 0 }, 0.0, SPRT_CONTINUE },
+        { { 10, 20, 40, 20, 10 }, 0.0, SPRT_CONTINUE },
+        { { 0, 0, 0, 0, 60 }, 951.4, SPRT_H1 },
+        { { 60, 0, 0, 0, 0 }, -951.4, SPRT_H0 },
+        { { 100, 200, 400, 200, 100 }, 0.0, SPRT_H0 },
+        { { 50, 150, 400, 250, 150 }, 52.5, SPRT_H1 },
+    };
+
+    const int qcases = sizeof(cases) / sizeof(cases[0]);
+    for (int i = 0; i < qcases; ++i) {
+        const struct sprt_case * const test = cases + i;
+        struct sprt sprt = { .elo0 = 0.0, .elo1 = 20.0, .alpha = 0.05, .beta = 0.05 };
+        memcpy(sprt.penta, test->penta, sizeof(sprt.penta));
+
+        struct sprt_result result;
+        sprt_eval(&sprt, &result);
+
+        if (fabs(result.elo - test->elo) > 0.1) {
+            test_fail("Case %d: elo %.2f, expected %.2f.", i, result.elo, test->elo);
+        }
+
+        if (result.decision != test->decision) {
+            test_fail("Case %d: decision %d, expected %d (llr %.3f).", i, result.decision, test->decision, result.llr);
+        }
+
+        if (result.qpairs > 0 && !(result.elo_error > 0.0)) {
+            test_fail("Case %d: non-positive error bar %f.", i, result.elo_error);
+        }
+    }
+
+    return 0;
+}
+
+#endif
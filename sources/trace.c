@@ -0,0 +1,754 @@
+#include "paper-football.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC         0x43525446  /* "FTRC" */
+#define TRACE_VERSION       2
+#define TRACE_RING_BITS    14
+#define TRACE_RING_SZ      (1u << TRACE_RING_BITS)
+#define TRACE_FLIGHT_LEN   4096
+#define TRACE_MAX_DUMPS      16
+#define TRACE_ENV          "PAPER_FOOTBALL_TRACE"
+#define TRACE_DIR_ENV      "PAPER_FOOTBALL_TRACE_DIR"
+
+enum trace_tag { TAG_THREAD = 1, TAG_RECORD };
+
+/*
+ * Every conversion takes the next argument of the record except %N, it is
+ * the node index. Besides printf ones: %W prints the argument as spaces,
+ * %T is a title, %s is a step name, %M is a warning message and %f prints a
+ * fraction recorded with TRACE_FIXED.
+ */
+static const char * const event_formats[QTRACE_EVENTS] = {
+    [TRACE_EOL] = "\n",
+    [TRACE_WARN] = "WARN W%04d: %M at line %d\n",
+    [TRACE_ALLOC_OVERFLOW] = "Func alloc_node - overflow\n",
+    [TRACE_ALLOC_NODE] = "Func alloc_node - new %c-node %N\n",
+    [TRACE_SELECT_ENTER] = "Func select_answer - enter\n",
+    [TRACE_SELECT_ONE] = "  only one answer, return 0\n",
+    [TRACE_SELECT_RANDOM] = "  clean paren node (free kick) return random %d\n",
+    [TRACE_SELECT_CHILD_NULL] = "  child %d: NULL\n",
+    [TRACE_SELECT_UNEXPLORED] = "  child %d (node %N): unexplored, return %d\n",
+    [TRACE_SELECT_CHILD] = "  child %d (node %N): ev=%.4f qgames=%.0f weight=%.4f\n",
+    [TRACE_SELECT_NONE] = "  no valid answers, return 0\n",
+    [TRACE_SELECT_RESULT] = "  return %d from qbest=%d\n",
+    [TRACE_STEP] = "Step %s\n",
+    [TRACE_BALL_MOVE] = "Func bsf_ball_move - node=%N index=%d ball=%d count=%d\n",
+    [TRACE_BALL_MOVE_COUNT_OOR] = "  count out of range\n",
+    [TRACE_BALL_MOVE_ALLOC_FAILED] = "  alloc_answers failed\n",
+    [TRACE_BALL_MOVE_PNODE_NULL] = "  pnode %d is NULL\n",
+    [TRACE_EXPAND_WIN] = "Func expand_answers - found win\n",
+    [TRACE_EXPAND_SERIES] = "Func expand_answers - found %d series\n",
+    [TRACE_EXPAND_ALLOC_FAILED] = "Func expand_answers - alloc_answers failed with code %d\n",
+    [TRACE_EXPAND_GET_ANSWER] = "Func expand_answers - get_answer %d for node %N\n",
+    [TRACE_ITERATION] = "\n\n-------- new simulation iteration ---------------------\n\n",
+    [TRACE_NO_ANSWERS] = "Func simulate - no answers available, active=%d\n",
+    [TRACE_SELECTED] = "<-- select_answer: result=%d from qanswers=%d\n\n",
+    [TRACE_NEXT_CHILD] = "Func simulate - next child, index=%N\n",
+    [TRACE_APPLY_ANSWER] = "Func simulate - apply answer %d from node %N\n",
+    [TRACE_PUSH_HISTORY] = "Func simulate - push node %N to history, active=%d\n",
+    [TRACE_WIN_1] = "Func simulate - WIN_1 detected\n",
+    [TRACE_WIN_2] = "Func simulate - WIN_2 detected\n",
+    [TRACE_ITERATION_DONE] = "iteration done\n",
+    [TRACE_OUT_OF_NODES] = "Func simulate - out of nodes\n",
+    [TRACE_NEW_CHILD] = "Func simulate - allocated new child, index=%N\n",
+    [TRACE_ROLLOUT_START] = "\n\n------------- rollout ----------------------------\n\n",
+    [TRACE_ROLLOUT] = "Rollout %c%d\n",
+    [TRACE_SNAPSHOT_START] = "\n\n------------------ snapshot ----------------------\n\n",
+    [TRACE_SIMULATION_DONE] = "\n\n-------- simulation finished ---------------------\n\n",
+    [TRACE_BEST_PREPARATION] = "Func best_preparation - ibest = %d\n",
+    [TRACE_RETURN_PREPARATION] = "Func ai_go - return preparaion %s\n",
+    [TRACE_GO_PROGRESS] = "Func ai_go - qgames=%d qthink=%d of %d\n",
+    [TRACE_GO_START] = "\n\n======== ai=>go, choosing answer =================\n\n",
+    [TRACE_GO_ANSWER_NULL] = "Func ai_go answer[%d] is NULL\n",
+    [TRACE_GO_BEST] = "Func ai_go best_answer=%d\n",
+    [TRACE_GO_BEST_NULL] = "Func ai_go best node is null for answer %d\n",
+    [TRACE_GO_BAD_TYPE] = "Func ai_go unexpected best node type!\n",
+    [TRACE_SIMULATION] = "\nSimulation %d\n",
+    [TRACE_NODE] = "%WNode #%N <%T> score=%d qgames=%d\n",
+    [TRACE_NODE_TYPE] = "%W  opts: type=%c",
+    [TRACE_NODE_STEP] = " step=%s",
+    [TRACE_NODE_QANSWERS] = " qanswers=%d",
+    [TRACE_NODE_QSTEPS] = " qsteps=%d steps=%02X\n",
+    [TRACE_NODE_CHILDREN] = "%W  children:",
+    [TRACE_NODE_PATH] = "%W  path:",
+    [TRACE_CHILD] = " %d",
+    [TRACE_PATH_STEP] = " %s",
+    [TRACE_EXNODE] = "ExNode #%N <%c>",
+    [TRACE_SERIE] = "    [%d] -",
+    [TRACE_BALL_MOVES] = "BallMoves - qballs=%d (sorted by distance)\n",
+    [TRACE_BALL_MOVES_ITEM] = "  [%d] - ball=%d distance=%u count=%d\n",
+    [TRACE_SNAPSHOT_NODE] = "%Wnode-%c #%N: score=%d qgames=%d",
+    [TRACE_SNAPSHOT_NO_STEPS] = " steps=0",
+    [TRACE_SNAPSHOT_STEP] = " %s",
+    [TRACE_SNAPSHOT_NEXT_STEP] = "|%s",
+    [TRACE_SNAPSHOT_BALL] = " ball=%d",
+    [TRACE_STATE] = "State <%T>: active=%d ball=%d",
+    [TRACE_STATE_STEP1] = " step1=%s",
+    [TRACE_STATE_STEP2] = " step2=%s",
+    [TRACE_STATE_STEP12] = " step12=%016llX",
+};
+
+static const char * const titles[QTRACE_TITLES] = {
+    [TRACE_TITLE_NODE] = "node",
+    [TRACE_TITLE_PNODE] = "pnode",
+    [TRACE_TITLE_PWIN] = "pwin",
+    [TRACE_TITLE_MWIN] = "mwin",
+    [TRACE_TITLE_CHILDREN] = "children",
+    [TRACE_TITLE_BALLMOVE] = "ballmove",
+    [TRACE_TITLE_RESULT] = "result",
+    [TRACE_TITLE_CURRENT] = "current",
+    [TRACE_TITLE_NEXT] = "next",
+    [TRACE_TITLE_LAST] = "last",
+    [TRACE_TITLE_ROOT] = "root",
+    [TRACE_TITLE_CHILD] = "child",
+    [TRACE_TITLE_BEST] = "best",
+};
+
+struct trace_record
+{
+    uint16_t event;
+    uint16_t reserved;
+    int32_t node;
+    int64_t args[TRACE_QARGS];
+};
+
+struct trace_ring
+{
+    uint64_t head;     /* Count of all records */
+    uint64_t flushed;  /* Count of written records in the full mode */
+    uint32_t thread;
+    struct trace_ring * next;
+    struct trace_record records[TRACE_RING_SZ];
+};
+
+
+
+/*
+ * File: header, then entries starting with a tag byte, all numbers are LEB128
+ * varints. Thread (index) switches the thread of following records. Record is
+ * the event id, then the node and TRACE_QARGS arguments as zigzag integers.
+ */
+
+struct trace_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+/* Conversion of a format: flags, width, precision, length and the conversion char */
+struct trace_spec
+{
+    const char * start;
+    const char * length;
+    char conv;
+};
+
+/* Returns 0 at the end of the format, otherwise *ptr is moved after the spec */
+static int next_spec(
+    const char ** restrict const ptr,
+    struct trace_spec * restrict const spec)
+{
+    const char * p = strchr(*ptr, '%');
+    if (p == NULL) {
+        *ptr += strlen(*ptr);
+        return 0;
+    }
+
+    spec->start = p++;
+    while (*p != '\0' && strchr("-+ #0.", *p) != NULL) {
+        ++p;
+    }
+    while (isdigit(*p) || *p == '.') {
+        ++p;
+    }
+
+    spec->length = p;
+    while (*p != '\0' && strchr("hlzjL", *p) != NULL) {
+        ++p;
+    }
+
+    spec->conv = *p;
+    if (*p != '\0') {
+        ++p;
+    }
+
+    *ptr = p;
+    return 1;
+}
+
+static inline uint64_t zigzag(const int64_t value)
+{
+    return ((uint64_t)value << 1) ^ -((uint64_t)value >> 63);
+}
+
+static inline int64_t unzigzag(const uint64_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+static int read_varint(
+    FILE * f,
+    uint64_t * restrict const value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const int c = getc(f);
+        if (c == EOF) {
+            return EINVAL;
+        }
+
+        result |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return EINVAL;
+}
+
+static inline const char * name_of(
+    const char * const * const names,
+    const int qnames,
+    const int64_t index)
+{
+    return index >= 0 && index < qnames ? names[index] : "?";
+}
+
+/* The format is applied spec by spec, integer specs get the ll length */
+static void print_record(
+    FILE * f,
+    const struct trace_record * const record)
+{
+    const char * ptr = event_formats[record->event];
+    int iarg = 0;
+
+    for (;;) {
+        const char * const literal = ptr;
+        struct trace_spec desc;
+        const int has_spec = next_spec(&ptr, &desc);
+        const char * const literal_end = has_spec ? desc.start : ptr;
+        fwrite(literal, 1, literal_end - literal, f);
+        if (!has_spec) {
+            break;
+        }
+
+        const char conv = desc.conv;
+        if (conv == '%') {
+            fputc('%', f);
+            continue;
+        }
+
+        if (conv == 'N') {
+            fprintf(f, "%d", record->node);
+            continue;
+        }
+
+        const int64_t arg = iarg < TRACE_QARGS ? record->args[iarg++] : 0;
+        const int prefix_len = desc.length - desc.start;
+        char spec[32];
+
+        switch (conv) {
+            case 'W':
+                fprintf(f, "%*s", (int)(arg > 0 && arg < 256 ? arg : 0), "");
+                break;
+            case 'T':
+                fputs(name_of(titles, QTRACE_TITLES, arg), f);
+                break;
+            case 's':
+                fputs(name_of(step_names, QSTEPS, arg), f);
+                break;
+            case 'M':
+                fputs(warns_message(arg), f);
+                break;
+            case 'c':
+                fputc((int)arg, f);
+                break;
+            case 'f':
+                snprintf(spec, sizeof(spec), "%.*sf", prefix_len, desc.start);
+                fprintf(f, spec, (double)arg / TRACE_FIXED);
+                break;
+            default:
+                snprintf(spec, sizeof(spec), "%.*sll%c", prefix_len, desc.start, conv);
+                fprintf(f, spec, (long long)arg);
+                break;
+        }
+    }
+}
+
+static int decode_thread(
+    FILE * f,
+    FILE * output,
+    uint64_t * restrict const thread,
+    int * restrict const has_thread)
+{
+    uint64_t value;
+    const int status = read_varint(f, &value);
+    if (status != 0) {
+        return status;
+    }
+
+    /* Threads are marked in traces of several threads */
+    if (*has_thread && value != *thread) {
+        fprintf(output, "--- thread %" PRIu64 " ---\n", value);
+    }
+
+    *thread = value;
+    *has_thread = 1;
+    return 0;
+}
+
+static int decode_record(
+    FILE * f,
+    FILE * output)
+{
+    uint64_t values[2 + TRACE_QARGS];
+    for (int i = 0; i < 2 + TRACE_QARGS; ++i) {
+        const int status = read_varint(f, values + i);
+        if (status != 0) {
+            return status;
+        }
+    }
+
+    if (values[0] >= QTRACE_EVENTS) {
+        return EINVAL;
+    }
+
+    struct trace_record record;
+    record.event = values[0];
+    record.node = unzigzag(values[1]);
+    for (int i = 0; i < TRACE_QARGS; ++i) {
+        record.args[i] = unzigzag(values[2 + i]);
+    }
+
+    print_record(output, &record);
+    return 0;
+}
+
+int trace_decode(
+    const char * const filename,
+    void * out)
+{
+    FILE * const f = fopen(filename, "rb");
+    if (f == NULL) {
+        return errno;
+    }
+
+    FILE * const output = out;
+    struct trace_file_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fclose(f);
+        return EINVAL;
+    }
+
+    uint64_t thread = 0;
+    int has_thread = 0;
+    int status = 0;
+
+    int tag;
+    while (status == 0 && (tag = getc(f)) != EOF) {
+        switch (tag) {
+            case TAG_THREAD:
+                status = decode_thread(f, output, &thread, &has_thread);
+                break;
+            case TAG_RECORD:
+                status = decode_record(f, output);
+                break;
+            default:
+                status = EINVAL;
+                break;
+        }
+    }
+
+    fclose(f);
+    return status;
+}
+
+
+
+#if ENABLE_LOGS || defined(MAKE_CHECK)
+
+struct trace_writer
+{
+    FILE * f;
+    uint32_t thread;
+    int has_thread;
+};
+
+static int init_writer(
+    struct trace_writer * restrict const me,
+    FILE * f)
+{
+    const struct trace_file_header header = { TRACE_MAGIC, TRACE_VERSION };
+    me->f = f;
+    me->thread = 0;
+    me->has_thread = 0;
+    return fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : EIO;
+}
+
+static inline uint8_t * put_varint(
+    uint8_t * restrict ptr,
+    uint64_t value)
+{
+    while (value >= 0x80) {
+        *ptr++ = value | 0x80;
+        value >>= 7;
+    }
+    *ptr++ = value;
+    return ptr;
+}
+
+static int writer_record(
+    struct trace_writer * restrict const me,
+    const uint32_t thread,
+    const struct trace_record * const record)
+{
+    uint8_t buf[16 + 10 * (2 + TRACE_QARGS)];
+    uint8_t * ptr = buf;
+
+    if (!me->has_thread || me->thread != thread) {
+        *ptr++ = TAG_THREAD;
+        ptr = put_varint(ptr, thread);
+        me->thread = thread;
+        me->has_thread = 1;
+    }
+
+    *ptr++ = TAG_RECORD;
+    ptr = put_varint(ptr, record->event);
+    ptr = put_varint(ptr, zigzag(record->node));
+    for (int i = 0; i < TRACE_QARGS; ++i) {
+        ptr = put_varint(ptr, zigzag(record->args[i]));
+    }
+
+    const size_t size = ptr - buf;
+    return fwrite(buf, 1, size, me->f) == size ? 0 : EIO;
+}
+
+#endif
+
+
+
+#if ENABLE_LOGS
+
+enum trace_mode { TRACE_OFF, TRACE_FULL, TRACE_FLIGHT };
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static enum trace_mode trace_mode = TRACE_OFF;
+static const char * trace_dir = NULL;
+
+/* Under the lock */
+static struct trace_ring * rings = NULL;
+static uint32_t qthreads = 0;
+static int qdumps = 0;
+static struct trace_writer full_writer = { .f = NULL };
+
+static __thread struct trace_ring * ring = NULL;
+
+static FILE * create_trace_file(void)
+{
+    const size_t filename_sz = strlen(trace_dir) + 32;
+    char filename[filename_sz];
+    for (int i = 1; i <= 9999; i++) {
+        snprintf(filename, filename_sz, "%s/mcts-trace-%04d.bin", trace_dir, i);
+        const int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            return NULL;
+        }
+
+        fprintf(stderr, "MCTS trace file: %s\n", filename);
+        return fdopen(fd, "wb");
+    }
+
+    return NULL;
+}
+
+static void flush_ring(struct trace_ring * restrict const me)
+{
+    pthread_mutex_lock(&trace_lock);
+
+    if (full_writer.f == NULL) {
+        FILE * const f = create_trace_file();
+        if (f == NULL || init_writer(&full_writer, f) != 0) {
+            trace_mode = TRACE_OFF;
+        }
+    }
+
+    if (full_writer.f != NULL) {
+        for (uint64_t i = me->flushed; i != me->head; ++i) {
+            writer_record(&full_writer, me->thread, me->records + (i & (TRACE_RING_SZ - 1)));
+        }
+        fflush(full_writer.f);
+    }
+
+    me->flushed = me->head;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void release_ring(void * arg)
+{
+    struct trace_ring * restrict const me = arg;
+    if (trace_mode == TRACE_FULL) {
+        flush_ring(me);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    struct trace_ring ** ptr = &rings;
+    while (*ptr != NULL && *ptr != me) {
+        ptr = &(*ptr)->next;
+    }
+    if (*ptr != NULL) {
+        *ptr = me->next;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    free(me);
+}
+
+static void trace_exit(void)
+{
+    if (trace_mode != TRACE_FULL) {
+        return;
+    }
+
+    for (struct trace_ring * ptr = rings; ptr != NULL; ptr = ptr->next) {
+        flush_ring(ptr);
+    }
+
+    if (full_writer.f != NULL) {
+        fclose(full_writer.f);
+        full_writer.f = NULL;
+    }
+}
+
+/* Without a directory nothing is written, the full mode works as the flight one */
+static void trace_init(void)
+{
+    const char * const mode = getenv(TRACE_ENV);
+    trace_dir = getenv(TRACE_DIR_ENV);
+    if (mode == NULL || strcmp(mode, "flight") == 0) {
+        trace_mode = TRACE_FLIGHT;
+    } else if (strcmp(mode, "full") == 0) {
+        trace_mode = trace_dir != NULL ? TRACE_FULL : TRACE_FLIGHT;
+    } else {
+        trace_mode = TRACE_OFF;
+        return;
+    }
+
+    pthread_key_create(&ring_key, release_ring);
+    if (trace_mode == TRACE_FULL) {
+        atexit(trace_exit);
+    }
+}
+
+static struct trace_ring * get_ring(void)
+{
+    pthread_once(&trace_once, trace_init);
+    if (trace_mode == TRACE_OFF) {
+        return NULL;
+    }
+
+    struct trace_ring * restrict const me = malloc(sizeof(struct trace_ring));
+    if (me == NULL) {
+        return NULL;
+    }
+
+    me->head = 0;
+    me->flushed = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    me->thread = qthreads++;
+    me->next = rings;
+    rings = me;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(ring_key, me);
+    ring = me;
+    return me;
+}
+
+int trace_is_full(void)
+{
+    pthread_once(&trace_once, trace_init);
+    return trace_mode == TRACE_FULL;
+}
+
+void trace_add(
+    const enum trace_event event,
+    const int32_t node,
+    const int64_t arg1,
+    const int64_t arg2,
+    const int64_t arg3,
+    const int64_t arg4)
+{
+    struct trace_ring * restrict const me = ring != NULL ? ring : get_ring();
+    if (me == NULL) {
+        return;
+    }
+
+    struct trace_record * restrict const record = me->records + (me->head & (TRACE_RING_SZ - 1));
+    record->event = event;
+    record->reserved = 0;
+    record->node = node;
+    record->args[0] = arg1;
+    record->args[1] = arg2;
+    record->args[2] = arg3;
+    record->args[3] = arg4;
+    ++me->head;
+
+    if (trace_mode == TRACE_FULL && me->head - me->flushed == TRACE_RING_SZ) {
+        flush_ring(me);
+    }
+}
+
+/* Flight recorder: the last records of the thread are dumped into a new file */
+void trace_warn(const struct warn * const warn)
+{
+    trace_add(TRACE_WARN, 0, warn->num, warn->num, warn->line_num, 0);
+
+    struct trace_ring * restrict const me = ring;
+    if (me == NULL || trace_mode != TRACE_FLIGHT || trace_dir == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    const int is_allowed = qdumps < TRACE_MAX_DUMPS;
+    qdumps += is_allowed;
+    pthread_mutex_unlock(&trace_lock);
+
+    if (!is_allowed) {
+        return;
+    }
+
+    FILE * const f = create_trace_file();
+    if (f == NULL) {
+        return;
+    }
+
+    struct trace_writer writer;
+    if (init_writer(&writer, f) == 0) {
+        const uint64_t qrecords = me->head < TRACE_FLIGHT_LEN ? me->head : TRACE_FLIGHT_LEN;
+        for (uint64_t i = me->head - qrecords; i != me->head; ++i) {
+            writer_record(&writer, me->thread, me->records + (i & (TRACE_RING_SZ - 1)));
+        }
+    }
+
+    fclose(f);
+}
+
+#endif
+
+
+
+#ifdef MAKE_CHECK
+
+#include "insider.h"
+
+/* The record is written into the file */
+static void write_event(
+    struct trace_writer * restrict const writer,
+    const uint32_t thread,
+    const enum trace_event event,
+    const int32_t node,
+    const int64_t arg1,
+    const int64_t arg2,
+    const int64_t arg3,
+    const int64_t arg4)
+{
+    const struct trace_record record = {
+        .event = event,
+        .node = node,
+        .args = { arg1, arg2, arg3, arg4 },
+    };
+
+    const int status = writer_record(writer, thread, &record);
+    if (status != 0) {
+        test_fail("writer_record failed with code %d.", status);
+    }
+}
+
+int test_trace(void)
+{
+    for (int i = 0; i < QTRACE_EVENTS; ++i) {
+        if (event_formats[i] == NULL) {
+            test_fail("No format for trace event %d.", i);
+        }
+    }
+
+    for (int i = 0; i < QTRACE_TITLES; ++i) {
+        if (titles[i] == NULL) {
+            test_fail("No trace title %d.", i);
+        }
+    }
+
+    char filename[] = "/tmp/pf-trace-XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0) {
+        test_fail("mkstemp failed, errno = %d.", errno);
+    }
+
+    FILE * const f = fdopen(fd, "wb");
+    struct trace_writer writer;
+    if (f == NULL || init_writer(&writer, f) != 0) {
+        test_fail("Cannot init trace writer, errno = %d.", errno);
+    }
+
+    write_event(&writer, 0, TRACE_GO_PROGRESS, 0, -5, 4000000000ll, 7, 0);
+    write_event(&writer, 0, TRACE_NODE, 17, 2, TRACE_TITLE_PNODE, -1, 3);
+    write_event(&writer, 0, TRACE_NODE_TYPE, 17, 2, 'P', 0, 0);
+    write_event(&writer, 0, TRACE_NODE_STEP, 17, NORTH_EAST, 0, 0, 0);
+    write_event(&writer, 0, TRACE_NODE_QSTEPS, 17, 2, 0xA, 0, 0);
+    write_event(&writer, 0, TRACE_SELECT_CHILD, 12345678, 3, 5250, 1230000, -2500);
+    write_event(&writer, 0, TRACE_STATE, 0, TRACE_TITLE_NEXT, 2, 108, 0);
+    write_event(&writer, 0, TRACE_STATE_STEP12, 0, 0x0123456789ABCDEFll, 0, 0, 0);
+    write_event(&writer, 0, TRACE_EOL, 0, 0, 0, 0, 0);
+    write_event(&writer, 0, TRACE_WARN, 0, WARN_BSF_ALLOC_FAILED, WARN_BSF_ALLOC_FAILED, 42, 0);
+    write_event(&writer, 3, TRACE_ROLLOUT, 0, '-', 1, 0, 0);
+    write_event(&writer, 3, TRACE_PATH_STEP, 0, QSTEPS, 0, 0, 0);
+    write_event(&writer, 3, TRACE_EOL, 0, 0, 0, 0, 0);
+
+    char expected[1024];
+    snprintf(expected, sizeof(expected),
+        "Func ai_go - qgames=-5 qthink=4000000000 of 7\n"
+        "  Node #17 <pnode> score=-1 qgames=3\n"
+        "    opts: type=P step=%s qsteps=2 steps=0A\n"
+        "  child 3 (node 12345678): ev=0.5250 qgames=123 weight=-0.2500\n"
+        "State <next>: active=2 ball=108 step12=0123456789ABCDEF\n"
+        "WARN W%04d: %s at line 42\n"
+        "--- thread 3 ---\n"
+        "Rollout -1\n"
+        " ?\n",
+        step_names[NORTH_EAST], WARN_BSF_ALLOC_FAILED, warns_message(WARN_BSF_ALLOC_FAILED));
+
+    fclose(f);
+
+    char * text = NULL;
+    size_t text_sz = 0;
+    FILE * const out = open_memstream(&text, &text_sz);
+    const int status = trace_decode(filename, out);
+    fclose(out);
+    unlink(filename);
+
+    if (status != 0) {
+        test_fail("trace_decode failed with code %d.", status);
+    }
+
+    if (strcmp(text, expected) != 0) {
+        test_fail("Decoded text differs:\n%s\nexpected:\n%s", text, expected);
+    }
+
+    free(text);
+    return 0;
+}
+
+#endif
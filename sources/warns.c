@@ -55,6 +55,13 @@ void warns_add(
     warn->file_name = file_name;
     warn->line_num = line_num;
     ++ws->qwarns;
+
+    trace_warn(warn);
+}
+
+const char * warns_message(const int num)
+{
+    return num > 0 && num < QWARNS ? messages[num] : messages[0];
 }
 
 void warns_reset(struct warns * const ws)
@@ -0,0 +1,343 @@
+#include "insider.h"
+#include "paper-football.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALL_STEPS        INT_MAX
+#define MAX_ENGINE_STEPS     100
+#define MOVE_BUF_SZ          512
+
+#define DEF_QTHINK  (1024 * 1024)
+#define DEF_SEED            1
+
+const char * test_name = "bench";
+
+void test_fail(const char * const fmt, ...)
+{
+    fprintf(stderr, "Bench fails: ");
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void info(const char * const fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+
+
+/* Positions are protocols of db.c, qsteps < 0 drops steps from the end */
+struct bench_item
+{
+    const char * name;
+    const struct game_protocol * protocol;
+    int qsteps;
+};
+
+static const struct bench_item items[] = {
+    { "empty", &protocol_empty, ALL_STEPS },
+    { "free-kick-1", &protocol_fastest_free_kick1, -1 },
+    { "free-kick-2", &protocol_fastest_free_kick2, -1 },
+    { "after-free-kick-1", &protocol_fastest_free_kick1, ALL_STEPS },
+    { "after-free-kick-2", &protocol_fastest_free_kick2, ALL_STEPS },
+    { "step12-overflow", &protocol_step12_overflow_bug_example, -1 },
+    { "with-hang-midgame", &protocol_with_hang, 60 },
+    { "with-hang", &protocol_with_hang, ALL_STEPS },
+    { "game-000050-midgame", &protocol_000050, 30 },
+    { "game-000461-end", &protocol_000461, -1 },
+    { "game-002255-midgame", &protocol_002255, 30 },
+    { "game-002255-end", &protocol_002255, -1 },
+    { NULL, NULL, 0 }
+};
+
+struct bench_result
+{
+    int qsteps;
+    uint64_t qplayouts;
+    uint64_t qnodes;
+    uint64_t qstate_steps;
+    double time;
+    long peak_rss;
+    char move[MOVE_BUF_SZ];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int get_qsteps(const struct bench_item * const item)
+{
+    const int total = item->protocol->qsteps;
+    if (item->qsteps == ALL_STEPS) {
+        return total;
+    }
+
+    if (item->qsteps < 0) {
+        return total + item->qsteps;
+    }
+
+    return item->qsteps < total ? item->qsteps : total;
+}
+
+/* One move of the active player, as "ai go" makes it */
+static void bench_run(
+    const struct bench_item * const item,
+    const uint32_t qthink,
+    const unsigned int seed,
+    struct bench_result * restrict const result)
+{
+    memset(result, 0, sizeof(struct bench_result));
+    result->qsteps = get_qsteps(item);
+
+    srand(seed);
+    must_init_ctx(item->protocol);
+    struct ai * restrict const ai = ctx->ai;
+    must_set_param(ai, "qthink", &qthink);
+
+    const int status = ai->do_steps(ai, result->qsteps, item->protocol->steps);
+    if (status != 0) {
+        test_fail("position %s: do_steps failed with code %d, %s.", item->name, status, ai->error);
+    }
+
+    const struct state * const state = ai->get_state(ai);
+    if (state_status(state) != IN_PROGRESS) {
+        test_fail("position %s: game is over.", item->name);
+    }
+
+    const int active = state->active;
+    size_t move_len = 0;
+
+    for (int qsteps = 0; qsteps < MAX_ENGINE_STEPS; ++qsteps) {
+        struct ai_explanation explanation = { 0 };
+
+        const double start = now();
+        const enum step step = ai->go(ai, &explanation);
+        result->time += now() - start;
+
+        if (step < 0 || step >= INVALID_STEP) {
+            test_fail("position %s: ai->go returns invalid step %d.", item->name, step);
+        }
+
+        const struct search_explanation * const search = &explanation.search;
+        result->qplayouts += search->qplayouts;
+        result->qstate_steps += search->qstate_steps;
+        for (int i = 0; i < QNODE_TYPES; ++i) {
+            result->qnodes += search->qanswers[i];
+        }
+
+        move_len += snprintf(result->move + move_len, MOVE_BUF_SZ - move_len,
+            "%s%s", move_len > 0 ? " " : "", step_names[step]);
+        if (move_len >= MOVE_BUF_SZ) {
+            move_len = MOVE_BUF_SZ - 1;
+        }
+
+        const int status = ai->do_step(ai, step);
+        if (status != 0) {
+            test_fail("position %s: ai->do_step(%s) failed with code %d.", item->name, step_names[step], status);
+        }
+
+        if (state_status(state) != IN_PROGRESS || state->active != active) {
+            break;
+        }
+    }
+
+    free_ctx();
+}
+
+/* Every position runs in a child process, so ru_maxrss of the child is the peak of this position */
+static void bench_fork(
+    const struct bench_item * const item,
+    const uint32_t qthink,
+    const unsigned int seed,
+    struct bench_result * restrict const result)
+{
+    struct bench_result * restrict const shared = mmap(NULL, sizeof(struct bench_result),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        test_fail("position %s: mmap failed, errno is %d.", item->name, errno);
+    }
+
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == -1) {
+        test_fail("position %s: fork failed, errno is %d.", item->name, errno);
+    }
+
+    if (pid == 0) {
+        bench_run(item, qthink, seed, shared);
+        _exit(0);
+    }
+
+    int wstatus;
+    struct rusage usage;
+    if (wait4(pid, &wstatus, 0, &usage) != pid) {
+        test_fail("position %s: wait4 failed, errno is %d.", item->name, errno);
+    }
+
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        test_fail("position %s: child process fails, wait status is %d.", item->name, wstatus);
+    }
+
+    memcpy(result, shared, sizeof(struct bench_result));
+    result->peak_rss = usage.ru_maxrss;
+    munmap(shared, sizeof(struct bench_result));
+}
+
+static double per_sec(const uint64_t value, const double time)
+{
+    return time > 0.0 ? value / time : 0.0;
+}
+
+static void print_text(
+    const char * const name,
+    const struct bench_result * const result)
+{
+    printf("%-20s %5d %10" PRIu64 " %12.0f %12.0f %8.3f %8ld  %s\n",
+        name, result->qsteps, result->qplayouts,
+        per_sec(result->qplayouts, result->time),
+        per_sec(result->qnodes, result->time),
+        result->time, result->peak_rss / 1024, result->move);
+}
+
+/* JSON lines, one object per position and the total */
+static void print_json(
+    const char * const name,
+    const struct bench_result * const result,
+    const uint32_t qthink,
+    const unsigned int seed)
+{
+    printf("{\"position\": \"%s\", \"qsteps\": %d, \"qthink\": %u, \"seed\": %u, "
+        "\"playouts\": %" PRIu64 ", \"nodes\": %" PRIu64 ", \"state_steps\": %" PRIu64 ", "
+        "\"time\": %.6f, \"playouts_per_sec\": %.1f, \"nodes_per_sec\": %.1f, "
+        "\"peak_rss_kb\": %ld, \"move\": \"%s\"}\n",
+        name, result->qsteps, qthink, seed,
+        result->qplayouts, result->qnodes, result->qstate_steps,
+        result->time, per_sec(result->qplayouts, result->time), per_sec(result->qnodes, result->time),
+        result->peak_rss, result->move);
+}
+
+static void print_usage(const char * const program)
+{
+    fprintf(stderr, "Usage: %s [--json] [--qthink n] [--seed n] [position ...]\n", program);
+    fprintf(stderr, "Positions:");
+    for (const struct bench_item * item = items; item->name != NULL; ++item) {
+        fprintf(stderr, " %s", item->name);
+    }
+    fprintf(stderr, "\n");
+}
+
+static int parse_uint(const char * const str, unsigned long * restrict const value)
+{
+    char * end;
+    errno = 0;
+    *value = strtoul(str, &end, 10);
+    return errno != 0 || end == str || *end != '\0' ? EINVAL : 0;
+}
+
+int main(const int argc, const char * const argv[])
+{
+    int is_json = 0;
+    uint32_t qthink = DEF_QTHINK;
+    unsigned int seed = DEF_SEED;
+    const char * names[argc];
+    int qnames = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char * const arg = argv[i];
+        unsigned long value;
+
+        if (strcmp(arg, "--json") == 0) {
+            is_json = 1;
+        } else if (strcmp(arg, "--qthink") == 0 && i + 1 < argc && parse_uint(argv[i+1], &value) == 0 && value > 0 && value <= UINT32_MAX) {
+            qthink = value;
+            ++i;
+        } else if (strcmp(arg, "--seed") == 0 && i + 1 < argc && parse_uint(argv[i+1], &value) == 0 && value <= UINT_MAX) {
+            seed = value;
+            ++i;
+        } else if (arg[0] != '-') {
+            names[qnames++] = arg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < qnames; ++i) {
+        const struct bench_item * item = items;
+        while (item->name != NULL && strcmp(item->name, names[i]) != 0) {
+            ++item;
+        }
+
+        if (item->name == NULL) {
+            fprintf(stderr, "Position “%s” is not found.\n", names[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!is_json) {
+        printf("qthink %u, seed %u\n", qthink, seed);
+        printf("%-20s %5s %10s %12s %12s %8s %8s  %s\n",
+            "position", "steps", "playouts", "playouts/s", "nodes/s", "time", "peak MB", "move");
+    }
+
+    struct bench_result total = { 0 };
+    snprintf(total.move, MOVE_BUF_SZ, "-");
+
+    for (const struct bench_item * item = items; item->name != NULL; ++item) {
+        int is_selected = qnames == 0;
+        for (int i = 0; i < qnames; ++i) {
+            is_selected |= strcmp(item->name, names[i]) == 0;
+        }
+
+        if (!is_selected) {
+            continue;
+        }
+
+        struct bench_result result;
+        bench_fork(item, qthink, seed, &result);
+
+        total.qsteps += result.qsteps;
+        total.qplayouts += result.qplayouts;
+        total.qnodes += result.qnodes;
+        total.qstate_steps += result.qstate_steps;
+        total.time += result.time;
+        total.peak_rss = result.peak_rss > total.peak_rss ? result.peak_rss : total.peak_rss;
+
+        if (is_json) {
+            print_json(item->name, &result, qthink, seed);
+        } else {
+            print_text(item->name, &result);
+        }
+        fflush(stdout);
+    }
+
+    if (is_json) {
+        print_json("total", &total, qthink, seed);
+    } else {
+        print_text("total", &total);
+    }
+
+    return 0;
+}
@@ -286,3 +286,173 @@ struct game_protocol protocol_002255 = {
     .qsteps = ARRAY_LEN(steps_from_game_002255_loop_in_engine_answer),
     .steps = steps_from_game_002255_loop_in_engine_answer,
 };
+
+const struct game_protocol * const game_protocols[] = {
+    &protocol_empty,
+    &protocol_fastest_free_kick1,
+    &protocol_fastest_free_kick2,
+    &protocol_step12_overflow_bug_example,
+    &protocol_with_hang,
+    &protocol_000050,
+    &protocol_000461,
+    &protocol_002255,
+    NULL
+};
+
+
+
+/* Leaf counts checked against the rules before the table-driven steps */
+struct perft_reference perft_references[] = {
+    { &protocol_empty, 0, 5, 13680 },
+    { &protocol_empty, 0, 6, 82808 },
+    { &protocol_empty, 0, 7, 496544 },
+    { &protocol_fastest_free_kick1, ARRAY_LEN(fastest_free_kick1), 4, 1761 },
+    { &protocol_fastest_free_kick1, ARRAY_LEN(fastest_free_kick1), 5, 9584 },
+    { &protocol_fastest_free_kick2, ARRAY_LEN(fastest_free_kick2), 5, 9625 },
+    { &protocol_step12_overflow_bug_example, ARRAY_LEN(steps_step12_overflow_bug_example) - 1, 5, 996 },
+    { &protocol_000461, ARRAY_LEN(game_000461) - 1, 5, 1842 },
+    { &protocol_000461, ARRAY_LEN(game_000461) - 1, 6, 10288 },
+    { &protocol_002255, ARRAY_LEN(steps_from_game_002255_loop_in_engine_answer), 4, 773 },
+    { NULL, 0, 0, 0 }
+};
+
+
+
+static void must_push_position(
+    struct recording * restrict const me,
+    const struct state * const state,
+    const enum step step)
+{
+    struct recorded_position * const positions = realloc(me->positions, (me->qpositions + 1) * sizeof(struct recorded_position));
+    if (positions == NULL) {
+        test_fail("realloc positions failed, errno = %d.", errno);
+    }
+    me->positions = positions;
+
+    struct state * restrict const copy = create_state(state->geometry);
+    if (copy == NULL) {
+        test_fail("create_state failed, errno = %d.", errno);
+    }
+    state_copy(copy, state);
+
+    positions[me->qpositions].state = copy;
+    positions[me->qpositions].step = step;
+    ++me->qpositions;
+}
+
+static void must_record_series(struct recording * restrict const me)
+{
+    struct bsf_free_kicks * fks[me->qgeometries];
+    for (int i = 0; i < me->qgeometries; ++i) {
+        fks[i] = create_bsf_free_kicks(me->geometries[i], BSF_CAPACITY, MAX_FREE_KICK_SERIE, 8, 8);
+        if (fks[i] == NULL) {
+            test_fail("create_bsf_free_kicks failed, errno = %d.", errno);
+        }
+    }
+
+    struct warns warns;
+    warns_init(&warns);
+
+    for (int i = 0; i < me->qpositions; ++i) {
+        const struct recorded_position * const position = me->positions + i;
+        if (!is_free_kick_situation(position->state)) {
+            continue;
+        }
+
+        struct bsf_free_kicks * restrict const bsf = fks[recording_geometry_index(me, position->state->geometry)];
+        bsf_gen(&warns, bsf, position->state);
+
+        struct recorded_serie * const series = realloc(me->series, (me->qseries + bsf->qseries) * sizeof(struct recorded_serie));
+        if (series == NULL && bsf->qseries > 0) {
+            test_fail("realloc series failed, errno = %d.", errno);
+        }
+        me->series = series;
+
+        for (int j = 0; j < bsf->qseries; ++j) {
+            if (bsf->series[j].qsteps <= MAX_FREE_KICK_SERIE) {
+                me->series[me->qseries].position = position;
+                me->series[me->qseries].serie = bsf->series[j];
+                ++me->qseries;
+            }
+        }
+    }
+
+    for (int i = 0; i < me->qgeometries; ++i) {
+        destroy_bsf_free_kicks(fks[i]);
+    }
+}
+
+struct recording * must_create_recording(void)
+{
+    struct recording * restrict const me = calloc(1, sizeof(struct recording));
+    if (me == NULL) {
+        test_fail("calloc recording failed, errno = %d.", errno);
+    }
+
+    int qprotocols = 0;
+    while (game_protocols[qprotocols] != NULL) {
+        ++qprotocols;
+    }
+
+    me->geometries = calloc(qprotocols, sizeof(struct geometry *));
+    if (me->geometries == NULL) {
+        test_fail("calloc geometries failed, errno = %d.", errno);
+    }
+
+    for (int i = 0; i < qprotocols; ++i) {
+        const struct game_protocol * const protocol = game_protocols[i];
+        struct geometry * const geometry = must_create_protocol_geometry(protocol);
+        me->geometries[me->qgeometries++] = geometry;
+
+        struct state * restrict const state = create_state(geometry);
+        if (state == NULL) {
+            test_fail("create_state failed, errno = %d.", errno);
+        }
+
+        /* Protocols may end with an illegal step, recording stops there */
+        for (int j = 0; j < protocol->qsteps && state_status(state) == IN_PROGRESS; ++j) {
+            const enum step step = protocol->steps[j];
+            if (((state_get_steps(state) >> step) & 1) == 0) {
+                break;
+            }
+
+            must_push_position(me, state, step);
+            state_step(state, step);
+        }
+
+        destroy_state(state);
+    }
+
+    must_record_series(me);
+    return me;
+}
+
+void destroy_recording(struct recording * restrict const me)
+{
+    for (int i = 0; i < me->qpositions; ++i) {
+        destroy_state(me->positions[i].state);
+    }
+
+    for (int i = 0; i < me->qgeometries; ++i) {
+        destroy_geometry(me->geometries[i]);
+    }
+
+    free(me->series);
+    free(me->positions);
+    free(me->geometries);
+    free(me);
+}
+
+int recording_geometry_index(
+    const struct recording * const me,
+    const struct geometry * const geometry)
+{
+    for (int i = 0; i < me->qgeometries; ++i) {
+        if (me->geometries[i] == geometry) {
+            return i;
+        }
+    }
+
+    test_fail("geometry %p is not found in recording.", geometry);
+    return -1;
+}
@@ -65,6 +65,11 @@ const struct test_item tests[] = {
     { "step", &test_step },
     { "step2", &test_step2 },
     { "history", &test_history },
+    { "gen-step12", &test_gen_step12 },
+    { "step-lines", &test_step_lines },
+    { "journal-overflow", &test_journal_overflow },
+    { "gen-turns", &test_gen_turns },
+    { "position-record", &test_position_record },
     { "step12-overflow", &test_step12_overflow_error },
     { "geometry-straight-dist", &test_geometry_straight_dist},
     { "random-ai", &test_random_ai },
@@ -75,7 +80,10 @@ const struct test_item tests[] = {
     { "simulation", &test_simulation },
     { "random-ai-unstep", &test_random_ai_unstep},
     { "mcts-ai-unstep", &test_mcts_ai_unstep},
+    { "mcts-srand", &test_mcts_srand},
+    { "search-stats", &test_search_stats},
     { "cycle-detection", &test_cycle_detection},
+    { "cycle-set-random", &test_cycle_set_random},
     { "preparation", &test_preparation},
     { "gen-complete-free-kicks", &test_gen_complete_free_kicks},
     { "gen-complete-free-kicks-win", &test_gen_complete_free_kicks_win},
@@ -83,6 +91,22 @@ const struct test_item tests[] = {
     { "long-free-kick-to-loose", &test_long_free_kick_to_loose},
     { "gen-complete-free-kicks-long", &test_gen_complete_free_kicks_long},
     { "pack-unpack-serie", &test_pack_unpack_serie},
+    { "many-answers", &test_many_answers},
+    { "gen-parallel-free-kicks", &test_gen_parallel_free_kicks},
+    { "gen-free-kicks-transpositions", &test_gen_free_kicks_transpositions},
+    { "gen-free-kicks-many-series", &test_gen_free_kicks_many_series},
+    { "alloc-free-search", &test_alloc_free_search},
+    { "perft", &test_perft},
+    { "ai-pool", &test_ai_pool},
+    { "annotate", &test_annotate},
+    { "selfplay", &test_selfplay},
+    { "sprt", &test_sprt},
+    { "archive", &test_archive},
+    { "replay", &test_replay},
+    { "server", &test_server},
+    { "mux", &test_mux},
+    { "mux-bsf", &test_mux_bsf},
+    { "trace", &test_trace},
 
     { "debug-ai-go", &debug_ai_go},
     { "debug-simulate", &debug_simulate},
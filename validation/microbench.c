@@ -0,0 +1,285 @@
+#include "insider.h"
+#include "paper-football.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEF_REPS           20
+#define DEF_WARMUP          3
+#define MAX_REPS         1000
+#define MIN_SAMPLE_TIME  1e-3
+#define MAX_QRUNS     (1 << 24)
+
+const char * test_name = "microbench";
+
+void test_fail(const char * const fmt, ...)
+{
+    fprintf(stderr, "Microbench fails: ");
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void info(const char * const fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+
+
+/* Kernel tables live in MICROBENCH blocks of their sources, most kernels are static */
+
+static const struct microbench * const tables[] = {
+    game_microbenches,
+    enginelib_microbenches,
+    mcts_microbenches,
+    NULL
+};
+
+struct sample_stats
+{
+    int qsamples;
+    uint64_t ops_per_sample;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Time of qruns calls, prepare is called before every run and is not counted */
+static double run_sample(
+    const struct microbench * const bench,
+    void * const data,
+    const int qruns,
+    uint64_t * restrict const qops)
+{
+    double time = 0.0;
+    *qops = 0;
+
+    for (int i = 0; i < qruns; ++i) {
+        if (bench->prepare != NULL) {
+            bench->prepare(data);
+        }
+
+        const double start = now();
+        *qops += bench->run(data);
+        time += now() - start;
+    }
+
+    return time;
+}
+
+/* Runs per sample are doubled until a sample takes MIN_SAMPLE_TIME */
+static int calibrate(
+    const struct microbench * const bench,
+    void * const data)
+{
+    int qruns = 1;
+    for (;;) {
+        uint64_t qops;
+        const double time = run_sample(bench, data, qruns, &qops);
+        if (qops == 0) {
+            test_fail("kernel %s: no recorded inputs.", bench->name);
+        }
+
+        if (time >= MIN_SAMPLE_TIME || qruns >= MAX_QRUNS) {
+            return qruns;
+        }
+
+        qruns *= 2;
+    }
+}
+
+static void measure(
+    const struct microbench * const bench,
+    const int qreps,
+    const int qwarmup,
+    struct sample_stats * restrict const stats)
+{
+    void * const data = bench->create();
+    const int qruns = calibrate(bench, data);
+
+    uint64_t qops;
+    for (int i = 0; i < qwarmup; ++i) {
+        run_sample(bench, data, qruns, &qops);
+    }
+
+    double samples[qreps];
+    for (int i = 0; i < qreps; ++i) {
+        const double time = run_sample(bench, data, qruns, &qops);
+        samples[i] = 1e9 * time / qops;
+    }
+
+    bench->destroy(data);
+
+    double sum = 0.0;
+    double min = samples[0];
+    double max = samples[0];
+    for (int i = 0; i < qreps; ++i) {
+        sum += samples[i];
+        min = samples[i] < min ? samples[i] : min;
+        max = samples[i] > max ? samples[i] : max;
+    }
+
+    const double mean = sum / qreps;
+    double sum2 = 0.0;
+    for (int i = 0; i < qreps; ++i) {
+        sum2 += (samples[i] - mean) * (samples[i] - mean);
+    }
+
+    stats->qsamples = qreps;
+    stats->ops_per_sample = qops;
+    stats->mean = mean;
+    stats->stddev = qreps > 1 ? sqrt(sum2 / (qreps - 1)) : 0.0;
+    stats->min = min;
+    stats->max = max;
+}
+
+static double cv(const struct sample_stats * const stats)
+{
+    return stats->mean > 0.0 ? 100.0 * stats->stddev / stats->mean : 0.0;
+}
+
+static void print_text(
+    const char * const name,
+    const struct sample_stats * const stats)
+{
+    printf("%-20s %10.2f %10.2f %6.1f%% %10.2f %10.2f %10" PRIu64 " %5d\n",
+        name, stats->mean, stats->stddev, cv(stats), stats->min, stats->max,
+        stats->ops_per_sample, stats->qsamples);
+}
+
+/* JSON lines, one object per kernel */
+static void print_json(
+    const char * const name,
+    const struct sample_stats * const stats)
+{
+    printf("{\"kernel\": \"%s\", \"ns_per_op\": %.3f, \"stddev\": %.3f, \"cv\": %.2f, "
+        "\"min\": %.3f, \"max\": %.3f, \"ops_per_sample\": %" PRIu64 ", \"samples\": %d}\n",
+        name, stats->mean, stats->stddev, cv(stats), stats->min, stats->max,
+        stats->ops_per_sample, stats->qsamples);
+}
+
+static void print_usage(const char * const program)
+{
+    fprintf(stderr, "Usage: %s [--json] [--reps n] [--warmup n] [kernel ...]\n", program);
+    fprintf(stderr, "Kernels:");
+    for (const struct microbench * const * table = tables; *table != NULL; ++table) {
+        for (const struct microbench * bench = *table; bench->name != NULL; ++bench) {
+            fprintf(stderr, " %s", bench->name);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+static int parse_uint(const char * const str, unsigned long * restrict const value)
+{
+    char * end;
+    errno = 0;
+    *value = strtoul(str, &end, 10);
+    return errno != 0 || end == str || *end != '\0' ? EINVAL : 0;
+}
+
+static const struct microbench * find_bench(const char * const name)
+{
+    for (const struct microbench * const * table = tables; *table != NULL; ++table) {
+        for (const struct microbench * bench = *table; bench->name != NULL; ++bench) {
+            if (strcmp(bench->name, name) == 0) {
+                return bench;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int main(const int argc, const char * const argv[])
+{
+    int is_json = 0;
+    int qreps = DEF_REPS;
+    int qwarmup = DEF_WARMUP;
+    const char * names[argc];
+    int qnames = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char * const arg = argv[i];
+        unsigned long value;
+
+        if (strcmp(arg, "--json") == 0) {
+            is_json = 1;
+        } else if (strcmp(arg, "--reps") == 0 && i + 1 < argc && parse_uint(argv[i+1], &value) == 0 && value > 0 && value <= MAX_REPS) {
+            qreps = value;
+            ++i;
+        } else if (strcmp(arg, "--warmup") == 0 && i + 1 < argc && parse_uint(argv[i+1], &value) == 0 && value <= MAX_REPS) {
+            qwarmup = value;
+            ++i;
+        } else if (arg[0] != '-') {
+            names[qnames++] = arg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < qnames; ++i) {
+        if (find_bench(names[i]) == NULL) {
+            fprintf(stderr, "Kernel “%s” is not found.\n", names[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!is_json) {
+        struct recording * restrict const recording = must_create_recording();
+        printf("recorded %d positions, %d free kick series; %d samples after %d warm-up\n",
+            recording->qpositions, recording->qseries, qreps, qwarmup);
+        destroy_recording(recording);
+
+        printf("%-20s %10s %10s %7s %10s %10s %10s %5s\n",
+            "kernel", "ns/op", "stddev", "cv", "min", "max", "ops", "reps");
+    }
+
+    for (const struct microbench * const * table = tables; *table != NULL; ++table) {
+        for (const struct microbench * bench = *table; bench->name != NULL; ++bench) {
+            int is_selected = qnames == 0;
+            for (int i = 0; i < qnames; ++i) {
+                is_selected |= strcmp(bench->name, names[i]) == 0;
+            }
+
+            if (!is_selected) {
+                continue;
+            }
+
+            struct sample_stats stats;
+            measure(bench, qreps, qwarmup, &stats);
+
+            if (is_json) {
+                print_json(bench->name, &stats);
+            } else {
+                print_text(bench->name, &stats);
+            }
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
@@ -3,6 +3,46 @@
 struct mcts_ctx mcts_ctx_storage = { 0 };
 struct mcts_ctx * restrict const ctx = &mcts_ctx_storage;
 
+
+
+#ifdef MAKE_CHECK
+
+/* Allocation counting: insider interposes the glibc allocator, bench uses the plain one */
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static unsigned long qallocs = 0;
+
+unsigned long test_qallocs(void)
+{
+    return __atomic_load_n(&qallocs, __ATOMIC_RELAXED);
+}
+
+void * malloc(size_t size)
+{
+    __atomic_add_fetch(&qallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&qallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    __atomic_add_fetch(&qallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+#endif
+
+
+
+
 void must_init_ctx(
     const struct game_protocol * const protocol)
 {